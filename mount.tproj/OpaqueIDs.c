@@ -25,6 +25,7 @@
 
 #include <stdlib.h>
 #include <pthread.h>
+#include <stdatomic.h>
 
 #include "OpaqueIDs.h"
 
@@ -35,14 +36,13 @@ enum
 	 * a table which holds the actual data for the opaque id.  The upper half is a
 	 * counter which insures that a particular opaque id value isn't reused for a long
 	 * time after it has been disposed.  Currently, with 20 bits as the index, there
-	 * can be (2^20)-2 opaque ids in existence at any particular point in time
+	 * can be (2^20)-1 opaque ids in existence at any particular point in time
 	 * (index 0 is not used), and no opaque id value will be re-issued more frequently than every
 	 * 2^12th (4096) times. (although, in practice many more opaque ids will be issued
 	 * before one is re-used).
 	 */
 	kOpaqueIDIndexBits = 20,
 	kOpaqueIDIndexMask = ((1 << kOpaqueIDIndexBits) - 1),
-	kOpaqueIDMaximumCount = (1 << kOpaqueIDIndexBits) - 1, /* all 0 bits are never a valid index */
 
 	/*
 	 * This keeps a little 'extra room' in the table, so that if it gets
@@ -51,8 +51,22 @@ enum
 	 * available items, the table will get grown.
 	 */
 	kOpaqueIDMinimumFree = 1024,
-	/* When the table is grown, grow by this many entries */
-	kOpaqueIDGrowCount = 2048
+	
+	/*
+	 * The table is grown a chunk at a time. Chunks are never moved or freed, so
+	 * an OpaqueEntry's address never changes once its chunk is allocated.
+	 */
+	kOpaqueIDChunkBits = 11,
+	kOpaqueIDChunkCount = (1 << kOpaqueIDChunkBits),	/* entries per chunk */
+	kOpaqueIDChunkMask = (kOpaqueIDChunkCount - 1),
+	kOpaqueIDMaximumChunks = (1 << (kOpaqueIDIndexBits - kOpaqueIDChunkBits)),
+	
+	/*
+	 * Each thread moves this many free entries at a time between the global free
+	 * list and its own cache, so the mutex is taken once per batch instead of
+	 * once per AssignOpaqueID or DeleteOpaqueID.
+	 */
+	kOpaqueIDThreadBatch = 32
 };
 
 /*
@@ -73,33 +87,81 @@ enum
 /*****************************************************************************/
 
 /*
- * Keep a 'list' of free records in the gOpaqueEntryArray table, using the .nextIndex field as
+ * Keep a 'list' of free records in the OpaqueEntry table, using the .nextIndex field as
  * the link to the next one.  Nodes are put into this list at the end, and removed
  * from the front, to try harder to keep from re-allocating a particular opaque id
  * anytime soon after it has been disposed of.
+ *
+ * The free list, the table's chunks and the counts are protected by
+ * gOpaqueEntryMutex. RetrieveDataFromOpaqueID doesn't take the mutex: it
+ * reads the entry's id, then its data, then the id again, and only returns the
+ * data if the id still matches. AssignOpaqueID stores the data before
+ * publishing the id, and DeleteOpaqueID clears the id (with a compare and swap
+ * so only one caller can delete a given id) before clearing the data. The
+ * stores are releases and the loads acquires, so a reader that sees either
+ * store also sees everything written before it.
  */
  
 struct OpaqueEntry
 {
-	opaque_id id;	/* when in use, this is the opaque ID; when not in use, the index part is zero */
+	_Atomic(opaque_id) id;	/* when in use, this is the opaque ID; when not in use, the index part is zero */
 	uint32_t nextIndex;	/* linkage for the free list */
-	void *data;		/* when in use, this is pointer to the data; it is NULL otherwise */
+	_Atomic(void *) data;	/* when in use, this is pointer to the data; it is NULL otherwise */
 };
 typedef struct OpaqueEntry *OpaqueEntryArrayPtr;
 
+/*
+ * A thread's cache of free indexes. alloc holds indexes taken from the head of
+ * the global free list, used in order; freed holds deleted indexes waiting to
+ * be put back on the tail of the global free list.
+ */
+struct OpaqueIDThreadCache
+{
+	u_int32_t allocNext;
+	u_int32_t allocCount;
+	u_int32_t alloc[kOpaqueIDThreadBatch];
+	u_int32_t freedCount;
+	u_int32_t freed[kOpaqueIDThreadBatch];
+};
+
 static pthread_mutex_t gOpaqueEntryMutex = PTHREAD_MUTEX_INITIALIZER;
-static u_int32_t gOpaqueEntriesAllocated = 0;
-static u_int32_t gOpaqueEntriesUsed = 0;
-static OpaqueEntryArrayPtr gOpaqueEntryArray = NULL;
+static _Atomic(u_int32_t) gOpaqueEntriesAllocated = 0;	/* stored with release after the chunk is in gOpaqueEntryChunks */
+static u_int32_t gOpaqueEntriesFree = 0;
+static OpaqueEntryArrayPtr gOpaqueEntryChunks[kOpaqueIDMaximumChunks];
 
 static u_int32_t gIndexOfFreeOpaqueEntryHead = 0;
 static u_int32_t gIndexOfFreeOpaqueEntryTail = 0;
 
+static pthread_once_t gOpaqueIDThreadCacheOnce = PTHREAD_ONCE_INIT;
+static pthread_key_t gOpaqueIDThreadCacheKey;
+
 /*****************************************************************************/
 
 /*
- * AddToFreeList adds the OpaqueEntry at the specified index in the gOpaqueEntryArray array
- * to the free list.
+ * OpaqueEntriesAllocated returns the number of entries in the table. The load
+ * is an acquire, so every chunk it counts can be indexed into.
+ */
+static u_int32_t OpaqueEntriesAllocated(void)
+{
+	return ( atomic_load_explicit(&gOpaqueEntriesAllocated, memory_order_acquire) );
+}
+
+/*****************************************************************************/
+
+/*
+ * OpaqueEntryAtIndex returns the OpaqueEntry at the specified index. The index
+ * must be less than OpaqueEntriesAllocated().
+ */
+static OpaqueEntryArrayPtr OpaqueEntryAtIndex(u_int32_t index)
+{
+	return ( &gOpaqueEntryChunks[index >> kOpaqueIDChunkBits][index & kOpaqueIDChunkMask] );
+}
+
+/*****************************************************************************/
+
+/*
+ * AddToFreeList adds the OpaqueEntry at the specified index in the table
+ * to the free list. gOpaqueEntryMutex must be held.
  */
 static void AddToFreeList(u_int32_t indexToFree)
 {
@@ -108,14 +170,13 @@ static void AddToFreeList(u_int32_t indexToFree)
 	/* don't add the OpaqueEntry at index 0 to free list -- it just won't be used */
 	if ( indexToFree != 0 )
 	{
-		freeEntry = &gOpaqueEntryArray[indexToFree];
-		freeEntry->data = 0;
+		freeEntry = OpaqueEntryAtIndex(indexToFree);
 		freeEntry->nextIndex = 0;
 		
 		/* Add this OpaqueEntry to the tail of the free list */
 		if ( gIndexOfFreeOpaqueEntryTail != 0 )
 		{
-			gOpaqueEntryArray[gIndexOfFreeOpaqueEntryTail].nextIndex = indexToFree;
+			OpaqueEntryAtIndex(gIndexOfFreeOpaqueEntryTail)->nextIndex = indexToFree;
 		}
 		gIndexOfFreeOpaqueEntryTail = indexToFree;
 
@@ -124,6 +185,8 @@ static void AddToFreeList(u_int32_t indexToFree)
 		{
 			gIndexOfFreeOpaqueEntryHead = indexToFree;
 		}
+		
+		++gOpaqueEntriesFree;
 	}
 }
 
@@ -131,7 +194,7 @@ static void AddToFreeList(u_int32_t indexToFree)
 
 /*
  * RemoveFromFreeList removes a OpaqueEntry from the free list and returns
- * its index in the gOpaqueEntryArray array.
+ * its index in the table. gOpaqueEntryMutex must be held.
  */
 static u_int32_t RemoveFromFreeList()
 {
@@ -148,7 +211,9 @@ static u_int32_t RemoveFromFreeList()
 			gIndexOfFreeOpaqueEntryTail = 0;
 		}
 
-		gIndexOfFreeOpaqueEntryHead = gOpaqueEntryArray[gIndexOfFreeOpaqueEntryHead].nextIndex;
+		gIndexOfFreeOpaqueEntryHead = OpaqueEntryAtIndex(gIndexOfFreeOpaqueEntryHead)->nextIndex;
+		
+		--gOpaqueEntriesFree;
 	}
 	else
 	{
@@ -160,70 +225,201 @@ static u_int32_t RemoveFromFreeList()
 
 /*****************************************************************************/
 
+/*
+ * GrowOpaqueEntryTable adds a chunk to the table and puts its entries on the
+ * free list. gOpaqueEntryMutex must be held.
+ */
+static void GrowOpaqueEntryTable(void)
+{
+	u_int32_t chunk;
+	u_int32_t i;
+	OpaqueEntryArrayPtr newChunk;
+	
+	chunk = OpaqueEntriesAllocated() >> kOpaqueIDChunkBits;
+	require_quiet(chunk < kOpaqueIDMaximumChunks, table_full);
+	
+	/* calloc sets both count and index of each new entry to 0 */
+	newChunk = (OpaqueEntryArrayPtr)calloc(kOpaqueIDChunkCount, sizeof(struct OpaqueEntry));
+	require(newChunk != NULL, calloc);
+	
+	gOpaqueEntryChunks[chunk] = newChunk;
+	
+	/* make sure the chunk is visible before RetrieveDataFromOpaqueID can index into it */
+	atomic_fetch_add_explicit(&gOpaqueEntriesAllocated, kOpaqueIDChunkCount, memory_order_release);
+	
+	/* Add all the 'new' OpaqueEntry to the free list. */
+	for ( i = 0; i < kOpaqueIDChunkCount; ++i )
+	{
+		AddToFreeList((chunk << kOpaqueIDChunkBits) + i);
+	}
+
+calloc:
+table_full:
+
+	return;
+}
+
+/*****************************************************************************/
+
+/*
+ * FlushFreedEntries puts the indexes in the thread cache's freed list back on
+ * the global free list. gOpaqueEntryMutex must be held.
+ */
+static void FlushFreedEntries(struct OpaqueIDThreadCache *cache)
+{
+	u_int32_t i;
+	
+	for ( i = 0; i < cache->freedCount; ++i )
+	{
+		AddToFreeList(cache->freed[i]);
+	}
+	cache->freedCount = 0;
+}
+
+/*****************************************************************************/
+
+/*
+ * OpaqueIDThreadCacheDestructor returns an exiting thread's cached indexes to
+ * the global free list.
+ */
+static void OpaqueIDThreadCacheDestructor(void *value)
+{
+	struct OpaqueIDThreadCache *cache;
+	
+	cache = (struct OpaqueIDThreadCache *)value;
+	
+	if ( pthread_mutex_lock(&gOpaqueEntryMutex) == 0 )
+	{
+		/* unused allocated indexes go back first since they were freed first */
+		for ( ; cache->allocNext < cache->allocCount; ++cache->allocNext )
+		{
+			AddToFreeList(cache->alloc[cache->allocNext]);
+		}
+		FlushFreedEntries(cache);
+		
+		pthread_mutex_unlock(&gOpaqueEntryMutex);
+	}
+	
+	free(cache);
+}
+
+/*****************************************************************************/
+
+static void OpaqueIDThreadCacheInit(void)
+{
+	(void) pthread_key_create(&gOpaqueIDThreadCacheKey, OpaqueIDThreadCacheDestructor);
+}
+
+/*****************************************************************************/
+
+/*
+ * GetOpaqueIDThreadCache returns the calling thread's cache, creating it if
+ * needed, or NULL if it can't be created (the caller then goes straight to the
+ * global free list).
+ */
+static struct OpaqueIDThreadCache *GetOpaqueIDThreadCache(void)
+{
+	struct OpaqueIDThreadCache *cache;
+	
+	(void) pthread_once(&gOpaqueIDThreadCacheOnce, OpaqueIDThreadCacheInit);
+	
+	cache = (struct OpaqueIDThreadCache *)pthread_getspecific(gOpaqueIDThreadCacheKey);
+	if ( cache == NULL )
+	{
+		cache = (struct OpaqueIDThreadCache *)calloc(1, sizeof(struct OpaqueIDThreadCache));
+		if ( cache != NULL )
+		{
+			if ( pthread_setspecific(gOpaqueIDThreadCacheKey, cache) != 0 )
+			{
+				free(cache);
+				cache = NULL;
+			}
+		}
+	}
+	
+	return ( cache );
+}
+
+/*****************************************************************************/
+
 int AssignOpaqueID(void *inData, opaque_id *outID)
 {
 	int error;
 	u_int32_t entryToUse;
+	struct OpaqueIDThreadCache *cache;
+	OpaqueEntryArrayPtr entry;
 	
 	require_action(outID != NULL, bad_parameter, error = EINVAL);
 	
 	*outID = kInvalidOpaqueID;
+	error = 0;
 	
-	error = pthread_mutex_lock(&gOpaqueEntryMutex);
-	require_noerr(error, pthread_mutex_lock);
+	cache = GetOpaqueIDThreadCache();
 	
-	/*
-	 * If there aren't any items in the table, or if the number of free items is
-	 * lower than we want, then grow the table.
-	 */
-	if ( (gIndexOfFreeOpaqueEntryHead == 0) || ((gOpaqueEntriesAllocated - gOpaqueEntriesUsed) < kOpaqueIDMinimumFree) )
+	if ( (cache != NULL) && (cache->allocNext < cache->allocCount) )
 	{
-		u_int32_t newCount;
+		/* use the next cached index */
+		entryToUse = cache->alloc[cache->allocNext++];
+	}
+	else
+	{
+		error = pthread_mutex_lock(&gOpaqueEntryMutex);
+		require_noerr(error, pthread_mutex_lock);
 		
-		newCount = MIN(gOpaqueEntriesAllocated + 2048, kOpaqueIDMaximumCount);
-
-		if ( gOpaqueEntriesAllocated < newCount )
+		/*
+		 * If there aren't enough free items in the table for a batch plus the
+		 * minimum, then grow the table.
+		 */
+		while ( (gOpaqueEntriesFree < kOpaqueIDMinimumFree + kOpaqueIDThreadBatch) &&
+				(OpaqueEntriesAllocated() < (kOpaqueIDMaximumChunks << kOpaqueIDChunkBits)) )
 		{
-			OpaqueEntryArrayPtr nuids;
+			u_int32_t oldAllocated;
 			
-			nuids = (OpaqueEntryArrayPtr)realloc(gOpaqueEntryArray, sizeof(struct OpaqueEntry) * newCount);
-
-			if ( nuids != NULL )
+			oldAllocated = OpaqueEntriesAllocated();
+			GrowOpaqueEntryTable();
+			if ( OpaqueEntriesAllocated() == oldAllocated )
 			{
-				u_int32_t i;
-
-				gOpaqueEntryArray = nuids;
-
-				/* Add all the 'new' OpaqueEntry to the free list. */
-				for ( i = 0; i < newCount - gOpaqueEntriesAllocated; ++i )
+				/* out of memory -- make do with what is free */
+				break;
+			}
+		}
+		
+		/* get index of an OpaqueEntry to use */
+		entryToUse = RemoveFromFreeList();
+		
+		/* and refill the thread's cache while the lock is held */
+		if ( cache != NULL )
+		{
+			cache->allocNext = 0;
+			cache->allocCount = 0;
+			while ( cache->allocCount < kOpaqueIDThreadBatch )
+			{
+				u_int32_t index;
+				
+				index = RemoveFromFreeList();
+				if ( index == 0 )
 				{
-					/* set both count and index to 0 */
-					gOpaqueEntryArray[gOpaqueEntriesAllocated + i].id = 0;
-
-					AddToFreeList(gOpaqueEntriesAllocated + i);
+					break;
 				}
-
-				gOpaqueEntriesAllocated = newCount;
+				cache->alloc[cache->allocCount++] = index;
 			}
 		}
+		
+		/* release the lock */
+		pthread_mutex_unlock(&gOpaqueEntryMutex);
 	}
 
-	/* get index of an OpaqueEntry to use */
-	entryToUse = RemoveFromFreeList();
-
-	/* release the lock */
-	pthread_mutex_unlock(&gOpaqueEntryMutex);
-
 	/* did we get an OpaqueEntry? */
-	require_action((entryToUse != 0) && (entryToUse < gOpaqueEntriesAllocated), no_opaqueID, error = EINVAL);
-		
-	/* the new id is created with the previous counter + 1, and the index */
-	gOpaqueEntryArray[entryToUse].id = CreateOpaqueID(GetOpaqueIDCounterPart(gOpaqueEntryArray[entryToUse].id) + 1, entryToUse);
-	gOpaqueEntryArray[entryToUse].data = inData;
+	require_action((entryToUse != 0) && (entryToUse < OpaqueEntriesAllocated()), no_opaqueID, error = EINVAL);
 	
-	*outID = gOpaqueEntryArray[entryToUse].id;
-
-	++gOpaqueEntriesUsed;
+	entry = OpaqueEntryAtIndex(entryToUse);
+	
+	/* store the data before the id makes the entry visible to RetrieveDataFromOpaqueID */
+	atomic_store_explicit(&entry->data, inData, memory_order_release);
+	
+	/* the new id is created with the previous counter + 1, and the index */
+	*outID = CreateOpaqueID(GetOpaqueIDCounterPart(atomic_load_explicit(&entry->id, memory_order_relaxed)) + 1, entryToUse);
+	atomic_store_explicit(&entry->id, *outID, memory_order_release);
 
 no_opaqueID:
 pthread_mutex_lock:
@@ -238,32 +434,52 @@ int DeleteOpaqueID(opaque_id inID)
 {
 	int error;
 	uint32_t index;
+	OpaqueEntryArrayPtr entry;
+	struct OpaqueIDThreadCache *cache;
+	opaque_id expectedID;
 
-	error = pthread_mutex_lock(&gOpaqueEntryMutex);
-	require_noerr(error, pthread_mutex_lock);
+	error = 0;
 	
 	index = GetOpaqueIDIndexPart(inID);
-	if ( (index != 0) && (index < gOpaqueEntriesAllocated) && (gOpaqueEntryArray[index].id == inID) )
-	{
-		/*
-		 * Keep the old counter so that next time we can increment the
-		 * generation count and return a 'new' opaque ID which maps to this
-		 * same index. The index is set to zero to indicate this entry is not
-		 * in use.
-		 */
-		gOpaqueEntryArray[index].id = CreateOpaqueID(GetOpaqueIDCounterPart(inID), 0);
+	require_action_quiet((index != 0) && (index < OpaqueEntriesAllocated()), bad_id, error = EINVAL);
+	
+	entry = OpaqueEntryAtIndex(index);
+	
+	/*
+	 * Keep the old counter so that next time we can increment the
+	 * generation count and return a 'new' opaque ID which maps to this
+	 * same index. The index is set to zero to indicate this entry is not
+	 * in use. If the id isn't inID, it was already deleted.
+	 */
+	expectedID = inID;
+	require_action_quiet(atomic_compare_exchange_strong_explicit(&entry->id, &expectedID, CreateOpaqueID(GetOpaqueIDCounterPart(inID), 0),
+		memory_order_acq_rel, memory_order_relaxed),
+		bad_id, error = EINVAL);
+	
+	/* a reader that sees the data cleared also sees the id cleared */
+	atomic_store_explicit(&entry->data, NULL, memory_order_release);
 
-		AddToFreeList(index);
-		--gOpaqueEntriesUsed;
+	cache = GetOpaqueIDThreadCache();
+	if ( cache != NULL && cache->freedCount < kOpaqueIDThreadBatch )
+	{
+		cache->freed[cache->freedCount++] = index;
 	}
 	else
 	{
-		error = EINVAL;
+		error = pthread_mutex_lock(&gOpaqueEntryMutex);
+		require_noerr(error, pthread_mutex_lock);
+		
+		if ( cache != NULL )
+		{
+			FlushFreedEntries(cache);
+		}
+		AddToFreeList(index);
+		
+		pthread_mutex_unlock(&gOpaqueEntryMutex);
 	}
 
-	pthread_mutex_unlock(&gOpaqueEntryMutex);
-
 pthread_mutex_lock:
+bad_id:
 
 	return ( error );
 }
@@ -274,26 +490,29 @@ int RetrieveDataFromOpaqueID(opaque_id inID, void **outData)
 {
 	int error;
 	uint32_t index;
+	OpaqueEntryArrayPtr entry;
+	void *data;
 
-	error = pthread_mutex_lock(&gOpaqueEntryMutex);
-	require_noerr(error, pthread_mutex_lock);
+	error = 0;
 	
 	index = GetOpaqueIDIndexPart(inID);
-	if ( (index != 0) && (index < gOpaqueEntriesAllocated) && (gOpaqueEntryArray[index].id == inID) )
-	{
-		if (outData)
-		{
-			*outData = gOpaqueEntryArray[index].data;
-		}
-	}
-	else
+	/* the acquire in OpaqueEntriesAllocated pairs with the release in GrowOpaqueEntryTable */
+	require_action_quiet((index != 0) && (index < OpaqueEntriesAllocated()), bad_id, error = EINVAL);
+	
+	entry = OpaqueEntryAtIndex(index);
+	
+	require_action_quiet(atomic_load_explicit(&entry->id, memory_order_acquire) == inID, bad_id, error = EINVAL);
+	data = atomic_load_explicit(&entry->data, memory_order_acquire);
+	
+	/* if the id changed while the data was read, the data may belong to someone else */
+	require_action_quiet(atomic_load_explicit(&entry->id, memory_order_acquire) == inID, bad_id, error = EINVAL);
+	
+	if (outData)
 	{
-		error = EINVAL;
+		*outData = data;
 	}
-	
-	pthread_mutex_unlock(&gOpaqueEntryMutex);
 
-pthread_mutex_lock:
+bad_id:
 
 	return ( error );
 }
@@ -1401,6 +1401,9 @@ int main(int argc, char *argv[])
 	
 	syslog(LOG_DEBUG, "%s unmounted\n", g_mountPoint);
 
+	/* save the files that are in the persistent cache (if any) */
+	filesystem_flush_persistent_cache();
+
 	/* attempt to delete the cache directory (if any) and the bound socket name */
 	if (*gWebdavCachePath != '\0')
 	{
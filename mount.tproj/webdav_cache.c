@@ -25,6 +25,7 @@
 
 #include <sys/syslog.h>
 #include <sys/errno.h>
+#include <sys/stat.h>
 #include <stdlib.h>
 #include <strings.h>
 #include <stdio.h>
@@ -41,7 +42,16 @@
 
 static int open_cache_files = 0;
 
-pthread_mutex_t g_node_cache_lock;
+/*
+ * g_node_cache_lock is a reader/writer lock. Anything that changes the tree or
+ * a node_entry takes it exclusive with lock_node_cache(); pure lookups (finding
+ * an existing child, attribute validity checks, path building from cached
+ * paths, the base URL) take it shared with lock_node_cache_shared() so they can
+ * run on several request threads at once. Nodes are only freed by
+ * internal_free_nodes() with the lock held exclusive, so a node found under the
+ * shared lock stays valid until the lock is dropped.
+ */
+pthread_rwlock_t g_node_cache_lock;
 
 /*****************************************************************************/
 
@@ -66,12 +76,147 @@ struct node_entry *g_deleted_root_node;
 */
 u_int32_t g_next_fileid;
 
+/*
+ * The path generation.
+ * Each node caches its percent escaped path along with the g_path_generation
+ * it was built in. Moving, renaming or redirecting a node changes the paths of
+ * every node below it, so rather than walking the subtree those operations
+ * just bump g_path_generation and the stale paths are rebuilt when next used.
+ */
+static u_int32_t g_path_generation;
+
 /*
  * The file_cache_head list.
- * Entries are stored in the order inserted into the list.
+ * Entries are kept in least recently used order: a node is moved to the head
+ * of the list when its cache file is added, reopened, or closed, so inactive
+ * cache files are evicted from the tail.
  */
 struct node_head g_file_list;
 
+/*
+ * When the cache files in g_file_list take more than g_file_cache_high_water
+ * bytes (counting each one's size when it was last closed), inactive ones are
+ * evicted from the tail of the list until they take no more than
+ * g_file_cache_low_water bytes. WEBDAVFS_FILE_CACHE_HIGH and
+ * WEBDAVFS_FILE_CACHE_LOW in the environment override FILE_CACHE_HIGH_WATER
+ * and FILE_CACHE_LOW_WATER (megabytes).
+ */
+static off_t g_file_cache_high_water;
+static off_t g_file_cache_low_water;
+
+/* counters for nodecache_log_stats. Protected by the node cache lock held exclusive. */
+static struct
+{
+	off_t		bytes;				/* sum of file_cache_size of the nodes in g_file_list */
+	u_int64_t	hits;				/* cache files reopened */
+	u_int64_t	misses;				/* cache files added */
+	u_int64_t	evictions;			/* inactive cache files removed to make room */
+} g_file_cache_stats;
+
+/*
+ * node_entry allocation.
+ * Nodes (other than g_root_node and g_deleted_root_node) are allocated from
+ * node_slabs of WEBDAV_NODE_SLAB_COUNT node_entry each instead of one calloc per
+ * node, which keeps large trees from fragmenting the heap. Slabs with free
+ * nodes are on g_node_slabs; a full slab is taken off the list until one of
+ * its nodes is freed. An empty slab is freed unless it is the only slab with
+ * free nodes. Free nodes in a slab are linked through their hash_next field.
+ */
+#define WEBDAV_NODE_SLAB_COUNT 256
+
+struct node_slab
+{
+	LIST_ENTRY(node_slab)	slabs;			/* the other slabs on g_node_slabs */
+	struct node_entry		*free_list;		/* the free nodes in this slab */
+	u_int32_t				in_use;			/* the number of nodes allocated from this slab */
+	struct node_entry		nodes[WEBDAV_NODE_SLAB_COUNT];
+};
+
+static LIST_HEAD(, node_slab) g_node_slabs = LIST_HEAD_INITIALIZER(g_node_slabs);
+
+/*
+ * Memory usage counters for nodecache_log_stats. Protected by g_node_cache_lock.
+ */
+static struct
+{
+	u_int32_t	slabs;				/* node_slabs allocated */
+	u_int32_t	nodes;				/* node_entry in use */
+	u_int32_t	heap_names;			/* names too long for name_inline */
+	u_int64_t	heap_name_bytes;	/* bytes allocated for those names */
+	u_int64_t	escaped_paths;		/* nodes with a cached escaped_path */
+} g_node_stats;
+
+/*
+ * File blocks.
+ * Bytes read out of band (with a Range request) while a file is still being
+ * downloaded into its cache file are kept in the node's file_blocks, in whole
+ * WEBDAV_FILE_BLOCK_SIZE blocks, so reading them again doesn't go back to the
+ * server, and a segmented download can copy them instead of downloading them
+ * again. The blocks are stored in a file from get_cachefile, packed in the
+ * order they were read (HFS+ has no sparse files): slots maps a block number
+ * to its place in that file.
+ *
+ * Blocks are only good for the version of the file they were read from, so
+ * they are kept with its strong entity tag and thrown away when they are used
+ * with a different one. They are also thrown away with the cache file.
+ * All of this is protected by g_file_blocks_lock.
+ */
+struct file_blocks
+{
+	int				fd;						/* the file holding the blocks */
+	u_int32_t		*slots;					/* for each block number, its place in fd plus one, or 0 if it isn't here */
+	u_int32_t		slot_count;				/* number of entries in slots */
+	u_int32_t		used;					/* number of blocks in fd */
+	char			*entity_tag;			/* the strong entity tag the blocks were read with */
+};
+
+static pthread_mutex_t g_file_blocks_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* counters for nodecache_log_stats. Protected by g_file_blocks_lock. */
+static struct
+{
+	u_int64_t	hits;				/* reads satisfied from file blocks */
+	u_int64_t	misses;				/* reads that weren't */
+	u_int64_t	added;				/* blocks added */
+	u_int64_t	copied;				/* blocks copied into segmented downloads */
+	u_int64_t	discarded;			/* file_blocks thrown away because the entity tag changed */
+} g_file_blocks_stats;
+
+/*
+ * Persistent cache files being saved.
+ * Saving a persistent cache entry syncs its data file and writes its meta
+ * file, which is too slow to do with the node cache lock held exclusive. So
+ * internal_remove_file_cache detaches the cache file's fd, key and validators
+ * from the node onto g_saved_cache_files, and the nodecache_ function that
+ * removed it takes the list with take_saved_cache_files before it unlocks the
+ * node cache and saves them with save_cache_files afterwards.
+ * g_saved_cache_files is protected by the node cache lock held exclusive.
+ */
+struct saved_cache_file
+{
+	struct saved_cache_file	*next;
+	int						fd;					/* the cache file; closed once it's saved */
+	int						keep;				/* TRUE if the entry can be kept */
+	char					*key;				/* the persistent cache key */
+	time_t					last_modified;		/* the file's Last-Modified date, or -1 */
+	char					*entity_tag;		/* the file's ETag, or NULL */
+};
+
+static struct saved_cache_file *g_saved_cache_files = NULL;
+
+/*
+ * Directories with WEBDAV_CHILD_HASH_MIN or more children get a child_hash
+ * table so finding a child doesn't walk the children list. The table starts
+ * with WEBDAV_CHILD_HASH_INITIAL_SIZE buckets and grows 4x whenever there are
+ * more children than buckets.
+ */
+#define WEBDAV_CHILD_HASH_MIN			32
+#define WEBDAV_CHILD_HASH_INITIAL_SIZE	64
+
+/* FNV-1a */
+#define NODE_NAME_HASH_INIT		2166136261U
+#define NODE_NAME_HASH_PRIME	16777619U
+
 /* static prototypes */
 
 static int internal_add_attributes(
@@ -87,11 +232,37 @@ static int internal_node_appledoubleheader_valid(
 	uid_t uid);
 static void invalidate_level(
 	struct node_entry *dir_node);
+static void internal_touch_file_cache(
+	struct node_entry *node);
+static void internal_trim_file_cache(void);
 static void internal_remove_file_cache(
 	struct node_entry *node);
+static struct saved_cache_file *take_saved_cache_files(void);
+static void save_cache_files(
+	struct saved_cache_file *saved);
 static int internal_add_file_cache(
 	struct node_entry *node,
 	int fd);
+static void file_blocks_free(
+	struct node_entry *node);
+static struct node_entry *node_alloc(void);
+static void node_free(
+	struct node_entry *node);
+static int node_set_name(
+	struct node_entry *node,
+	const char *name,
+	size_t name_length);
+static void node_release_name(
+	struct node_entry *node);
+static u_int32_t node_name_hash(
+	const char *name,
+	size_t name_length,
+	CFStringRef name_ref);
+static void insert_child(
+	struct node_entry *parent,
+	struct node_entry *node);
+static void remove_child(
+	struct node_entry *node);
 static int internal_get_node(
 	struct node_entry *parent,
 	size_t name_length,
@@ -117,6 +288,12 @@ static int internal_get_path_from_node(
 	struct node_entry *target_node,
 	bool *pathHasRedirection,
 	char **path);
+static int internal_get_escaped_path_from_node(
+	struct node_entry *node,
+	bool *pathHasRedirection,
+	CFStringRef *escapedPath);
+static char *internal_get_cache_key(
+	struct node_entry *node);
 static CFArrayRef internal_get_locktokens(
 	struct node_entry *a_node);
 
@@ -240,7 +417,7 @@ int node_appledoubleheader_valid(
 {
 	int result;
 
-	lock_node_cache();
+	lock_node_cache_shared();
 
 	result = internal_node_appledoubleheader_valid(node, uid);
 
@@ -257,7 +434,7 @@ int node_attributes_valid(
 {
 	int result;
 
-	lock_node_cache();
+	lock_node_cache_shared();
 
 	result = ( (node->attr_time != 0) && /* 0 attr_time is invalid */
 			 ((uid == node->attr_uid) || (0 == node->attr_uid)) && /* does this user or root have access to the cached attributes */
@@ -382,7 +559,7 @@ void nodecache_display_file_cache(void)
 	
 	lock_node_cache();
 
-	LIST_FOREACH(node, &g_file_list, file_list)
+	TAILQ_FOREACH(node, &g_file_list, file_list)
 	{
 		++count;
 		
@@ -425,7 +602,7 @@ struct node_entry *nodecache_get_next_file_cache_node(
 	
 	if ( get_first )
 	{
-		node = g_file_list.lh_first;
+		node = TAILQ_FIRST(&g_file_list);
 	}
 	else
 	{
@@ -434,7 +611,7 @@ struct node_entry *nodecache_get_next_file_cache_node(
 	
 	if ( node != NULL )
 	{
-		g_next_file_cache_node = node->file_list.le_next;
+		g_next_file_cache_node = TAILQ_NEXT(node, file_list);
 	}
 	else
 	{
@@ -464,27 +641,31 @@ static int internal_add_file_cache(
 		struct node_entry *file_node;
 		struct node_entry *victim_node;
 		
-		/* find oldest victim node */
+		/* find least recently used victim node */
 		victim_node = NULL;
-		LIST_FOREACH(file_node, &g_file_list, file_list)
+		TAILQ_FOREACH_REVERSE(file_node, &g_file_list, node_head, file_list)
 		{
 			if ( !NODE_FILE_IS_OPEN(file_node) )
 			{
 				victim_node = file_node;
+				break;
 			}
 		}
 		
 		require_action(victim_node != NULL, too_many_files_open, error = ENFILE);
 
 		internal_remove_file_cache(victim_node);
+		++g_file_cache_stats.evictions;
 	}
 	
 	++open_cache_files;
+	++g_file_cache_stats.misses;
 	node->flags |= nodeInFileListMask;
 	node->file_fd = fd;
 	node->file_status = WEBDAV_DOWNLOAD_NEVER;
 	node->file_validated_time = 0;
 	node->file_inactive_time = 0;
+	node->file_cache_size = 0;
 	node->file_last_modified = -1;
 	if ( node->file_entity_tag != NULL )
 	{
@@ -498,8 +679,8 @@ static int internal_add_file_cache(
 		node->file_locktoken = NULL;
 	}
 	
-	/* add it to the head of the g_file_active_list */
-	LIST_INSERT_HEAD(&g_file_list, node, file_list);
+	/* add it to the head of the g_file_list */
+	TAILQ_INSERT_HEAD(&g_file_list, node, file_list);
 	
 too_many_files_open:
 already_cached:
@@ -514,12 +695,16 @@ int nodecache_add_file_cache(
 	int fd)							/* the file descriptor of the cache file */
 {
 	int error;
+	struct saved_cache_file *saved;
 
 	lock_node_cache();
 
 	error = internal_add_file_cache(node, fd);
+	saved = take_saved_cache_files();
 
 	unlock_node_cache();
+	
+	save_cache_files(saved);
 
 	return ( error );
 }
@@ -539,16 +724,60 @@ static void internal_remove_file_cache(struct node_entry *node)
 			debug_string("internal_remove_file_cache: open_cache_files was zero");
 		}
 		node->flags &= ~nodeInFileListMask;
-		close(node->file_fd);
-		node->file_fd = -1;
+		if ( node->file_cache_key != NULL )
+		{
+			struct saved_cache_file *saved;
+			char *key;
+			int keep;
+			
+			/* keep the persistent cache entry only if it's complete and the node is still at the same path */
+			key = internal_get_cache_key(node);
+			keep = ((node->file_status & WEBDAV_DOWNLOAD_STATUS_MASK) == WEBDAV_DOWNLOAD_FINISHED) &&
+				(key != NULL) && (strcmp(key, node->file_cache_key) == 0);
+			if ( key != NULL )
+			{
+				free(key);
+			}
+			
+			/* hand the cache file off to be saved after the node cache is unlocked */
+			saved = malloc(sizeof(struct saved_cache_file));
+			if ( saved != NULL )
+			{
+				saved->fd = node->file_fd;
+				saved->keep = keep;
+				saved->key = node->file_cache_key;
+				saved->last_modified = node->file_last_modified;
+				saved->entity_tag = node->file_entity_tag;
+				saved->next = g_saved_cache_files;
+				g_saved_cache_files = saved;
+				node->file_fd = -1;
+				node->file_cache_key = NULL;
+				node->file_entity_tag = NULL;
+			}
+			else
+			{
+				/* no memory to defer it -- save it now */
+				save_persistent_cachefile(node->file_cache_key, node->file_fd, keep,
+					node->file_last_modified, node->file_entity_tag);
+				free(node->file_cache_key);
+				node->file_cache_key = NULL;
+			}
+		}
+		if ( node->file_fd != -1 )
+		{
+			close(node->file_fd);
+			node->file_fd = -1;
+		}
 		if ( node == g_next_file_cache_node )
 		{
-			g_next_file_cache_node = node->file_list.le_next;
+			g_next_file_cache_node = TAILQ_NEXT(node, file_list);
 		}
 		/* remove from g_file_list */
-		LIST_REMOVE(node, file_list);
-		node->file_list.le_next = NULL;
-		node->file_list.le_prev = NULL;
+		TAILQ_REMOVE(&g_file_list, node, file_list);
+		node->file_list.tqe_next = NULL;
+		node->file_list.tqe_prev = NULL;
+		g_file_cache_stats.bytes -= node->file_cache_size;
+		node->file_cache_size = 0;
 		node->file_status = WEBDAV_DOWNLOAD_NEVER;
 		node->file_validated_time = 0;
 		node->file_inactive_time = 0;
@@ -564,6 +793,49 @@ static void internal_remove_file_cache(struct node_entry *node)
 			free(node->file_locktoken);
 			node->file_locktoken = NULL;
 		}
+		
+		/* the blocks go with the cache file */
+		pthread_mutex_lock(&g_file_blocks_lock);
+		file_blocks_free(node);
+		pthread_mutex_unlock(&g_file_blocks_lock);
+	}
+}
+
+/*****************************************************************************/
+
+/* take_saved_cache_files takes g_saved_cache_files. The node cache must be locked exclusive. */
+static struct saved_cache_file *take_saved_cache_files(void)
+{
+	struct saved_cache_file *saved;
+	
+	saved = g_saved_cache_files;
+	g_saved_cache_files = NULL;
+	return ( saved );
+}
+
+/*****************************************************************************/
+
+/*
+ * save_cache_files saves the persistent cache entries taken with
+ * take_saved_cache_files, closes their cache files and frees the list. It's
+ * called with the node cache unlocked.
+ */
+static void save_cache_files(struct saved_cache_file *saved)
+{
+	struct saved_cache_file *next;
+	
+	while ( saved != NULL )
+	{
+		next = saved->next;
+		save_persistent_cachefile(saved->key, saved->fd, saved->keep, saved->last_modified, saved->entity_tag);
+		close(saved->fd);
+		free(saved->key);
+		if ( saved->entity_tag != NULL )
+		{
+			free(saved->entity_tag);
+		}
+		free(saved);
+		saved = next;
 	}
 }
 
@@ -571,11 +843,422 @@ static void internal_remove_file_cache(struct node_entry *node)
 
 void nodecache_remove_file_cache(struct node_entry *node)
 {
+	struct saved_cache_file *saved;
+	
 	lock_node_cache();
 	
 	internal_remove_file_cache(node);
+	saved = take_saved_cache_files();
+	
+	unlock_node_cache();
+	
+	save_cache_files(saved);
+}
+
+/*****************************************************************************/
+
+/*
+ * nodecache_flush_file_cache removes every node from the file cache. It's used
+ * when the file system is unmounted so that persistent cache entries are saved.
+ */
+void nodecache_flush_file_cache(void)
+{
+	struct saved_cache_file *saved;
+	
+	lock_node_cache();
+	
+	while ( !TAILQ_EMPTY(&g_file_list) )
+	{
+		internal_remove_file_cache(TAILQ_FIRST(&g_file_list));
+	}
+	saved = take_saved_cache_files();
+	
+	unlock_node_cache();
+	
+	save_cache_files(saved);
+}
+
+/*****************************************************************************/
+
+/* internal_touch_file_cache moves node to the most recently used end of g_file_list */
+static void internal_touch_file_cache(struct node_entry *node)
+{
+	if ( node == g_next_file_cache_node )
+	{
+		g_next_file_cache_node = TAILQ_NEXT(node, file_list);
+	}
+	TAILQ_REMOVE(&g_file_list, node, file_list);
+	TAILQ_INSERT_HEAD(&g_file_list, node, file_list);
+}
+
+/*****************************************************************************/
+
+/*
+ * internal_trim_file_cache evicts inactive cache files, least recently used
+ * first, if the cache files have grown past g_file_cache_high_water bytes.
+ * Only the tail of g_file_list that is evicted (and any open files in it) is
+ * walked.
+ */
+static void internal_trim_file_cache(void)
+{
+	struct node_entry *node;
+	struct node_entry *prev_node;
+	
+	if ( g_file_cache_stats.bytes > g_file_cache_high_water )
+	{
+		node = TAILQ_LAST(&g_file_list, node_head);
+		while ( (node != NULL) && (g_file_cache_stats.bytes > g_file_cache_low_water) )
+		{
+			prev_node = TAILQ_PREV(node, node_head, file_list);
+			if ( !NODE_FILE_IS_OPEN(node) )
+			{
+				internal_remove_file_cache(node);
+				++g_file_cache_stats.evictions;
+			}
+			node = prev_node;
+		}
+	}
+}
+
+/*****************************************************************************/
+
+/* nodecache_reuse_file_cache makes node's cache file active again when it is reopened */
+void nodecache_reuse_file_cache(struct node_entry *node)
+{
+	lock_node_cache();
+	
+	if ( NODE_FILE_IS_CACHED(node) )
+	{
+		node->file_inactive_time = 0;
+		internal_touch_file_cache(node);
+		++g_file_cache_stats.hits;
+	}
+	
+	unlock_node_cache();
+}
+
+/*****************************************************************************/
+
+/*
+ * nodecache_close_file_cache makes node's cache file inactive when it is
+ * closed and accounts for its current size. Eviction is left to
+ * nodecache_trim_file_cache since the caller is still using node's cache
+ * fields.
+ */
+void nodecache_close_file_cache(struct node_entry *node)
+{
+	struct stat statbuf;
+	
+	lock_node_cache();
+	
+	if ( NODE_FILE_IS_CACHED(node) )
+	{
+		time(&node->file_inactive_time);
+		if ( fstat(node->file_fd, &statbuf) == 0 )
+		{
+			g_file_cache_stats.bytes += statbuf.st_size - node->file_cache_size;
+			node->file_cache_size = statbuf.st_size;
+		}
+		internal_touch_file_cache(node);
+	}
+	
+	unlock_node_cache();
+}
+
+/*****************************************************************************/
+
+void nodecache_trim_file_cache(void)
+{
+	struct saved_cache_file *saved;
+	
+	lock_node_cache();
+	
+	internal_trim_file_cache();
+	saved = take_saved_cache_files();
 	
 	unlock_node_cache();
+	
+	save_cache_files(saved);
+}
+
+/*****************************************************************************/
+
+/* frees a node's file_blocks. g_file_blocks_lock must be held. */
+static void file_blocks_free(struct node_entry *node)
+{
+	struct file_blocks *blocks;
+	
+	blocks = node->file_blocks;
+	if ( blocks != NULL )
+	{
+		node->file_blocks = NULL;
+		close(blocks->fd);
+		free(blocks->slots);
+		free(blocks->entity_tag);
+		free(blocks);
+	}
+}
+
+/*****************************************************************************/
+
+/*
+ * file_blocks_get returns node's file_blocks if they were read with
+ * entity_tag. Blocks read with another entity tag are thrown away. If there
+ * are no blocks and create is TRUE, empty file_blocks are created. NULL is
+ * returned if there are no blocks, or if entity_tag is missing or weak.
+ * g_file_blocks_lock must be held.
+ */
+static struct file_blocks *file_blocks_get(struct node_entry *node, const char *entity_tag, int create)
+{
+	struct file_blocks *blocks;
+	
+	/* a weak entity tag doesn't promise the bytes are the same */
+	require_quiet((entity_tag != NULL) && (strncmp(entity_tag, "W/", 2) != 0), no_entity_tag);
+	
+	blocks = node->file_blocks;
+	if ( (blocks != NULL) && (strcmp(blocks->entity_tag, entity_tag) != 0) )
+	{
+		/* the file changed since these blocks were read */
+		file_blocks_free(node);
+		++g_file_blocks_stats.discarded;
+		blocks = NULL;
+	}
+	
+	if ( (blocks == NULL) && create )
+	{
+		blocks = calloc(1, sizeof(struct file_blocks));
+		require(blocks != NULL, calloc_blocks);
+		
+		blocks->entity_tag = strdup(entity_tag);
+		require(blocks->entity_tag != NULL, strdup_entity_tag);
+		
+		require_noerr_quiet(get_cachefile(&blocks->fd), get_cachefile);
+		(void) ftruncate(blocks->fd, 0LL);
+		
+		node->file_blocks = blocks;
+	}
+	
+	return ( blocks );
+	
+get_cachefile:
+	free(blocks->entity_tag);
+strdup_entity_tag:
+	free(blocks);
+calloc_blocks:
+no_entity_tag:
+	
+	return ( NULL );
+}
+
+/*****************************************************************************/
+
+/*
+ * nodecache_read_file_blocks copies count bytes at offset into buffer and
+ * returns TRUE if every block they are in was read out of band from the
+ * version of the file being downloaded into the cache file. Otherwise, it
+ * returns FALSE.
+ */
+int nodecache_read_file_blocks(
+	struct node_entry *node,		/* -> the node */
+	off_t offset,					/* -> position within the file */
+	size_t count,					/* -> number of bytes */
+	char *buffer)					/* <- the bytes, if all of them are in the node's blocks */
+{
+	struct file_blocks *blocks;
+	u_int32_t block;
+	size_t block_offset;
+	size_t length;
+	int result;
+	
+	result = FALSE;
+	pthread_mutex_lock(&g_file_blocks_lock);
+	
+	blocks = file_blocks_get(node, node->file_entity_tag, FALSE);
+	require_quiet(blocks != NULL, no_blocks);
+	
+	while ( count != 0 )
+	{
+		block = (u_int32_t)(offset / WEBDAV_FILE_BLOCK_SIZE);
+		require_quiet((block < blocks->slot_count) && (blocks->slots[block] != 0), miss);
+		
+		block_offset = (size_t)(offset % WEBDAV_FILE_BLOCK_SIZE);
+		length = MIN(count, WEBDAV_FILE_BLOCK_SIZE - block_offset);
+		require(pread(blocks->fd, buffer, length,
+			((off_t)(blocks->slots[block] - 1) * WEBDAV_FILE_BLOCK_SIZE) + block_offset) == (ssize_t)length, pread);
+		
+		buffer += length;
+		offset += length;
+		count -= length;
+	}
+	result = TRUE;
+	
+pread:
+miss:
+	
+	if ( result )
+	{
+		++g_file_blocks_stats.hits;
+	}
+	else
+	{
+		++g_file_blocks_stats.misses;
+	}
+	
+no_blocks:
+	
+	pthread_mutex_unlock(&g_file_blocks_lock);
+	
+	return ( result );
+}
+
+/*****************************************************************************/
+
+/*
+ * nodecache_add_file_blocks adds the whole blocks in bytes to node's
+ * file_blocks. They are only added if they came from the version of the file
+ * being downloaded into the cache file: entity_tag must be the node's strong
+ * entity tag. A partial block (at either end, or at the end of the file)
+ * isn't added.
+ */
+void nodecache_add_file_blocks(
+	struct node_entry *node,		/* -> the node */
+	const char *entity_tag,			/* -> the ETag of the response the bytes came from */
+	off_t offset,					/* -> position within the file of the bytes */
+	const char *bytes,				/* -> the bytes */
+	size_t count)					/* -> number of bytes */
+{
+	struct file_blocks *blocks;
+	off_t skip;
+	u_int32_t block;
+	
+	/* start at the first whole block */
+	skip = (WEBDAV_FILE_BLOCK_SIZE - (offset % WEBDAV_FILE_BLOCK_SIZE)) % WEBDAV_FILE_BLOCK_SIZE;
+	if ( (off_t)count < skip + WEBDAV_FILE_BLOCK_SIZE )
+	{
+		return;
+	}
+	bytes += skip;
+	offset += skip;
+	count -= (size_t)skip;
+	
+	if ( (entity_tag == NULL) || (node->file_entity_tag == NULL) || (strcmp(entity_tag, node->file_entity_tag) != 0) )
+	{
+		return;
+	}
+	
+	pthread_mutex_lock(&g_file_blocks_lock);
+	
+	blocks = file_blocks_get(node, entity_tag, TRUE);
+	require_quiet(blocks != NULL, no_blocks);
+	
+	for ( ; count >= WEBDAV_FILE_BLOCK_SIZE; bytes += WEBDAV_FILE_BLOCK_SIZE, offset += WEBDAV_FILE_BLOCK_SIZE, count -= WEBDAV_FILE_BLOCK_SIZE )
+	{
+		block = (u_int32_t)(offset / WEBDAV_FILE_BLOCK_SIZE);
+		if ( block >= blocks->slot_count )
+		{
+			u_int32_t *slots;
+			u_int32_t slot_count;
+			
+			/* grow slots geometrically */
+			slot_count = MAX(blocks->slot_count * 2, 64);
+			while ( slot_count <= block )
+			{
+				slot_count *= 2;
+			}
+			slots = realloc(blocks->slots, slot_count * sizeof(u_int32_t));
+			require(slots != NULL, realloc_slots);
+			bzero(slots + blocks->slot_count, (slot_count - blocks->slot_count) * sizeof(u_int32_t));
+			blocks->slots = slots;
+			blocks->slot_count = slot_count;
+		}
+		else if ( blocks->slots[block] != 0 )
+		{
+			/* already have it */
+			continue;
+		}
+		
+		require_quiet(blocks->used < WEBDAV_MAX_FILE_BLOCKS, too_many_blocks);
+		require(pwrite(blocks->fd, bytes, WEBDAV_FILE_BLOCK_SIZE, (off_t)blocks->used * WEBDAV_FILE_BLOCK_SIZE) == WEBDAV_FILE_BLOCK_SIZE, pwrite);
+		blocks->slots[block] = ++blocks->used;
+		++g_file_blocks_stats.added;
+	}
+	
+pwrite:
+too_many_blocks:
+realloc_slots:
+no_blocks:
+	
+	pthread_mutex_unlock(&g_file_blocks_lock);
+}
+
+/*****************************************************************************/
+
+/*
+ * nodecache_copy_file_blocks copies the bytes of node's file_blocks from
+ * offset up to the first block that isn't there (or end) into fd at
+ * fd_offset. Nothing is copied unless the blocks were read with entity_tag.
+ * g_file_blocks_lock is only held while one block is read, and the blocks are
+ * looked up again for each block since they may be freed in between.
+ * Returns the number of bytes copied.
+ */
+off_t nodecache_copy_file_blocks(
+	struct node_entry *node,		/* -> the node */
+	const char *entity_tag,			/* -> the ETag of the file being downloaded */
+	off_t offset,					/* -> position within the file to start copying */
+	off_t end,						/* -> position within the file to stop copying */
+	int fd,							/* -> the file to copy to */
+	off_t fd_offset)				/* -> position within fd to copy offset to */
+{
+	struct file_blocks *blocks;
+	char *buffer;
+	u_int32_t block;
+	size_t block_offset;
+	size_t length;
+	ssize_t bytes_read;
+	off_t copied;
+	
+	copied = 0;
+	buffer = malloc(WEBDAV_FILE_BLOCK_SIZE);
+	require(buffer != NULL, malloc_buffer);
+	
+	while ( offset + copied < end )
+	{
+		block_offset = (size_t)((offset + copied) % WEBDAV_FILE_BLOCK_SIZE);
+		length = (size_t)MIN(end - (offset + copied), (off_t)(WEBDAV_FILE_BLOCK_SIZE - block_offset));
+		bytes_read = -1;
+		
+		pthread_mutex_lock(&g_file_blocks_lock);
+		blocks = file_blocks_get(node, entity_tag, FALSE);
+		if ( blocks != NULL )
+		{
+			block = (u_int32_t)((offset + copied) / WEBDAV_FILE_BLOCK_SIZE);
+			if ( (block < blocks->slot_count) && (blocks->slots[block] != 0) )
+			{
+				bytes_read = pread(blocks->fd, buffer, length,
+					((off_t)(blocks->slots[block] - 1) * WEBDAV_FILE_BLOCK_SIZE) + block_offset);
+				if ( bytes_read == (ssize_t)length )
+				{
+					++g_file_blocks_stats.copied;
+				}
+			}
+		}
+		pthread_mutex_unlock(&g_file_blocks_lock);
+		
+		/* stop at the first block that isn't there */
+		require_quiet(bytes_read == (ssize_t)length, pread);
+		
+		require(pwrite(fd, buffer, length, fd_offset + copied) == (ssize_t)length, pwrite);
+		copied += length;
+	}
+	
+pwrite:
+pread:
+	
+	free(buffer);
+	
+malloc_buffer:
+	
+	return ( copied );
 }
 
 /*****************************************************************************/
@@ -591,22 +1274,20 @@ int nodecache_init(
 	error = 0;
 	
 	g_next_fileid = WEBDAV_ROOTFILEID;
+	g_path_generation = 1;
 		
 	/* allocate space for g_root_node and its name */
 	g_root_node = calloc(1, sizeof(struct node_entry));
 	require_action(g_root_node != NULL, calloc_g_root_node, error = ENOMEM);
 	
 	*root_node = g_root_node;
-	g_root_node->name = malloc(name_length + 1);
-	require_action(g_root_node->name != NULL, malloc_name, error = ENOMEM);
+	error = node_set_name(g_root_node, name, name_length);
+	require_noerr(error, malloc_name);
 	
 	/* initialize the node_entry */
 	g_root_node->parent = NULL;
 	LIST_INIT(&g_root_node->children);
-	g_root_node->name_length = name_length;
-	memcpy(g_root_node->name, name, name_length);
-	g_root_node->name[name_length] = '\0';
-	g_root_node->name_ref = CFStringCreateWithCStringNoCopy(kCFAllocatorDefault, g_root_node->name, kCFStringEncodingUTF8, kCFAllocatorNull);
+	g_root_node->name_hash = node_name_hash(g_root_node->name, g_root_node->name_length, g_root_node->name_ref);
 	g_root_node->fileid = g_next_fileid++;
 	g_root_node->node_type = WEBDAV_DIR_TYPE;
 	g_root_node->node_time = time(NULL);
@@ -621,53 +1302,411 @@ int nodecache_init(
 	g_deleted_root_node = calloc(1, sizeof(struct node_entry));
 	require_action(g_root_node != NULL, calloc_g_deleted_root_node, error = ENOMEM);
 	
-	g_deleted_root_node->name = malloc(1);
-	require_action(g_root_node->name != NULL, malloc_g_deleted_root_node_name, error = ENOMEM);
+	error = node_set_name(g_deleted_root_node, "", 0);
+	require_noerr(error, malloc_g_deleted_root_node_name);
 	
 	/* initialize the node_entry */
 	g_deleted_root_node->parent = NULL;
 	LIST_INIT(&g_deleted_root_node->children);
-	g_deleted_root_node->name_length = 0;
-	g_deleted_root_node->name[0] = '\0';
-	g_deleted_root_node->name_ref = CFStringCreateWithCStringNoCopy(kCFAllocatorDefault, g_deleted_root_node->name, kCFStringEncodingUTF8, kCFAllocatorNull);
 	/* attribute fields are already zeroed */
 	/* file cache fields are already zeroed - set file_fd to indicate there is no cache file */
 	g_deleted_root_node->file_fd = -1;
 	
 	/* initialize g_file_list header */
-	LIST_INIT(&g_file_list);
+	TAILQ_INIT(&g_file_list);
+	
+	g_file_cache_high_water = (off_t)FILE_CACHE_HIGH_WATER * 1024 * 1024;
+	g_file_cache_low_water = (off_t)FILE_CACHE_LOW_WATER * 1024 * 1024;
+	if ( getenv("WEBDAVFS_FILE_CACHE_HIGH") != NULL )
+	{
+		g_file_cache_high_water = (off_t)strtoll(getenv("WEBDAVFS_FILE_CACHE_HIGH"), NULL, 10) * 1024 * 1024;
+		/* the low watermark defaults to 3/4 of the high one */
+		g_file_cache_low_water = g_file_cache_high_water / 4 * 3;
+	}
+	if ( getenv("WEBDAVFS_FILE_CACHE_LOW") != NULL )
+	{
+		g_file_cache_low_water = (off_t)strtoll(getenv("WEBDAVFS_FILE_CACHE_LOW"), NULL, 10) * 1024 * 1024;
+	}
+	if ( g_file_cache_low_water > g_file_cache_high_water )
+	{
+		g_file_cache_low_water = g_file_cache_high_water;
+	}
+
+	error = init_node_cache_lock();
+
+malloc_g_deleted_root_node_name:
+calloc_g_deleted_root_node:
+malloc_name:
+AssignOpaqueID:
+calloc_g_root_node:
+	
+	return ( error );
+}
+
+/*****************************************************************************/
+
+/* returns a zeroed node_entry from a node_slab, or NULL if out of memory */
+static struct node_entry *node_alloc(void)
+{
+	struct node_slab *slab;
+	struct node_entry *node;
+	u_int32_t i;
+	
+	node = NULL;
+	
+	slab = LIST_FIRST(&g_node_slabs);
+	if ( slab == NULL )
+	{
+		slab = malloc(sizeof(struct node_slab));
+		require(slab != NULL, malloc_slab);
+		
+		/* put all of the slab's nodes on its free list */
+		slab->in_use = 0;
+		slab->free_list = NULL;
+		for ( i = WEBDAV_NODE_SLAB_COUNT; i != 0; --i )
+		{
+			slab->nodes[i - 1].hash_next = slab->free_list;
+			slab->free_list = &slab->nodes[i - 1];
+		}
+		LIST_INSERT_HEAD(&g_node_slabs, slab, slabs);
+		++g_node_stats.slabs;
+	}
+	
+	node = slab->free_list;
+	slab->free_list = node->hash_next;
+	++slab->in_use;
+	if ( slab->free_list == NULL )
+	{
+		/* full -- take it off the list until a node is freed */
+		LIST_REMOVE(slab, slabs);
+	}
+	
+	memset(node, 0, sizeof(struct node_entry));
+	node->slab = slab;
+	++g_node_stats.nodes;
+
+malloc_slab:
+
+	return ( node );
+}
+
+/*****************************************************************************/
+
+/* returns a node_entry allocated by node_alloc to its node_slab */
+static void node_free(
+	struct node_entry *node)
+{
+	struct node_slab *slab;
+	
+	slab = node->slab;
+	
+	if ( slab->free_list == NULL )
+	{
+		/* it was full, so it has a free node again */
+		LIST_INSERT_HEAD(&g_node_slabs, slab, slabs);
+	}
+	node->hash_next = slab->free_list;
+	slab->free_list = node;
+	--slab->in_use;
+	--g_node_stats.nodes;
+	
+	/* free empty slabs, but keep one around so a delete and create doesn't malloc and free a slab */
+	if ( (slab->in_use == 0) && ((LIST_FIRST(&g_node_slabs) != slab) || (LIST_NEXT(slab, slabs) != NULL)) )
+	{
+		LIST_REMOVE(slab, slabs);
+		free(slab);
+		--g_node_stats.slabs;
+	}
+}
+
+/*****************************************************************************/
+
+/*
+ * Sets (or replaces) a node's name, name_length and name_ref. Short names are
+ * stored in name_inline. If ENOMEM is returned, the old name is unchanged.
+ */
+static int node_set_name(
+	struct node_entry *node,
+	const char *name,				/* the utf8 name */
+	size_t name_length)				/* length of name */
+{
+	int error;
+	char *storage;
+	
+	error = 0;
+	
+	if ( name_length < WEBDAV_NODE_INLINE_NAME_SIZE )
+	{
+		storage = node->name_inline;
+	}
+	else
+	{
+		storage = malloc(name_length + 1);
+		require_action(storage != NULL, malloc_storage, error = ENOMEM);
+		
+		++g_node_stats.heap_names;
+		g_node_stats.heap_name_bytes += name_length + 1;
+	}
+	
+	node_release_name(node);
+	
+	memcpy(storage, name, name_length);
+	storage[name_length] = '\0';
+	node->name = storage;
+	node->name_length = name_length;
+	node->name_ref = CFStringCreateWithCStringNoCopy(kCFAllocatorDefault, node->name, kCFStringEncodingUTF8, kCFAllocatorNull);
+
+malloc_storage:
+
+	return ( error );
+}
+
+/*****************************************************************************/
+
+/* releases a node's name and name_ref */
+static void node_release_name(
+	struct node_entry *node)
+{
+	if ( node->name_ref != NULL )
+	{
+		CFRelease(node->name_ref);
+		node->name_ref = NULL;
+	}
+	if ( (node->name != NULL) && (node->name != node->name_inline) )
+	{
+		free(node->name);
+		--g_node_stats.heap_names;
+		g_node_stats.heap_name_bytes -= node->name_length + 1;
+	}
+	node->name = NULL;
+}
+
+/*****************************************************************************/
+
+/* logs the node cache memory usage counters */
+void nodecache_log_stats(void)
+{
+	u_int32_t slabs, nodes, heap_names;
+	u_int64_t heap_name_bytes, escaped_paths;
+	
+	lock_node_cache_shared();
+	slabs = g_node_stats.slabs;
+	nodes = g_node_stats.nodes;
+	heap_names = g_node_stats.heap_names;
+	heap_name_bytes = g_node_stats.heap_name_bytes;
+	escaped_paths = g_node_stats.escaped_paths;
+	unlock_node_cache();
+	
+	LogMessage(kTrace, "nodecache: %u nodes in %u slabs (%llu bytes), %u long names (%llu bytes), %llu escaped paths\n",
+		nodes, slabs, (unsigned long long)slabs * sizeof(struct node_slab),
+		heap_names, heap_name_bytes, escaped_paths);
+	
+	lock_node_cache();
+	LogMessage(kTrace, "nodecache: file cache: %d files, %lld bytes (high %lld, low %lld), %llu hits, %llu misses, %llu evictions\n",
+		open_cache_files, (long long)g_file_cache_stats.bytes,
+		(long long)g_file_cache_high_water, (long long)g_file_cache_low_water,
+		g_file_cache_stats.hits, g_file_cache_stats.misses, g_file_cache_stats.evictions);
+	unlock_node_cache();
+	
+	pthread_mutex_lock(&g_file_blocks_lock);
+	LogMessage(kTrace, "nodecache: file blocks: %llu hits, %llu misses, %llu added, %llu copied, %llu discarded\n",
+		g_file_blocks_stats.hits, g_file_blocks_stats.misses, g_file_blocks_stats.added,
+		g_file_blocks_stats.copied, g_file_blocks_stats.discarded);
+	pthread_mutex_unlock(&g_file_blocks_lock);
+}
+
+/*****************************************************************************/
+
+/*
+ * node_name_hash returns the hash used for child_hash. Names are compared with
+ * kCFCompareNonliteral, so names that are canonically equivalent must hash the
+ * same: the hash is computed over the UTF-16 characters of the canonically
+ * decomposed (NFD) name. ASCII names are already decomposed, so they are hashed
+ * straight from their bytes.
+ */
+static u_int32_t node_name_hash(
+	const char *name,				/* the utf8 name */
+	size_t name_length,				/* length of name */
+	CFStringRef name_ref)			/* the name as a CFString */
+{
+	u_int32_t hash;
+	size_t i;
+	CFIndex index, length;
+	CFMutableStringRef decomposed;
+	CFStringInlineBuffer buffer;
+	
+	hash = NODE_NAME_HASH_INIT;
+	
+	for ( i = 0; i < name_length; ++i )
+	{
+		if ( (unsigned char)name[i] >= 0x80 )
+		{
+			break;
+		}
+	}
+	
+	if ( i == name_length )
+	{
+		/* ASCII */
+		for ( i = 0; i < name_length; ++i )
+		{
+			hash = (hash ^ (unsigned char)name[i]) * NODE_NAME_HASH_PRIME;
+		}
+	}
+	else if ( name_ref != NULL )
+	{
+		decomposed = CFStringCreateMutableCopy(kCFAllocatorDefault, 0, name_ref);
+		require(decomposed != NULL, CFStringCreateMutableCopy);
+		
+		CFStringNormalize(decomposed, kCFStringNormalizationFormD);
+		
+		length = CFStringGetLength(decomposed);
+		CFStringInitInlineBuffer(decomposed, &buffer, CFRangeMake(0, length));
+		for ( index = 0; index < length; ++index )
+		{
+			hash = (hash ^ CFStringGetCharacterFromInlineBuffer(&buffer, index)) * NODE_NAME_HASH_PRIME;
+		}
+		
+		CFRelease(decomposed);
+	}
+
+CFStringCreateMutableCopy:
+
+	return ( hash );
+}
+
+/*****************************************************************************/
+
+/* adds node to its parent's child_hash, building or growing child_hash if needed */
+static void child_hash_insert(
+	struct node_entry *node)
+{
+	struct node_entry *parent;
+	struct node_entry **new_hash;
+	struct node_entry *child;
+	u_int32_t new_size;
+	u_int32_t bucket;
+	
+	parent = node->parent;
+	if ( parent->child_count >= WEBDAV_CHILD_HASH_MIN )
+	{
+		/* new_size is 0 if child_hash doesn't need to be (re)built */
+		new_size = 0;
+		if ( parent->child_hash == NULL )
+		{
+			new_size = WEBDAV_CHILD_HASH_INITIAL_SIZE;
+		}
+		else if ( parent->child_count > parent->child_hash_size )
+		{
+			new_size = parent->child_hash_size * 4;
+		}
+		while ( (new_size != 0) && (new_size < parent->child_count) )
+		{
+			new_size *= 4;
+		}
+		
+		if ( new_size != 0 )
+		{
+			/* if this fails, the old table (if any) is still good -- just more crowded */
+			new_hash = calloc(new_size, sizeof(struct node_entry *));
+			if ( new_hash != NULL )
+			{
+				/* rehash everything on the children list (which node is already on) */
+				LIST_FOREACH(child, &(parent->children), entries)
+				{
+					bucket = child->name_hash & (new_size - 1);
+					child->hash_next = new_hash[bucket];
+					new_hash[bucket] = child;
+				}
+				if ( parent->child_hash != NULL )
+				{
+					free(parent->child_hash);
+				}
+				parent->child_hash = new_hash;
+				parent->child_hash_size = new_size;
+				return;
+			}
+		}
+	}
+	
+	if ( parent->child_hash != NULL )
+	{
+		bucket = node->name_hash & (parent->child_hash_size - 1);
+		node->hash_next = parent->child_hash[bucket];
+		parent->child_hash[bucket] = node;
+	}
+}
 
-	error = init_node_cache_lock();
+/*****************************************************************************/
 
-malloc_g_deleted_root_node_name:
-calloc_g_deleted_root_node:
-malloc_name:
-AssignOpaqueID:
-calloc_g_root_node:
+/* removes node from its parent's child_hash (if the parent has one) */
+static void child_hash_remove(
+	struct node_entry *node)
+{
+	struct node_entry **link;
+	struct node_entry *parent;
 	
-	return ( error );
+	parent = node->parent;
+	if ( parent->child_hash != NULL )
+	{
+		link = &parent->child_hash[node->name_hash & (parent->child_hash_size - 1)];
+		while ( *link != NULL )
+		{
+			if ( *link == node )
+			{
+				*link = node->hash_next;
+				break;
+			}
+			link = &(*link)->hash_next;
+		}
+	}
+	node->hash_next = NULL;
+}
+
+/*****************************************************************************/
+
+/* inserts node into parent's children list (and child_hash), and sets node's parent */
+static void insert_child(
+	struct node_entry *parent,
+	struct node_entry *node)
+{
+	LIST_INSERT_HEAD(&parent->children, node, entries);
+	node->parent = parent;
+	++parent->child_count;
+	child_hash_insert(node);
+}
+
+/*****************************************************************************/
+
+/* removes node from its parent's children list (and child_hash) */
+static void remove_child(
+	struct node_entry *node)
+{
+	child_hash_remove(node);
+	LIST_REMOVE(node, entries);
+	--node->parent->child_count;
 }
 
 /*****************************************************************************/
 
 /*
- * Finds a node by name in the parent node's children. If the node is
- * not found and make_entry is TRUE, then internal_get_node creates a new node.
+ * Finds the existing child of parent named name (or parent itself if there is
+ * no name) without changing anything, so it can be called with the node cache
+ * locked shared. *node is NULL if there is no such child.
  */
-static int internal_get_node(
+static int internal_find_child(
 	struct node_entry *parent,		/* the parent node_entry */
 	size_t name_length,				/* length of name */
 	const char *name,				/* the utf8 name of the node */
-	int make_entry,					/* TRUE if a new node_entry should be created if needed */
-	int client_created,				/* TRUE if this client created the node (used in conjunction with make_entry */
-	webdav_filetype_t node_type,	/* if make_entry is TRUE, the type of node to create */
-	struct node_entry **node)		/* the found (or new) node_entry */
+	u_int32_t *name_hash,			/* <- the name's name_hash (0 if no name) */
+	struct node_entry **node)		/* <- the found node_entry or NULL */
 {
 	struct node_entry *node_ptr;
 	int error;
 	
 	node_ptr = NULL;
 	error = 0;
+	*name_hash = 0;
 	
 	if ( name_length != 0 && name != NULL )
 	{
@@ -675,13 +1714,32 @@ static int internal_get_node(
 		
 		name_string = CFStringCreateWithBytes(kCFAllocatorDefault, (const UInt8 *)name, name_length, kCFStringEncodingUTF8, false);
 		require_action(name_string != NULL, out, error = EINVAL);
+		
+		*name_hash = node_name_hash(name, name_length, name_string);
 
-		/* search for an existing node_entry */
-		LIST_FOREACH(node_ptr, &(parent->children), entries)
+		/* search for an existing node_entry -- only names with the same hash need to be compared */
+		if ( parent->child_hash != NULL )
 		{
-			if ( CFStringCompare(name_string, node_ptr->name_ref, kCFCompareNonliteral) == kCFCompareEqualTo )
+			for ( node_ptr = parent->child_hash[*name_hash & (parent->child_hash_size - 1)];
+				  node_ptr != NULL;
+				  node_ptr = node_ptr->hash_next )
 			{
-				break;
+				if ( (node_ptr->name_hash == *name_hash) &&
+					 (CFStringCompare(name_string, node_ptr->name_ref, kCFCompareNonliteral) == kCFCompareEqualTo) )
+				{
+					break;
+				}
+			}
+		}
+		else
+		{
+			LIST_FOREACH(node_ptr, &(parent->children), entries)
+			{
+				if ( (node_ptr->name_hash == *name_hash) &&
+					 (CFStringCompare(name_string, node_ptr->name_ref, kCFCompareNonliteral) == kCFCompareEqualTo) )
+				{
+					break;
+				}
 			}
 		}
 		
@@ -691,6 +1749,38 @@ static int internal_get_node(
 	{
 		node_ptr = parent;
 	}
+
+out:
+
+	*node = node_ptr;
+	
+	return ( error );
+}
+
+/*****************************************************************************/
+
+/*
+ * Finds a node by name in the parent node's children. If the node is
+ * not found and make_entry is TRUE, then internal_get_node creates a new node.
+ */
+static int internal_get_node(
+	struct node_entry *parent,		/* the parent node_entry */
+	size_t name_length,				/* length of name */
+	const char *name,				/* the utf8 name of the node */
+	int make_entry,					/* TRUE if a new node_entry should be created if needed */
+	int client_created,				/* TRUE if this client created the node (used in conjunction with make_entry */
+	webdav_filetype_t node_type,	/* if make_entry is TRUE, the type of node to create */
+	struct node_entry **node)		/* the found (or new) node_entry */
+{
+	struct node_entry *node_ptr;
+	int error;
+	u_int32_t name_hash;
+	
+	node_ptr = NULL;
+	name_hash = 0;
+	
+	error = internal_find_child(parent, name_length, name, &name_hash, &node_ptr);
+	require_noerr_quiet(error, out);
 	
 	/* if we didn't find it and we're supposed to create it... */
 	if ( node_ptr == NULL )
@@ -698,20 +1788,16 @@ static int internal_get_node(
 		if ( make_entry )
 		{
 			/* allocate new node_entry */
-			node_ptr = calloc(1, sizeof(struct node_entry));
+			node_ptr = node_alloc();
 			require_action(node_ptr != NULL, calloc_node_ptr, error = ENOMEM; webdav_kill(-1));
 			
-			/* allocate space for its name */
-			node_ptr->name = malloc(name_length + 1);
-			require_action(node_ptr->name != NULL, malloc_name, node_ptr = NULL; error = ENOMEM; webdav_kill(-1));
+			/* set its name */
+			error = node_set_name(node_ptr, name, name_length);
+			require_noerr_action(error, malloc_name, node_free(node_ptr); node_ptr = NULL; webdav_kill(-1));
 			
 			/* initialize the node_entry */
-			node_ptr->parent = parent;
 			LIST_INIT(&node_ptr->children);
-			node_ptr->name_length = name_length;
-			memcpy(node_ptr->name, name, name_length);
-			node_ptr->name[name_length] = '\0';
-			node_ptr->name_ref = CFStringCreateWithCStringNoCopy(kCFAllocatorDefault, node_ptr->name, kCFStringEncodingUTF8, kCFAllocatorNull);
+			node_ptr->name_hash = name_hash;
 			node_ptr->fileid = g_next_fileid++;
 			node_ptr->node_type = node_type;
 			node_ptr->node_time = time(NULL);
@@ -728,8 +1814,8 @@ static int internal_get_node(
 			/* file cache fields are already zeroed - set file_fd to indicate there is no cache file */
 			node_ptr->file_fd = -1;
 			
-			/* insert the node_entry into the parent's children list */
-			LIST_INSERT_HEAD(&parent->children, node_ptr, entries);
+			/* insert the node_entry into the parent's children list (this sets its parent) */
+			insert_child(parent, node_ptr);
 		}
 		else
 		{
@@ -784,7 +1870,30 @@ int nodecache_get_node(
 	struct node_entry **node)		/* the found (or new) node */
 {
 	int error;
+	u_int32_t name_hash;
+	struct node_entry *node_ptr;
 
+	/*
+	 * Most calls just look up an existing node whose recent flag doesn't need
+	 * changing. Try that with the lock shared and only take it exclusive if
+	 * the node has to be created or updated.
+	 */
+	if ( !make_entry )
+	{
+		lock_node_cache_shared();
+		
+		error = internal_find_child(parent, name_length, name, &name_hash, &node_ptr);
+		if ( (error == 0) && (node_ptr != NULL) &&
+			 (((node_ptr->flags & nodeRecentMask) != 0) == (client_created != 0)) )
+		{
+			unlock_node_cache();
+			*node = node_ptr;
+			return ( 0 );
+		}
+		
+		unlock_node_cache();
+	}
+	
 	lock_node_cache();
 	
 	error = internal_get_node(parent, name_length, name, make_entry, client_created, node_type, node);
@@ -814,7 +1923,7 @@ static void internal_free_nodes(void)
 		if ( !NODE_FILE_IS_CACHED(node) )
 		{
 			/* remove the node_entry from the list it is in */
-			LIST_REMOVE(node, entries);
+			remove_child(node);
 			
 			/* invalidate the nodeid */
 			(void) DeleteOpaqueID(node->nodeid);
@@ -833,14 +1942,22 @@ static void internal_free_nodes(void)
 			}
 
 			/* free memory used by the node */
-			free(node->name);
-			CFRelease(node->name_ref);
+			node_release_name(node);
+			if ( node->child_hash != NULL )
+			{
+				free(node->child_hash);
+			}
 			if (node->redir_name != NULL) 
 				free (node->redir_name);
+			if ( node->escaped_path != NULL )
+			{
+				CFRelease(node->escaped_path);
+				--g_node_stats.escaped_paths;
+			}
 
 			(void) internal_remove_attributes(node, TRUE);
 
-			free(node);
+			node_free(node);
 		}
 		node = next_node;
 	}
@@ -859,6 +1976,19 @@ void nodecache_free_nodes(void)
 
 /*****************************************************************************/
 
+/* invalidates every node's cached escaped_path */
+static void internal_invalidate_paths(void)
+{
+	++g_path_generation;
+	/* generation 0 is never valid so zeroed nodes never match */
+	if ( g_path_generation == 0 )
+	{
+		g_path_generation = 1;
+	}
+}
+
+/*****************************************************************************/
+
 static int internal_move_node(
 	struct node_entry *node,		/* the node_entry to move */
 	struct node_entry *new_parent,  /* the new parent node_entry */
@@ -882,19 +2012,23 @@ static int internal_move_node(
 		/* did the name change? */
 		if ( compare_result != kCFCompareEqualTo )
 		{
-			char *name;
+			/* the name_hash is changing, so take the node out of child_hash while the name changes */
+			child_hash_remove(node);
+			
+			error = node_set_name(node, new_name, new_name_length);
+			if ( error )
+			{
+				/* the old name is still good, so put the node back */
+				child_hash_insert(node);
+			}
+			require_noerr_action(error, malloc_name, webdav_kill(-1));
+			
+			node->name_hash = node_name_hash(node->name, node->name_length, node->name_ref);
 			
-			/* allocate space for new name */
-			name = malloc(new_name_length + 1);
-			require_action(name != NULL, malloc_name, error = errno; webdav_kill(-1));
+			child_hash_insert(node);
 			
-			free(node->name);
-			CFRelease(node->name_ref);
-			node->name = name;
-			memcpy(node->name, new_name, new_name_length);
-			node->name[new_name_length] = '\0';
-			node->name_ref = CFStringCreateWithCStringNoCopy(kCFAllocatorDefault, node->name, kCFStringEncodingUTF8, kCFAllocatorNull);
-			node->name_length = new_name_length;
+			/* the paths to this node and everything below it changed */
+			internal_invalidate_paths();
 		}
 	}
 
@@ -902,9 +2036,11 @@ static int internal_move_node(
 	if ( node->parent != new_parent )
 	{
 		/* move the node_entry to the new parent */
-		LIST_REMOVE(node, entries);
-		LIST_INSERT_HEAD(&new_parent->children, node, entries);
-		node->parent = new_parent;
+		remove_child(node);
+		insert_child(new_parent, node);
+		
+		/* the paths to this node and everything below it changed */
+		internal_invalidate_paths();
 	}
 
 malloc_name:
@@ -1084,6 +2220,40 @@ int nodecache_delete_invalid_directory_nodes(
 
 /*****************************************************************************/
 
+u_int32_t nodecache_get_child_directories(
+	struct node_entry *dir_node,		/* parent directory node */
+	opaque_id *ids,						/* <- the child directories' opaque_ids */
+	u_int32_t max_ids)					/* -> the number of entries in ids */
+{
+	struct node_entry *node;
+	u_int32_t count;
+	
+	count = 0;
+	
+	lock_node_cache_shared();
+	
+	if ( (dir_node->node_type == WEBDAV_DIR_TYPE) && !NODE_IS_DELETED(dir_node) )
+	{
+		LIST_FOREACH(node, &dir_node->children, entries)
+		{
+			if ( count == max_ids )
+			{
+				break;
+			}
+			if ( (node->node_type == WEBDAV_DIR_TYPE) && !NODE_IS_DELETED(node) )
+			{
+				ids[count++] = node->nodeid;
+			}
+		}
+	}
+	
+	unlock_node_cache();
+	
+	return ( count );
+}
+
+/*****************************************************************************/
+
 /*
  * nodecache_get_path_from_node
  *
@@ -1200,6 +2370,66 @@ node_deleted:
 
 /*****************************************************************************/
 
+/*
+ * internal_get_cache_key returns node's key in the persistent cache -- the
+ * mount's base URL followed by node's path -- in a malloc'd string, or NULL
+ * if node has no path or its path was redirected.
+ */
+static char *internal_get_cache_key(struct node_entry *node)
+{
+	char *key;
+	char *path;
+	bool pathHasRedirection;
+	CFStringRef urlString;
+	size_t key_size;
+	
+	key = NULL;
+	
+	require_noerr_quiet(internal_get_path_from_node(node, &pathHasRedirection, &path), internal_get_path_from_node);
+	require_quiet(!pathHasRedirection, redirected);
+	
+	urlString = CFURLGetString(gBaseURL);
+	key_size = CFStringGetMaximumSizeForEncoding(CFStringGetLength(urlString), kCFStringEncodingUTF8) + strlen(path) + 1;
+	key = malloc(key_size);
+	require(key != NULL, malloc_key);
+	
+	if ( CFStringGetCString(urlString, key, (CFIndex)key_size, kCFStringEncodingUTF8) )
+	{
+		strlcat(key, path, key_size);
+	}
+	else
+	{
+		free(key);
+		key = NULL;
+	}
+
+malloc_key:
+redirected:
+
+	free(path);
+
+internal_get_path_from_node:
+
+	return ( key );
+}
+
+/*****************************************************************************/
+
+char *nodecache_get_cache_key(struct node_entry *node)
+{
+	char *key;
+	
+	lock_node_cache_shared();
+	
+	key = internal_get_cache_key(node);
+	
+	unlock_node_cache();
+	
+	return ( key );
+}
+
+/*****************************************************************************/
+
 int nodecache_get_path_from_node(
 	struct node_entry *node,		/* -> node */
 	bool *pathHasRedirection,		/* true if path contains a URL from a redirected node (http 3xx redirect) */
@@ -1207,7 +2437,7 @@ int nodecache_get_path_from_node(
 {
 	int error;
 
-	lock_node_cache();
+	lock_node_cache_shared();
 
 	error = internal_get_path_from_node(node, pathHasRedirection, path);
 
@@ -1218,6 +2448,193 @@ int nodecache_get_path_from_node(
 
 /*****************************************************************************/
 
+CFStringRef nodecache_create_escaped_path(
+	const char *path,				/* the utf8 path or name to escape */
+	size_t path_length,				/* length of path */
+	bool pathHasRedirection)		/* true if path is (or will be appended to) a redirected URL */
+{
+	CFStringRef stringRef;
+	CFStringRef escapedPathRef;
+	
+	escapedPathRef = NULL;
+	
+	/* convert the path to a CFString */
+	stringRef = CFStringCreateWithBytes(kCFAllocatorDefault, (const UInt8 *)path, path_length, kCFStringEncodingUTF8, false);
+	require_string(stringRef != NULL, CFStringCreateWithBytes, "name was not legal UTF8");
+	
+	if ( pathHasRedirection )
+	{
+		/* the path already starts with the redirected URL so leave its ":" alone */
+		escapedPathRef = CFURLCreateStringByAddingPercentEscapes(kCFAllocatorDefault, stringRef, NULL, CFSTR(";?"), kCFStringEncodingUTF8);
+	}
+	else
+	{
+		/*
+		 * Percent escape everything that CFURLCreateStringByAddingPercentEscapes()
+		 * considers illegal URL characters plus the characters ";" and "?" which are
+		 * not legal pchar (see rfc2396) characters, and ":" so that names in the root
+		 * directory do not look like absolute URLs with some weird scheme.
+		 */
+		escapedPathRef = CFURLCreateStringByAddingPercentEscapes(kCFAllocatorDefault, stringRef, NULL, CFSTR(":;?"), kCFStringEncodingUTF8);
+	}
+	
+	CFRelease(stringRef);
+
+CFStringCreateWithBytes:
+
+	return ( escapedPathRef );
+}
+
+/*****************************************************************************/
+
+/*
+ * Returns the node's percent escaped path, building it from the parent's
+ * escaped path if the node's cached escaped_path is out of date. Since
+ * percent escaping works a character at a time, escaping each name and
+ * concatenating gives the same result as escaping the whole path.
+ */
+static int internal_get_escaped_path_from_node(
+	struct node_entry *node,
+	bool *pathHasRedirection,		/* true if path contains a URL from a redirected node (http 3xx redirect) */
+	CFStringRef *escapedPath)
+{
+	int error;
+	CFStringRef parentPathRef;
+	CFStringRef nameRef;
+	CFMutableStringRef pathRef;
+	bool parentHasRedirection;
+	
+	error = 0;
+	parentPathRef = NULL;
+	nameRef = NULL;
+	pathRef = NULL;
+	*pathHasRedirection = false;
+	*escapedPath = NULL;
+	
+	require_action(!NODE_IS_DELETED(node), node_deleted, error = ENOENT);
+	
+	if ( node == g_root_node )
+	{
+		/* no relative path */
+		*escapedPath = CFSTR("");
+		CFRetain(*escapedPath);
+		goto done;
+	}
+	
+	/* is the cached path still good? */
+	if ( (node->escaped_path != NULL) && (node->escaped_path_generation == g_path_generation) )
+	{
+		*pathHasRedirection = node->escaped_path_redirected;
+		*escapedPath = node->escaped_path;
+		CFRetain(*escapedPath);
+		goto done;
+	}
+	
+	if ( node->isRedirected )
+	{
+		/* a redirected node's path starts with its redir_name */
+		nameRef = nodecache_create_escaped_path(node->redir_name, node->redir_name_length, true);
+		require_action(nameRef != NULL, nodecache_create_escaped_path, error = EINVAL);
+		
+		pathRef = CFStringCreateMutableCopy(kCFAllocatorDefault, 0, nameRef);
+		require_action(pathRef != NULL, CFStringCreateMutableCopy, error = ENOMEM);
+		
+		*pathHasRedirection = true;
+	}
+	else
+	{
+		require_action(node->parent != NULL, name_too_long, error = ENAMETOOLONG);
+		
+		error = internal_get_escaped_path_from_node(node->parent, &parentHasRedirection, &parentPathRef);
+		require_noerr_quiet(error, internal_get_escaped_path_from_node);
+		
+		nameRef = nodecache_create_escaped_path(node->name, node->name_length, parentHasRedirection);
+		require_action(nameRef != NULL, nodecache_create_escaped_path, error = EINVAL);
+		
+		pathRef = CFStringCreateMutableCopy(kCFAllocatorDefault, 0, parentPathRef);
+		require_action(pathRef != NULL, CFStringCreateMutableCopy, error = ENOMEM);
+		
+		CFStringAppend(pathRef, nameRef);
+		
+		*pathHasRedirection = parentHasRedirection;
+	}
+	
+	/* directory paths end with a slash */
+	if ( node->node_type == WEBDAV_DIR_TYPE )
+	{
+		CFStringAppend(pathRef, CFSTR("/"));
+	}
+	
+	/* cache it */
+	if ( node->escaped_path != NULL )
+	{
+		CFRelease(node->escaped_path);
+	}
+	else
+	{
+		++g_node_stats.escaped_paths;
+	}
+	node->escaped_path = pathRef;
+	node->escaped_path_generation = g_path_generation;
+	node->escaped_path_redirected = *pathHasRedirection;
+	
+	/* one reference for the node, one for the caller */
+	CFRetain(pathRef);
+	*escapedPath = pathRef;
+
+CFStringCreateMutableCopy:
+	if ( nameRef != NULL )
+	{
+		CFRelease(nameRef);
+	}
+nodecache_create_escaped_path:
+	if ( parentPathRef != NULL )
+	{
+		CFRelease(parentPathRef);
+	}
+internal_get_escaped_path_from_node:
+name_too_long:
+done:
+node_deleted:
+
+	return ( error );
+}
+
+/*****************************************************************************/
+
+int nodecache_get_escaped_path_from_node(
+	struct node_entry *node,		/* -> node */
+	bool *pathHasRedirection,		/* true if path contains a URL from a redirected node (http 3xx redirect) */
+	CFStringRef *escapedPath)		/* <- percent escaped relative path to root node (caller must release) */
+{
+	int error;
+
+	/* a valid cached path only needs the lock shared */
+	lock_node_cache_shared();
+	
+	if ( !NODE_IS_DELETED(node) && (node->escaped_path != NULL) &&
+		 (node->escaped_path_generation == g_path_generation) )
+	{
+		*pathHasRedirection = node->escaped_path_redirected;
+		*escapedPath = node->escaped_path;
+		CFRetain(*escapedPath);
+		unlock_node_cache();
+		return ( 0 );
+	}
+	
+	unlock_node_cache();
+	
+	lock_node_cache();
+
+	error = internal_get_escaped_path_from_node(node, pathHasRedirection, escapedPath);
+
+	unlock_node_cache();
+
+	return ( error );
+}
+
+/*****************************************************************************/
+
 int nodecache_redirect_node(
 	CFURLRef url,						/* original url that caused the redirect */
 	struct node_entry *redirected_node,	/* the node_entry that was redirected */
@@ -1354,6 +2771,9 @@ int nodecache_redirect_node(
 		redirected_node->redir_name = name_ptr;
 		redirected_node->redir_name_length = name_ptr_len;
 		
+		/* the paths to this node and everything below it changed */
+		internal_invalidate_paths();
+		
 		syslog(LOG_DEBUG, "Node %s redirected to: %s", redirected_node->name, name_ptr);
 	}
 	else {
@@ -1391,6 +2811,9 @@ int nodecache_redirect_node(
 		g_root_node->redir_name = name_ptr;
 		g_root_node->redir_name_length = name_ptr_len;
 		
+		/* relative paths haven't changed, but be safe since the base URL has */
+		internal_invalidate_paths();
+		
 		syslog(LOG_DEBUG, "Base node redirected to: %s", name_ptr);
 	}
 
@@ -1469,7 +2892,7 @@ CFArrayRef nodecache_get_locktokens(struct node_entry *a_node)
 {
 	CFArrayRef arr;
 	
-	lock_node_cache();
+	lock_node_cache_shared();
 	
 	arr = internal_get_locktokens(a_node);
 	
@@ -1482,16 +2905,16 @@ CFArrayRef nodecache_get_locktokens(struct node_entry *a_node)
 static int init_node_cache_lock(void)
 {
 	int error;
-	pthread_mutexattr_t mutexattr;
+	pthread_rwlockattr_t rwlockattr;
 	
-	error = pthread_mutexattr_init(&mutexattr);
-	require_noerr(error, pthread_mutexattr_init);
+	error = pthread_rwlockattr_init(&rwlockattr);
+	require_noerr(error, pthread_rwlockattr_init);
 	
-	error = pthread_mutex_init(&g_node_cache_lock, &mutexattr);
-	require_noerr(error, pthread_mutex_init);
+	error = pthread_rwlock_init(&g_node_cache_lock, &rwlockattr);
+	require_noerr(error, pthread_rwlock_init);
 
-pthread_mutex_init:
-pthread_mutexattr_init:
+pthread_rwlock_init:
+pthread_rwlockattr_init:
 
 	return ( error );
 }
@@ -1509,7 +2932,7 @@ CFURLRef nodecache_get_baseURL(void)
 {
 	CFURLRef baseURL;
 			
-	lock_node_cache();
+	lock_node_cache_shared();
 	CFRetain(gBaseURL);
 	baseURL = gBaseURL;
 	unlock_node_cache();
@@ -1521,10 +2944,24 @@ CFURLRef nodecache_get_baseURL(void)
 {
 	int error;
 	
-	error = pthread_mutex_lock(&g_node_cache_lock);
-	require_noerr_action(error, pthread_mutex_lock, webdav_kill(-1));
+	error = pthread_rwlock_wrlock(&g_node_cache_lock);
+	require_noerr_action(error, pthread_rwlock_wrlock, webdav_kill(-1));
+
+pthread_rwlock_wrlock:
+	
+	return;
+}
+
+/*****************************************************************************/
+
+void lock_node_cache_shared(void)
+{
+	int error;
+	
+	error = pthread_rwlock_rdlock(&g_node_cache_lock);
+	require_noerr_action(error, pthread_rwlock_rdlock, webdav_kill(-1));
 
-pthread_mutex_lock:
+pthread_rwlock_rdlock:
 	
 	return;
 }
@@ -1535,10 +2972,10 @@ void unlock_node_cache(void)
 {
 	int error;
 	
-	error = pthread_mutex_unlock(&g_node_cache_lock);
-	require_noerr_action(error, pthread_mutex_unlock, webdav_kill(-1));
+	error = pthread_rwlock_unlock(&g_node_cache_lock);
+	require_noerr_action(error, pthread_rwlock_unlock, webdav_kill(-1));
 
-pthread_mutex_unlock:
+pthread_rwlock_unlock:
 	
 	return;
 }
@@ -31,7 +31,7 @@
 /*****************************************************************************/
 
 /* define node_head structure */
-LIST_HEAD(node_head, node_entry);
+TAILQ_HEAD(node_head, node_entry);
 
 struct webdav_stat_attr {
 	struct stat				attr_stat;			/* stat attributes */
@@ -40,18 +40,33 @@ struct webdav_stat_attr {
 	Boolean start;
 };
 
+/*
+ * Names shorter than WEBDAV_NODE_INLINE_NAME_SIZE are stored in the node_entry's
+ * name_inline buffer instead of a separate allocation.
+ */
+#define WEBDAV_NODE_INLINE_NAME_SIZE 32
+
+struct node_slab;
+
 struct node_entry
 {
 	LIST_ENTRY(node_entry)  entries;				/* the other nodes on the parent's children list */
 	struct node_entry		*parent;				/* the parent node_entry, or NULL if this is the root node */
 	LIST_HEAD(, node_entry) children;				/* this node's children (if any) */
+	u_int32_t				child_count;			/* number of nodes on the children list */
+	u_int32_t				child_hash_size;		/* number of buckets in child_hash (a power of 2), or 0 */
+	struct node_entry		**child_hash;			/* the children hashed by name_hash (NULL until there are WEBDAV_CHILD_HASH_MIN children) */
+	struct node_entry		*hash_next;				/* the next node in the parent's child_hash bucket (or the slab's free list) */
+	struct node_slab		*slab;					/* the node_slab this node_entry was allocated from, or NULL */
 	
 	/*
 	 * Node identification fields
 	 */
 	size_t					name_length;			/* length of name */
-	char					*name;					/* the utf8 name */
+	char					*name;					/* the utf8 name (points to name_inline for short names) */
+	char					name_inline[WEBDAV_NODE_INLINE_NAME_SIZE]; /* storage for short names */
 	CFStringRef				name_ref;				/* the name as a CFString */
+	u_int32_t				name_hash;				/* hash of the canonically decomposed name (see node_name_hash) */
 	webdav_ino_t			fileid;					/* file ID number */
 	webdav_filetype_t		node_type;				/* (int) either WEBDAV_FILE_TYPE or WEBDAV_DIR_TYPE */
 	u_int32_t				flags;
@@ -82,10 +97,10 @@ struct node_entry
 	 * A valid cache file can be either active (the file or directory it is a
 	 * cache for is open) or inactive (the file or directory it is a cache for
 	 * is closed). Active cache files have a file_inactive_time of zero;
-	 * inactive cache files have the time the cache file was made inactive so
-	 * that they can be aged out of the cache.
+	 * inactive cache files have the time the cache file was made inactive.
+	 * Only inactive cache files are evicted from the cache.
 	 */
-	LIST_ENTRY(node_entry)  file_list;				/* the g_file_list */
+	TAILQ_ENTRY(node_entry)  file_list;				/* the g_file_list */
 	int						file_fd;				/* the cache file's file descriptor or -1 if none */
 	u_int32_t				file_status;			/* the status of the cache file download:
 													 *		WEBDAV_DOWNLOAD_NEVER (never downloaded)
@@ -97,11 +112,14 @@ struct node_entry
 													 */
 	time_t					file_validated_time;	/* local time - when cache file was last validated by server */
 	time_t					file_inactive_time;		/* local time - when cache file was made inactive (the file this cache is for was closed) - 0 if active */
+	off_t					file_cache_size;		/* the size of the cache file when it was last made inactive */
 	/* file system specific file cache data */
 	time_t					file_last_modified;		/* the HTTP-date converted to time_t from the Last-Modified entity-header or from the getlastmodified property, or -1 if no valid Last-Modified date */
 	char					*file_entity_tag;		/* The entity-tag from the ETag response-header or from the getetag property */
 	uid_t					file_locktoken_uid;		/* the uid associated with the locktoken (filesystem_close and filesystem_lock need it to renew locks and to unlock). */
 	char					*file_locktoken;		/* the lock token, or NULL */
+	struct file_blocks		*file_blocks;			/* blocks of the file read out of band, or NULL (see nodecache_add_file_blocks) */
+	char					*file_cache_key;		/* if the cache file is a persistent cache entry, its key (see nodecache_get_cache_key), or NULL */
 
 	/* Context for sequential writes */
 	struct stream_put_ctx* put_ctx;
@@ -110,6 +128,11 @@ struct node_entry
 	boolean_t				isRedirected;		/* TRUE if this node has been redirected */
 	size_t					redir_name_length;	/* length of redirected name */
 	char					*redir_name;		/* the redirected utf8 name (From Location header of 3xx response) */
+	
+	/* Cached percent escaped path (see nodecache_get_escaped_path_from_node) */
+	CFStringRef				escaped_path;			/* the escaped path from the root node, or NULL */
+	u_int32_t				escaped_path_generation; /* g_path_generation when escaped_path was built */
+	boolean_t				escaped_path_redirected; /* TRUE if escaped_path contains a URL from a redirected node */
 };
 
 #define WEBDAV_DOWNLOAD_NEVER		0
@@ -135,7 +158,8 @@ enum
 #define ATTRIBUTES_TIMEOUT_MIN		2		/* Minimum number of seconds attributes are valid */
 #define ATTRIBUTES_TIMEOUT_MAX		60		/* Maximum number of seconds attributes are valid */
 #define FILE_VALIDATION_TIMEOUT		60		/* Number of seconds file is valid from file_validated_time */
-#define FILE_CACHE_TIMEOUT			3600	/* 1 hour */
+#define FILE_CACHE_HIGH_WATER		1024	/* Number of megabytes of cache files before inactive ones are evicted */
+#define FILE_CACHE_LOW_WATER		768		/* Number of megabytes of cache files eviction stops at */
 #define FILE_RECENTLY_CREATED_TIMEOUT	1	/* Maximum number of seconds to skip GETs on opens after a create */
 
 #define NODE_IS_DELETED(node)		(((node)->flags & nodeDeletedMask) != 0)
@@ -149,8 +173,6 @@ int node_attributes_valid(
 										  
 #define NODE_FILE_IS_CACHED(node)	( ((node)->flags & nodeInFileListMask) != 0 )
 #define NODE_FILE_IS_OPEN(node)		( (node)->file_inactive_time == 0 )
-#define NODE_FILE_CACHE_INVALID(node) ( ((node)->file_inactive_time != 0) && \
-									  (time(NULL) >= ((node)->file_inactive_time + FILE_CACHE_TIMEOUT)) )
 #define NODE_FILE_INVALID(node)		( ((node)->file_validated_time == 0) || \
 									  (time(NULL) >= ((node)->file_validated_time + FILE_VALIDATION_TIMEOUT)) )
 #define NODE_FILE_RECENTLY_CREATED(node) ( ((node)->node_time != 0) && \
@@ -203,14 +225,58 @@ int nodecache_add_file_cache(
 void nodecache_remove_file_cache(
 	struct node_entry *node);		/* the node_entry to remove file_cache_entry from */
 
+void nodecache_reuse_file_cache(
+	struct node_entry *node);		/* the node_entry whose cache file is being reopened */
+
+void nodecache_close_file_cache(
+	struct node_entry *node);		/* the node_entry whose cache file is being made inactive */
+
+void nodecache_trim_file_cache(void);
+
 struct node_entry *nodecache_get_next_file_cache_node(
 	int get_first);					/* if true, return first file cache node; otherwise, the next one */
 
+void nodecache_flush_file_cache(void);
+
+char *nodecache_get_cache_key(
+	struct node_entry *node);		/* -> node */
+
+int nodecache_read_file_blocks(
+	struct node_entry *node,		/* -> the node */
+	off_t offset,					/* -> position within the file */
+	size_t count,					/* -> number of bytes */
+	char *buffer);					/* <- the bytes, if all of them are in the node's blocks */
+
+void nodecache_add_file_blocks(
+	struct node_entry *node,		/* -> the node */
+	const char *entity_tag,			/* -> the ETag of the response the bytes came from */
+	off_t offset,					/* -> position within the file of the bytes */
+	const char *bytes,				/* -> the bytes */
+	size_t count);					/* -> number of bytes */
+
+off_t nodecache_copy_file_blocks(
+	struct node_entry *node,		/* -> the node */
+	const char *entity_tag,			/* -> the ETag of the file being downloaded */
+	off_t offset,					/* -> position within the file to start copying */
+	off_t end,						/* -> position within the file to stop copying */
+	int fd,							/* -> the file to copy to */
+	off_t fd_offset);				/* -> position within fd to copy offset to */
+
 int nodecache_get_path_from_node(
 	struct node_entry *node,		/* -> node */
 	bool *pathHasRedirection,		/* true if path contains a URL from a redirected node (http 3xx redirect) */
 	char **path);					/* <- relative path to root node */
 
+int nodecache_get_escaped_path_from_node(
+	struct node_entry *node,		/* -> node */
+	bool *pathHasRedirection,		/* true if path contains a URL from a redirected node (http 3xx redirect) */
+	CFStringRef *escapedPath);		/* <- percent escaped relative path to root node (caller must release) */
+
+CFStringRef nodecache_create_escaped_path(
+	const char *path,				/* the utf8 path or name to escape */
+	size_t path_length,				/* length of path */
+	bool pathHasRedirection);		/* true if path is (or will be appended to) a redirected URL */
+
 int nodecache_redirect_node(
 	CFURLRef url,						/* original url that caused the redirect */
 	struct node_entry *redirected_node,	/* the node being redirected NULL if root node */
@@ -223,12 +289,21 @@ int nodecache_invalidate_directory_node_time(
 int nodecache_delete_invalid_directory_nodes(
 	struct node_entry *dir_node);	/* parent directory node */
 
+/* returns the number of dir_node's child directories whose opaque_ids were put in ids */
+u_int32_t nodecache_get_child_directories(
+	struct node_entry *dir_node,	/* parent directory node */
+	opaque_id *ids,					/* <- the child directories' opaque_ids */
+	u_int32_t max_ids);				/* -> the number of entries in ids */
+
 CFURLRef nodecache_get_baseURL(void);
 
 CFArrayRef nodecache_get_locktokens(
 	struct node_entry *a_node);		/* node or directory node */
 
-void lock_node_cache(void);
+void nodecache_log_stats(void);
+
+void lock_node_cache(void);			/* exclusive -- for anything that changes the node cache */
+void lock_node_cache_shared(void);	/* shared -- for lookups that change nothing */
 void unlock_node_cache(void);
 
 
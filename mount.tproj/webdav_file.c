@@ -35,9 +35,13 @@
 #include <sys/param.h>
 #include <sys/stat.h>
 #include <sys/sysctl.h>
+#include <sys/mman.h>
+#include <dirent.h>
+#include <syslog.h>
 
 #include "webdav_cache.h"
 #include "webdav_network.h"
+#include "webdav_requestqueue.h"
 #include "OpaqueIDs.h"
 #include "LogMessage.h"
 
@@ -57,151 +61,1405 @@ int g_vfc_typenum;
 static pthread_mutex_t webdav_cachefile_lock;	/* this mutex protects webdav_cachefile */
 static int webdav_cachefile;	/* file descriptor for an empty, unlinked cache file or -1 */
 
+static pthread_mutex_t webdav_read_ring_lock;	/* this mutex protects webdav_read_ring_fd and webdav_read_ring */
+static int webdav_read_ring_fd;	/* file descriptor for the read ring file or -1 */
+static char *webdav_read_ring;	/* the read ring file mapped shared, or NULL */
+
 /*****************************************************************************/
 
-static int get_cachefile(int *fd);
 static void save_cachefile(int fd);
 static int associate_cachefile(int ref, int fd);
+static int get_read_ring(int *fd);
 
 /*****************************************************************************/
 
 #define TMP_CACHE_DIR _PATH_TMP ".webdavcache"		/* Directory for local file cache */
 #define CACHEFILE_TEMPLATE "webdav.XXXXXX"			/* template for cache files */
 
+/*
+ * The persistent cache keeps the contents of closed files in a directory that
+ * outlives the mount and the daemon, so a file opened again after a remount is
+ * revalidated with a conditional GET instead of downloaded again.
+ *
+ * Each entry is named for a hash of its key (the server URL and path -- see
+ * nodecache_get_cache_key): "<hash>.data" holds the file's contents and
+ * "<hash>.meta" holds the key, the state of the data, its size, the file's
+ * Last-Modified time and ETag, and when the entry was last used. Meta files are
+ * only replaced with rename(2), an entry is marked busy before its data file is
+ * used as a cache file, and it is marked clean only after the data is complete
+ * and synced; so after a crash, busy entries are simply thrown away. A process
+ * using an entry holds an exclusive flock on its data file so mounts sharing the
+ * directory never use or evict each other's entries.
+ *
+ * Clean entries are evicted least recently used first when they take more than
+ * persistent_cache_max bytes.
+ */
+#define PERSISTENT_CACHE_DIR TMP_CACHE_DIR ".persistent"	/* followed by ".<uid>" */
+#define PERSISTENT_CACHE_VERSION "webdavfs persistent cache 1"	/* first line of meta files */
+#define PERSISTENT_CACHE_TEMP_TIMEOUT 60	/* Number of seconds before an orphaned temp meta file is removed */
+
+struct persistent_meta
+{
+	int		clean;			/* TRUE if the data is complete */
+	off_t	size;			/* the length of the data */
+	time_t	last_modified;	/* the file's Last-Modified time */
+	time_t	used;			/* local time - when the entry was last used */
+	char	*entity_tag;	/* the file's ETag, or NULL */
+	char	*key;			/* the entry's key */
+};
+
+static pthread_mutex_t persistent_cache_lock = PTHREAD_MUTEX_INITIALIZER;	/* protects persistent_cache_size and serializes scans */
+static char persistent_cache_path[MAXPATHLEN];	/* the persistent cache directory, or "" if there's no persistent cache */
+static off_t persistent_cache_max;		/* the size cap of the persistent cache */
+static off_t persistent_cache_size;		/* bytes in clean entries (an estimate, since other mounts can share the directory) */
+
 /* get_cachefile returns the fd for a cache file. If webdav_cachefile is not
  * storing a cache file fd, open/create a new temp file and return it.
  * Otherwise, return the stored cache file fd.
  */
-static int get_cachefile(int *fd)
+int get_cachefile(int *fd)
+{
+	int error, mutexerror;
+	char pathbuf[MAXPATHLEN];
+	int retrycount;
+	
+	error = 0;
+
+	error = pthread_mutex_lock(&webdav_cachefile_lock);
+	require_noerr_action(error, pthread_mutex_lock, webdav_kill(-1));
+	
+	/* did a previous call leave a cache file for us to use? */
+	if ( webdav_cachefile < 0 )
+	{
+		/* no, so create a temp file */
+		retrycount = 0;
+		/* don't get stuck here forever */
+		while ( retrycount < 5 )
+		{
+			++retrycount;
+			error = 0;
+			if ( *gWebdavCachePath == '\0' )
+			{
+				/* create a template with our pid */
+				snprintf(gWebdavCachePath, MAXPATHLEN + 1, "%s.%lu.XXXXXX", TMP_CACHE_DIR, (unsigned long)getpid());
+				
+				/* create the cache directory */
+				require_action(mkdtemp(gWebdavCachePath) != NULL, mkdtemp, error = errno);
+			}
+			
+			/* create a template for the cache file */
+			snprintf(pathbuf, MAXPATHLEN, "%s/%s", gWebdavCachePath, CACHEFILE_TEMPLATE);
+			
+			/* create and open the cache file */
+			*fd = mkstemp(pathbuf);
+			if ( *fd != -1 )
+			{
+				/* unlink it so the last close will delete it */
+				verify_noerr(unlink(pathbuf));
+				break;	/* break with success */
+			}
+			else
+			{
+				error = errno;
+				if ( ENOENT == error )
+				{
+					/* the gWebdavCachePath directory is missing, clear the old one and try again */
+					*gWebdavCachePath = '\0';
+					continue;
+				}
+				else
+				{
+					debug_string("mkstemp failed");
+					break;	/* break with error */
+				}
+			}
+		}
+	}
+	else
+	{
+		/* yes, so grab it */
+		*fd = webdav_cachefile;
+		webdav_cachefile = -1;
+	}
+
+mkdtemp:
+	
+	mutexerror = pthread_mutex_unlock(&webdav_cachefile_lock);
+	require_noerr_action(mutexerror, pthread_mutex_unlock, error = mutexerror; webdav_kill(-1));
+
+pthread_mutex_unlock:
+pthread_mutex_lock:
+
+	return ( error );
+}
+
+/*****************************************************************************/
+
+/* save_cachefile saves a cache file fd that wasn't needed. If there is already
+ * stored a cache file fd, then the input fd is closed (closing will only
+ * happen when there there is a race between multiple open requests so it
+ * should be rare).
+ */
+static void save_cachefile(int fd)
+{
+	int mutexerror;
+	
+	mutexerror = pthread_mutex_lock(&webdav_cachefile_lock);
+	require_noerr_action(mutexerror, pthread_mutex_lock, webdav_kill(-1));
+	
+	/* are we already storing a cache file that wasn't used? */
+	if ( webdav_cachefile < 0 )
+	{
+		/* no, so store this one */
+		webdav_cachefile = fd;
+	}
+	else
+	{
+		/* yes, so close this one */
+		close(fd);
+	}
+
+	mutexerror = pthread_mutex_unlock(&webdav_cachefile_lock);
+	require_noerr_action(mutexerror, pthread_mutex_unlock, webdav_kill(-1));
+
+pthread_mutex_unlock:
+pthread_mutex_lock:
+	
+	return;
+}
+
+/*****************************************************************************/
+
+static int associate_cachefile(int ref, int fd)
+{
+	int error = 0;
+	int mib[5];
+	
+	/* setup mib for the request */
+	mib[0] = CTL_VFS;
+	mib[1] = g_vfc_typenum;
+	mib[2] = WEBDAV_ASSOCIATECACHEFILE_SYSCTL;
+	mib[3] = ref;
+	mib[4] = fd;
+	
+	require_noerr_action(sysctl(mib, 5, NULL, NULL, NULL, 0), sysctl, error = errno);
+
+sysctl:
+
+	return ( error );
+}
+
+/*****************************************************************************/
+
+/* get_read_ring returns the fd for the read ring file, creating and mapping
+ * it the first time it is needed. The file stays open and mapped for the
+ * life of the mount.
+ */
+static int get_read_ring(int *fd)
+{
+	int error, mutexerror;
+	int ring_fd;
+	void *ring;
+	
+	error = pthread_mutex_lock(&webdav_read_ring_lock);
+	require_noerr_action(error, pthread_mutex_lock, webdav_kill(-1));
+	
+	if ( webdav_read_ring_fd < 0 )
+	{
+		/* the read ring is just another unlinked cache file */
+		ring_fd = -1;
+		error = get_cachefile(&ring_fd);
+		require_noerr_quiet(error, get_cachefile);
+		
+		require_action(ftruncate(ring_fd, (off_t)WEBDAV_READ_RING_SLOTS * WEBDAV_READ_RING_SLOT_SIZE) == 0, ftruncate, error = errno);
+		
+		ring = mmap(NULL, (size_t)WEBDAV_READ_RING_SLOTS * WEBDAV_READ_RING_SLOT_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, ring_fd, 0);
+		require_action(ring != MAP_FAILED, mmap, error = errno);
+		
+		webdav_read_ring_fd = ring_fd;
+		webdav_read_ring = (char *)ring;
+	}
+	
+	*fd = webdav_read_ring_fd;
+	
+	mutexerror = pthread_mutex_unlock(&webdav_read_ring_lock);
+	require_noerr_action(mutexerror, pthread_mutex_unlock, error = mutexerror; webdav_kill(-1));
+	
+	return ( error );
+
+mmap:
+ftruncate:
+
+	close(ring_fd);
+
+get_cachefile:
+
+	mutexerror = pthread_mutex_unlock(&webdav_read_ring_lock);
+	require_noerr_action(mutexerror, pthread_mutex_unlock, webdav_kill(-1));
+
+pthread_mutex_unlock:
+pthread_mutex_lock:
+
+	return ( error );
+}
+
+/*****************************************************************************/
+
+/* persistent_cache_entry_path makes the path of key's entry file with suffix */
+static void persistent_cache_entry_path(const char *key, const char *suffix, char *path)
+{
+	u_int64_t hash;
+	const unsigned char *cp;
+	
+	/* FNV-1a */
+	hash = 0xcbf29ce484222325ULL;
+	for ( cp = (const unsigned char *)key; *cp != '\0'; ++cp )
+	{
+		hash ^= *cp;
+		hash *= 0x100000001b3ULL;
+	}
+	snprintf(path, MAXPATHLEN, "%s/%016llx%s", persistent_cache_path, (unsigned long long)hash, suffix);
+}
+
+/*****************************************************************************/
+
+static void persistent_meta_free(struct persistent_meta *meta)
+{
+	if ( meta->entity_tag != NULL )
+	{
+		free(meta->entity_tag);
+		meta->entity_tag = NULL;
+	}
+	if ( meta->key != NULL )
+	{
+		free(meta->key);
+		meta->key = NULL;
+	}
+}
+
+/*****************************************************************************/
+
+/* persistent_meta_read reads the meta file at path into meta. */
+static int persistent_meta_read(const char *path, struct persistent_meta *meta)
+{
+	int error;
+	FILE *file;
+	char *line;
+	size_t line_size;
+	ssize_t length;
+	int field;
+	
+	bzero(meta, sizeof(struct persistent_meta));
+	line = NULL;
+	line_size = 0;
+	
+	file = fopen(path, "r");
+	require_action_quiet(file != NULL, fopen, error = errno);
+	
+	error = EINVAL;
+	for ( field = 0; (length = getline(&line, &line_size, file)) > 0; ++field )
+	{
+		require_quiet(line[length - 1] == '\n', bad_meta);
+		line[length - 1] = '\0';
+		switch ( field )
+		{
+			case 0:
+				require_quiet(strcmp(line, PERSISTENT_CACHE_VERSION) == 0, bad_meta);
+				break;
+			case 1:
+				meta->clean = (strcmp(line, "clean") == 0);
+				break;
+			case 2:
+				meta->size = strtoll(line, NULL, 10);
+				break;
+			case 3:
+				meta->last_modified = (time_t)strtoll(line, NULL, 10);
+				break;
+			case 4:
+				meta->used = (time_t)strtoll(line, NULL, 10);
+				break;
+			case 5:
+				if ( *line != '\0' )
+				{
+					meta->entity_tag = strdup(line);
+					require_action(meta->entity_tag != NULL, bad_meta, error = ENOMEM);
+				}
+				break;
+			case 6:
+				meta->key = strdup(line);
+				require_action(meta->key != NULL, bad_meta, error = ENOMEM);
+				error = 0;
+				break;
+			default:
+				break;
+		}
+	}
+
+bad_meta:
+
+	if ( error )
+	{
+		persistent_meta_free(meta);
+	}
+	if ( line != NULL )
+	{
+		free(line);
+	}
+	fclose(file);
+
+fopen:
+
+	return ( error );
+}
+
+/*****************************************************************************/
+
+/* persistent_meta_write atomically replaces the meta file at path with meta. */
+static int persistent_meta_write(const char *path, const struct persistent_meta *meta)
+{
+	int error;
+	char temp_path[MAXPATHLEN];
+	int fd;
+	FILE *file;
+	
+	snprintf(temp_path, MAXPATHLEN, "%s.XXXXXX", path);
+	fd = mkstemp(temp_path);
+	require_action(fd != -1, mkstemp, error = errno);
+	
+	file = fdopen(fd, "w");
+	require_action(file != NULL, fdopen, error = errno; close(fd));
+	
+	fprintf(file, "%s\n%s\n%lld\n%lld\n%lld\n%s\n%s\n", PERSISTENT_CACHE_VERSION,
+		meta->clean ? "clean" : "busy", (long long)meta->size, (long long)meta->last_modified,
+		(long long)meta->used, (meta->entity_tag != NULL) ? meta->entity_tag : "", meta->key);
+	error = ((fflush(file) == 0) && (fsync(fileno(file)) == 0)) ? 0 : errno;
+	if ( (fclose(file) != 0) && (error == 0) )
+	{
+		error = errno;
+	}
+	if ( error == 0 )
+	{
+		require_action(rename(temp_path, path) == 0, rename, error = errno);
+	}
+
+rename:
+fdopen:
+
+	if ( error )
+	{
+		(void) unlink(temp_path);
+	}
+
+mkstemp:
+
+	return ( error );
+}
+
+/*****************************************************************************/
+
+/*
+ * persistent_cache_remove deletes the entry whose files are named stem unless
+ * its data file is in use. It returns EWOULDBLOCK if the entry is in use.
+ */
+static int persistent_cache_remove(const char *stem)
+{
+	int error;
+	char path[MAXPATHLEN];
+	int fd;
+	
+	error = 0;
+	
+	/* hold the data file's lock while deleting so no one can start using it */
+	snprintf(path, MAXPATHLEN, "%s/%s.data", persistent_cache_path, stem);
+	fd = open(path, O_RDONLY | O_EXLOCK | O_NONBLOCK | O_NOFOLLOW);
+	require_action_quiet((fd != -1) || (errno == ENOENT), open, error = errno);
+	
+	snprintf(path, MAXPATHLEN, "%s/%s.meta", persistent_cache_path, stem);
+	(void) unlink(path);
+	
+	if ( fd != -1 )
+	{
+		snprintf(path, MAXPATHLEN, "%s/%s.data", persistent_cache_path, stem);
+		(void) unlink(path);
+		close(fd);
+	}
+
+open:
+
+	return ( error );
+}
+
+/*****************************************************************************/
+
+/* the files found by persistent_cache_scan */
+struct persistent_cache_file
+{
+	char	stem[32];		/* the file's name without its suffix */
+	int		kind;			/* PERSISTENT_CACHE_CLEAN, PERSISTENT_CACHE_BUSY, PERSISTENT_CACHE_DATA, or PERSISTENT_CACHE_TEMP */
+	time_t	used;			/* when a clean entry was last used */
+	off_t	size;			/* the size of a clean entry */
+};
+
+#define PERSISTENT_CACHE_CLEAN	0	/* the meta file of a clean entry */
+#define PERSISTENT_CACHE_BUSY	1	/* the meta file of a busy entry, or one that can't be read */
+#define PERSISTENT_CACHE_DATA	2	/* a data file */
+#define PERSISTENT_CACHE_TEMP	3	/* a temp meta file left from persistent_meta_write */
+
+static int persistent_cache_file_compare(const void *a, const void *b)
+{
+	const struct persistent_cache_file *file_a = (const struct persistent_cache_file *)a;
+	const struct persistent_cache_file *file_b = (const struct persistent_cache_file *)b;
+	
+	/* clean entries, least recently used first */
+	if ( file_a->kind != file_b->kind )
+	{
+		return ( (file_a->kind < file_b->kind) ? -1 : 1 );
+	}
+	if ( file_a->used != file_b->used )
+	{
+		return ( (file_a->used < file_b->used) ? -1 : 1 );
+	}
+	return ( 0 );
+}
+
+/*****************************************************************************/
+
+/*
+ * persistent_cache_scan evicts clean entries from the persistent cache, least
+ * recently used first, until they take no more than limit bytes. If recover is
+ * TRUE, it also removes what a crash leaves behind: busy entries and data files
+ * without meta files that aren't in use, and old temp meta files.
+ * persistent_cache_lock must be held.
+ */
+static void persistent_cache_scan(off_t limit, int recover)
+{
+	DIR *dir;
+	struct dirent *entry;
+	struct persistent_cache_file *files;
+	struct persistent_cache_file *new_files;
+	size_t count;
+	size_t capacity;
+	size_t index;
+	size_t evicted;
+	off_t total;
+	time_t now;
+	char path[MAXPATHLEN];
+	struct persistent_meta meta;
+	struct stat statbuf;
+	
+	files = NULL;
+	count = capacity = 0;
+	evicted = 0;
+	total = 0;
+	
+	dir = opendir(persistent_cache_path);
+	require(dir != NULL, opendir);
+	
+	/* collect the files first; the directory is changed afterwards */
+	while ( (entry = readdir(dir)) != NULL )
+	{
+		char *suffix;
+		size_t stem_length;
+		
+		suffix = strchr(entry->d_name, '.');
+		if ( (suffix == NULL) || (suffix == entry->d_name) )
+		{
+			/* ".", "..", or not ours */
+			continue;
+		}
+		stem_length = suffix - entry->d_name;
+		if ( stem_length >= sizeof(files->stem) )
+		{
+			continue;
+		}
+		
+		if ( count == capacity )
+		{
+			capacity = (capacity == 0) ? 256 : capacity * 2;
+			new_files = realloc(files, capacity * sizeof(struct persistent_cache_file));
+			require(new_files != NULL, realloc);
+			files = new_files;
+		}
+		memcpy(files[count].stem, entry->d_name, stem_length);
+		files[count].stem[stem_length] = '\0';
+		files[count].used = 0;
+		files[count].size = 0;
+		
+		snprintf(path, MAXPATHLEN, "%s/%s", persistent_cache_path, entry->d_name);
+		if ( strcmp(suffix, ".meta") == 0 )
+		{
+			if ( (persistent_meta_read(path, &meta) == 0) && meta.clean )
+			{
+				files[count].kind = PERSISTENT_CACHE_CLEAN;
+				files[count].used = meta.used;
+				files[count].size = meta.size;
+				total += meta.size;
+			}
+			else
+			{
+				files[count].kind = PERSISTENT_CACHE_BUSY;
+			}
+			persistent_meta_free(&meta);
+		}
+		else if ( strcmp(suffix, ".data") == 0 )
+		{
+			files[count].kind = PERSISTENT_CACHE_DATA;
+		}
+		else if ( strncmp(suffix, ".meta.", 6) == 0 )
+		{
+			files[count].kind = PERSISTENT_CACHE_TEMP;
+			strlcpy(files[count].stem, entry->d_name, sizeof(files->stem));
+		}
+		else
+		{
+			continue;
+		}
+		++count;
+	}
+
+realloc:
+
+	closedir(dir);
+	
+	qsort(files, count, sizeof(struct persistent_cache_file), persistent_cache_file_compare);
+	
+	now = time(NULL);
+	for ( index = 0; index < count; ++index )
+	{
+		switch ( files[index].kind )
+		{
+			case PERSISTENT_CACHE_CLEAN:
+				if ( (total > limit) && (persistent_cache_remove(files[index].stem) == 0) )
+				{
+					total -= files[index].size;
+					++evicted;
+				}
+				break;
+			case PERSISTENT_CACHE_BUSY:
+				if ( recover )
+				{
+					(void) persistent_cache_remove(files[index].stem);
+				}
+				break;
+			case PERSISTENT_CACHE_DATA:
+				snprintf(path, MAXPATHLEN, "%s/%s.meta", persistent_cache_path, files[index].stem);
+				if ( recover && (lstat(path, &statbuf) != 0) && (errno == ENOENT) )
+				{
+					(void) persistent_cache_remove(files[index].stem);
+				}
+				break;
+			case PERSISTENT_CACHE_TEMP:
+				snprintf(path, MAXPATHLEN, "%s/%s", persistent_cache_path, files[index].stem);
+				if ( recover && (lstat(path, &statbuf) == 0) &&
+					(statbuf.st_mtime + PERSISTENT_CACHE_TEMP_TIMEOUT < now) )
+				{
+					(void) unlink(path);
+				}
+				break;
+		}
+	}
+	
+	persistent_cache_size = total;
+	
+	LogMessage(kTrace, "persistent_cache_scan: %ld entries evicted, %lld bytes cached\n", (long)evicted, (long long)total);
+	
+	if ( files != NULL )
+	{
+		free(files);
+	}
+
+opendir:
+
+	return;
+}
+
+/*****************************************************************************/
+
+/*
+ * persistent_cache_init makes the persistent cache directory (if it doesn't
+ * already exist) and cleans up after any crash. The directory is per-user and
+ * since it's in /tmp, it isn't used unless it belongs to the user and no one
+ * else can get into it.
+ */
+static void persistent_cache_init(void)
+{
+	char path[MAXPATHLEN];
+	struct stat statbuf;
+	
+	snprintf(path, MAXPATHLEN, "%s.%lu", PERSISTENT_CACHE_DIR, (unsigned long)gProcessUID);
+	require_quiet((mkdir(path, S_IRWXU) == 0) || (errno == EEXIST), mkdir);
+	require_quiet(lstat(path, &statbuf) == 0, lstat);
+	require_action(S_ISDIR(statbuf.st_mode) && (statbuf.st_uid == gProcessUID) &&
+		((statbuf.st_mode & (S_IRWXG | S_IRWXO)) == 0), bad_directory,
+		syslog(LOG_ERR, "%s: %s can't be used for the persistent cache\n", __FUNCTION__, path));
+	
+	strlcpy(persistent_cache_path, path, MAXPATHLEN);
+	
+	pthread_mutex_lock(&persistent_cache_lock);
+	persistent_cache_scan(persistent_cache_max, TRUE);
+	pthread_mutex_unlock(&persistent_cache_lock);
+
+bad_directory:
+lstat:
+mkdir:
+
+	return;
+}
+
+/*****************************************************************************/
+
+/*
+ * get_persistent_cachefile opens node's entry in the persistent cache so its
+ * data file can be used as node's cache file. It returns the data file in *fd
+ * and the entry's meta data in *meta (meta->clean is FALSE if the data can't
+ * be used), or an error if there's no persistent cache or the entry is in use.
+ */
+static int get_persistent_cachefile(struct node_entry *node, int *fd, struct persistent_meta *meta)
+{
+	int error;
+	char *key;
+	char path[MAXPATHLEN];
+	struct stat statbuf;
+	
+	error = 0;
+	key = NULL;
+	
+	require_action_quiet(*persistent_cache_path != '\0', no_persistent_cache, error = ENOENT);
+	
+	/* keys are stored as a line of the meta file */
+	key = nodecache_get_cache_key(node);
+	require_action_quiet((key != NULL) && (strchr(key, '\n') == NULL), nodecache_get_cache_key, error = ENOENT);
+	
+	/* the lock can't be had if another mount is using the entry */
+	persistent_cache_entry_path(key, ".data", path);
+	*fd = open(path, O_RDWR | O_CREAT | O_EXLOCK | O_NONBLOCK | O_NOFOLLOW, S_IRUSR | S_IWUSR);
+	require_action_quiet(*fd != -1, open, error = errno);
+	
+	persistent_cache_entry_path(key, ".meta", path);
+	if ( persistent_meta_read(path, meta) == 0 )
+	{
+		/* the data can only be used if it's complete, it's for this key, and it can be revalidated */
+		meta->clean = meta->clean && (strcmp(meta->key, key) == 0) &&
+			((meta->last_modified != -1) || (meta->entity_tag != NULL)) &&
+			(fstat(*fd, &statbuf) == 0) && (statbuf.st_size == meta->size);
+		free(meta->key);
+	}
+	meta->key = key;
+	key = NULL;
+
+open:
+nodecache_get_cache_key:
+
+	if ( key != NULL )
+	{
+		free(key);
+	}
+
+no_persistent_cache:
+
+	return ( error );
+}
+
+/*****************************************************************************/
+
+/*
+ * adopt_persistent_cachefile is called after the data file from
+ * get_persistent_cachefile becomes node's cache file. The entry is marked busy
+ * and if its data is clean, node gets the data's validators so network_open
+ * revalidates it with a conditional GET instead of downloading the file.
+ */
+static void adopt_persistent_cachefile(struct node_entry *node, struct persistent_meta *meta)
+{
+	char path[MAXPATHLEN];
+	int clean;
+	
+	clean = meta->clean;
+	meta->clean = FALSE;
+	meta->used = time(NULL);
+	persistent_cache_entry_path(meta->key, ".meta", path);
+	if ( persistent_meta_write(path, meta) == 0 )
+	{
+		if ( clean )
+		{
+			pthread_mutex_lock(&persistent_cache_lock);
+			persistent_cache_size -= MIN(meta->size, persistent_cache_size);
+			pthread_mutex_unlock(&persistent_cache_lock);
+			
+			/* file_validated_time was left 0 so the data will be revalidated */
+			node->file_status = WEBDAV_DOWNLOAD_FINISHED;
+			node->file_last_modified = meta->last_modified;
+			node->file_entity_tag = meta->entity_tag;
+			meta->entity_tag = NULL;
+		}
+		else
+		{
+			(void) ftruncate(node->file_fd, 0LL);
+		}
+		(void) fchflags(node->file_fd, 0);
+		node->file_cache_key = meta->key;
+		meta->key = NULL;
+	}
+	else
+	{
+		/* the entry can't be kept, so the data file is just an unlinked cache file */
+		(void) unlink(path);
+		persistent_cache_entry_path(meta->key, ".data", path);
+		(void) unlink(path);
+		(void) ftruncate(node->file_fd, 0LL);
+	}
+	persistent_meta_free(meta);
+}
+
+/*****************************************************************************/
+
+/*
+ * save_persistent_cachefile is called after the node cache is unlocked when a
+ * node whose cache file is the data file of a persistent cache entry has been
+ * removed from the file cache (see save_cache_files). If keep is TRUE, the data is synced and the entry is marked
+ * clean with the file's validators; otherwise, the entry is deleted. The caller
+ * closes fd.
+ */
+void save_persistent_cachefile(const char *key, int fd, int keep, time_t last_modified, const char *entity_tag)
+{
+	char path[MAXPATHLEN];
+	struct persistent_meta meta;
+	struct stat statbuf;
+	
+	keep = keep && ((last_modified != -1) || (entity_tag != NULL)) && (fstat(fd, &statbuf) == 0) && (fsync(fd) == 0);
+	if ( keep )
+	{
+		meta.clean = TRUE;
+		meta.size = statbuf.st_size;
+		meta.last_modified = last_modified;
+		meta.used = time(NULL);
+		meta.entity_tag = (char *)entity_tag;
+		meta.key = (char *)key;
+		persistent_cache_entry_path(key, ".meta", path);
+		keep = (persistent_meta_write(path, &meta) == 0);
+	}
+	
+	if ( keep )
+	{
+		pthread_mutex_lock(&persistent_cache_lock);
+		persistent_cache_size += statbuf.st_size;
+		pthread_mutex_unlock(&persistent_cache_lock);
+	}
+	else
+	{
+		/* the data file is still locked by fd */
+		persistent_cache_entry_path(key, ".meta", path);
+		(void) unlink(path);
+		persistent_cache_entry_path(key, ".data", path);
+		(void) unlink(path);
+	}
+}
+
+/*****************************************************************************/
+
+/*
+ * filesystem_trim_persistent_cache evicts entries from the persistent cache (if
+ * any) when it's over its size cap. If purge is TRUE, every entry that isn't in
+ * use is evicted.
+ */
+void filesystem_trim_persistent_cache(int purge)
+{
+	if ( *persistent_cache_path != '\0' )
+	{
+		pthread_mutex_lock(&persistent_cache_lock);
+		if ( purge || (persistent_cache_size > persistent_cache_max) )
+		{
+			persistent_cache_scan(purge ? 0 : persistent_cache_max, FALSE);
+		}
+		pthread_mutex_unlock(&persistent_cache_lock);
+	}
+}
+
+/*****************************************************************************/
+
+/*
+ * filesystem_flush_persistent_cache is called when the file system is
+ * unmounted to save the cache files that are persistent cache entries.
+ */
+void filesystem_flush_persistent_cache(void)
+{
+	if ( *persistent_cache_path != '\0' )
+	{
+		nodecache_flush_file_cache();
+		filesystem_trim_persistent_cache(FALSE);
+	}
+}
+
+/*****************************************************************************/
+
+/*
+ * Single-flight. When several requests need the same thing from the server at
+ * once -- the attributes or contents of the same node, or the same name looked
+ * up in the same directory, for the same uid -- only the first one sends its
+ * request. The others wait for it to finish and then use what it cached (or
+ * return its error).
+ */
+#define INFLIGHT_LOOKUP		0	/* network_lookup of name in node */
+#define INFLIGHT_GETATTR	1	/* network_getattr of node */
+#define INFLIGHT_OPEN		2	/* network_open of node for reading */
+
+struct inflight_request
+{
+	LIST_ENTRY(inflight_request) list;	/* the inflight_list */
+	int operation;					/* INFLIGHT_LOOKUP, INFLIGHT_GETATTR or INFLIGHT_OPEN */
+	struct node_entry *node;		/* the node (the parent directory for INFLIGHT_LOOKUP) */
+	uid_t uid;						/* the uid the request is for */
+	const char *name;				/* INFLIGHT_LOOKUP: the name being looked up */
+	size_t name_length;				/* INFLIGHT_LOOKUP: length of name */
+	int done;						/* TRUE when the request has finished */
+	int error;						/* the request's result */
+	u_int32_t waiters;				/* requests waiting for the result */
+};
+
+static pthread_mutex_t inflight_lock = PTHREAD_MUTEX_INITIALIZER;	/* protects inflight_list, the waiters and inflight_stats */
+static pthread_cond_t inflight_cond = PTHREAD_COND_INITIALIZER;	/* broadcast when a request finishes or its last waiter leaves */
+static LIST_HEAD(, inflight_request) inflight_list = LIST_HEAD_INITIALIZER(inflight_list);
+
+/* counters for filesystem_log_stats */
+static struct
+{
+	u_int64_t	sent;			/* requests sent to the server */
+	u_int64_t	coalesced;		/* requests that used another's result instead */
+} inflight_stats;
+
+/*
+ * inflight_begin returns TRUE if the caller should send its request; the
+ * caller must then pass request and the result to inflight_end. Otherwise, an
+ * identical request was in flight: inflight_begin waited for it to finish and
+ * returns FALSE with its result in *error.
+ */
+static int inflight_begin(
+	struct inflight_request *request,	/* <- the caller's request */
+	int operation,
+	struct node_entry *node,
+	uid_t uid,
+	const char *name,
+	size_t name_length,
+	int *error)
+{
+	struct inflight_request *current;
+	int send;
+	
+	send = TRUE;
+	
+	pthread_mutex_lock(&inflight_lock);
+	
+	LIST_FOREACH(current, &inflight_list, list)
+	{
+		if ( (current->operation == operation) && (current->node == node) && (current->uid == uid) &&
+			 (current->name_length == name_length) &&
+			 ((name_length == 0) || (memcmp(current->name, name, name_length) == 0)) )
+		{
+			break;
+		}
+	}
+	
+	if ( current != NULL )
+	{
+		/* wait for the request in flight */
+		++current->waiters;
+		while ( !current->done )
+		{
+			pthread_cond_wait(&inflight_cond, &inflight_lock);
+		}
+		*error = current->error;
+		if ( --current->waiters == 0 )
+		{
+			pthread_cond_broadcast(&inflight_cond);
+		}
+		++inflight_stats.coalesced;
+		send = FALSE;
+	}
+	else
+	{
+		bzero(request, sizeof(struct inflight_request));
+		request->operation = operation;
+		request->node = node;
+		request->uid = uid;
+		request->name = name;
+		request->name_length = name_length;
+		LIST_INSERT_HEAD(&inflight_list, request, list);
+		++inflight_stats.sent;
+	}
+	
+	pthread_mutex_unlock(&inflight_lock);
+	
+	return ( send );
+}
+
+/*
+ * inflight_end passes the result of a request sent after inflight_begin to the
+ * requests waiting for it, and returns once they all have it.
+ */
+static void inflight_end(struct inflight_request *request, int error)
+{
+	pthread_mutex_lock(&inflight_lock);
+	
+	LIST_REMOVE(request, list);
+	request->error = error;
+	request->done = TRUE;
+	pthread_cond_broadcast(&inflight_cond);
+	
+	/* request is on the caller's stack, so it has to outlive the waiters */
+	while ( request->waiters != 0 )
+	{
+		pthread_cond_wait(&inflight_cond, &inflight_lock);
+	}
+	
+	pthread_mutex_unlock(&inflight_lock);
+}
+
+/*****************************************************************************/
+
+/*
+ * Directory prefetch. A recursive walk (find, du, rsync, the Finder copying a
+ * folder) reads a directory, then each of its child directories, then theirs,
+ * and waits for a Depth 1 PROPFIND every time. filesystem_readdir remembers the
+ * last PREFETCH_RECENT directories it read; while each directory read is a
+ * child of one read within WEBDAV_PREFETCH_WINDOW seconds, the walk streak
+ * grows. Once it reaches WEBDAV_PREFETCH_WALK, the child directories of each
+ * directory read are queued (WEBDAV_CLASS_PREFETCH) to be read into spare cache
+ * files by filesystem_prefetch. A readdir that finds its directory's listing in
+ * prefetch_dirs copies it into the directory's cache file instead of asking the
+ * server; one that finds the listing being read waits for it.
+ *
+ * Depth infinity PROPFINDs aren't used: many servers refuse them, and their
+ * responses can't be written as listings until the whole tree has arrived.
+ */
+#define PREFETCH_RECENT		16	/* directories remembered for walk detection */
+
+#define PREFETCH_FREE		0	/* the slot is unused */
+#define PREFETCH_QUEUED		1	/* waiting for a request thread */
+#define PREFETCH_RUNNING	2	/* being read from the server */
+#define PREFETCH_DONE		3	/* the listing is in fd */
+
+struct prefetch_dir
+{
+	opaque_id nodeid;			/* the directory, or kInvalidOpaqueID if the slot is free */
+	uid_t uid;					/* the uid the directory is read for */
+	int cache;					/* TRUE if the additional caching properties are asked for */
+	int state;					/* PREFETCH_FREE, PREFETCH_QUEUED, PREFETCH_RUNNING or PREFETCH_DONE */
+	int stale;					/* TRUE if the directory changed while it was being read */
+	int fd;						/* PREFETCH_DONE: the cache file holding the listing, otherwise -1 */
+	time_t fetched;				/* local time - when the listing was read */
+};
+
+static pthread_mutex_t prefetch_lock = PTHREAD_MUTEX_INITIALIZER;	/* protects everything below but prefetch_enabled */
+static pthread_cond_t prefetch_cond = PTHREAD_COND_INITIALIZER;	/* broadcast when a prefetch finishes */
+static int prefetch_enabled;	/* TRUE if WEBDAVFS_PREFETCH is in the environment */
+static struct prefetch_dir prefetch_dirs[WEBDAV_PREFETCH_DIRS];
+static struct
+{
+	opaque_id	nodeid;			/* a directory read by filesystem_readdir */
+	time_t		read_time;		/* local time - when it was read */
+} prefetch_recent[PREFETCH_RECENT];
+static u_int32_t prefetch_recent_next;	/* the prefetch_recent entry to replace next */
+static u_int32_t prefetch_streak;		/* directories in a row read after their parents */
+
+/* counters for filesystem_log_stats */
+static struct
+{
+	u_int64_t	walks;			/* readdirs that queued prefetches */
+	u_int64_t	queued;			/* directories queued */
+	u_int64_t	fetched;		/* listings read */
+	u_int64_t	hits;			/* readdirs that used a listing */
+	u_int64_t	waits;			/* readdirs that waited for a listing being read */
+	u_int64_t	wasted;			/* listings thrown away unused */
+} prefetch_stats;
+
+/* returns nodeid's slot, or NULL. prefetch_lock must be held. */
+static struct prefetch_dir *prefetch_find(opaque_id nodeid)
+{
+	int index;
+	
+	for ( index = 0; index < WEBDAV_PREFETCH_DIRS; ++index )
+	{
+		if ( prefetch_dirs[index].nodeid == nodeid )
+		{
+			return ( &prefetch_dirs[index] );
+		}
+	}
+	return ( NULL );
+}
+
+/* frees a slot that isn't PREFETCH_RUNNING. prefetch_lock must be held. */
+static void prefetch_release(struct prefetch_dir *dir)
+{
+	if ( dir->fd != -1 )
+	{
+		++prefetch_stats.wasted;
+		close(dir->fd);
+	}
+	bzero(dir, sizeof(struct prefetch_dir));
+	dir->nodeid = kInvalidOpaqueID;
+	dir->state = PREFETCH_FREE;
+	dir->fd = -1;
+}
+
+/*
+ * returns a free slot, freeing a listing that has outlived WEBDAV_PREFETCH_TTL
+ * if it has to, or NULL if all the slots are busy. prefetch_lock must be held.
+ */
+static struct prefetch_dir *prefetch_slot(time_t now)
+{
+	struct prefetch_dir *expired;
+	int index;
+	
+	expired = NULL;
+	for ( index = 0; index < WEBDAV_PREFETCH_DIRS; ++index )
+	{
+		struct prefetch_dir *dir = &prefetch_dirs[index];
+		
+		if ( dir->state == PREFETCH_FREE )
+		{
+			return ( dir );
+		}
+		if ( (dir->state == PREFETCH_DONE) && (now >= dir->fetched + WEBDAV_PREFETCH_TTL) &&
+			 ((expired == NULL) || (dir->fetched < expired->fetched)) )
+		{
+			expired = dir;
+		}
+	}
+	if ( expired != NULL )
+	{
+		prefetch_release(expired);
+	}
+	return ( expired );
+}
+
+/*
+ * prefetch_forget throws away what the prefetch engine has for a directory
+ * that was just changed. A listing being read is thrown away when it arrives.
+ */
+static void prefetch_forget(struct node_entry *dir_node)
+{
+	struct prefetch_dir *dir;
+	
+	if ( !prefetch_enabled || (dir_node == NULL) )
+	{
+		return;
+	}
+	
+	pthread_mutex_lock(&prefetch_lock);
+	
+	dir = prefetch_find(dir_node->nodeid);
+	if ( dir != NULL )
+	{
+		if ( dir->state == PREFETCH_RUNNING )
+		{
+			dir->stale = TRUE;
+		}
+		else
+		{
+			prefetch_release(dir);
+		}
+	}
+	
+	pthread_mutex_unlock(&prefetch_lock);
+}
+
+/* prefetch_forget_all throws away everything the prefetch engine has */
+static void prefetch_forget_all(void)
+{
+	int index;
+	
+	if ( !prefetch_enabled )
+	{
+		return;
+	}
+	
+	pthread_mutex_lock(&prefetch_lock);
+	
+	for ( index = 0; index < WEBDAV_PREFETCH_DIRS; ++index )
+	{
+		if ( prefetch_dirs[index].state == PREFETCH_RUNNING )
+		{
+			prefetch_dirs[index].stale = TRUE;
+		}
+		else if ( prefetch_dirs[index].state != PREFETCH_FREE )
+		{
+			prefetch_release(&prefetch_dirs[index]);
+		}
+	}
+	prefetch_streak = 0;
+	
+	pthread_mutex_unlock(&prefetch_lock);
+}
+
+/* copies the listing in from_fd to the directory cache file to_fd */
+static int prefetch_copy(int from_fd, int to_fd)
+{
+	int error;
+	char buffer[8192];
+	ssize_t count;
+	
+	error = 0;
+	
+	require_action(ftruncate(to_fd, 0) == 0, ftruncate, error = errno);
+	require_action(lseek(to_fd, 0, SEEK_SET) == 0, lseek, error = errno);
+	require_action(lseek(from_fd, 0, SEEK_SET) == 0, lseek, error = errno);
+	
+	while ( (count = read(from_fd, buffer, sizeof(buffer))) > 0 )
+	{
+		require_action(write(to_fd, buffer, (size_t)count) == count, write, error = EIO);
+	}
+	require_action(count == 0, read, error = errno);
+	
+	return ( 0 );
+	
+read:
+write:
+	/* directory is in unknown condition - erase whatever is there */
+	(void) ftruncate(to_fd, 0);
+lseek:
+ftruncate:
+
+	return ( error );
+}
+
+/*
+ * prefetch_take returns TRUE if node's prefetched listing was copied into its
+ * cache file, in which case the server doesn't need to be asked for it.
+ */
+static int prefetch_take(uid_t uid, int cache, struct node_entry *node)
+{
+	struct prefetch_dir *dir;
+	int fd;
+	int taken;
+	
+	fd = -1;
+	
+	pthread_mutex_lock(&prefetch_lock);
+	
+	dir = prefetch_find(node->nodeid);
+	if ( (dir != NULL) && (dir->uid == uid) && (dir->cache || !cache) )
+	{
+		if ( dir->state == PREFETCH_RUNNING )
+		{
+			/* the listing is on its way, so wait for it instead of asking for it again */
+			++prefetch_stats.waits;
+			while ( (dir->state == PREFETCH_RUNNING) && (dir->nodeid == node->nodeid) )
+			{
+				pthread_cond_wait(&prefetch_cond, &prefetch_lock);
+			}
+			dir = prefetch_find(node->nodeid);
+		}
+		if ( (dir != NULL) && (dir->state == PREFETCH_DONE) && (time(NULL) < dir->fetched + WEBDAV_PREFETCH_TTL) )
+		{
+			fd = dir->fd;
+			dir->fd = -1;
+			++prefetch_stats.hits;
+		}
+	}
+	if ( (dir != NULL) && (dir->state != PREFETCH_RUNNING) )
+	{
+		/* a listing is only used once, and a queued prefetch is too late now */
+		prefetch_release(dir);
+	}
+	
+	pthread_mutex_unlock(&prefetch_lock);
+	
+	taken = FALSE;
+	if ( fd != -1 )
+	{
+		taken = (prefetch_copy(fd, node->file_fd) == 0);
+		close(fd);
+	}
+	
+	return ( taken );
+}
+
+/*
+ * prefetch_walk is called after node's listing is read. If a recursive walk
+ * is going on, node's child directories are queued to be prefetched.
+ */
+static void prefetch_walk(uid_t uid, int cache, struct node_entry *node)
 {
-	int error, mutexerror;
-	char pathbuf[MAXPATHLEN];
-	int retrycount;
+	opaque_id ids[WEBDAV_PREFETCH_FANOUT];
+	u_int32_t count;
+	u_int32_t index;
+	u_int32_t queued;
+	time_t now;
+	int walking;
 	
-	error = 0;
-
-	error = pthread_mutex_lock(&webdav_cachefile_lock);
-	require_noerr_action(error, pthread_mutex_lock, webdav_kill(-1));
+	now = time(NULL);
 	
-	/* did a previous call leave a cache file for us to use? */
-	if ( webdav_cachefile < 0 )
+	pthread_mutex_lock(&prefetch_lock);
+	
+	/* was node's parent read recently? */
+	walking = FALSE;
+	if ( node->parent != NULL )
 	{
-		/* no, so create a temp file */
-		retrycount = 0;
-		/* don't get stuck here forever */
-		while ( retrycount < 5 )
+		for ( index = 0; index < PREFETCH_RECENT; ++index )
 		{
-			++retrycount;
-			error = 0;
-			if ( *gWebdavCachePath == '\0' )
-			{
-				/* create a template with our pid */
-				snprintf(gWebdavCachePath, MAXPATHLEN + 1, "%s.%lu.XXXXXX", TMP_CACHE_DIR, (unsigned long)getpid());
-				
-				/* create the cache directory */
-				require_action(mkdtemp(gWebdavCachePath) != NULL, mkdtemp, error = errno);
-			}
-			
-			/* create a template for the cache file */
-			snprintf(pathbuf, MAXPATHLEN, "%s/%s", gWebdavCachePath, CACHEFILE_TEMPLATE);
-			
-			/* create and open the cache file */
-			*fd = mkstemp(pathbuf);
-			if ( *fd != -1 )
-			{
-				/* unlink it so the last close will delete it */
-				verify_noerr(unlink(pathbuf));
-				break;	/* break with success */
-			}
-			else
+			if ( (prefetch_recent[index].nodeid == node->parent->nodeid) &&
+				 (now < prefetch_recent[index].read_time + WEBDAV_PREFETCH_WINDOW) )
 			{
-				error = errno;
-				if ( ENOENT == error )
-				{
-					/* the gWebdavCachePath directory is missing, clear the old one and try again */
-					*gWebdavCachePath = '\0';
-					continue;
-				}
-				else
-				{
-					debug_string("mkstemp failed");
-					break;	/* break with error */
-				}
+				walking = TRUE;
+				break;
 			}
 		}
 	}
-	else
+	prefetch_streak = walking ? (prefetch_streak + 1) : 0;
+	
+	prefetch_recent[prefetch_recent_next].nodeid = node->nodeid;
+	prefetch_recent[prefetch_recent_next].read_time = now;
+	prefetch_recent_next = (prefetch_recent_next + 1) % PREFETCH_RECENT;
+	
+	walking = (prefetch_streak >= WEBDAV_PREFETCH_WALK);
+	
+	pthread_mutex_unlock(&prefetch_lock);
+	
+	require_quiet(walking, not_walking);
+	
+	count = nodecache_get_child_directories(node, ids, WEBDAV_PREFETCH_FANOUT);
+	require_quiet(count != 0, no_children);
+	
+	/* claim slots for the children that aren't already prefetched */
+	queued = 0;
+	pthread_mutex_lock(&prefetch_lock);
+	for ( index = 0; index < count; ++index )
 	{
-		/* yes, so grab it */
-		*fd = webdav_cachefile;
-		webdav_cachefile = -1;
+		struct prefetch_dir *dir;
+		
+		if ( prefetch_find(ids[index]) != NULL )
+		{
+			continue;
+		}
+		dir = prefetch_slot(now);
+		if ( dir == NULL )
+		{
+			break;
+		}
+		dir->nodeid = ids[index];
+		dir->uid = uid;
+		dir->cache = cache;
+		dir->state = PREFETCH_QUEUED;
+		dir->stale = FALSE;
+		dir->fd = -1;
+		dir->fetched = 0;
+		ids[queued++] = ids[index];
 	}
-
-mkdtemp:
+	if ( queued != 0 )
+	{
+		++prefetch_stats.walks;
+		prefetch_stats.queued += queued;
+	}
+	pthread_mutex_unlock(&prefetch_lock);
 	
-	mutexerror = pthread_mutex_unlock(&webdav_cachefile_lock);
-	require_noerr_action(mutexerror, pthread_mutex_unlock, error = mutexerror; webdav_kill(-1));
+	for ( index = 0; index < queued; ++index )
+	{
+		if ( requestqueue_enqueue_prefetch(ids[index]) != 0 )
+		{
+			struct prefetch_dir *dir;
+			
+			pthread_mutex_lock(&prefetch_lock);
+			dir = prefetch_find(ids[index]);
+			if ( (dir != NULL) && (dir->state == PREFETCH_QUEUED) )
+			{
+				prefetch_release(dir);
+			}
+			pthread_mutex_unlock(&prefetch_lock);
+		}
+	}
 
-pthread_mutex_unlock:
-pthread_mutex_lock:
+no_children:
+not_walking:
 
-	return ( error );
+	return;
 }
 
 /*****************************************************************************/
 
-/* save_cachefile saves a cache file fd that wasn't needed. If there is already
- * stored a cache file fd, then the input fd is closed (closing will only
- * happen when there there is a race between multiple open requests so it
- * should be rare).
+/*
+ * filesystem_prefetch reads a directory queued by prefetch_walk into a spare
+ * cache file. Reading it also caches its children's attributes.
  */
-static void save_cachefile(int fd)
+void filesystem_prefetch(opaque_id nodeid)
 {
-	int mutexerror;
+	struct prefetch_dir *dir;
+	struct node_entry *node;
+	uid_t uid;
+	int cache;
+	int fd;
+	int error;
 	
-	mutexerror = pthread_mutex_lock(&webdav_cachefile_lock);
-	require_noerr_action(mutexerror, pthread_mutex_lock, webdav_kill(-1));
+	pthread_mutex_lock(&prefetch_lock);
 	
-	/* are we already storing a cache file that wasn't used? */
-	if ( webdav_cachefile < 0 )
+	/* was it taken by a readdir or forgotten while it was queued? */
+	dir = prefetch_find(nodeid);
+	if ( (dir == NULL) || (dir->state != PREFETCH_QUEUED) )
 	{
-		/* no, so store this one */
-		webdav_cachefile = fd;
+		pthread_mutex_unlock(&prefetch_lock);
+		return;
+	}
+	dir->state = PREFETCH_RUNNING;
+	uid = dir->uid;
+	cache = dir->cache;
+	
+	pthread_mutex_unlock(&prefetch_lock);
+	
+	fd = -1;
+	
+	error = RetrieveDataFromOpaqueID(nodeid, (void **)&node);
+	require_noerr_action_quiet(error, bad_obj_id, error = ESTALE);
+	
+	require_action_quiet(!NODE_IS_DELETED(node), deleted_node, error = ESTALE);
+	
+	error = get_cachefile(&fd);
+	require_noerr_quiet(error, get_cachefile);
+	
+	error = network_prefetch_directory(uid, cache, node, fd);
+	LogMessage(kTrace, "filesystem_prefetch: read %s, error %d\n", node->name, error);
+
+get_cachefile:
+deleted_node:
+bad_obj_id:
+
+	pthread_mutex_lock(&prefetch_lock);
+	
+	/* the slot can't be taken while it's PREFETCH_RUNNING, so dir is still nodeid's */
+	if ( (error == 0) && !dir->stale )
+	{
+		dir->state = PREFETCH_DONE;
+		dir->fd = fd;
+		dir->fetched = time(NULL);
+		++prefetch_stats.fetched;
 	}
 	else
 	{
-		/* yes, so close this one */
-		close(fd);
+		if ( fd != -1 )
+		{
+			close(fd);
+		}
+		prefetch_release(dir);
 	}
-
-	mutexerror = pthread_mutex_unlock(&webdav_cachefile_lock);
-	require_noerr_action(mutexerror, pthread_mutex_unlock, webdav_kill(-1));
-
-pthread_mutex_unlock:
-pthread_mutex_lock:
+	pthread_cond_broadcast(&prefetch_cond);
 	
-	return;
+	pthread_mutex_unlock(&prefetch_lock);
 }
 
 /*****************************************************************************/
 
-static int associate_cachefile(int ref, int fd)
+void filesystem_log_stats(void)
 {
-	int error = 0;
-	int mib[5];
-	
-	/* setup mib for the request */
-	mib[0] = CTL_VFS;
-	mib[1] = g_vfc_typenum;
-	mib[2] = WEBDAV_ASSOCIATECACHEFILE_SYSCTL;
-	mib[3] = ref;
-	mib[4] = fd;
+	pthread_mutex_lock(&inflight_lock);
+	LogMessage(kTrace, "filesystem: %llu requests sent, %llu coalesced\n",
+		inflight_stats.sent, inflight_stats.coalesced);
+	pthread_mutex_unlock(&inflight_lock);
 	
-	require_noerr_action(sysctl(mib, 5, NULL, NULL, NULL, 0), sysctl, error = errno);
-
-sysctl:
-
-	return ( error );
+	if ( prefetch_enabled )
+	{
+		pthread_mutex_lock(&prefetch_lock);
+		LogMessage(kTrace, "filesystem prefetch: %llu walks, %llu queued, %llu read, %llu hits (%llu waited), %llu wasted\n",
+			prefetch_stats.walks, prefetch_stats.queued, prefetch_stats.fetched,
+			prefetch_stats.hits, prefetch_stats.waits, prefetch_stats.wasted);
+		pthread_mutex_unlock(&prefetch_lock);
+	}
 }
 
 /*****************************************************************************/
@@ -209,6 +1467,7 @@ sysctl:
 int filesystem_init(int typenum)
 {
 	pthread_mutexattr_t mutexattr;
+	int index;
 	int error;
 	
 	g_vfc_typenum = typenum;
@@ -218,6 +1477,9 @@ int filesystem_init(int typenum)
 	statfs_cache_time = 0;
 	
 	webdav_cachefile = -1;	/* closed */
+	
+	webdav_read_ring_fd = -1;	/* not created yet */
+	webdav_read_ring = NULL;
 				
 	/* set up the lock on the queues */
 	error = pthread_mutexattr_init(&mutexattr);
@@ -225,6 +1487,32 @@ int filesystem_init(int typenum)
 	
 	error = pthread_mutex_init(&webdav_cachefile_lock, &mutexattr);
 	require_noerr(error, pthread_mutex_init);
+	
+	error = pthread_mutex_init(&webdav_read_ring_lock, &mutexattr);
+	require_noerr(error, pthread_mutex_init);
+	
+	/* WEBDAVFS_PERSISTENT_CACHE turns on the persistent cache and gives its size cap in megabytes */
+	*persistent_cache_path = '\0';
+	if ( getenv("WEBDAVFS_PERSISTENT_CACHE") != NULL )
+	{
+		long megabytes;
+		
+		megabytes = atol(getenv("WEBDAVFS_PERSISTENT_CACHE"));
+		if ( megabytes > 0 )
+		{
+			persistent_cache_max = (off_t)MIN(megabytes, WEBDAV_MAX_PERSISTENT_CACHE_SIZE) * 1024 * 1024;
+			persistent_cache_init();
+		}
+	}
+	
+	/* WEBDAVFS_PREFETCH turns on directory prefetch */
+	prefetch_enabled = (getenv("WEBDAVFS_PREFETCH") != NULL);
+	for ( index = 0; index < WEBDAV_PREFETCH_DIRS; ++index )
+	{
+		prefetch_dirs[index].nodeid = kInvalidOpaqueID;
+		prefetch_dirs[index].state = PREFETCH_FREE;
+		prefetch_dirs[index].fd = -1;
+	}
 
 pthread_mutex_init:
 pthread_mutexattr_init:
@@ -266,12 +1554,30 @@ int filesystem_open(struct webdav_request_open *request_open,
 			save_cachefile(theCacheFile);
 		
 			/* mark the old cache file active again */
-			node->file_inactive_time = 0;
+			nodecache_reuse_file_cache(node);
 		}
 		else
 		{
-			error = nodecache_add_file_cache(node, theCacheFile);
-			require_noerr_action_quiet(error, nodecache_add_file_cache, save_cachefile(theCacheFile));
+			int persistentCacheFile;
+			struct persistent_meta meta;
+			
+			/* use the file's persistent cache entry (if any) for the cache file */
+			if ( get_persistent_cachefile(node, &persistentCacheFile, &meta) == 0 )
+			{
+				error = nodecache_add_file_cache(node, persistentCacheFile);
+				require_noerr_action_quiet(error, nodecache_add_file_cache,
+					persistent_meta_free(&meta); close(persistentCacheFile); save_cachefile(theCacheFile));
+				
+				/* save the cache file we didn't need */
+				save_cachefile(theCacheFile);
+				
+				adopt_persistent_cachefile(node, &meta);
+			}
+			else
+			{
+				error = nodecache_add_file_cache(node, theCacheFile);
+				require_noerr_action_quiet(error, nodecache_add_file_cache, save_cachefile(theCacheFile));
+			}
 			
 			/* If we get an error beyond this point we need to call nodecache_remove_file_cache() */
 		}
@@ -307,11 +1613,25 @@ int filesystem_open(struct webdav_request_open *request_open,
 			}
 			else
 			{
-				error = network_open(request_open->pcr.pcr_uid, node, write_mode);
+				struct inflight_request inflight;
+				
+				/* opens for reading share the request of an open of the same file that's in flight */
+				if ( write_mode ||
+					 inflight_begin(&inflight, INFLIGHT_OPEN, node, request_open->pcr.pcr_uid, NULL, 0, &error) )
+				{
+					error = network_open(request_open->pcr.pcr_uid, node, write_mode);
+					if ( error == ENOENT )
+					{
+						/* the server says it's gone so delete it and its descendants */
+						(void) nodecache_delete_node(node, TRUE);
+					}
+					if ( !write_mode )
+					{
+						inflight_end(&inflight, error);
+					}
+				}
 				if ( error == ENOENT )
 				{
-					/* the server says it's gone so delete it and its descendants */
-					(void) nodecache_delete_node(node, TRUE);
 					error = ESTALE;
 					goto bad_obj_id;
 				}
@@ -392,8 +1712,8 @@ int filesystem_close(struct webdav_request_close *request_close)
 		usleep(10000);	/* 10 milliseconds */
 	}
 
-	/* set the file_inactive_time  */
-	time(&node->file_inactive_time);
+	/* set the file_inactive_time and account for the cache file's size */
+	nodecache_close_file_cache(node);
 
 	/* if file was written sequentially, clean up the context that's hanging around */
 	if ( node->put_ctx != NULL ) {
@@ -433,6 +1753,9 @@ int filesystem_close(struct webdav_request_close *request_close)
 	{
 		(void)nodecache_remove_file_cache(node);
 	}
+	
+	/* evict inactive cache files if the cache has grown past its high watermark */
+	nodecache_trim_file_cache();
 
 not_open:
 bad_obj_id:
@@ -483,32 +1806,49 @@ int filesystem_lookup(struct webdav_request_lookup *request_lookup, struct webda
 		{
 			/* can we used the cached node? */
 			lookup = !node_attributes_valid(node, request_lookup->pcr.pcr_uid);
+			if ( lookup && network_stat_ahead(request_lookup->pcr.pcr_uid, node) )
+			{
+				/* the parent directory was just refreshed */
+				lookup = !node_attributes_valid(node, request_lookup->pcr.pcr_uid);
+			}
 		}
 	}
 	
 	if ( lookup )
 	{
-		/* look it up on the server */
-		error = network_lookup(request_lookup->pcr.pcr_uid, parent_node,
-			request_lookup->name, request_lookup->name_length, &statbuf);
-		if ( !error )
+		struct inflight_request inflight;
+		
+		/* look it up on the server (unless the same lookup is in flight) */
+		if ( inflight_begin(&inflight, INFLIGHT_LOOKUP, parent_node, request_lookup->pcr.pcr_uid,
+				request_lookup->name, request_lookup->name_length, &error) )
 		{
-			/* create a new node */
-			error = nodecache_get_node(parent_node, request_lookup->name_length, request_lookup->name, TRUE, FALSE,
-				S_ISREG(statbuf.attr_stat.st_mode) ? WEBDAV_FILE_TYPE : WEBDAV_DIR_TYPE, &node);
+			error = network_lookup(request_lookup->pcr.pcr_uid, parent_node,
+				request_lookup->name, request_lookup->name_length, &statbuf);
 			if ( !error )
 			{
-				/* network_lookup gets all of the struct stat fields except for st_ino so fill it in here with the fileid of the new node */
-				statbuf.attr_stat.st_ino = node->fileid;
-				/* cache the attributes */
-				error = nodecache_add_attributes(node, request_lookup->pcr.pcr_uid, &statbuf, NULL);
+				/* create a new node */
+				error = nodecache_get_node(parent_node, request_lookup->name_length, request_lookup->name, TRUE, FALSE,
+					S_ISREG(statbuf.attr_stat.st_mode) ? WEBDAV_FILE_TYPE : WEBDAV_DIR_TYPE, &node);
+				if ( !error )
+				{
+					/* network_lookup gets all of the struct stat fields except for st_ino so fill it in here with the fileid of the new node */
+					statbuf.attr_stat.st_ino = node->fileid;
+					/* cache the attributes */
+					error = nodecache_add_attributes(node, request_lookup->pcr.pcr_uid, &statbuf, NULL);
+				}
+			}
+			else if ( (error == ENOENT) && (node != NULL) )
+			{
+				/* the server says it's gone so delete it and its descendants */
+				(void) nodecache_delete_node(node, TRUE);
+				node = NULL;
 			}
+			inflight_end(&inflight, error);
 		}
-		else if ( (error == ENOENT) && (node != NULL) )
+		else if ( !error )
 		{
-			/* the server says it's gone so delete it and its descendants */
-			(void) nodecache_delete_node(node, TRUE);
-			node = NULL;
+			/* use the node the other lookup cached */
+			error = nodecache_get_node(parent_node, request_lookup->name_length, request_lookup->name, FALSE, FALSE, 0, &node);
 		}
 	}
 	else if ( node == NULL )
@@ -559,15 +1899,22 @@ int filesystem_getattr(struct webdav_request_getattr *request_getattr, struct we
 	
 	require_action_quiet(!NODE_IS_DELETED(node), deleted_node, error = ESTALE);
 	
-	/* see if we have valid attributes */
-	if ( !node_attributes_valid(node, request_getattr->pcr.pcr_uid) )
+	/* see if we have valid attributes (refreshing the parent directory's if its children are being stat'd) */
+	if ( !node_attributes_valid(node, request_getattr->pcr.pcr_uid) &&
+		 !(network_stat_ahead(request_getattr->pcr.pcr_uid, node) && node_attributes_valid(node, request_getattr->pcr.pcr_uid)) )
 	{
-		/* no... look it up on the server */
-		error = network_getattr( request_getattr->pcr.pcr_uid, node, &statbuf);
-		if ( !error )
+		struct inflight_request inflight;
+		
+		/* no... look it up on the server (unless the same request is in flight -- then use what it caches) */
+		if ( inflight_begin(&inflight, INFLIGHT_GETATTR, node, request_getattr->pcr.pcr_uid, NULL, 0, &error) )
 		{
-			/* cache the attributes */
-			error = nodecache_add_attributes(node, request_getattr->pcr.pcr_uid, &statbuf, NULL);
+			error = network_getattr( request_getattr->pcr.pcr_uid, node, &statbuf);
+			if ( !error )
+			{
+				/* cache the attributes */
+				error = nodecache_add_attributes(node, request_getattr->pcr.pcr_uid, &statbuf, NULL);
+			}
+			inflight_end(&inflight, error);
 		}
 	}
 	else
@@ -719,6 +2066,9 @@ int filesystem_create(struct webdav_request_create *request_create, struct webda
 	
 	if ( !error )
 	{
+		/* a prefetched listing of parent_node is out of date */
+		prefetch_forget(parent_node);
+		
 		/*
 		 * we just changed the parent_node so update or remove its attributes
 		 */
@@ -820,6 +2170,9 @@ int filesystem_mkdir(struct webdav_request_mkdir *request_mkdir, struct webdav_r
 	error = network_mkdir(request_mkdir->pcr.pcr_uid, parent_node, request_mkdir->name, request_mkdir->name_length, &creation_date);
 	if ( !error )
 	{
+		/* a prefetched listing of parent_node is out of date */
+		prefetch_forget(parent_node);
+		
 		/*
 		 * we just changed the parent_node so update or remove its attributes
 		 */
@@ -889,10 +2242,24 @@ bad_obj_id:
 
 /*****************************************************************************/
 
+/*
+ * filesystem_read reads bytes the kext needs before the download of the cache
+ * file gets to them. The whole blocks around them are read from the server and
+ * kept (see nodecache_add_file_blocks), so reading them again, or downloading
+ * them in a segment, doesn't go to the server.
+ */
 int filesystem_read(struct webdav_request_read *request_read, char **a_byte_addr, size_t *a_size)
 {
 	int error;
 	struct node_entry *node;
+	off_t offset, start, end;
+	size_t count, skip;
+	char *bytes;
+	size_t num_bytes;
+	char *entity_tag;
+	
+	*a_byte_addr = NULL;
+	*a_size = 0;
 	
 	error = RetrieveDataFromOpaqueID(request_read->obj_id, (void **)&node);
 	require_noerr_action_quiet(error, bad_obj_id, error = ESTALE);
@@ -900,9 +2267,56 @@ int filesystem_read(struct webdav_request_read *request_read, char **a_byte_addr
 	require_action_quiet(!NODE_IS_DELETED(node), deleted_node, error = ESTALE);
 
 	// Note: request_read->count has already been checked for overflow
-	error = network_read(request_read->pcr.pcr_uid, node,
-		request_read->offset, (size_t)request_read->count, a_byte_addr, a_size);
+	offset = request_read->offset;
+	count = (size_t)request_read->count;
+	
+	if ( !NODE_FILE_IS_CACHED(node) || (count == 0) )
+	{
+		/* no cache file, so nowhere to keep the blocks */
+		error = network_read(request_read->pcr.pcr_uid, node, offset, count, a_byte_addr, a_size, NULL);
+		goto done;
+	}
+	
+	bytes = malloc(count);
+	require_action(bytes != NULL, malloc_bytes, error = ENOMEM);
+	if ( nodecache_read_file_blocks(node, offset, count, bytes) )
+	{
+		*a_byte_addr = bytes;
+		*a_size = count;
+		goto done;
+	}
+	free(bytes);
+	
+	/* read the whole blocks the bytes are in */
+	start = offset - (offset % WEBDAV_FILE_BLOCK_SIZE);
+	end = offset + count;
+	end += (WEBDAV_FILE_BLOCK_SIZE - (end % WEBDAV_FILE_BLOCK_SIZE)) % WEBDAV_FILE_BLOCK_SIZE;
+	error = network_read(request_read->pcr.pcr_uid, node, start, (size_t)(end - start), &bytes, &num_bytes, &entity_tag);
+	require_noerr_quiet(error, network_read);
+	
+	nodecache_add_file_blocks(node, entity_tag, start, bytes, num_bytes);
+	if ( entity_tag != NULL )
+	{
+		free(entity_tag);
+	}
+	
+	/* return just the bytes asked for */
+	skip = (size_t)(offset - start);
+	if ( num_bytes > skip )
+	{
+		num_bytes = MIN(num_bytes - skip, count);
+		memmove(bytes, bytes + skip, num_bytes);
+	}
+	else
+	{
+		num_bytes = 0;
+	}
+	*a_byte_addr = bytes;
+	*a_size = num_bytes;
 
+network_read:
+malloc_bytes:
+done:
 deleted_node:
 bad_obj_id:
 
@@ -911,6 +2325,81 @@ bad_obj_id:
 
 /*****************************************************************************/
 
+/*
+ * filesystem_read_ring reads the same bytes as filesystem_read, but places
+ * them in the read ring slot request_read->ring_slot instead of returning them.
+ */
+int filesystem_read_ring(struct webdav_request_read *request_read,
+		struct webdav_reply_read *reply_read)
+{
+	int error;
+	char *bytes;
+	size_t num_bytes;
+	
+	reply_read->count = 0;
+	
+	/* the kext only uses a slot once the ring has been associated, and only if the data will fit */
+	require_action((webdav_read_ring != NULL) &&
+		(request_read->ring_slot >= 0) && (request_read->ring_slot < WEBDAV_READ_RING_SLOTS) &&
+		(request_read->count <= WEBDAV_READ_RING_SLOT_SIZE), bad_ring_slot, error = EINVAL);
+	
+	bytes = NULL;
+	num_bytes = 0;
+	error = filesystem_read(request_read, &bytes, &num_bytes);
+	if ( !error )
+	{
+		/* network_read never returns more than request_read->count bytes */
+		memcpy(webdav_read_ring + ((size_t)request_read->ring_slot * WEBDAV_READ_RING_SLOT_SIZE), bytes, num_bytes);
+		reply_read->count = num_bytes;
+	}
+	
+	if ( bytes != NULL )
+	{
+		free(bytes);
+	}
+
+bad_ring_slot:
+
+	return ( error );
+}
+
+/*****************************************************************************/
+
+/*
+ * filesystem_associate_read_ring associates the read ring file with the
+ * mount using the ring_ref the kext sent with WEBDAV_OPEN_CHANNEL. If the
+ * ring can't be associated, reply_open_channel->ring_slots is left 0 and the
+ * kext returns READ data in the reply.
+ */
+int filesystem_associate_read_ring(int ring_ref,
+		struct webdav_reply_open_channel *reply_open_channel)
+{
+	int error;
+	int ring_fd;
+	
+	reply_open_channel->pid = getpid();
+	reply_open_channel->ring_slots = 0;
+	
+	/* does the kext want the read ring? */
+	require_action_quiet(ring_ref >= 0, no_ring_wanted, error = 0);
+	
+	error = get_read_ring(&ring_fd);
+	require_noerr_quiet(error, get_read_ring);
+	
+	error = associate_cachefile(ring_ref, ring_fd);
+	require_noerr_quiet(error, associate_cachefile);
+	
+	reply_open_channel->ring_slots = WEBDAV_READ_RING_SLOTS;
+
+associate_cachefile:
+get_read_ring:
+no_ring_wanted:
+
+	return ( error );
+}
+
+/*****************************************************************************/
+
 int filesystem_rename(struct webdav_request_rename *request_rename)
 {
 	int error = 0;
@@ -960,6 +2449,10 @@ int filesystem_rename(struct webdav_request_rename *request_rename)
 			parent_node, request_rename->to_name, request_rename->to_name_length, &rename_date);
 		if ( !error )
 		{
+			/* prefetched listings of the parent node(s) are out of date */
+			prefetch_forget(f_node->parent);
+			prefetch_forget(parent_node);
+			
 			/*
 			 * we just changed the parent node(s) so update or remove their attributes
 			 */
@@ -1044,6 +2537,9 @@ int filesystem_remove(struct webdav_request_remove *request_remove)
 	 */
 	if ( (!error) || (error == ENOENT) )
 	{
+		/* a prefetched listing of the parent_node is out of date */
+		prefetch_forget(node->parent);
+		
 		/*
 		 * we just changed the parent_node so update or remove its attributes
 		 */
@@ -1097,6 +2593,9 @@ int filesystem_rmdir(struct webdav_request_rmdir *request_rmdir)
 	error = network_rmdir(request_rmdir->pcr.pcr_uid, node, &remove_date);
 	if ( !error )
 	{
+		/* a prefetched listing of the parent_node is out of date */
+		prefetch_forget(node->parent);
+		
 		/*
 		 * we just changed the parent_node so update or remove its attributes
 		 */
@@ -1444,8 +2943,16 @@ int filesystem_readdir(struct webdav_request_readdir *request_readdir)
 	require_noerr_action_quiet(error, bad_obj_id, error = ESTALE);
 
 	require_action_quiet(!NODE_IS_DELETED(node), deleted_node, error = ESTALE);
-		
-	error = network_readdir(request_readdir->pcr.pcr_uid, request_readdir->cache, node);
+	
+	if ( !prefetch_enabled || !prefetch_take(request_readdir->pcr.pcr_uid, request_readdir->cache, node) )
+	{
+		error = network_readdir(request_readdir->pcr.pcr_uid, request_readdir->cache, node);
+	}
+	
+	if ( !error && prefetch_enabled )
+	{
+		prefetch_walk(request_readdir->pcr.pcr_uid, request_readdir->cache, node);
+	}
 
 deleted_node:
 bad_obj_id:
@@ -1485,6 +2992,7 @@ int filesystem_invalidate_caches(struct webdav_request_invalcaches *request_inva
 	require_action(request_invalcaches->pcr.pcr_uid == gProcessUID, not_permitted, error = EPERM);
 	
 	nodecache_invalidate_caches();
+	prefetch_forget_all();
 	error = 0;
 
 not_permitted:
@@ -34,6 +34,9 @@
 #include <Security/Security.h>
 #include <netdb.h>
 #include <stdio.h>
+#include <poll.h>
+#include <ctype.h>
+#include <zlib.h>
 
 #include "webdav_parse.h"
 #include "webdav_requestqueue.h"
@@ -71,6 +74,42 @@ enum RedirectAction {
 	REDIRECT_AUTO = 2		// Let CFNetwork handle redirecion, i.e. set kCFStreamPropertyHTTPShouldAutoredirect on stream 
 };
 
+/*
+ * A BodyConsumer is handed the body of a successful (2xx) response as it is read
+ * from the stream, instead of stream_transaction collecting the whole body in
+ * one buffer.
+ */
+struct BodyConsumer
+{
+	int (*consume)(void *context, const UInt8 *data, CFIndex length);	/* returns 0, or an errno to stop the transaction */
+	void *context;
+};
+
+/*
+ * A Transport sends a request that send_transaction_to_consumer has finished
+ * (headers, cookies and credentials added) and returns the response the way
+ * stream_transaction does; the authentication loop, redirect handling and
+ * status translation stay in send_transaction_to_consumer. A transport is
+ * responsible for the connection state and Set-Cookie headers of the responses
+ * it gets. If it can't send a request -- or gets a response it can't handle,
+ * like a redirect to follow -- it returns ENOTSUP and the request is sent by
+ * stream_transaction instead. WEBDAVFS_TRANSPORT selects the mount's transport
+ * by name (see gTransports).
+ */
+struct Transport
+{
+	const char *name;
+	int (*transaction)(
+		CFHTTPMessageRef request,	/* -> the request to send */
+		int auto_redirect,			/* -> if TRUE, follow redirects */
+		int *retryTransaction,		/* <-> see stream_transaction */
+		struct BodyConsumer *consumer, /* -> if not NULL, the consumer for a successful response's body */
+		int decode,					/* -> if TRUE, the request asked for a compressed body (see stream_transaction) */
+		UInt8 **buffer,				/* <- response data buffer (caller responsible for freeing) */
+		CFIndex *count,				/* <- response data buffer length */
+		CFHTTPMessageRef *response);	/* <- the response message */
+};
+
 /******************************************************************************/
 
 // The maximum size of an upload or download to allow the
@@ -81,6 +120,7 @@ static CFStringRef userAgentHeaderValue = NULL;	/* The User-Agent request-header
 static CFIndex first_read_len = 4096;	/* bytes.  Amount to download at open so first read at offset 0 doesn't stall */
 static CFStringRef X_Source_Id_HeaderValue = NULL;	/* the X-Source-Id header value, or NULL if not iDisk */
 static CFStringRef X_Apple_Realm_Support_HeaderValue = NULL;	/* the X-Apple-Realm-Support header value, or NULL if not iDisk */
+static int gDownloadSegments = WEBDAV_DOWNLOAD_SEGMENTS;	/* segments in a segmented download (see download_segments_create) */
 
 static SCDynamicStoreRef gProxyStore;
 
@@ -96,7 +136,56 @@ static int gHttpsProxyEnabled;
 static char gHttpsProxyServer[MAXHOSTNAMELEN];
 static int gHttpsProxyPort;
 static CFMutableDictionaryRef gSSLPropertiesDict = NULL;
-static struct ReadStreamRec gReadStreams[WEBDAV_REQUEST_THREADS + 1];	/* one for every request thread plus one for the pulse thread */
+static struct ReadStreamRec gReadStreams[WEBDAV_READ_STREAMS];
+static int gSegmentThreads = 0;	/* running segment threads (never more than WEBDAV_MAX_SEGMENT_THREADS) */
+static pthread_cond_t gReadStreams_cond = PTHREAD_COND_INITIALIZER;	/* signalled when a ReadStreamRec is released */
+static int gMaxConnections = WEBDAV_MAX_CONNECTIONS;	/* see WEBDAV_MAX_CONNECTIONS */
+static int gConnectionIdleTimeout = WEBDAV_CONNECTION_IDLE_TIMEOUT;	/* see WEBDAV_CONNECTION_IDLE_TIMEOUT */
+/* counters for network_log_stats */
+static struct
+{
+	int active;					/* ReadStreamRecs in use */
+	int peak_active;			/* high water mark of active */
+	u_int64_t waits;			/* times a request waited for a connection */
+	u_int64_t overcommits;		/* times a request went over gMaxConnections after waiting */
+	u_int64_t refused;			/* times a segment thread was refused a connection */
+	u_int64_t stale;			/* idle connections found closed by the server */
+	u_int64_t reaped;			/* idle connections closed for being idle too long */
+} gConnectionStats;
+static pthread_mutex_t gPipeline_lock = PTHREAD_MUTEX_INITIALIZER;	/* protects the pipeline (see pipeline_transaction) */
+static int gPipelineDepth = 0;	/* see WEBDAV_MAX_PIPELINE_DEPTH; 0 when pipelining is off */
+static const struct Transport *gTransport = NULL;	/* the mount's Transport (see struct Transport) */
+/* counters for network_log_stats. Protected by gPipeline_lock. */
+static struct
+{
+	u_int64_t sent;				/* requests written on the pipeline connection */
+	u_int64_t overlapped;		/* requests written while others were waiting for responses */
+	u_int64_t fallbacks;		/* requests that had to be sent one at a time */
+	u_int64_t connections;		/* pipeline connections opened */
+} gPipelineStats;
+
+/******************************************************************************/
+
+static pthread_mutex_t gBodyBuffers_lock = PTHREAD_MUTEX_INITIALIZER;
+/* these variables are protected by gBodyBuffers_lock */
+static UInt8 *gBodyBuffers[WEBDAV_BODY_BUFFER_POOL];	/* free BODY_BUFFER_SIZE buffers */
+static int gBodyBuffersFree = 0;	/* number of buffers in gBodyBuffers */
+/* counters for network_log_stats */
+static struct
+{
+	u_int64_t gets;			/* buffers requested */
+	u_int64_t reused;		/* requests satisfied from the pool (malloc avoided) */
+	u_int32_t in_use;		/* buffers handed out and not yet returned */
+	u_int32_t peak_in_use;	/* high water mark of in_use */
+} gBodyBufferStats;
+/* counters for network_log_stats: response bodies inflated by a ContentDecoder. Protected by gBodyBuffers_lock. */
+static struct
+{
+	u_int64_t bodies;			/* bodies inflated */
+	u_int64_t compressed;		/* bytes received */
+	u_int64_t uncompressed;		/* bytes after inflating */
+} gContentDecodeStats;
+static int gAcceptEncoding = TRUE;	/* if TRUE, PROPFIND requests ask for a compressed response */
 
 /******************************************************************************/
 
@@ -111,1662 +200,3733 @@ static int network_dir_is_empty(
 	uid_t uid,					/* -> uid of the user making the request */
 	CFURLRef urlRef);			/* -> url to check */
 
+static int ReadStreamRec_is_healthy(
+	struct ReadStreamRec *theReadStreamRec,	/* -> an open ReadStreamRec not in use */
+	time_t now);				/* -> the current time */
+
+static const struct Transport *transport_named( /* <- the Transport, or NULL if there isn't one by that name */
+	const char *name);			/* -> the Transport's name */
+
+static int network_propfind_directory(
+	uid_t uid,					/* -> uid of the user making the request */
+	int cache,					/* -> if TRUE, perform additional caching */
+	struct node_entry *node,	/* -> directory node to read */
+	int dirents_fd);			/* -> the file to write the dirents to, or -1 */
+
 static CFStringRef CFStringCreateRFC2616DateStringWithTimeT( /* <- CFString containing RFC 1123 date, NULL if error */
 	time_t clock);				/* -> time_t value */
 
 /*****************************************************************************/
 
-#define ISO8601_UTC "%04d-%02d-%02dT%02d:%02d:%02dZ"
-#define ISO8601_BEHIND_UTC "%04d-%02d-%02dT%02d:%02d:%02d-%02d:%02d"
-#define ISO8601_AHEAD_UTC "%04d-%02d-%02dT%02d:%02d:%02d+%02d:%02d"
-
 /*
- * ISO8601_To_Time parses an ISO8601 formatted date/time 'C' string
- * and returns time_t. If the parse fails, this function return (-1).
- *
- * Examples:
- *
- * 1994-11-05T08:15:30-05:00 corresponds to November 5, 1994, 8:15:30 am, US Eastern Standard Time.
- *
- * 1994-11-05T13:15:30Z corresponds to the same instant.
- *
+ * body_buffer_get returns a BODY_BUFFER_SIZE buffer for reading a response
+ * body, from the pool when one is free. The buffer must be given back with
+ * body_buffer_put, or with body_buffer_disown if it is realloc'd or handed
+ * to a caller that will free it. Returns NULL if malloc fails.
  */
-
-time_t ISO8601ToTime(			/* <- time_t value */
-		const UInt8 *bytes,			/* -> pointer to bytes to parse */
-		CFIndex length)				/* -> number of bytes to parse */
+static UInt8 *body_buffer_get(void)
 {
-	int num, tm_sec, tm_min, tm_hour, tm_year, tm_mon, tm_day;
-	int utc_offset, utc_offset_hour, utc_offset_min;
-	struct tm tm_temp;
-	time_t clock;
-	const UInt8 *ch;
-	boolean_t done, have_z;
-	
-	done = FALSE;
-	utc_offset = utc_offset_hour = utc_offset_min = 0;
-	clock = -1;
-	
-	if ( (bytes == NULL) || (length == 0))
-		return (clock);
-	
-	memset(&tm_temp, 0, sizeof(struct tm));
-	
-	// Try ISO8601_UTC "1994-11-05T13:15:30Z"
-	have_z = FALSE;
-	ch = bytes + length - 1;
-
-	while (ch > bytes) {
-		if (isspace(*ch)) {
-			ch--;
-			continue;
-		}
-		
-		if (*ch == 'Z')
-			have_z = TRUE;
-		break;
-	}
-	
-	if (ch <= bytes)
-		return (clock);	// not a valid date/time string, nothing but white space
-	
-	if (have_z == TRUE) {
-		num = sscanf((const char *)bytes, ISO8601_UTC, &tm_year, &tm_mon, &tm_day,
-					 &tm_hour, &tm_min, &tm_sec);
-		if (num == 6) {
-			done = TRUE;
-		}
-	}
+	UInt8 *buffer;
 	
-	if (done == FALSE) {
-		// Try ISO8601_BEHIND_UTC "1994-11-05T08:15:30-05:00"
-		num = sscanf((const char *)bytes, ISO8601_BEHIND_UTC, &tm_year, &tm_mon, &tm_day,
-					 &tm_hour, &tm_min, &tm_sec,
-					 &utc_offset_hour, &utc_offset_min);
-		if (num == 8) {
-			// Need to add offset later to get UTC
-			utc_offset = (utc_offset_hour * 3600) + (utc_offset_min * 60);
-			done = TRUE;
-		}
+	buffer = NULL;
+	pthread_mutex_lock(&gBodyBuffers_lock);
+	++gBodyBufferStats.gets;
+	if ( gBodyBuffersFree != 0 )
+	{
+		buffer = gBodyBuffers[--gBodyBuffersFree];
+		++gBodyBufferStats.reused;
 	}
+	pthread_mutex_unlock(&gBodyBuffers_lock);
 	
-	if (done == FALSE) {
-		// Try ISO8601_AHEAD_UTC "1994-11-05T08:15:30+05:00"
-		num = sscanf((const char *)bytes, ISO8601_AHEAD_UTC, &tm_year, &tm_mon, &tm_day,
-					 &tm_hour, &tm_min, &tm_sec,
-					 &utc_offset_hour, &utc_offset_min);
-		if (num == 8) {
-			// Need to subtract offset later to get UTC
-			utc_offset = - (utc_offset_hour * 3600) - (utc_offset_min * 60);
-			done = TRUE;
-		}
+	if ( buffer == NULL )
+	{
+		buffer = malloc(BODY_BUFFER_SIZE);
+		require(buffer != NULL, malloc_buffer);
 	}
 	
-	if (done == TRUE) {
-		// fill in tm_temp and adjust before converting to time_t
-		tm_temp.tm_sec = tm_sec;
-		tm_temp.tm_min = tm_min;
-		tm_temp.tm_hour = tm_hour;
-		tm_temp.tm_mday = tm_day;
-		tm_temp.tm_mon = tm_mon - 1;
-		tm_temp.tm_year = tm_year - 1900;
-		tm_temp.tm_isdst = -1;
-	
-		// Convert to time_t
-		clock = timegm(&tm_temp);
-	
-		// apply offset so we end up with UTC
-		clock += utc_offset;
+	pthread_mutex_lock(&gBodyBuffers_lock);
+	if ( ++gBodyBufferStats.in_use > gBodyBufferStats.peak_in_use )
+	{
+		gBodyBufferStats.peak_in_use = gBodyBufferStats.in_use;
 	}
+	pthread_mutex_unlock(&gBodyBuffers_lock);
+
+malloc_buffer:
 	
-	return (clock);
+	return ( buffer );
 }
 
 /*****************************************************************************/
 
 /*
- * CFStringCreateRFC2616DateStringWithTimeT creates a RFC 1123 date CFString from
- * a time_t time.
+ * body_buffer_put gives back a buffer from body_buffer_get. Buffers that are
+ * still BODY_BUFFER_SIZE go back into the pool if there's room; anything
+ * else is freed.
  */
-static CFStringRef CFStringCreateRFC2616DateStringWithTimeT( /* <- CFString containing RFC 1123 date, NULL if error */
-	time_t clock)				/* -> time_t value */
+static void body_buffer_put(UInt8 *buffer, CFIndex bufferSize)
 {
-	struct tm *tm_temp;
-	CFGregorianDate gdate;
-	CFStringRef result;
-	
-	require_action_quiet(clock != -1, InvalidClock, result = NULL);
+	pthread_mutex_lock(&gBodyBuffers_lock);
+	--gBodyBufferStats.in_use;
+	if ( (bufferSize == BODY_BUFFER_SIZE) && (gBodyBuffersFree < WEBDAV_BODY_BUFFER_POOL) )
+	{
+		gBodyBuffers[gBodyBuffersFree++] = buffer;
+		buffer = NULL;
+	}
+	pthread_mutex_unlock(&gBodyBuffers_lock);
 	
-	/* get struct tm (in GMT) from time_t */
-	tm_temp = gmtime(&clock);
+	if ( buffer != NULL )
+	{
+		free(buffer);
+	}
+}
 
-	/* copy the struct tm into CFGregorianDate */
-	gdate.second = tm_temp->tm_sec;
-	gdate.minute = tm_temp->tm_min;
-	gdate.hour = tm_temp->tm_hour;
-	gdate.day = tm_temp->tm_mday;
-	gdate.month = tm_temp->tm_mon + 1;
-	gdate.year = tm_temp->tm_year + 1900;
-	
-	/* get a CFStringRef with the RFC 1123 date string */
-	result = _CFStringCreateRFC2616DateStringWithGregorianDate(kCFAllocatorDefault, &gdate, NULL);
+/*****************************************************************************/
 
-InvalidClock:
-	
-	return ( result );
+/*
+ * body_buffer_disown is called when a buffer from body_buffer_get leaves the
+ * pool's control (it was handed to a caller that will free it).
+ */
+static void body_buffer_disown(void)
+{
+	pthread_mutex_lock(&gBodyBuffers_lock);
+	--gBodyBufferStats.in_use;
+	pthread_mutex_unlock(&gBodyBuffers_lock);
 }
 
 /*****************************************************************************/
 
 /*
- * SkipCodedURL finds the end of a Coded-URL using the rules
- * (rfc 2518, section 9.4 and rfc 2396):
- *	
- *	Coded-URL		= "<" absoluteURI ">"
- *	
- * On input, the bytes parameter points to the character AFTER the initial
- * '<' character. The function result is a pointer to the '>' character that
- * terminates the Coded-URL or the end of the C string.
+ * A ContentDecoder inflates a response body sent with Content-Encoding gzip
+ * or deflate and passes the result on to a BodyConsumer as it's decoded. It's
+ * only used for requests send_transaction_to_consumer asked to be compressed
+ * (PROPFIND). The first two bytes of the body decide how it's decoded: with
+ * gzip, a body without the gzip magic number was already decoded (by
+ * CFNetwork) and is passed on as is; with deflate, a body that starts with a
+ * valid zlib header is inflated as zlib, a body that starts like XML ('<',
+ * white space or a UTF-8 byte order mark) was already decoded, and anything
+ * else is inflated as raw deflate (some servers leave off the zlib wrapper).
  */
-static const char * SkipCodedURL(const char *bytes)
+struct ContentDecoder
 {
-	/* the end of the string or Coded-URL? */
-	while ( (*bytes != '\0') && (*bytes != '>') )
-	{
-		/* skip character */
-		++bytes;
-	}
-	
-	return ( bytes );
-}
+	int state;					/* CONTENT_DECODER_xxx */
+	int deflate;				/* TRUE if the Content-Encoding was deflate */
+	UInt8 magic[2];				/* the first bytes of the body, until there are enough to decide */
+	CFIndex magic_length;		/* number of bytes in magic */
+	z_stream zstream;
+	UInt8 *out;					/* the inflated data (a body buffer) */
+	u_int64_t compressed;		/* bytes given to the decoder */
+	u_int64_t uncompressed;		/* bytes passed on to the consumer */
+};
+
+#define CONTENT_DECODER_START		0	/* no data yet */
+#define CONTENT_DECODER_IDENTITY	1	/* the body isn't compressed */
+#define CONTENT_DECODER_INFLATE		2	/* inflating */
+#define CONTENT_DECODER_END			3	/* the compressed data ended */
 
 /*****************************************************************************/
 
 /*
- * SkipToken finds the end of a token using the rules (rfc 2616, section 2.2):
- *	
- *	token		= 1*<any CHAR except CTLs or separators>
- *	CTL			= <any US-ASCII control character (octets 0 - 31) and
- *				  DEL (127)>
- *	separators	= "(" | ")" | "<" | ">" | "@"
- *				  | "," | ";" | ":" | "\" | <">
- *				  | "/" | "[" | "]" | "?" | "="
- *				  | "{" | "}" | SP | HT
- *	
- * The function result is a pointer to the first non token character or the
- * end of the C string.
+ * content_decoder_init returns TRUE (and sets up decoder) if the response
+ * body has a Content-Encoding content_decoder_consume can decode.
  */
-static const char * SkipToken(const char *bytes)
+static int content_decoder_init(struct ContentDecoder *decoder, CFHTTPMessageRef response)
 {
-	while ( *bytes != '\0' )
+	CFStringRef headerRef;
+	int result;
+	
+	result = FALSE;
+	headerRef = CFHTTPMessageCopyHeaderFieldValue(response, CFSTR("Content-Encoding"));
+	if ( headerRef != NULL )
 	{
-		/* CTL - US-ASCII control character (octets 0 - 31) */
-		if ( (unsigned char)*bytes <= 31 )
+		bzero(decoder, sizeof(*decoder));
+		if ( (CFStringCompare(headerRef, CFSTR("gzip"), kCFCompareCaseInsensitive) == kCFCompareEqualTo) ||
+			 (CFStringCompare(headerRef, CFSTR("x-gzip"), kCFCompareCaseInsensitive) == kCFCompareEqualTo) )
 		{
-			/* not a token character - done */
-			goto Done;
+			result = TRUE;
 		}
-		else
+		else if ( CFStringCompare(headerRef, CFSTR("deflate"), kCFCompareCaseInsensitive) == kCFCompareEqualTo )
 		{
-			switch ( *bytes )
-			{
-			/* CTL - DEL (127) */
-			case '\x7f':
-			/* separators */
-			case '(':
-			case ')':
-			case '<':
-			case '>':
-			case '@':
-			case ',':
-			case ';':
-			case ':':
-			case '\\':
-			case '\"':
-			case '/':
-			case '[':
-			case ']':
-			case '\?':
-			case '=':
-			case '{':
-			case '}':
-			case ' ':
-			case '\t':
-				/* not a token character - done */
-				goto Done;
-				break;
-			
-			default:
-				/* skip token characters */
-				++bytes;
-				break;
-			}
+			decoder->deflate = TRUE;
+			result = TRUE;
 		}
+		CFRelease(headerRef);
 	}
-
-Done:	
-	return (bytes);
+	
+	return ( result );
 }
 
 /*****************************************************************************/
 
 /*
- * SkipLWS finds the end of a run of LWS using the rule
- * (rfc 2616, section 2.2):
- *	
- *	LWS = [CRLF] 1*( SP | HT )
- *	
- * The function result is a pointer to the first non LWS character or the end
- * of the C string.
+ * content_decoder_start decides from the Content-Encoding and the first two
+ * bytes of the body (in decoder->magic) whether and how to inflate it.
+ * Returns 0, or an errno.
  */
-static const char * SkipLWS(const char *bytes)
+static int content_decoder_start(struct ContentDecoder *decoder)
 {
-	while ( *bytes != '\0' )
+	int windowBits;
+	int zresult;
+	int error;
+	
+	error = 0;
+	if ( decoder->deflate )
 	{
-		if ( (*bytes == ' ') || (*bytes == '\t') )
+		/* a zlib header: compression method 8, and the header check bits make it a multiple of 31 */
+		if ( ((decoder->magic[0] & 0x0f) == 8) && ((((decoder->magic[0] << 8) | decoder->magic[1]) % 31) == 0) )
 		{
-			/* skip SP and HT characters */
-			++bytes;
-			continue;
+			windowBits = MAX_WBITS;
 		}
-		/*
-		 * skip CRLF only if followed by SP or HT (in which case the SP 
-		 * or HT can be skipped, too)
-		 */
-		else if ( *bytes == '\x0d' ) /* CR? */
+		else if ( (decoder->magic[0] == '<') || isspace(decoder->magic[0]) || (decoder->magic[0] == 0xef) )
 		{
-			/* LF? */
-			if ( bytes[1] == '\x0a' )
-			{
-				/* SP or HT? */
-				if ( (bytes[2] == ' ') || (bytes[2] == '\t') )
-				{	
-					/* skip CRLF followed by SP or HT */
-					bytes += 3;
-					continue;
-				}
-			}
+			/* it looks like XML, so it was already decoded */
+			decoder->state = CONTENT_DECODER_IDENTITY;
+			return ( 0 );
+		}
+		else
+		{
+			windowBits = -MAX_WBITS;
 		}
-		
-		/* found the end of the LWS run */
-		break;
+	}
+	else if ( (decoder->magic[0] == 0x1f) && (decoder->magic[1] == 0x8b) )
+	{
+		windowBits = MAX_WBITS + 16;
+	}
+	else
+	{
+		/* not gzip data, so it was already decoded */
+		decoder->state = CONTENT_DECODER_IDENTITY;
+		return ( 0 );
 	}
 	
-	return ( bytes );
+	decoder->out = body_buffer_get();
+	require_action(decoder->out != NULL, body_buffer_get, error = ENOMEM);
+	
+	zresult = inflateInit2(&decoder->zstream, windowBits);
+	if ( zresult != Z_OK )
+	{
+		body_buffer_put(decoder->out, BODY_BUFFER_SIZE);
+		decoder->out = NULL;
+	}
+	require_action(zresult == Z_OK, inflateInit2, error = ENOMEM);
+	decoder->state = CONTENT_DECODER_INFLATE;
+
+inflateInit2:
+body_buffer_get:
+
+	return ( error );
 }
 
 /*****************************************************************************/
 
-static int set_global_stream_properties(CFReadStreamRef readStreamRef)
+/*
+ * content_decoder_process passes length bytes of the body through the
+ * decoder once it has started. Returns 0, or an errno.
+ */
+static int content_decoder_process(
+	struct ContentDecoder *decoder,
+	struct BodyConsumer *consumer,
+	const UInt8 *data,
+	CFIndex length)
 {
-	int error, mutexerror;
-		
-	mutexerror = pthread_mutex_lock(&gNetworkGlobals_lock);
-	require_noerr_action(mutexerror, pthread_mutex_lock, error = mutexerror; webdav_kill(-1));
-	
-	error = (CFReadStreamSetProperty(readStreamRef, kCFStreamPropertyHTTPProxy, gProxyDict) == TRUE) ? 0 : 1;
-	
-	mutexerror = pthread_mutex_unlock(&gNetworkGlobals_lock);
-	require_noerr_action(mutexerror, pthread_mutex_unlock, error = mutexerror; webdav_kill(-1));
-	
-pthread_mutex_unlock:
-pthread_mutex_lock:
+	int zresult;
+	CFIndex produced;
+	int error;
 	
+	error = 0;
+	switch ( decoder->state )
+	{
+		case CONTENT_DECODER_IDENTITY:
+			decoder->uncompressed += length;
+			error = consumer->consume(consumer->context, data, length);
+			break;
+			
+		case CONTENT_DECODER_INFLATE:
+			decoder->zstream.next_in = (Bytef *)data;
+			decoder->zstream.avail_in = (uInt)length;
+			do
+			{
+				decoder->zstream.next_out = decoder->out;
+				decoder->zstream.avail_out = BODY_BUFFER_SIZE;
+				zresult = inflate(&decoder->zstream, Z_NO_FLUSH);
+				require_action((zresult == Z_OK) || (zresult == Z_STREAM_END) || (zresult == Z_BUF_ERROR), inflate, error = EIO);
+				
+				produced = BODY_BUFFER_SIZE - decoder->zstream.avail_out;
+				if ( produced != 0 )
+				{
+					decoder->uncompressed += produced;
+					error = consumer->consume(consumer->context, decoder->out, produced);
+					require_noerr_quiet(error, consume);
+				}
+				if ( zresult == Z_STREAM_END )
+				{
+					/* anything after the end of the compressed data is ignored */
+					decoder->state = CONTENT_DECODER_END;
+					break;
+				}
+			} while ( (decoder->zstream.avail_in != 0) || (decoder->zstream.avail_out == 0) );
+			break;
+			
+		default:
+			break;
+	}
+
+consume:
+inflate:
+
 	return ( error );
 }
 
-/******************************************************************************/
+/*****************************************************************************/
 
-int network_get_proxy_settings(
-	int *httpProxyEnabled,		/* <- true if HTTP proxy is enabled */
-	char **httpProxyServer,		/* <- HTTP proxy server name */
-	int *httpProxyPort,			/* <- HTTP proxy port number */
-	int *httpsProxyEnabled,		/* <- true if HTTPS proxy is enabled */
-	char **httpsProxyServer,	/* <- HTTPS proxy server name */
-	int* httpsProxyPort)		/* <- HTTPS proxy port number */
+/*
+ * content_decoder_consume decodes length bytes of the body and passes what
+ * comes out to consumer. Returns 0, or an errno.
+ */
+static int content_decoder_consume(
+	struct ContentDecoder *decoder,
+	struct BodyConsumer *consumer,
+	const UInt8 *data,
+	CFIndex length)
 {
-	int error, mutexerror;
+	int error;
 	
 	error = 0;
+	decoder->compressed += length;
 	
-	mutexerror = pthread_mutex_lock(&gNetworkGlobals_lock);
-	require_noerr_action(mutexerror, pthread_mutex_lock, error = mutexerror; webdav_kill(-1));
-	
-	*httpProxyServer = malloc(MAXHOSTNAMELEN);
-	require_action(*httpProxyServer != NULL, malloc_httpProxyServer, error = ENOMEM);
-	
-	*httpsProxyServer = malloc(MAXHOSTNAMELEN);
-	require_action(*httpsProxyServer != NULL, malloc_httpsProxyServer, free(*httpProxyServer); error = ENOMEM);
-	
-	*httpProxyEnabled = gHttpProxyEnabled;
-	memcpy(*httpProxyServer, gHttpProxyServer, MAXHOSTNAMELEN);
-	*httpProxyPort = gHttpProxyPort;
+	if ( decoder->state == CONTENT_DECODER_START )
+	{
+		/* hold on to the first bytes until there are enough to tell what they are */
+		while ( (decoder->magic_length < (CFIndex)sizeof(decoder->magic)) && (length != 0) )
+		{
+			decoder->magic[decoder->magic_length++] = *data++;
+			--length;
+		}
+		if ( decoder->magic_length < (CFIndex)sizeof(decoder->magic) )
+		{
+			return ( 0 );
+		}
+		
+		error = content_decoder_start(decoder);
+		require_noerr_quiet(error, content_decoder_start);
+		
+		error = content_decoder_process(decoder, consumer, decoder->magic, decoder->magic_length);
+		require_noerr_quiet(error, content_decoder_process);
+	}
 	
-	*httpsProxyEnabled = gHttpsProxyEnabled;
-	memcpy(*httpsProxyServer, gHttpsProxyServer, MAXHOSTNAMELEN);
-	*httpsProxyPort = gHttpsProxyPort;
+	if ( length != 0 )
+	{
+		error = content_decoder_process(decoder, consumer, data, length);
+	}
+
+content_decoder_process:
+content_decoder_start:
 
-malloc_httpsProxyServer:
-malloc_httpProxyServer:
-	
-	mutexerror = pthread_mutex_unlock(&gNetworkGlobals_lock);
-	require_noerr_action(mutexerror, pthread_mutex_unlock, error = mutexerror; webdav_kill(-1));
-	
-pthread_mutex_unlock:
-pthread_mutex_lock:
-	
 	return ( error );
 }
 
-/******************************************************************************/
+/*****************************************************************************/
 
-int network_update_proxy(void *arg)
+/*
+ * content_decoder_finish releases the decoder's resources and counts what it
+ * decoded. Returns EIO if the compressed data was cut short (or the body was
+ * too short to tell what it was).
+ */
+static int content_decoder_finish(struct ContentDecoder *decoder)
 {
-#pragma unused(arg)
-	int error, mutexerror;
-	
-	error = 0;
+	int error;
 	
-	mutexerror = pthread_mutex_lock(&gNetworkGlobals_lock);
-	require_noerr_action(mutexerror, pthread_mutex_lock, error = mutexerror; webdav_kill(-1));
-
-	/* release the old proxies dictionary */
-	if ( gProxyDict )
+	error = ((decoder->state == CONTENT_DECODER_INFLATE) ||
+		((decoder->state == CONTENT_DECODER_START) && (decoder->magic_length != 0))) ? EIO : 0;
+	if ( decoder->out != NULL )
 	{
-		CFRelease(gProxyDict);
+		inflateEnd(&decoder->zstream);
+		body_buffer_put(decoder->out, BODY_BUFFER_SIZE);
+		decoder->out = NULL;
 	}
 	
-	/* slam everything to default disabled state in case something fails */
-	gHttpProxyEnabled = 0;
-	gHttpProxyServer[0] = '\0';
-	gHttpProxyPort = 0;
+	if ( decoder->state >= CONTENT_DECODER_INFLATE )
+	{
+		pthread_mutex_lock(&gBodyBuffers_lock);
+		++gContentDecodeStats.bodies;
+		gContentDecodeStats.compressed += decoder->compressed;
+		gContentDecodeStats.uncompressed += decoder->uncompressed;
+		pthread_mutex_unlock(&gBodyBuffers_lock);
+	}
 	
-	gHttpsProxyEnabled = 0;
-	gHttpsProxyServer[0] = '\0';
-	gHttpsProxyPort = 0;
+	return ( error );
+}
+
+/*****************************************************************************/
+
+/* the BodyConsumer used by content_decode_buffer to collect the decoded body */
+struct DecodedBody
+{
+	UInt8 *buffer;
+	CFIndex length;
+	CFIndex size;
+};
+
+static int decoded_body_consume(void *context, const UInt8 *data, CFIndex length)
+{
+	struct DecodedBody *body = (struct DecodedBody *)context;
+	UInt8 *newBuffer;
 	
-	/* get the current internet proxy dictionary */
-	gProxyDict = SCDynamicStoreCopyProxies(gProxyStore);
-	if ( gProxyDict != NULL )
+	if ( body->length + length > body->size )
 	{
-		CFNumberRef cf_enabled;
-		int enabled;
-		CFStringRef cf_host;
-		CFNumberRef cf_port;
-		
-		/*
-		 * take care of HTTP proxies
-		 */
-		/* are HTTP proxies enabled? */ 
-		cf_enabled = CFDictionaryGetValue(gProxyDict, kSCPropNetProxiesHTTPEnable);
-		if ( (cf_enabled != NULL) && CFNumberGetValue(cf_enabled, kCFNumberIntType, &enabled) && enabled )
-		{
-			/* get the HTTP proxy */
-			cf_host = CFDictionaryGetValue(gProxyDict, kSCPropNetProxiesHTTPProxy);
-			if ( (cf_host != NULL) && CFStringGetCString(cf_host, gHttpProxyServer, sizeof(gHttpProxyServer), kCFStringEncodingUTF8) )
-			{
-				/* get the HTTP proxy port */
-				cf_port = CFDictionaryGetValue(gProxyDict, kSCPropNetProxiesHTTPPort);
-				if ( (cf_port != NULL) && CFNumberGetValue(cf_port, kCFNumberIntType, &gHttpProxyPort) ) 
-				{
-					if ( gHttpProxyPort == 0 )
-					{
-						/* no port specified so use the default HTTP port */
-						gHttpProxyPort = kHttpDefaultPort;
-					}
-					gHttpProxyEnabled = 1;
-				}
-			}
-		}
-		
-		/*
-		 * take care of HTTPS proxies
-		 */
-		/* are HTTP proxies enabled? */ 
-		cf_enabled = CFDictionaryGetValue(gProxyDict, kSCPropNetProxiesHTTPSEnable);
-		if ( (cf_enabled != NULL) && CFNumberGetValue(cf_enabled, kCFNumberIntType, &enabled) && enabled )
+		/* double the buffer so the copying stays linear in the body size */
+		while ( body->length + length > body->size )
 		{
-			/* get the HTTP proxy */
-			cf_host = CFDictionaryGetValue(gProxyDict, kSCPropNetProxiesHTTPSProxy);
-			if ( (cf_host != NULL) && CFStringGetCString(cf_host, gHttpsProxyServer, sizeof(gHttpsProxyServer), kCFStringEncodingUTF8) )
-			{
-				/* get the HTTP proxy port */
-				cf_port = CFDictionaryGetValue(gProxyDict, kSCPropNetProxiesHTTPSPort);
-				if ( (cf_port != NULL) && CFNumberGetValue(cf_port, kCFNumberIntType, &gHttpsProxyPort) ) 
-				{
-					if ( gHttpsProxyPort == 0 )
-					{
-						/* no port specified so use the default HTTPS port */
-						gHttpsProxyPort = kHttpsDefaultPort;
-					}
-					gHttpsProxyEnabled = 1;
-				}
-			}
+			body->size *= 2;
 		}
+		newBuffer = realloc(body->buffer, body->size);
+		require(newBuffer != NULL, realloc);
+		body->buffer = newBuffer;
 	}
+	memcpy(body->buffer + body->length, data, length);
+	body->length += length;
 	
-	mutexerror = pthread_mutex_unlock(&gNetworkGlobals_lock);
-	require_noerr_action(mutexerror, pthread_mutex_unlock, error = mutexerror; webdav_kill(-1));
-	
-	/* remove proxy authentications */
-	error = authcache_proxy_invalidate();
+	return ( 0 );
 
-pthread_mutex_unlock:
-pthread_mutex_lock:
+realloc:
 
-	return ( error );
+	return ( ENOMEM );
 }
 
 /*****************************************************************************/
 
 /*
-	The InitUserAgentHeaderValue initializes the string userAgentHeaderValue which
-	is sent with every request to the server. The User-Agent request-header field
-	is defined in RFC 2616, section 14.43 as:
-		User-Agent		= "User-Agent" ":" 1*( product | comment )
-	section 3.8 defines product as:
-		product			= token ["/" product-version]
-		product-version	= token
-	section 2.2 defines comment as:
-		comment			= "(" *( ctext | quoted-pair | comment ) ")"
-		ctext			= <any TEXT excluding "(" and ")">
-		quoted-pair		= "\" CHAR
-
-	We want our User-Agent request-header field to look something like:
-		"User-Agent: WebDAVFS/1.1 (0110800000) Darwin/5.3 (Power Macintosh)"
-	where:
-		1.1	= the CFBundleShortVersionString from webdav.fs bundle
-		0110800000 = webdav.fs bundle's numeric version
-		Darwin = CTL_KERN/KERN_OSTYPE
-		5.3 = CTL_KERN/KERN_OSRELEASE
-		Power Macintosh = CTL_HW/HW_MACHINE
+ * content_decode_buffer replaces the body of a successful response that was
+ * returned in a buffer with the decoded body, if the response has a
+ * Content-Encoding content_decoder_consume can decode. It's only called for
+ * requests that asked for a compressed body. Error bodies are left alone.
+ */
+static int content_decode_buffer(
+	CFHTTPMessageRef response,	/* -> the response message */
+	UInt8 **buffer,				/* <-> the response data buffer (malloc'd) */
+	CFIndex *count)				/* <-> the response data buffer length */
+{
+	struct ContentDecoder decoder;
+	struct DecodedBody body;
+	struct BodyConsumer consumer;
+	int error;
 	
-	webdav.fs bundle is located at:
-		/System/Library/Filesystems/webdav.fs
+	if ( (*buffer == NULL) || (*count == 0) || ((CFHTTPMessageGetResponseStatusCode(response) / 100) != 2) ||
+		 !content_decoder_init(&decoder, response) )
+	{
+		return ( 0 );
+	}
 	
-	If the data from webdav.fs bundle could not be obtained, then we'll
-	fall back to the generic User-Agent request-header string WebDAV FS
-	used to use.
+	body.length = 0;
+	body.size = MAX(*count * 8, BODY_BUFFER_SIZE);
+	body.buffer = malloc(body.size);
+	require_action(body.buffer != NULL, malloc_buffer, error = ENOMEM);
+	consumer.consume = decoded_body_consume;
+	consumer.context = &body;
 	
-	IMPORTANT: The user-agent header MUST start with the
-	product token "WebDAVFS" because there are WebDAV servers
-	that special case this client.
- */
-
-static int InitUserAgentHeaderValue(int add_mirror_comment)
-{
-	char				buf[128];
-	int					mib[2];
-	char				ostype[128];
-	char				osrelease[128];
-	char				machine[128];
-	size_t				len;
-	CFURLRef			url;
-	CFBundleRef			bundle;
-	CFDictionaryRef		dict;
-	CFStringRef			shortVersion;
-	CFIndex				shortVersionLen;
-	char				*webdavfsVersionStr;
-	UInt32				webdavfsVersion;
-	int					result;
-	
-	/* Get the ostype, osrelease, and machine strings using sysctl*/
-	mib[0] = CTL_KERN;
-	mib[1] = KERN_OSTYPE;
-	len = sizeof ostype;
-	if (sysctl(mib, 2, ostype, &len, 0, 0) < 0)
-	{
-		ostype[0] = '\0';
-	}
-	mib[1] = KERN_OSRELEASE;
-	len = sizeof osrelease;
-	if (sysctl(mib, 2, osrelease, &len, 0, 0) < 0)
-	{
-		osrelease[0] = '\0';
-	}
-	mib[0] = CTL_HW;
-	mib[1] = HW_MACHINE;
-	len = sizeof machine;
-	if (sysctl(mib, 2, machine, &len, 0, 0) < 0)
+	error = content_decoder_consume(&decoder, &consumer, *buffer, *count);
+	if ( content_decoder_finish(&decoder) != 0 )
 	{
-		machine[0] = '\0';
+		error = EIO;
 	}
+	require_noerr_action_quiet(error, content_decoder_consume, free(body.buffer));
 	
-	/* We don't have it yet */
-	webdavfsVersionStr = NULL;
-	webdavfsVersion = 0x010080000; /* 1.0 final */
+	free(*buffer);
+	*buffer = body.buffer;
+	*count = body.length;
+
+content_decoder_consume:
+malloc_buffer:
+
+	return ( error );
+}
+
+/*****************************************************************************/
+
+void network_log_stats(void)
+{
+	int index;
 	
-	/* Create the CFURLRef to the webdav.fs bundle's version.plist */
-	url = CFURLCreateWithFileSystemPath(kCFAllocatorDefault,
-		CFSTR("/System/Library/Filesystems/webdav.fs"),
-		kCFURLPOSIXPathStyle, true);
-	if ( url != NULL )
+	pthread_mutex_lock(&gBodyBuffers_lock);
+	LogMessage(kTrace, "network: body buffers %u in use (peak %u), %d pooled, %llu requested, %llu reused\n",
+		gBodyBufferStats.in_use, gBodyBufferStats.peak_in_use, gBodyBuffersFree,
+		gBodyBufferStats.gets, gBodyBufferStats.reused);
+	LogMessage(kTrace, "network: %llu compressed bodies, %llu bytes received, %llu bytes inflated\n",
+		gContentDecodeStats.bodies, gContentDecodeStats.compressed, gContentDecodeStats.uncompressed);
+	pthread_mutex_unlock(&gBodyBuffers_lock);
+	
+	pthread_mutex_lock(&gNetworkGlobals_lock);
+	LogMessage(kTrace, "network: connections %d in use (peak %d, max %d), %llu waits, %llu overcommits, %llu refused, %llu stale, %llu reaped\n",
+		gConnectionStats.active, gConnectionStats.peak_active, gMaxConnections, gConnectionStats.waits,
+		gConnectionStats.overcommits, gConnectionStats.refused, gConnectionStats.stale, gConnectionStats.reaped);
+	for ( index = 0; index < WEBDAV_READ_STREAMS; ++index )
 	{
-		/* Create the bundle */
-		bundle = CFBundleCreate(kCFAllocatorDefault, url);
-		if ( bundle != NULL )
+		if ( gReadStreams[index].uses != 0 )
 		{
-			/* Get the bundle's numeric version */
-			webdavfsVersion = CFBundleGetVersionNumber(bundle);
-			
-			/* Get the Info dictionary */ 
-			dict = CFBundleGetInfoDictionary(bundle);
-			if ( dict != NULL )
-			{
-				/* Get the CFBundleShortVersionString (display string) */
-				shortVersion = CFDictionaryGetValue(dict, CFSTR("CFBundleShortVersionString"));
-				if ( shortVersion != NULL )
-				{
-					/* Get the bundleVersionStr */
-					shortVersionLen = CFStringGetLength(shortVersion) + 1;
-					webdavfsVersionStr = malloc((size_t)shortVersionLen);
-					if ( webdavfsVersionStr != NULL )
-					{
-						/* Convert it to a C string */
-						if ( !CFStringGetCString(shortVersion, webdavfsVersionStr, shortVersionLen, kCFStringEncodingUTF8) )
-						{
-							/* If we can't get it, free the memory */
-							free(webdavfsVersionStr);
-							webdavfsVersionStr = NULL;
-						}
-					}
-				}
-			}
-			/* release created bundle */
-			CFRelease(bundle);
+			LogMessage(kTrace, "network: connection %d %s, %llu uses, %llu reuses, %llu usec average, %llu usec max\n",
+				index, gReadStreams[index].inUse ? "busy" : ((gReadStreams[index].readStreamRef != NULL) ? "idle" : "closed"),
+				gReadStreams[index].uses, gReadStreams[index].reuses,
+				gReadStreams[index].busyUsec / gReadStreams[index].uses, gReadStreams[index].maxBusyUsec);
 		}
-		/* release created url */
-		CFRelease(url);
-	}
-	
-	if ( webdavfsVersionStr != NULL )
-	{
-		/* if everything worked, use the new format User-Agent request-header string */
-		snprintf(buf, sizeof(buf), "WebDAVFS/%s (%.8lx) %s%s/%s (%s)",
-			webdavfsVersionStr, (unsigned long)webdavfsVersion, (add_mirror_comment ? "(mirrored) " : ""), ostype, osrelease, machine);
-		free(webdavfsVersionStr);
-	}
-	else
-	{
-		/* create the generic User-Agent request-header string WebDAV FS used to use */
-		snprintf(buf, sizeof(buf), "WebDAVFS/1.4 %s/%s (%s)",
-			ostype, osrelease, machine);
 	}
-			
-	userAgentHeaderValue = CFStringCreateWithCString(kCFAllocatorDefault, buf, kCFStringEncodingUTF8);
-	require_action(userAgentHeaderValue != NULL, CFStringCreateWithCString, result = ENOMEM);
-	
-	result = 0;
-
-CFStringCreateWithCString:
+	pthread_mutex_unlock(&gNetworkGlobals_lock);
 	
-	return ( result );
+	pthread_mutex_lock(&gPipeline_lock);
+	LogMessage(kTrace, "network: transport %s, pipeline depth %d, %llu sent, %llu overlapped, %llu sent one at a time, %llu connections\n",
+		gTransport->name, gPipelineDepth, gPipelineStats.sent, gPipelineStats.overlapped, gPipelineStats.fallbacks, gPipelineStats.connections);
+	pthread_mutex_unlock(&gPipeline_lock);
 }
 
 /*****************************************************************************/
 
-/*
- * The get_first_read_len function sets the global
- * first_read_len. It is set to the system's page size so that if the
- * first read after an open starts at offset 0, that page will already be
- * downloaded into the cache file.
- */
-static void get_first_read_len(void)
+void network_reap_connections(void)
 {
-	int		mib[2];
-	size_t	len;
-	int		result;
-	int		pagesize;
+	CFReadStreamRef staleStreams[WEBDAV_READ_STREAMS];
+	int staleCount;
+	time_t now;
+	int index;
 	
-	/* get the hardware page size */
-	mib[0] = CTL_HW;
-	mib[1] = HW_PAGESIZE;
-	len = sizeof(int);
-	result = sysctl(mib, 2, &pagesize, &len, 0, 0);
-	if ( result < 0 )
+	staleCount = 0;
+	now = time(NULL);
+	
+	pthread_mutex_lock(&gNetworkGlobals_lock);
+	for ( index = 0; index < WEBDAV_READ_STREAMS; ++index )
 	{
-		/* set first_read_len to PowerPC page size */
-		first_read_len = 4096;
+		if ( !gReadStreams[index].inUse && (gReadStreams[index].readStreamRef != NULL) &&
+			!ReadStreamRec_is_healthy(&gReadStreams[index], now) )
+		{
+			staleStreams[staleCount++] = gReadStreams[index].readStreamRef;
+			gReadStreams[index].readStreamRef = NULL;
+			gReadStreams[index].sock = -1;
+			++gConnectionStats.reaped;
+		}
 	}
-	else
+	pthread_mutex_unlock(&gNetworkGlobals_lock);
+	
+	/* close and release them after unlocking */
+	for ( index = 0; index < staleCount; ++index )
 	{
-		first_read_len = pagesize;
+		CFReadStreamClose(staleStreams[index]);
+		CFRelease(staleStreams[index]);
 	}
 }
 
-/******************************************************************************/
-
-static void InitXSourceIdHeaderValue(void)
-{
-	CFStringRef hostName;
-	char encodedIdBuffer[32];
-	CFURLRef baseURL;
-	
-	X_Source_Id_HeaderValue = NULL;
-	X_Apple_Realm_Support_HeaderValue = NULL;
-	
-	/* get the host name */
-	baseURL = nodecache_get_baseURL();
-	hostName = CFURLCopyHostName(baseURL);
-	CFRelease(baseURL);
-	require_quiet(hostName != NULL, CFURLCopyHostName);
-	
-	/* is it one of "idisk.mac.com" or "idisk.me.com" - if not, we don't want it */
-	if ( (CFStringCompare(hostName, CFSTR("idisk.mac.com"), kCFCompareCaseInsensitive) != kCFCompareEqualTo) &&
-		 (CFStringCompare(hostName, CFSTR("idisk.me.com"), kCFCompareCaseInsensitive) != kCFCompareEqualTo) )
-		goto NotIdisk;
-	
-	/* create the X-Apple-Realm-Support string */
-	X_Apple_Realm_Support_HeaderValue = CFStringCreateWithCString(kCFAllocatorDefault, X_APPLE_REALM_SUPPORT_VALUE, kCFStringEncodingUTF8);
-	
-	/* created the X-Source-Id string */
-	require_quiet(GetEncodedSourceID(encodedIdBuffer), GetEncodedSourceID);
-	
-	/* and make it a CFString */
-	X_Source_Id_HeaderValue = CFStringCreateWithCString(kCFAllocatorDefault, encodedIdBuffer, kCFStringEncodingUTF8);
-
-GetEncodedSourceID:
-NotIdisk:
-	CFRelease(hostName);
-CFURLCopyHostName:
+/*****************************************************************************/
 
-	return;
-}
+#define ISO8601_UTC "%04d-%02d-%02dT%02d:%02d:%02dZ"
+#define ISO8601_BEHIND_UTC "%04d-%02d-%02dT%02d:%02d:%02d-%02d:%02d"
+#define ISO8601_AHEAD_UTC "%04d-%02d-%02dT%02d:%02d:%02d+%02d:%02d"
 
-/******************************************************************************/
+/*
+ * ISO8601_To_Time parses an ISO8601 formatted date/time 'C' string
+ * and returns time_t. If the parse fails, this function return (-1).
+ *
+ * Examples:
+ *
+ * 1994-11-05T08:15:30-05:00 corresponds to November 5, 1994, 8:15:30 am, US Eastern Standard Time.
+ *
+ * 1994-11-05T13:15:30Z corresponds to the same instant.
+ *
+ */
 
-int network_init(const UInt8 *uri, CFIndex uriLength, int *store_notify_fd, int add_mirror_comment)
+time_t ISO8601ToTime(			/* <- time_t value */
+		const UInt8 *bytes,			/* -> pointer to bytes to parse */
+		CFIndex length)				/* -> number of bytes to parse */
 {
-	int error;
-	pthread_mutexattr_t mutexattr;
-	CFStringRef notification_string;
-	CFArrayRef keys;
-	int index;
-	
-	gProxyDict = NULL;
-	error = 0;
-	gBasePathStr[0] = 0;
+	int num, tm_sec, tm_min, tm_hour, tm_year, tm_mon, tm_day;
+	int utc_offset, utc_offset_hour, utc_offset_min;
+	struct tm tm_temp;
+	time_t clock;
+	const UInt8 *ch;
+	boolean_t done, have_z;
 	
-	/* set up the lock on the queues */
-	error = pthread_mutexattr_init(&mutexattr);
-	require_noerr(error, pthread_mutexattr_init);
+	done = FALSE;
+	utc_offset = utc_offset_hour = utc_offset_min = 0;
+	clock = -1;
 	
-	error = pthread_mutex_init(&gNetworkGlobals_lock, &mutexattr);
-	require_noerr(error, pthread_mutex_init);
+	if ( (bytes == NULL) || (length == 0))
+		return (clock);
 	
-	/* create a dynnamic store */
-	gProxyStore = SCDynamicStoreCreate(kCFAllocatorDefault, CFSTR("WebDAVFS"), NULL, NULL);
-	require_action(gProxyStore != NULL, SCDynamicStoreCreate, error = ENOMEM);
+	memset(&tm_temp, 0, sizeof(struct tm));
 	
-	/* open a file descriptor to be notified on */
-	require_action(SCDynamicStoreNotifyFileDescriptor(gProxyStore, 0, store_notify_fd),
-		SCDynamicStoreNotifyFileDescriptor, error = ENOMEM);
+	// Try ISO8601_UTC "1994-11-05T13:15:30Z"
+	have_z = FALSE;
+	ch = bytes + length - 1;
 
-	/* create a keys for network proxy changes */
-	notification_string = SCDynamicStoreKeyCreateProxies(kCFAllocatorDefault);
-	require_action(notification_string != NULL, SCDynamicStoreKeyCreateProxies, error = ENOMEM);
+	while (ch > bytes) {
+		if (isspace(*ch)) {
+			ch--;
+			continue;
+		}
+		
+		if (*ch == 'Z')
+			have_z = TRUE;
+		break;
+	}
 	
-	keys = CFArrayCreate(kCFAllocatorDefault, (const void **)&notification_string, 1, &kCFTypeArrayCallBacks);
-	require_action(keys != NULL, CFArrayCreate, error = ENOMEM);
-	CFRelease(notification_string);
+	if (ch <= bytes)
+		return (clock);	// not a valid date/time string, nothing but white space
+	
+	if (have_z == TRUE) {
+		num = sscanf((const char *)bytes, ISO8601_UTC, &tm_year, &tm_mon, &tm_day,
+					 &tm_hour, &tm_min, &tm_sec);
+		if (num == 6) {
+			done = TRUE;
+		}
+	}
+	
+	if (done == FALSE) {
+		// Try ISO8601_BEHIND_UTC "1994-11-05T08:15:30-05:00"
+		num = sscanf((const char *)bytes, ISO8601_BEHIND_UTC, &tm_year, &tm_mon, &tm_day,
+					 &tm_hour, &tm_min, &tm_sec,
+					 &utc_offset_hour, &utc_offset_min);
+		if (num == 8) {
+			// Need to add offset later to get UTC
+			utc_offset = (utc_offset_hour * 3600) + (utc_offset_min * 60);
+			done = TRUE;
+		}
+	}
+	
+	if (done == FALSE) {
+		// Try ISO8601_AHEAD_UTC "1994-11-05T08:15:30+05:00"
+		num = sscanf((const char *)bytes, ISO8601_AHEAD_UTC, &tm_year, &tm_mon, &tm_day,
+					 &tm_hour, &tm_min, &tm_sec,
+					 &utc_offset_hour, &utc_offset_min);
+		if (num == 8) {
+			// Need to subtract offset later to get UTC
+			utc_offset = - (utc_offset_hour * 3600) - (utc_offset_min * 60);
+			done = TRUE;
+		}
+	}
+	
+	if (done == TRUE) {
+		// fill in tm_temp and adjust before converting to time_t
+		tm_temp.tm_sec = tm_sec;
+		tm_temp.tm_min = tm_min;
+		tm_temp.tm_hour = tm_hour;
+		tm_temp.tm_mday = tm_day;
+		tm_temp.tm_mon = tm_mon - 1;
+		tm_temp.tm_year = tm_year - 1900;
+		tm_temp.tm_isdst = -1;
+	
+		// Convert to time_t
+		clock = timegm(&tm_temp);
+	
+		// apply offset so we end up with UTC
+		clock += utc_offset;
+	}
+	
+	return (clock);
+}
+
+/*****************************************************************************/
+
+/*
+ * CFStringCreateRFC2616DateStringWithTimeT creates a RFC 1123 date CFString from
+ * a time_t time.
+ */
+static CFStringRef CFStringCreateRFC2616DateStringWithTimeT( /* <- CFString containing RFC 1123 date, NULL if error */
+	time_t clock)				/* -> time_t value */
+{
+	struct tm *tm_temp;
+	CFGregorianDate gdate;
+	CFStringRef result;
+	
+	require_action_quiet(clock != -1, InvalidClock, result = NULL);
+	
+	/* get struct tm (in GMT) from time_t */
+	tm_temp = gmtime(&clock);
+
+	/* copy the struct tm into CFGregorianDate */
+	gdate.second = tm_temp->tm_sec;
+	gdate.minute = tm_temp->tm_min;
+	gdate.hour = tm_temp->tm_hour;
+	gdate.day = tm_temp->tm_mday;
+	gdate.month = tm_temp->tm_mon + 1;
+	gdate.year = tm_temp->tm_year + 1900;
+	
+	/* get a CFStringRef with the RFC 1123 date string */
+	result = _CFStringCreateRFC2616DateStringWithGregorianDate(kCFAllocatorDefault, &gdate, NULL);
+
+InvalidClock:
+	
+	return ( result );
+}
+
+/*****************************************************************************/
+
+/*
+ * SkipCodedURL finds the end of a Coded-URL using the rules
+ * (rfc 2518, section 9.4 and rfc 2396):
+ *	
+ *	Coded-URL		= "<" absoluteURI ">"
+ *	
+ * On input, the bytes parameter points to the character AFTER the initial
+ * '<' character. The function result is a pointer to the '>' character that
+ * terminates the Coded-URL or the end of the C string.
+ */
+static const char * SkipCodedURL(const char *bytes)
+{
+	/* the end of the string or Coded-URL? */
+	while ( (*bytes != '\0') && (*bytes != '>') )
+	{
+		/* skip character */
+		++bytes;
+	}
+	
+	return ( bytes );
+}
+
+/*****************************************************************************/
+
+/*
+ * SkipToken finds the end of a token using the rules (rfc 2616, section 2.2):
+ *	
+ *	token		= 1*<any CHAR except CTLs or separators>
+ *	CTL			= <any US-ASCII control character (octets 0 - 31) and
+ *				  DEL (127)>
+ *	separators	= "(" | ")" | "<" | ">" | "@"
+ *				  | "," | ";" | ":" | "\" | <">
+ *				  | "/" | "[" | "]" | "?" | "="
+ *				  | "{" | "}" | SP | HT
+ *	
+ * The function result is a pointer to the first non token character or the
+ * end of the C string.
+ */
+static const char * SkipToken(const char *bytes)
+{
+	while ( *bytes != '\0' )
+	{
+		/* CTL - US-ASCII control character (octets 0 - 31) */
+		if ( (unsigned char)*bytes <= 31 )
+		{
+			/* not a token character - done */
+			goto Done;
+		}
+		else
+		{
+			switch ( *bytes )
+			{
+			/* CTL - DEL (127) */
+			case '\x7f':
+			/* separators */
+			case '(':
+			case ')':
+			case '<':
+			case '>':
+			case '@':
+			case ',':
+			case ';':
+			case ':':
+			case '\\':
+			case '\"':
+			case '/':
+			case '[':
+			case ']':
+			case '\?':
+			case '=':
+			case '{':
+			case '}':
+			case ' ':
+			case '\t':
+				/* not a token character - done */
+				goto Done;
+				break;
+			
+			default:
+				/* skip token characters */
+				++bytes;
+				break;
+			}
+		}
+	}
+
+Done:	
+	return (bytes);
+}
+
+/*****************************************************************************/
+
+/*
+ * SkipLWS finds the end of a run of LWS using the rule
+ * (rfc 2616, section 2.2):
+ *	
+ *	LWS = [CRLF] 1*( SP | HT )
+ *	
+ * The function result is a pointer to the first non LWS character or the end
+ * of the C string.
+ */
+static const char * SkipLWS(const char *bytes)
+{
+	while ( *bytes != '\0' )
+	{
+		if ( (*bytes == ' ') || (*bytes == '\t') )
+		{
+			/* skip SP and HT characters */
+			++bytes;
+			continue;
+		}
+		/*
+		 * skip CRLF only if followed by SP or HT (in which case the SP 
+		 * or HT can be skipped, too)
+		 */
+		else if ( *bytes == '\x0d' ) /* CR? */
+		{
+			/* LF? */
+			if ( bytes[1] == '\x0a' )
+			{
+				/* SP or HT? */
+				if ( (bytes[2] == ' ') || (bytes[2] == '\t') )
+				{	
+					/* skip CRLF followed by SP or HT */
+					bytes += 3;
+					continue;
+				}
+			}
+		}
+		
+		/* found the end of the LWS run */
+		break;
+	}
+	
+	return ( bytes );
+}
+
+/*****************************************************************************/
+
+static int set_global_stream_properties(CFReadStreamRef readStreamRef)
+{
+	int error, mutexerror;
+		
+	mutexerror = pthread_mutex_lock(&gNetworkGlobals_lock);
+	require_noerr_action(mutexerror, pthread_mutex_lock, error = mutexerror; webdav_kill(-1));
+	
+	error = (CFReadStreamSetProperty(readStreamRef, kCFStreamPropertyHTTPProxy, gProxyDict) == TRUE) ? 0 : 1;
+	
+	mutexerror = pthread_mutex_unlock(&gNetworkGlobals_lock);
+	require_noerr_action(mutexerror, pthread_mutex_unlock, error = mutexerror; webdav_kill(-1));
+	
+pthread_mutex_unlock:
+pthread_mutex_lock:
+	
+	return ( error );
+}
+
+/******************************************************************************/
+
+int network_get_proxy_settings(
+	int *httpProxyEnabled,		/* <- true if HTTP proxy is enabled */
+	char **httpProxyServer,		/* <- HTTP proxy server name */
+	int *httpProxyPort,			/* <- HTTP proxy port number */
+	int *httpsProxyEnabled,		/* <- true if HTTPS proxy is enabled */
+	char **httpsProxyServer,	/* <- HTTPS proxy server name */
+	int* httpsProxyPort)		/* <- HTTPS proxy port number */
+{
+	int error, mutexerror;
+	
+	error = 0;
+	
+	mutexerror = pthread_mutex_lock(&gNetworkGlobals_lock);
+	require_noerr_action(mutexerror, pthread_mutex_lock, error = mutexerror; webdav_kill(-1));
+	
+	*httpProxyServer = malloc(MAXHOSTNAMELEN);
+	require_action(*httpProxyServer != NULL, malloc_httpProxyServer, error = ENOMEM);
+	
+	*httpsProxyServer = malloc(MAXHOSTNAMELEN);
+	require_action(*httpsProxyServer != NULL, malloc_httpsProxyServer, free(*httpProxyServer); error = ENOMEM);
+	
+	*httpProxyEnabled = gHttpProxyEnabled;
+	memcpy(*httpProxyServer, gHttpProxyServer, MAXHOSTNAMELEN);
+	*httpProxyPort = gHttpProxyPort;
+	
+	*httpsProxyEnabled = gHttpsProxyEnabled;
+	memcpy(*httpsProxyServer, gHttpsProxyServer, MAXHOSTNAMELEN);
+	*httpsProxyPort = gHttpsProxyPort;
+
+malloc_httpsProxyServer:
+malloc_httpProxyServer:
+	
+	mutexerror = pthread_mutex_unlock(&gNetworkGlobals_lock);
+	require_noerr_action(mutexerror, pthread_mutex_unlock, error = mutexerror; webdav_kill(-1));
+	
+pthread_mutex_unlock:
+pthread_mutex_lock:
+	
+	return ( error );
+}
+
+/******************************************************************************/
+
+int network_update_proxy(void *arg)
+{
+#pragma unused(arg)
+	int error, mutexerror;
+	
+	error = 0;
+	
+	mutexerror = pthread_mutex_lock(&gNetworkGlobals_lock);
+	require_noerr_action(mutexerror, pthread_mutex_lock, error = mutexerror; webdav_kill(-1));
+
+	/* release the old proxies dictionary */
+	if ( gProxyDict )
+	{
+		CFRelease(gProxyDict);
+	}
+	
+	/* slam everything to default disabled state in case something fails */
+	gHttpProxyEnabled = 0;
+	gHttpProxyServer[0] = '\0';
+	gHttpProxyPort = 0;
+	
+	gHttpsProxyEnabled = 0;
+	gHttpsProxyServer[0] = '\0';
+	gHttpsProxyPort = 0;
+	
+	/* get the current internet proxy dictionary */
+	gProxyDict = SCDynamicStoreCopyProxies(gProxyStore);
+	if ( gProxyDict != NULL )
+	{
+		CFNumberRef cf_enabled;
+		int enabled;
+		CFStringRef cf_host;
+		CFNumberRef cf_port;
+		
+		/*
+		 * take care of HTTP proxies
+		 */
+		/* are HTTP proxies enabled? */ 
+		cf_enabled = CFDictionaryGetValue(gProxyDict, kSCPropNetProxiesHTTPEnable);
+		if ( (cf_enabled != NULL) && CFNumberGetValue(cf_enabled, kCFNumberIntType, &enabled) && enabled )
+		{
+			/* get the HTTP proxy */
+			cf_host = CFDictionaryGetValue(gProxyDict, kSCPropNetProxiesHTTPProxy);
+			if ( (cf_host != NULL) && CFStringGetCString(cf_host, gHttpProxyServer, sizeof(gHttpProxyServer), kCFStringEncodingUTF8) )
+			{
+				/* get the HTTP proxy port */
+				cf_port = CFDictionaryGetValue(gProxyDict, kSCPropNetProxiesHTTPPort);
+				if ( (cf_port != NULL) && CFNumberGetValue(cf_port, kCFNumberIntType, &gHttpProxyPort) ) 
+				{
+					if ( gHttpProxyPort == 0 )
+					{
+						/* no port specified so use the default HTTP port */
+						gHttpProxyPort = kHttpDefaultPort;
+					}
+					gHttpProxyEnabled = 1;
+				}
+			}
+		}
+		
+		/*
+		 * take care of HTTPS proxies
+		 */
+		/* are HTTP proxies enabled? */ 
+		cf_enabled = CFDictionaryGetValue(gProxyDict, kSCPropNetProxiesHTTPSEnable);
+		if ( (cf_enabled != NULL) && CFNumberGetValue(cf_enabled, kCFNumberIntType, &enabled) && enabled )
+		{
+			/* get the HTTP proxy */
+			cf_host = CFDictionaryGetValue(gProxyDict, kSCPropNetProxiesHTTPSProxy);
+			if ( (cf_host != NULL) && CFStringGetCString(cf_host, gHttpsProxyServer, sizeof(gHttpsProxyServer), kCFStringEncodingUTF8) )
+			{
+				/* get the HTTP proxy port */
+				cf_port = CFDictionaryGetValue(gProxyDict, kSCPropNetProxiesHTTPSPort);
+				if ( (cf_port != NULL) && CFNumberGetValue(cf_port, kCFNumberIntType, &gHttpsProxyPort) ) 
+				{
+					if ( gHttpsProxyPort == 0 )
+					{
+						/* no port specified so use the default HTTPS port */
+						gHttpsProxyPort = kHttpsDefaultPort;
+					}
+					gHttpsProxyEnabled = 1;
+				}
+			}
+		}
+	}
+	
+	mutexerror = pthread_mutex_unlock(&gNetworkGlobals_lock);
+	require_noerr_action(mutexerror, pthread_mutex_unlock, error = mutexerror; webdav_kill(-1));
+	
+	/* remove proxy authentications */
+	error = authcache_proxy_invalidate();
+
+pthread_mutex_unlock:
+pthread_mutex_lock:
+
+	return ( error );
+}
+
+/*****************************************************************************/
+
+/*
+	The InitUserAgentHeaderValue initializes the string userAgentHeaderValue which
+	is sent with every request to the server. The User-Agent request-header field
+	is defined in RFC 2616, section 14.43 as:
+		User-Agent		= "User-Agent" ":" 1*( product | comment )
+	section 3.8 defines product as:
+		product			= token ["/" product-version]
+		product-version	= token
+	section 2.2 defines comment as:
+		comment			= "(" *( ctext | quoted-pair | comment ) ")"
+		ctext			= <any TEXT excluding "(" and ")">
+		quoted-pair		= "\" CHAR
+
+	We want our User-Agent request-header field to look something like:
+		"User-Agent: WebDAVFS/1.1 (0110800000) Darwin/5.3 (Power Macintosh)"
+	where:
+		1.1	= the CFBundleShortVersionString from webdav.fs bundle
+		0110800000 = webdav.fs bundle's numeric version
+		Darwin = CTL_KERN/KERN_OSTYPE
+		5.3 = CTL_KERN/KERN_OSRELEASE
+		Power Macintosh = CTL_HW/HW_MACHINE
+	
+	webdav.fs bundle is located at:
+		/System/Library/Filesystems/webdav.fs
+	
+	If the data from webdav.fs bundle could not be obtained, then we'll
+	fall back to the generic User-Agent request-header string WebDAV FS
+	used to use.
+	
+	IMPORTANT: The user-agent header MUST start with the
+	product token "WebDAVFS" because there are WebDAV servers
+	that special case this client.
+ */
+
+static int InitUserAgentHeaderValue(int add_mirror_comment)
+{
+	char				buf[128];
+	int					mib[2];
+	char				ostype[128];
+	char				osrelease[128];
+	char				machine[128];
+	size_t				len;
+	CFURLRef			url;
+	CFBundleRef			bundle;
+	CFDictionaryRef		dict;
+	CFStringRef			shortVersion;
+	CFIndex				shortVersionLen;
+	char				*webdavfsVersionStr;
+	UInt32				webdavfsVersion;
+	int					result;
+	
+	/* Get the ostype, osrelease, and machine strings using sysctl*/
+	mib[0] = CTL_KERN;
+	mib[1] = KERN_OSTYPE;
+	len = sizeof ostype;
+	if (sysctl(mib, 2, ostype, &len, 0, 0) < 0)
+	{
+		ostype[0] = '\0';
+	}
+	mib[1] = KERN_OSRELEASE;
+	len = sizeof osrelease;
+	if (sysctl(mib, 2, osrelease, &len, 0, 0) < 0)
+	{
+		osrelease[0] = '\0';
+	}
+	mib[0] = CTL_HW;
+	mib[1] = HW_MACHINE;
+	len = sizeof machine;
+	if (sysctl(mib, 2, machine, &len, 0, 0) < 0)
+	{
+		machine[0] = '\0';
+	}
+	
+	/* We don't have it yet */
+	webdavfsVersionStr = NULL;
+	webdavfsVersion = 0x010080000; /* 1.0 final */
+	
+	/* Create the CFURLRef to the webdav.fs bundle's version.plist */
+	url = CFURLCreateWithFileSystemPath(kCFAllocatorDefault,
+		CFSTR("/System/Library/Filesystems/webdav.fs"),
+		kCFURLPOSIXPathStyle, true);
+	if ( url != NULL )
+	{
+		/* Create the bundle */
+		bundle = CFBundleCreate(kCFAllocatorDefault, url);
+		if ( bundle != NULL )
+		{
+			/* Get the bundle's numeric version */
+			webdavfsVersion = CFBundleGetVersionNumber(bundle);
+			
+			/* Get the Info dictionary */ 
+			dict = CFBundleGetInfoDictionary(bundle);
+			if ( dict != NULL )
+			{
+				/* Get the CFBundleShortVersionString (display string) */
+				shortVersion = CFDictionaryGetValue(dict, CFSTR("CFBundleShortVersionString"));
+				if ( shortVersion != NULL )
+				{
+					/* Get the bundleVersionStr */
+					shortVersionLen = CFStringGetLength(shortVersion) + 1;
+					webdavfsVersionStr = malloc((size_t)shortVersionLen);
+					if ( webdavfsVersionStr != NULL )
+					{
+						/* Convert it to a C string */
+						if ( !CFStringGetCString(shortVersion, webdavfsVersionStr, shortVersionLen, kCFStringEncodingUTF8) )
+						{
+							/* If we can't get it, free the memory */
+							free(webdavfsVersionStr);
+							webdavfsVersionStr = NULL;
+						}
+					}
+				}
+			}
+			/* release created bundle */
+			CFRelease(bundle);
+		}
+		/* release created url */
+		CFRelease(url);
+	}
+	
+	if ( webdavfsVersionStr != NULL )
+	{
+		/* if everything worked, use the new format User-Agent request-header string */
+		snprintf(buf, sizeof(buf), "WebDAVFS/%s (%.8lx) %s%s/%s (%s)",
+			webdavfsVersionStr, (unsigned long)webdavfsVersion, (add_mirror_comment ? "(mirrored) " : ""), ostype, osrelease, machine);
+		free(webdavfsVersionStr);
+	}
+	else
+	{
+		/* create the generic User-Agent request-header string WebDAV FS used to use */
+		snprintf(buf, sizeof(buf), "WebDAVFS/1.4 %s/%s (%s)",
+			ostype, osrelease, machine);
+	}
+			
+	userAgentHeaderValue = CFStringCreateWithCString(kCFAllocatorDefault, buf, kCFStringEncodingUTF8);
+	require_action(userAgentHeaderValue != NULL, CFStringCreateWithCString, result = ENOMEM);
+	
+	result = 0;
+
+CFStringCreateWithCString:
+	
+	return ( result );
+}
+
+/*****************************************************************************/
+
+/*
+ * The get_first_read_len function sets the global
+ * first_read_len. It is set to the system's page size so that if the
+ * first read after an open starts at offset 0, that page will already be
+ * downloaded into the cache file.
+ */
+static void get_first_read_len(void)
+{
+	int		mib[2];
+	size_t	len;
+	int		result;
+	int		pagesize;
+	
+	/* get the hardware page size */
+	mib[0] = CTL_HW;
+	mib[1] = HW_PAGESIZE;
+	len = sizeof(int);
+	result = sysctl(mib, 2, &pagesize, &len, 0, 0);
+	if ( result < 0 )
+	{
+		/* set first_read_len to PowerPC page size */
+		first_read_len = 4096;
+	}
+	else
+	{
+		first_read_len = pagesize;
+	}
+}
+
+/******************************************************************************/
+
+static void InitXSourceIdHeaderValue(void)
+{
+	CFStringRef hostName;
+	char encodedIdBuffer[32];
+	CFURLRef baseURL;
+	
+	X_Source_Id_HeaderValue = NULL;
+	X_Apple_Realm_Support_HeaderValue = NULL;
+	
+	/* get the host name */
+	baseURL = nodecache_get_baseURL();
+	hostName = CFURLCopyHostName(baseURL);
+	CFRelease(baseURL);
+	require_quiet(hostName != NULL, CFURLCopyHostName);
+	
+	/* is it one of "idisk.mac.com" or "idisk.me.com" - if not, we don't want it */
+	if ( (CFStringCompare(hostName, CFSTR("idisk.mac.com"), kCFCompareCaseInsensitive) != kCFCompareEqualTo) &&
+		 (CFStringCompare(hostName, CFSTR("idisk.me.com"), kCFCompareCaseInsensitive) != kCFCompareEqualTo) )
+		goto NotIdisk;
+	
+	/* create the X-Apple-Realm-Support string */
+	X_Apple_Realm_Support_HeaderValue = CFStringCreateWithCString(kCFAllocatorDefault, X_APPLE_REALM_SUPPORT_VALUE, kCFStringEncodingUTF8);
+	
+	/* created the X-Source-Id string */
+	require_quiet(GetEncodedSourceID(encodedIdBuffer), GetEncodedSourceID);
+	
+	/* and make it a CFString */
+	X_Source_Id_HeaderValue = CFStringCreateWithCString(kCFAllocatorDefault, encodedIdBuffer, kCFStringEncodingUTF8);
+
+GetEncodedSourceID:
+NotIdisk:
+	CFRelease(hostName);
+CFURLCopyHostName:
+
+	return;
+}
+
+/******************************************************************************/
+
+int network_init(const UInt8 *uri, CFIndex uriLength, int *store_notify_fd, int add_mirror_comment)
+{
+	int error;
+	pthread_mutexattr_t mutexattr;
+	CFStringRef notification_string;
+	CFArrayRef keys;
+	int index;
+	
+	gProxyDict = NULL;
+	error = 0;
+	gBasePathStr[0] = 0;
+	
+	/* set up the lock on the queues */
+	error = pthread_mutexattr_init(&mutexattr);
+	require_noerr(error, pthread_mutexattr_init);
+	
+	error = pthread_mutex_init(&gNetworkGlobals_lock, &mutexattr);
+	require_noerr(error, pthread_mutex_init);
+	
+	/* create a dynnamic store */
+	gProxyStore = SCDynamicStoreCreate(kCFAllocatorDefault, CFSTR("WebDAVFS"), NULL, NULL);
+	require_action(gProxyStore != NULL, SCDynamicStoreCreate, error = ENOMEM);
+	
+	/* open a file descriptor to be notified on */
+	require_action(SCDynamicStoreNotifyFileDescriptor(gProxyStore, 0, store_notify_fd),
+		SCDynamicStoreNotifyFileDescriptor, error = ENOMEM);
+
+	/* create a keys for network proxy changes */
+	notification_string = SCDynamicStoreKeyCreateProxies(kCFAllocatorDefault);
+	require_action(notification_string != NULL, SCDynamicStoreKeyCreateProxies, error = ENOMEM);
+	
+	keys = CFArrayCreate(kCFAllocatorDefault, (const void **)&notification_string, 1, &kCFTypeArrayCallBacks);
+	require_action(keys != NULL, CFArrayCreate, error = ENOMEM);
+	CFRelease(notification_string);
+	
+	require_action(SCDynamicStoreSetNotificationKeys(gProxyStore, keys, NULL),
+		SCDynamicStoreSetNotificationKeys, error = ENOMEM);
+	CFRelease(keys);
+
+	/* get the initial internet proxy settings */
+	error = network_update_proxy(NULL);
+	require_noerr_quiet(error, network_update_proxy);
+
+	/* create gBaseURL */
+	gBaseURL = CFURLCreateAbsoluteURLWithBytes(kCFAllocatorDefault, uri, uriLength, kCFStringEncodingUTF8, NULL, FALSE);
+	require_action_string(gBaseURL != NULL, CFURLCreateAbsoluteURLWithBytes, error = ENOMEM, "name was not legal UTF8");
+
+	/*
+	 * Make sure the gBaseURL doesn't have any components that it shouldn't have.
+	 * All it should have are the scheme, the host, the port, and the path.
+	 * UserInfo (name and password) and ResourceSpecifier (params, queries and fragments)
+	 * components are not allowed.
+	 */
+	require_action(((CFURLGetByteRangeForComponent(gBaseURL, kCFURLComponentUserInfo, NULL).location == kCFNotFound) &&
+				   (CFURLGetByteRangeForComponent(gBaseURL, kCFURLComponentResourceSpecifier, NULL).location == kCFNotFound)),
+				   IllegalURLComponent, error = EINVAL);
+	
+	gBasePath = CFURLCopyPath(gBaseURL);
+	if (gBasePath != NULL) {
+		CFStringGetCString(gBasePath, gBasePathStr, MAXPATHLEN, kCFStringEncodingUTF8);
+	}
+
+	/* initialize first_read_len variable */
+	get_first_read_len();
+	
+	/* init the X_Source_Id_HeaderValue string BEFORE InitUserAgentHeaderValue */
+	InitXSourceIdHeaderValue();
+
+	/* initialize userAgentHeaderValue */
+	error = InitUserAgentHeaderValue((X_Source_Id_HeaderValue != NULL) && add_mirror_comment);
+	if ( error )
+	{
+		/* not likely to fail, but just in case */
+		exit(error);
+	}
+	
+	/* WEBDAVFS_DOWNLOAD_SEGMENTS overrides the number of segments in a segmented download */
+	if ( getenv("WEBDAVFS_DOWNLOAD_SEGMENTS") != NULL )
+	{
+		gDownloadSegments = atoi(getenv("WEBDAVFS_DOWNLOAD_SEGMENTS"));
+		if ( gDownloadSegments < 1 )
+		{
+			gDownloadSegments = 1;
+		}
+		else if ( gDownloadSegments > WEBDAV_MAX_DOWNLOAD_SEGMENTS )
+		{
+			gDownloadSegments = WEBDAV_MAX_DOWNLOAD_SEGMENTS;
+		}
+	}
+	
+	/* WEBDAVFS_MAX_CONNECTIONS lowers the number of server connections allowed at once */
+	if ( getenv("WEBDAVFS_MAX_CONNECTIONS") != NULL )
+	{
+		gMaxConnections = atoi(getenv("WEBDAVFS_MAX_CONNECTIONS"));
+		if ( gMaxConnections < 1 )
+		{
+			gMaxConnections = 1;
+		}
+		else if ( gMaxConnections > WEBDAV_MAX_CONNECTIONS )
+		{
+			gMaxConnections = WEBDAV_MAX_CONNECTIONS;
+		}
+	}
+	
+	/* WEBDAVFS_PIPELINE_DEPTH turns on pipelining of small metadata requests */
+	if ( getenv("WEBDAVFS_PIPELINE_DEPTH") != NULL )
+	{
+		gPipelineDepth = atoi(getenv("WEBDAVFS_PIPELINE_DEPTH"));
+		if ( gPipelineDepth < 0 )
+		{
+			gPipelineDepth = 0;
+		}
+		else if ( gPipelineDepth > WEBDAV_MAX_PIPELINE_DEPTH )
+		{
+			gPipelineDepth = WEBDAV_MAX_PIPELINE_DEPTH;
+		}
+	}
+	
+	/* WEBDAVFS_NO_COMPRESSION stops PROPFIND requests from asking for compressed responses */
+	if ( getenv("WEBDAVFS_NO_COMPRESSION") != NULL )
+	{
+		gAcceptEncoding = FALSE;
+	}
+	
+	/* WEBDAVFS_TRANSPORT selects the transport; setting WEBDAVFS_PIPELINE_DEPTH selects "pipelined" */
+	if ( getenv("WEBDAVFS_TRANSPORT") != NULL )
+	{
+		gTransport = transport_named(getenv("WEBDAVFS_TRANSPORT"));
+		if ( gTransport == NULL )
+		{
+			syslog(LOG_ERR, "network_init: unknown WEBDAVFS_TRANSPORT %s", getenv("WEBDAVFS_TRANSPORT"));
+		}
+	}
+	else if ( gPipelineDepth != 0 )
+	{
+		gTransport = transport_named("pipelined");
+	}
+	if ( gTransport == NULL )
+	{
+		gTransport = transport_named("cfnetwork");
+	}
+	if ( (strcmp(gTransport->name, "pipelined") == 0) && (gPipelineDepth == 0) )
+	{
+		gPipelineDepth = WEBDAV_PIPELINE_DEPTH;
+	}
+	else if ( strcmp(gTransport->name, "pipelined") != 0 )
+	{
+		gPipelineDepth = 0;
+	}
+	
+	/* WEBDAVFS_CONNECTION_IDLE overrides how long an idle connection is kept */
+	if ( getenv("WEBDAVFS_CONNECTION_IDLE") != NULL )
+	{
+		gConnectionIdleTimeout = atoi(getenv("WEBDAVFS_CONNECTION_IDLE"));
+		if ( gConnectionIdleTimeout < 1 )
+		{
+			gConnectionIdleTimeout = 1;
+		}
+	}
+	
+	/* initialize the gReadStreams array */
+	for ( index = 0; index < WEBDAV_READ_STREAMS; ++index )
+	{
+		gReadStreams[index].inUse = 0; /* not in use */
+		gReadStreams[index].readStreamRef = NULL; /* no stream */
+		gReadStreams[index].uniqueValue = CFStringCreateWithFormat(kCFAllocatorDefault, NULL, CFSTR("%d"), index); /* unique string */
+		gReadStreams[index].sock = -1;
+	}
+
+IllegalURLComponent:
+CFURLCreateAbsoluteURLWithBytes:
+network_update_proxy:
+SCDynamicStoreSetNotificationKeys:
+CFArrayCreate:
+SCDynamicStoreKeyCreateProxies:
+SCDynamicStoreNotifyFileDescriptor:
+SCDynamicStoreCreate:
+pthread_mutex_init:
+pthread_mutexattr_init:
+	
+	return ( error );
+}
+
+/******************************************************************************/
+
+/*
+ * create_cfurl_from_node
+ *
+ * Creates a CFURL to the node if no name is provided, or to the node's named
+ * child if a name is provided.
+ *
+ * The caller is responsible for releasing the CFURL returned.
+ */
+static CFURLRef create_cfurl_from_node(
+	struct node_entry *node,
+	char *name,
+	size_t name_length)
+{
+	CFURLRef tempUrlRef, baseURL;
+	CFURLRef urlRef;
+	CFStringRef escapedPathRef;
+	bool pathHasRedirection;
+	int error;
+	
+	urlRef = NULL;
+	pathHasRedirection = false;
 	
-	require_action(SCDynamicStoreSetNotificationKeys(gProxyStore, keys, NULL),
-		SCDynamicStoreSetNotificationKeys, error = ENOMEM);
-	CFRelease(keys);
-
-	/* get the initial internet proxy settings */
-	error = network_update_proxy(NULL);
-	require_noerr_quiet(error, network_update_proxy);
-
-	/* create gBaseURL */
-	gBaseURL = CFURLCreateAbsoluteURLWithBytes(kCFAllocatorDefault, uri, uriLength, kCFStringEncodingUTF8, NULL, FALSE);
-	require_action_string(gBaseURL != NULL, CFURLCreateAbsoluteURLWithBytes, error = ENOMEM, "name was not legal UTF8");
-
 	/*
-	 * Make sure the gBaseURL doesn't have any components that it shouldn't have.
-	 * All it should have are the scheme, the host, the port, and the path.
-	 * UserInfo (name and password) and ResourceSpecifier (params, queries and fragments)
-	 * components are not allowed.
+	 * Get the percent escaped path from the root to the node (if any).
+	 * If the path is returned and it is to a directory, it will end with a slash.
 	 */
-	require_action(((CFURLGetByteRangeForComponent(gBaseURL, kCFURLComponentUserInfo, NULL).location == kCFNotFound) &&
-				   (CFURLGetByteRangeForComponent(gBaseURL, kCFURLComponentResourceSpecifier, NULL).location == kCFNotFound)),
-				   IllegalURLComponent, error = EINVAL);
+	error = nodecache_get_escaped_path_from_node(node, &pathHasRedirection, &escapedPathRef);
+	require_noerr_quiet(error, nodecache_get_escaped_path_from_node);
+
+	/* append the escaped name (if any) */
+	if ( name != NULL && name_length != 0 )
+	{
+		CFStringRef escapedNameRef;
+		CFMutableStringRef childPathRef;
+		
+		escapedNameRef = nodecache_create_escaped_path(name, name_length, pathHasRedirection);
+		require(escapedNameRef != NULL, nodecache_create_escaped_path);
+		
+		childPathRef = CFStringCreateMutableCopy(kCFAllocatorDefault, 0, escapedPathRef);
+		if ( childPathRef != NULL )
+		{
+			CFStringAppend(childPathRef, escapedNameRef);
+		}
+		CFRelease(escapedNameRef);
+		require(childPathRef != NULL, nodecache_create_escaped_path);
+		
+		CFRelease(escapedPathRef);
+		escapedPathRef = childPathRef;
+	}
+	
+	/* is there any relative path? */
+	if ( CFStringGetLength(escapedPathRef) != 0 )
+	{
+		/* create the URL */
+		if (pathHasRedirection == true) {
+			// this path already has a base URL since it contains a redirected node
+			urlRef = CFURLCreateWithString(kCFAllocatorDefault, escapedPathRef, NULL);
+
+			if (urlRef == NULL)
+				logDebugCFString("create_cfurl_from_node: CFURLCreateWithString error:", escapedPathRef);
+			
+			require(urlRef != NULL, CFURLCreateWithString);
+		}
+		else {
+			baseURL = nodecache_get_baseURL();
+			urlRef = CFURLCreateWithString(kCFAllocatorDefault, escapedPathRef, baseURL);
+			CFRelease(baseURL);
+			require(urlRef != NULL, CFURLCreateWithString);			
+		}
+		
+		/* and then make an absolute copy of it */
+		tempUrlRef = urlRef;
+		urlRef = CFURLCopyAbsoluteURL(tempUrlRef);
+		
+		CFRelease(tempUrlRef);
+CFURLCreateWithString:
+		;
+	}
+	else
+	{
+		/* no relative path -- use the base URL */
+		urlRef = nodecache_get_baseURL();
+	}
+
+nodecache_create_escaped_path:
+
+	CFRelease(escapedPathRef);
+
+nodecache_get_escaped_path_from_node:
+		
+	return ( urlRef );
+}
+
+/******************************************************************************/
+
+static int translate_status_to_error(UInt32 statusCode)
+{
+	int result;
+	uint64_t code = statusCode;
+	
+	/* switch by Nxx range */
+	switch ( statusCode / 100 )
+	{
+		case 1:	/* Informational 1xx */
+			syslog(LOG_ERR,"unexpected statusCode %llu", code);
+			result = ENOENT;	/* CFNetwork eats 1xx responses so this should never happen */
+			break;
+		case 2:	/* Successful 2xx */
+			result = 0;
+			break;
+		case 3:	/* Redirection 3xx */
+			syslog(LOG_ERR,"unexpected statusCode %llu", code);
+			result = ENOENT;
+			break;
+		case 4:	/* Client Error 4xx */
+			switch ( statusCode )
+			{
+				case 401:	/* 401 Unauthorized */
+				case 402:	/* Payment required */
+				case 403:	/* Forbidden */
+				case 405:   /* 405 Method Not Allowed.  A few DAV servers return when folder isn't writable 
+							 * <rdar://problem/4294372> MSG: Error message (filename too long) displayed when that's not the issue
+							 */
+					/* 
+					 * We return EPERM here so that Finder exhibits the correct behavior.
+					 * Returning EAUTH can result in strange behavior such as files 
+					 * dissappearing, as seen in:
+					 * <rdar://problem/6140701> Invalid credentials leads to scary user experience
+					 * 
+					 */
+					syslog(LOG_DEBUG,"unexpected statusCode %llu", code);
+					result = EPERM;
+					break;
+				case 407:	/* 407 Proxy Authentication Required */
+					syslog(LOG_ERR,"unexpected statusCode %llu", code);
+					result = EAUTH;
+					break;
+				case 404:	/* Not Found */
+				case 409:	/* Conflict (path prefix does not exist) */
+				case 410:	/* Gone */
+					result = ENOENT;
+					break;
+				case 413:	/* Request Entity Too Large (this server doesn't allow large PUTs) */
+					result = EFBIG;
+					syslog(LOG_ERR,"unexpected statusCode %llu", code);
+					break;
+				case 414:	/* Request URI Too Long */
+					syslog(LOG_ERR,"unexpected statusCode %llu", code);
+					result = ENAMETOOLONG;
+					break;
+				case 416:	/* Requested Range Not Available */
+					syslog(LOG_DEBUG,"unexpected statusCode %llu", code);
+					result = EINVAL;
+					break;
+				case 423:	/* Locked (WebDAV) */
+				case 424:	/* Failed Dependency (WebDAV) (EBUSY when a directory cannot be MOVE'd) */
+					syslog(LOG_ERR,"unexpected statusCode %llu", code);
+					result = EBUSY;
+					break;
+				default:
+					syslog(LOG_ERR,"unexpected statusCode %llu", code);
+					result = EINVAL;	/* unexpected */
+					break;
+			}
+			break;
+		case 5:	/* Server Error 5xx */
+			if ( statusCode == 507 )	/* Insufficient Storage (WebDAV) */
+			{
+				syslog(LOG_ERR,"unexpected statusCode %llu", code);
+				result = ENOSPC;
+			}
+			else
+			{
+				syslog(LOG_ERR,"unexpected statusCode %llu", code);
+				result = ENOENT;	/* unexpected */
+			}
+			break;
+		default: /* only the 1xx through 5xx ranges are defined */
+			syslog(LOG_ERR,"unexpected statusCode %llu", code);
+			result = EIO;
+			break;
+	}
+	
+	return ( result );
+}
+
+/******************************************************************************/
+
+/* returns TRUE if SSL properties were correctly applied (or were not needed) */
+static int ApplySSLProperties(CFReadStreamRef readStreamRef)
+{
+	int result = TRUE;
+	
+	if ( gSSLPropertiesDict != NULL ) 
+	{
+		result = (CFReadStreamSetProperty(readStreamRef, kCFStreamPropertySSLSettings, gSSLPropertiesDict) == TRUE);
+	}
+	
+	return ( result );
+}
+
+/******************************************************************************/
+
+/*
+ * ReadStreamRec_is_healthy
+ *
+ * Returns TRUE if an idle ReadStreamRec's connection can be reused: its stream
+ * hasn't failed, it hasn't been idle longer than gConnectionIdleTimeout, and
+ * nothing is waiting to be read on its socket (an idle keep-alive connection
+ * only becomes readable when the server closes or resets it).
+ * Called with gNetworkGlobals_lock locked.
+ */
+static int ReadStreamRec_is_healthy(struct ReadStreamRec *theReadStreamRec, time_t now)
+{
+	struct pollfd pfd;
+	
+	if ( CFReadStreamGetStatus(theReadStreamRec->readStreamRef) == kCFStreamStatusError )
+	{
+		return ( FALSE );
+	}
+	
+	if ( (now - theReadStreamRec->lastUsed) > gConnectionIdleTimeout )
+	{
+		return ( FALSE );
+	}
+	
+	if ( theReadStreamRec->sock >= 0 )
+	{
+		pfd.fd = theReadStreamRec->sock;
+		pfd.events = POLLIN;
+		pfd.revents = 0;
+		if ( (poll(&pfd, 1, 0) != 0) || (pfd.revents != 0) )
+		{
+			return ( FALSE );
+		}
+	}
+	
+	return ( TRUE );
+}
+
+/******************************************************************************/
+
+/*
+ * get_ReadStreamRec
+ *
+ * Tries to return a ReadStreamRec that's not in use and has a healthy open
+ * connection, preferring the lowest so the busy connections stay few and the
+ * rest go idle and are reaped. If there isn't one, returns a ReadStreamRec
+ * that's not in use and closed, opening a new connection, as long as fewer
+ * than gMaxConnections are in use. Otherwise, if wait is TRUE, waits for one
+ * to be released (going over the limit after WEBDAV_CONNECTION_WAIT seconds),
+ * or if wait is FALSE, returns NULL.
+ */
+static struct ReadStreamRec *get_ReadStreamRec(int wait)
+{
+	int index;
+	struct ReadStreamRec *result;
+	struct ReadStreamRec *closed;
+	CFReadStreamRef staleStreams[WEBDAV_READ_STREAMS];
+	int staleCount;
+	struct timespec deadline;
+	time_t now;
+	int waited;
+	int mutexerror;
+	
+	result = NULL;
+	staleCount = 0;
+	waited = FALSE;
+	deadline.tv_sec = time(NULL) + WEBDAV_CONNECTION_WAIT;
+	deadline.tv_nsec = 0;
+	
+	/* grab gNetworkGlobals_lock */
+	mutexerror = pthread_mutex_lock(&gNetworkGlobals_lock);
+	require_noerr_action(mutexerror, pthread_mutex_lock, webdav_kill(-1));
+	
+	while ( result == NULL )
+	{
+		closed = NULL;
+		now = time(NULL);
+		for ( index = 0; index < WEBDAV_READ_STREAMS; ++index )
+		{
+			if ( gReadStreams[index].inUse )
+			{
+				continue;
+			}
+			
+			/* found one not in use */
+			if ( gReadStreams[index].readStreamRef != NULL )
+			{
+				/* if its connection is still good, grab it */
+				if ( ReadStreamRec_is_healthy(&gReadStreams[index], now) )
+				{
+					result = &gReadStreams[index];
+					++result->reuses;
+					break;
+				}
+				
+				/* else... the connection is stale, so close it (after unlocking) */
+				staleStreams[staleCount++] = gReadStreams[index].readStreamRef;
+				gReadStreams[index].readStreamRef = NULL;
+				gReadStreams[index].sock = -1;
+				++gConnectionStats.stale;
+			}
+			
+			if ( closed == NULL )
+			{
+				/* keep track of the first closed one in case we don't find an open one */
+				closed = &gReadStreams[index];
+			}
+		}
+		
+		if ( (result == NULL) && (closed != NULL) )
+		{
+			if ( gConnectionStats.active < gMaxConnections )
+			{
+				/* open another connection */
+				result = closed;
+			}
+			else if ( !wait )
+			{
+				++gConnectionStats.refused;
+				break;
+			}
+		}
+		
+		if ( result == NULL )
+		{
+			/* wait for a ReadStreamRec to be released */
+			if ( !waited )
+			{
+				waited = TRUE;
+				++gConnectionStats.waits;
+			}
+			if ( pthread_cond_timedwait(&gReadStreams_cond, &gNetworkGlobals_lock, &deadline) == ETIMEDOUT )
+			{
+				if ( closed != NULL )
+				{
+					/* go over the limit instead of waiting any longer */
+					++gConnectionStats.overcommits;
+					result = closed;
+				}
+				else
+				{
+					/* every ReadStreamRec is in use, which shouldn't happen -- keep waiting */
+					deadline.tv_sec = time(NULL) + WEBDAV_CONNECTION_WAIT;
+				}
+			}
+		}
+	}
+	
+	if ( result != NULL )
+	{
+		result->inUse = TRUE;	/* mark it in use */
+		++result->uses;
+		gettimeofday(&result->acquired, NULL);
+		if ( ++gConnectionStats.active > gConnectionStats.peak_active )
+		{
+			gConnectionStats.peak_active = gConnectionStats.active;
+		}
+	}
+
+	/* release gNetworkGlobals_lock */
+	mutexerror = pthread_mutex_unlock(&gNetworkGlobals_lock);
+	require_noerr_action(mutexerror, pthread_mutex_unlock, webdav_kill(-1));
+
+pthread_mutex_unlock:
+
+	/* close and release the stale read streams */
+	for ( index = 0; index < staleCount; ++index )
+	{
+		CFReadStreamClose(staleStreams[index]);
+		CFRelease(staleStreams[index]);
+	}
+
+pthread_mutex_lock:
+
+	return ( result );
+}
+
+/******************************************************************************/
+
+/*
+ * release_ReadStreamRec
+ *
+ * Release a ReadStreamRec.
+ */
+static void release_ReadStreamRec(struct ReadStreamRec *theReadStreamRec)
+{
+	struct timeval now;
+	u_int64_t busyUsec;
+	int mutexerror;
+	
+	gettimeofday(&now, NULL);
+	busyUsec = ((u_int64_t)(now.tv_sec - theReadStreamRec->acquired.tv_sec) * 1000000) +
+		(now.tv_usec - theReadStreamRec->acquired.tv_usec);
+	
+	/* grab gNetworkGlobals_lock */
+	mutexerror = pthread_mutex_lock(&gNetworkGlobals_lock);
+	require_noerr_action(mutexerror, pthread_mutex_lock, webdav_kill(-1));
+	
+	/* release theReadStreamRec */
+	theReadStreamRec->inUse = FALSE;
+	theReadStreamRec->lastUsed = now.tv_sec;
+	if ( theReadStreamRec->readStreamRef == NULL )
+	{
+		theReadStreamRec->sock = -1;
+	}
+	theReadStreamRec->busyUsec += busyUsec;
+	if ( busyUsec > theReadStreamRec->maxBusyUsec )
+	{
+		theReadStreamRec->maxBusyUsec = busyUsec;
+	}
+	--gConnectionStats.active;
+	pthread_cond_signal(&gReadStreams_cond);
+	
+	/* release gNetworkGlobals_lock */
+	mutexerror = pthread_mutex_unlock(&gNetworkGlobals_lock);
+	require_noerr_action(mutexerror, pthread_mutex_unlock, webdav_kill(-1));
+
+pthread_mutex_unlock:
+pthread_mutex_lock:
+
+	return;
+}
+
+/******************************************************************************/
+
+/*
+ * SecAddTrustedCerts
+ *
+ * Adds trusted SecCertificateRefs to our global SSL properties dictionary
+ */
+static void SecAddTrustedCerts(CFArrayRef certs)
+{
+	SecCertificateRef certRef;
+	const void *certPtr;
+	CFMutableArrayRef newCertArr, incomingCerts;
+	CFArrayRef existingCertArr;
+	CFIndex i, count;
+	
+	require(certs != NULL, out);
+	require(gSSLPropertiesDict != NULL, out);
+	
+	incomingCerts = NULL;
+	
+	// Make a mutable copy of incoming certs
+	incomingCerts = CFArrayCreateMutableCopy(kCFAllocatorDefault, 0, certs);
+	require(incomingCerts != NULL, out);
+	
+	// Any existing trusted certificates?
+	existingCertArr = CFDictionaryGetValue(gSSLPropertiesDict, _kCFStreamSSLTrustedLeafCertificates);
+	
+	
+	if (existingCertArr == NULL) {
+		// Add our copy of incoming certs to the dictionary
+		CFDictionarySetValue(gSSLPropertiesDict, _kCFStreamSSLTrustedLeafCertificates, incomingCerts);
+	}
+	else {
+		// Copy old certificates
+		newCertArr = CFArrayCreateMutableCopy(kCFAllocatorDefault, 0, existingCertArr);
+		require(newCertArr != NULL, MallocNewCerts);
+		
+		// Remove old certificates
+		CFDictionaryRemoveValue(gSSLPropertiesDict, _kCFStreamSSLTrustedLeafCertificates);
+
+		// Add any new certs
+		count = CFArrayGetCount(incomingCerts);
+
+		for (i = 0; i < count; ++i)
+		{
+			certPtr = CFArrayGetValueAtIndex(incomingCerts, i);
+			if (certPtr == NULL)
+				continue;
+			
+			certRef = *((SecCertificateRef*)((void*)&certPtr)); /* ugly but it works */
+	
+			if (CFArrayContainsValue(newCertArr, CFRangeMake(0, CFArrayGetCount(newCertArr)), certRef) == false) {
+				
+				// Don't have this cert yet, so add it
+				CFArrayAppendValue(newCertArr, certRef);
+			}
+		}
+		
+		// Now set the new array
+		CFDictionarySetValue(gSSLPropertiesDict, _kCFStreamSSLTrustedLeafCertificates, newCertArr);
+	}
+
+	if (incomingCerts != NULL) {
+		// Release our reference from the Copy
+		CFRelease(incomingCerts);
+	}
+out:
+MallocNewCerts:	
+	return;
+}
+
+/******************************************************************************/
+
+/*
+ * SecCertificateCreateCFData
+ *
+ * Creates a CFDataRef from a SecCertificateRef.
+ */
+static CFDataRef SecCertificateCreateCFData(SecCertificateRef cert)
+{
+	CFDataRef data;
+
+	data = SecCertificateCopyData(cert);
+
+	if (data == NULL)
+		syslog(LOG_ERR, "%s : SecCertificateCopyData returned NULL\n", __FUNCTION__);
+ 
+	return (data);
+}
+
+/******************************************************************************/
+
+/*
+ * SecCertificateArrayCreateCFDataArray
+ *
+ * Convert a CFArray[SecCertificate] to CFArray[CFData].
+ */
+static CFArrayRef SecCertificateArrayCreateCFDataArray(CFArrayRef certs)
+{
+	CFMutableArrayRef array;
+	CFIndex count;
+	int i;
+	const void *certRef;
+
+	count = CFArrayGetCount(certs);
+	array = CFArrayCreateMutable(NULL, count, &kCFTypeArrayCallBacks);
+	require(array != NULL, CFArrayCreateMutable);
+	
+	for (i = 0; i < count; ++i)
+	{
+		SecCertificateRef cert;
+		CFDataRef data;
+
+		certRef = CFArrayGetValueAtIndex(certs, i);
+		cert = *((SecCertificateRef*)((void*)&certRef)); /* ugly but it works */
+		require(cert != NULL, CFArrayGetValueAtIndex);
+		
+		data = SecCertificateCreateCFData(cert);
+		require(data != NULL, SecCertificateCreateCFData);
+		
+		CFArrayAppendValue(array, data);
+		CFRelease(data);
+	}
+	
+	return (array);
+	
+	/************/
+
+SecCertificateCreateCFData:
+CFArrayGetValueAtIndex:
+	CFRelease(array);
+CFArrayCreateMutable:
+
+	return (NULL);
+}
+
+/******************************************************************************/
+
+/* returns TRUE if user asked to continue with this certificate problem; FALSE if not */
+static int ConfirmCertificate(CFReadStreamRef readStreamRef, SInt32 error)
+{
+	int result;
+	CFMutableDictionaryRef dict;
+	CFArrayRef certs;
+	CFArrayRef certs_data;
+	CFNumberRef error_number;
+	CFStringRef host_name;
+	CFDataRef theData;
+	CFURLRef  baseURL;
+	int fd[2];
+	int pid, terminated_pid;
+	union wait status;
+	char CFUserTextEncodingEnvSetting[sizeof(CFENVFORMATSTRING) + 20]; 
+	char *env[] = {CFUserTextEncodingEnvSetting, "", (char *) 0 };
+	
+	/* 
+	 * Create a new environment with a definition of __CF_USER_TEXT_ENCODING to work 
+	 * around CF's interest in the user's home directory (which could be networked, 
+	 * causing recursive references through automount). Make sure we include the uid
+	 * since CF will check for this when deciding if to look in the home directory.
+	 */ 
+	snprintf(CFUserTextEncodingEnvSetting, sizeof(CFUserTextEncodingEnvSetting), CFENVFORMATSTRING, getuid());
+	
+	certs = NULL;
+	result = FALSE;
+	fd[0] = fd[1] = -1;
+	
+	/* create a dictionary to stuff things all in */
+	dict = CFDictionaryCreateMutable(kCFAllocatorDefault, 0, &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks);
+	require(dict != NULL, CFDictionaryCreateMutable);
+	
+	/* get the certificates from the stream and add it with the kSSLClientPropTLSServerCertificateChain key */
+	certs = (CFArrayRef)CFReadStreamCopyProperty(readStreamRef, kCFStreamPropertySSLPeerCertificates);
+	require(certs != NULL, CFReadStreamCopyProperty);
+	
+	certs_data = SecCertificateArrayCreateCFDataArray(certs);
+	require(certs_data != NULL, CFReadStreamCopyProperty);
+
+	CFDictionaryAddValue(dict, kSSLClientPropTLSServerCertificateChain, certs_data);
+	CFRelease(certs_data);
+	
+	/* convert error to a CFNumberRef and add it with the kSSLClientPropTLSTrustClientStatus key */
+	error_number = CFNumberCreate(kCFAllocatorDefault, kCFNumberSInt32Type, &error);
+	require(error_number != NULL, CFNumberCreate);
+
+	CFDictionaryAddValue(dict, kSSLClientPropTLSTrustClientStatus, error_number);
+	CFRelease(error_number);
+	
+	/* get the host name from the base URL and add it with the kSSLClientPropTLSServerHostName key */
+	baseURL = nodecache_get_baseURL();
+	host_name = CFURLCopyHostName(baseURL);
+	CFRelease(baseURL);
+	require(host_name != NULL, CFURLCopyHostName);
+	
+	CFDictionaryAddValue(dict, kSSLClientPropTLSServerHostName, host_name);
+	CFRelease(host_name);
+	
+	/* flatten it */
+	theData = CFPropertyListCreateXMLData(kCFAllocatorDefault, dict);
+	require(theData != NULL, CFPropertyListCreateXMLData);
+
+	CFRelease(dict);
+	dict = NULL;
+	
+	/* open a pipe */
+	require(pipe(fd) >= 0, pipe);
+	
+	pid = fork();
+	require (pid >= 0, fork);
+	if ( pid > 0 )
+	{
+		/* parent */
+		size_t length;
+		ssize_t bytes_written;
+		
+		close(fd[0]); /* close read end */
+		fd[0] = -1;
+		length = CFDataGetLength(theData);
+		bytes_written = write(fd[1], CFDataGetBytePtr(theData), length);
+		require(bytes_written == (ssize_t)length, write);
+		
+		close(fd[1]); /* close write end */
+		fd[1] = -1;
+
+		/* Parent waits for child's completion here */
+		while ( (terminated_pid = wait4(pid, (int *)&status, 0, NULL)) < 0 )
+		{
+			/* retry if EINTR, else break out with error */
+			if ( errno != EINTR )
+			{
+				break;
+			}
+		}
+		
+		/* we'll get here when the child completes */
+		if ( (terminated_pid == pid) && (WIFEXITED(status)) )
+		{
+			result = WEXITSTATUS(status) == 0;
+		}
+		else
+		{
+			result = FALSE;
+		}
+		
+		// Did the user confirm the certificate?
+		if (result == TRUE) {
+			// Yes, add them to the global SSL properties dictionary
+			SecAddTrustedCerts(certs);
+		}
+	}
+	else
+	{
+		/* child */
+		close(fd[1]); /* close write end */
+		fd[1] = -1;
+		
+		if ( fd[0] != STDIN_FILENO )
+		{
+			require(dup2(fd[0], STDIN_FILENO) == STDIN_FILENO, dup2);
+			close(fd[0]); /* not needed after dup2 */
+			fd[0] = -1;
+		}
+		
+		require(execle(PRIVATE_CERT_UI_COMMAND, PRIVATE_CERT_UI_COMMAND, (char *) 0, env) >= 0, execl);
+	}
+
+	return ( result );
+
+	/************/
+
+execl:
+dup2:
+write:
+fork:
+	if (fd[0] != -1)
+	{
+		close(fd[0]);
+	}
+	if (fd[1] != -1)
+	{
+		close(fd[1]);
+	}
+pipe:
+CFPropertyListCreateXMLData:
+CFURLCopyHostName:
+CFNumberCreate:
+	if ( certs != NULL )
+	{
+		CFRelease(certs);
+	}
+CFReadStreamCopyProperty:
+	if ( dict != NULL )
+	{
+		CFRelease(dict);
+	}
+CFDictionaryCreateMutable:
+
+	return ( FALSE );
+}
+
+/******************************************************************************/
+
+/*
+ * returns EAGAIN if entire transaction should be retried
+ * returns ECANCELED if the user clicked cancel in the certificate UI
+ * returns EIO if this was not an SSL error
+ */
+static int HandleSSLErrors(CFReadStreamRef readStreamRef)
+{
+	CFStreamError streamError;
+	SInt32 error;
+	int result;
+	
+	result = EIO;
+
+	streamError = CFReadStreamGetError(readStreamRef);
+	if ( streamError.domain == kCFStreamErrorDomainSSL )
+	{
+		error = streamError.error;
+				
+		if ( gSSLPropertiesDict == NULL )
+		{
+			gSSLPropertiesDict = CFDictionaryCreateMutable(kCFAllocatorDefault, 0, &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks);
+			require(gSSLPropertiesDict != NULL, CFDictionaryCreateMutable);
+		}
+		
+		/* if we haven't tried falling back from TLS to SSL and the errror indicates that might work... */
+		if ( (CFDictionaryGetValue(gSSLPropertiesDict, kCFStreamSSLLevel) == NULL) &&
+				(((error <= errSSLProtocol) && (error > errSSLXCertChainInvalid)) ||
+				 ((error <= errSSLCrypto) && (error > errSSLUnknownRootCert)) ||
+				 ((error <= errSSLClosedNoNotify) && (error > errSSLPeerBadCert)) ||
+				 (error == errSSLIllegalParam) ||
+				 ((error <= errSSLPeerAccessDenied) && (error > errSSLLast))) )
+		{
+			/* retry with fall back from TLS to SSL */
+			CFDictionarySetValue(gSSLPropertiesDict, kCFStreamSSLLevel, kCFStreamSocketSecurityLevelSSLv3);
+			result = EAGAIN;
+		}
+		else
+		{
+			switch ( error )
+			{
+				case errSSLCertExpired:
+				case errSSLCertNotYetValid:
+					/* The certificate for this server has expired or is not yet valid */
+					if ( ConfirmCertificate(readStreamRef, error) )
+					{
+						result = EAGAIN;
+					}
+					else
+					{
+						result = ECANCELED;
+					}
+					break;
+					
+				case errSSLBadCert:
+				case errSSLXCertChainInvalid:
+				case errSSLHostNameMismatch:
+					/* The certificate for this server is invalid */
+					if ( ConfirmCertificate(readStreamRef, error) )
+					{
+						result = EAGAIN;
+					}
+					else
+					{
+						result = ECANCELED;
+					}
+					break;
+					
+				case errSSLUnknownRootCert:
+				case errSSLNoRootCert:
+					/* The certificate for this server was signed by an unknown certifying authority */
+					if ( ConfirmCertificate(readStreamRef, error) )
+					{
+						result = EAGAIN;
+					}
+					else
+					{
+						result = ECANCELED;
+					}
+					break;
+					
+				default:
+					result = EIO;
+					break;
+			}
+		}
+	}
+
+CFDictionaryCreateMutable:
+	
+	return ( result );
+}
+
+/******************************************************************************/
+
+/*
+ * returns ETIMEDOUT for server reachability type errors
+ * returns EXIO otherwise
+ * returns EIO if this was not an SSL error
+ */
+
+static int stream_error_to_errno(CFStreamError *streamError)
+{
+	int result = ENXIO;
 	
-	gBasePath = CFURLCopyPath(gBaseURL);
-	if (gBasePath != NULL) {
-		CFStringGetCString(gBasePath, gBasePathStr, MAXPATHLEN, kCFStringEncodingUTF8);
+	if (streamError->domain == kCFStreamErrorDomainPOSIX)
+	{
+		switch (streamError->error) {
+			case EADDRNOTAVAIL:
+			case ENETDOWN:
+			case ETIMEDOUT:
+			case ECONNRESET:
+			case ENETUNREACH:
+			case ECONNREFUSED:
+				/* These errors affect mobility, so return ETIMEDOUT */
+				syslog(LOG_ERR, "stream_error: Posix error %d", (int)streamError->error);
+				result = ETIMEDOUT;
+				break;
+			default:
+				syslog(LOG_ERR, "stream_error: Posix error %d", (int)streamError->error);
+				result = ENXIO;
+				break;
+		}
+	}
+	else if (streamError->domain == kCFStreamErrorDomainNetDB)
+	{
+		switch (streamError->error) {
+			case EAI_NODATA:
+				/* no address associated with host name */
+				syslog(LOG_ERR, "stream_error: NetDB error EAI_NODATA"); 
+				result = ETIMEDOUT;
+				break;
+			default:
+				syslog(LOG_ERR, "stream_error: NetDB error %d", (int)streamError->error);
+				result = ENXIO;
+				break;
+		}			
+	}
+	else {
+		syslog(LOG_ERR, "stream_error: Domain %d Error %d", (int) streamError->domain, (int)streamError->error);
+		result = ENXIO;
 	}
+	return result;
+}
 
-	/* initialize first_read_len variable */
-	get_first_read_len();
+/******************************************************************************/
+
+	/* create the HTTP read stream with CFReadStreamCreateForHTTPRequest */
+	/* turn on automatic redirection */
+	/* add proxies (if any) */
+	/* apply any SSL properties we've already negotiated with the server */
+	/* open the read stream */
 	
-	/* init the X_Source_Id_HeaderValue string BEFORE InitUserAgentHeaderValue */
-	InitXSourceIdHeaderValue();
+	
+	/* set the file position to 0 */
+	/* create a stream from the file */
+	/* create the HTTP read stream with CFReadStreamCreateForStreamedHTTPRequest */
+	/* Note: PUTs cannot be automatically redirected -- see rfc2616 section 10.3.x */
+	/* add proxies (if any) */
+	/* apply any SSL properties we've already negotiated with the server */
+	/* open the read stream */
 
-	/* initialize userAgentHeaderValue */
-	error = InitUserAgentHeaderValue((X_Source_Id_HeaderValue != NULL) && add_mirror_comment);
-	if ( error )
+
+	/* create the HTTP read stream with CFReadStreamCreateForHTTPRequest */
+	/* (conditional) turn on automatic redirection */
+	/* add proxies (if any) */
+	/* apply any SSL properties we've already negotiated with the server */
+	/* open the read stream and handle SSL errors */
+	
+static int open_stream_for_transaction(
+	CFHTTPMessageRef request,	/* -> the request to send */
+	CFReadStreamRef fdStream,	/* -> if not NULL, the file stream */
+	int auto_redirect,			/* -> if TRUE, set kCFStreamPropertyHTTPShouldAutoredirect on stream */
+	int *retryTransaction,		/* -> if TRUE, return EAGAIN on errors when streamError is kCFStreamErrorDomainPOSIX/EPIPE and set retryTransaction to FALSE */ 
+	int wait,					/* -> if TRUE, wait for a connection when gMaxConnections are in use; if FALSE, return EBUSY */
+	struct ReadStreamRec **readStreamRecPtr)	/* <- pointer to the ReadStreamRec in use */
+{
+	int result, error;
+	struct ReadStreamRec *theReadStreamRec;
+	CFReadStreamRef newReadStreamRef;
+	CFSocketNativeHandle sock;
+	CFDataRef sockWrapper = NULL;
+	
+	result = error = 0;
+	sock = -1;
+	*readStreamRecPtr = NULL;
+	
+	/* create the HTTP read stream */
+	if ( fdStream != NULL )
 	{
-		/* not likely to fail, but just in case */
-		exit(error);
+		newReadStreamRef = CFReadStreamCreateForStreamedHTTPRequest(kCFAllocatorDefault, request, fdStream);
+		require(newReadStreamRef != NULL, CFReadStreamCreateForStreamedHTTPRequest);
+	}
+	else
+	{
+		newReadStreamRef = CFReadStreamCreateForHTTPRequest(kCFAllocatorDefault, request);
+		require(newReadStreamRef != NULL, CFReadStreamCreateForHTTPRequest);
 	}
 	
-	/* initialize the gReadStreams array */
-	for ( index = 0; index < (WEBDAV_REQUEST_THREADS + 1); ++index )
+	/* add persistent property */
+	CFReadStreamSetProperty(newReadStreamRef, kCFStreamPropertyHTTPAttemptPersistentConnection, kCFBooleanTrue);
+
+	/* turn on automatic redirection */
+	if ( auto_redirect )
 	{
-		gReadStreams[index].inUse = 0; /* not in use */
-		gReadStreams[index].readStreamRef = NULL; /* no stream */
-		gReadStreams[index].uniqueValue = CFStringCreateWithFormat(kCFAllocatorDefault, NULL, CFSTR("%d"), index); /* unique string */
+		require(CFReadStreamSetProperty(newReadStreamRef, kCFStreamPropertyHTTPShouldAutoredirect, kCFBooleanTrue) != FALSE, SetAutoredirectProperty);
 	}
 
-IllegalURLComponent:
-CFURLCreateAbsoluteURLWithBytes:
-network_update_proxy:
-SCDynamicStoreSetNotificationKeys:
-CFArrayCreate:
-SCDynamicStoreKeyCreateProxies:
-SCDynamicStoreNotifyFileDescriptor:
-SCDynamicStoreCreate:
-pthread_mutex_init:
-pthread_mutexattr_init:
+	/* add proxies (if any) */
+	require_quiet(set_global_stream_properties(newReadStreamRef) == 0, set_global_stream_properties);
+
+	/* apply any SSL properties we've already negotiated with the server */
+	ApplySSLProperties(newReadStreamRef);
+
+	/* get a ReadStreamRec that was not in use */
+	theReadStreamRec = get_ReadStreamRec(wait);
 	
-	return ( error );
+	/* (after unlocking) make sure we got a ReadStreamRec */
+	require_action_quiet(theReadStreamRec != NULL, get_ReadStreamRec, result = EBUSY);
+	
+	/* add the unique property from the ReadStreamRec to newReadStreamRef */
+	require(CFReadStreamSetProperty(newReadStreamRef, CFSTR("WebdavConnectionNumber"), theReadStreamRec->uniqueValue) != FALSE, SetWebdavConnectionNumberProperty);
+	
+	/* open the read stream and handle SSL errors */
+	if ( CFReadStreamOpen(newReadStreamRef) == FALSE )
+	{
+		result = HandleSSLErrors(newReadStreamRef);
+		if ( result != EAGAIN )
+		{
+			CFStreamError streamError;
+			
+			streamError = CFReadStreamGetError(newReadStreamRef);
+			if ( *retryTransaction &&
+				((streamError.domain == kCFStreamErrorDomainPOSIX && streamError.error == EPIPE) ||
+				 (streamError.domain ==  kCFStreamErrorDomainHTTP && streamError.error ==  kCFStreamErrorHTTPConnectionLost)) )
+			{
+				/* if we get a POSIX EPIPE or HTTP Connection Lost error back from the stream, retry the transaction once */
+				syslog(LOG_INFO,"open_stream_for_transaction: CFStreamError: domain %ld, error %lld -- retrying", streamError.domain, (SInt64)streamError.error);
+				*retryTransaction = FALSE;
+				result = EAGAIN;
+			}
+			else
+			{
+				if ( get_connectionstate() == WEBDAV_CONNECTION_UP )
+				{
+					syslog(LOG_ERR,"open_stream_for_transaction: CFStreamError: domain %ld, error %lld", streamError.domain, (int64_t)streamError.error);
+				}
+				set_connectionstate(WEBDAV_CONNECTION_DOWN);
+				result = stream_error_to_errno(&streamError);
+			}
+		}
+		goto CFReadStreamOpen;
+	}
+	
+	/* close and release old read stream */
+	if ( theReadStreamRec->readStreamRef != NULL )
+	{
+		CFReadStreamClose(theReadStreamRec->readStreamRef);
+		CFRelease(theReadStreamRec->readStreamRef);
+	}
+	
+	/* Set SO_NOADDRERR on the socket so we will know about EADDRNOTAVAIL errors ASAP */
+	sockWrapper = (CFDataRef)CFReadStreamCopyProperty(newReadStreamRef, kCFStreamPropertySocketNativeHandle);
+	
+	if (sockWrapper)
+	{
+		CFRange r = {0, sizeof(CFSocketNativeHandle)};
+		CFDataGetBytes(sockWrapper, r, (UInt8 *)&sock);
+		CFRelease(sockWrapper);
+		int flag = 1;
+		setsockopt(sock, SOL_SOCKET, SO_NOADDRERR, &flag, (socklen_t)sizeof(flag));
+	}
+
+	/* save new read stream */
+	theReadStreamRec->readStreamRef = newReadStreamRef;
+	theReadStreamRec->sock = sock;
+	
+	/* return the ReadStreamRec to the caller */
+	*readStreamRecPtr = theReadStreamRec;
+	
+	return ( 0 );
+
+	/**********************/
+
+CFReadStreamOpen:
+SetWebdavConnectionNumberProperty:
+	
+	release_ReadStreamRec(theReadStreamRec);
+	
+get_ReadStreamRec:
+set_global_stream_properties:
+SetAutoredirectProperty:
+	
+	CFRelease(newReadStreamRef);
+	
+CFReadStreamCreateForHTTPRequest:	
+CFReadStreamCreateForStreamedHTTPRequest:
+	
+	*readStreamRecPtr = NULL;
+	if ( result == 0 )
+	{
+		result = EIO;
+	}
+	
+	return ( result );
 }
 
 /******************************************************************************/
 
 /*
- * create_cfurl_from_node
+ * Segmented downloads
  *
- * Creates a CFURL to the node if no name is provided, or to the node's named
- * child if a name is provided.
+ * When the first response to a GET shows a large file that the server will
+ * send in ranges, the rest of the file past the first segment is requested
+ * with Range requests on other connections, one thread per segment. The
+ * original response keeps filling the cache file with the first segment.
+ * Each other segment is written with pwrite into a spill file of its own at
+ * its offset within the segment. The thread finishing the download then
+ * appends each segment to the cache file in order as its bytes arrive.
  *
- * The caller is responsible for releasing the CFURL returned.
+ * So the cache file only ever holds a contiguous prefix of the file, and its
+ * size is the watermark the kernel waits on while UF_NODUMP is set, just as
+ * with a single stream.
+ */
+
+struct download_segment
+{
+	struct download_segments *segments;	/* the download this segment belongs to */
+	off_t start;						/* offset of the segment's first byte in the file */
+	off_t end;							/* offset just past the segment's last byte */
+	off_t received;						/* bytes of the segment in spill_fd */
+	int spill_fd;						/* the spill file, or -1 */
+	int done;							/* TRUE when no thread is downloading the segment */
+	int error;							/* the segment's thread's error if done */
+};
+
+struct download_segments
+{
+	pthread_mutex_t lock;				/* protects the fields below and the segments' received, spill_fd, done and error */
+	pthread_cond_t cond;				/* broadcast when a segment makes progress or is done */
+	int refcount;						/* the thread finishing the download plus running segment threads */
+	int abort;							/* TRUE when the segment threads should give up */
+	/* these fields are not changed after download_segments_create */
+	uid_t uid;							/* uid of the user who opened the file */
+	CFURLRef urlRef;					/* the file's URL */
+	CFStringRef validator;				/* the If-Range value: a strong ETag, or the Last-Modified date */
+	struct node_entry *node;			/* the node being downloaded; only used by the thread that owns it */
+	char *entity_tag;					/* the strong ETag as a C string, or NULL (see nodecache_copy_file_blocks) */
+	int count;							/* number of segments; segment 0 comes from the original response */
+	struct download_segment segment[WEBDAV_MAX_DOWNLOAD_SEGMENTS];
+};
+
+/******************************************************************************/
+
+static void download_segments_release(struct download_segments *segments)
+{
+	int index, refcount;
+	
+	pthread_mutex_lock(&segments->lock);
+	refcount = --segments->refcount;
+	pthread_mutex_unlock(&segments->lock);
+	
+	if ( refcount == 0 )
+	{
+		for ( index = 0; index < segments->count; ++index )
+		{
+			if ( segments->segment[index].spill_fd >= 0 )
+			{
+				close(segments->segment[index].spill_fd);
+			}
+		}
+		CFRelease(segments->urlRef);
+		CFRelease(segments->validator);
+		free(segments->entity_tag);
+		pthread_cond_destroy(&segments->cond);
+		pthread_mutex_destroy(&segments->lock);
+		free(segments);
+	}
+}
+
+/******************************************************************************/
+
+/*
+ * download_segments_abort tells the segment threads to give up and drops the
+ * caller's reference.
+ */
+static void download_segments_abort(struct download_segments *segments)
+{
+	pthread_mutex_lock(&segments->lock);
+	segments->abort = TRUE;
+	pthread_mutex_unlock(&segments->lock);
+	
+	download_segments_release(segments);
+}
+
+/******************************************************************************/
+
+/*
+ * download_segments_create returns the segments of a file whose response
+ * allows a segmented download, or NULL if it doesn't: the file is too small,
+ * the server doesn't accept byte ranges, the body is content-encoded, or
+ * there's no validator to make sure every range comes from the same file.
  */
-static CFURLRef create_cfurl_from_node(
-	struct node_entry *node,
-	char *name,
-	size_t name_length)
+static struct download_segments *download_segments_create(
+	uid_t uid,						/* -> uid of the user making the request */
+	CFHTTPMessageRef request,		/* -> the GET request */
+	CFHTTPMessageRef response,		/* -> the 200 response to it */
+	struct node_entry *node)		/* -> the node being downloaded */
 {
-	CFURLRef tempUrlRef, baseURL;
-	CFURLRef urlRef;
-	char *node_path;
-	bool pathHasRedirection;
-	int error;
+	struct download_segments *segments;
+	CFStringRef headerRef;
+	CFRange range;
+	char lengthString[32];
+	off_t length, segment_size;
+	int index;
 	
-	urlRef = NULL;
-	pathHasRedirection = false;
+	segments = NULL;
+	require_quiet(gDownloadSegments > 1, no_segments);
 	
-	/*
-	 * Get the UT8 path (not percent escaped) from the root to the node (if any).
-	 * If the path is returned and it is to a directory, it will end with a slash.
-	 */
-	error = nodecache_get_path_from_node(node, &pathHasRedirection, &node_path);
-	require_noerr_quiet(error, nodecache_get_path_from_node);
-
-	/* append the name (if any) */
-	if ( name != NULL && name_length != 0 )
+	/* the server must accept byte ranges... */
+	headerRef = CFHTTPMessageCopyHeaderFieldValue(response, CFSTR("Accept-Ranges"));
+	require_quiet(headerRef != NULL, no_segments);
+	range = CFStringFind(headerRef, CFSTR("bytes"), kCFCompareCaseInsensitive);
+	CFRelease(headerRef);
+	require_quiet(range.location != kCFNotFound, no_segments);
+	
+	/* ...of the entity itself, not of an encoding of it */
+	headerRef = CFHTTPMessageCopyHeaderFieldValue(response, CFSTR("Content-Encoding"));
+	if ( headerRef != NULL )
 	{
-		strncat(node_path, name, name_length);
+		CFRelease(headerRef);
+		goto no_segments;
 	}
 	
-	/* is there any relative path? */
-	if ( *node_path != '\0' )
+	/* and the file must be large enough to be worth it */
+	headerRef = CFHTTPMessageCopyHeaderFieldValue(response, CFSTR("Content-Length"));
+	require_quiet(headerRef != NULL, no_segments);
+	length = 0;
+	if ( CFStringGetCString(headerRef, lengthString, sizeof(lengthString), kCFStringEncodingASCII) )
 	{
-		CFStringRef stringRef;
-		CFStringRef	escapedPathRef;
-		
-		escapedPathRef = NULL;
-		
-		/* convert the relative path to a CFString */
-		stringRef = CFStringCreateWithCString(kCFAllocatorDefault, node_path, kCFStringEncodingUTF8);
-		require_string(stringRef != NULL, CFStringCreateWithCString, "name was not legal UTF8");
-		
-		/* create the URL */
-		if (pathHasRedirection == true) {
-			escapedPathRef = CFURLCreateStringByAddingPercentEscapes(kCFAllocatorDefault, stringRef, NULL, CFSTR(";?"), kCFStringEncodingUTF8);
-			require(escapedPathRef != NULL, CFURLCreateStringByAddingPercentEscapes);			
-			
-			// this path already has a base URL since it contains a redirected node
-			urlRef = CFURLCreateWithString(kCFAllocatorDefault, escapedPathRef, NULL);
-
-			if (urlRef == NULL)
-				logDebugCFString("create_cfurl_from_node: CFURLCreateWithString error:", escapedPathRef);
-			
-			require(urlRef != NULL, CFURLCreateWithString);
-		}
-		else {
-			/*
-			 * Then percent escape everything that CFURLCreateStringByAddingPercentEscapes()
-			 * considers illegal URL characters plus the characters ";" and "?" which are
-			 * not legal pchar (see rfc2396) characters, and ":" so that names in the root
-			 * directory do not look like absolute URLs with some weird scheme.
-			 */
-			escapedPathRef = CFURLCreateStringByAddingPercentEscapes(kCFAllocatorDefault, stringRef, NULL, CFSTR(":;?"), kCFStringEncodingUTF8);
-			require(escapedPathRef != NULL, CFURLCreateStringByAddingPercentEscapes);
-
-			baseURL = nodecache_get_baseURL();
-			urlRef = CFURLCreateWithString(kCFAllocatorDefault, escapedPathRef, baseURL);
-			CFRelease(baseURL);
-			require(urlRef != NULL, CFURLCreateWithString);			
-		}
-		
-		/* and then make an absolute copy of it */
-		tempUrlRef = urlRef;
-		urlRef = CFURLCopyAbsoluteURL(tempUrlRef);
-		
-		CFRelease(tempUrlRef);
-CFURLCreateWithString:
-		if (escapedPathRef != NULL)
-			CFRelease(escapedPathRef);
-CFURLCreateStringByAddingPercentEscapes:	
-		CFRelease(stringRef);
-CFStringCreateWithCString:
-		;
+		length = strtoll(lengthString, NULL, 10);
 	}
-	else
+	CFRelease(headerRef);
+	require_quiet(length >= WEBDAV_SEGMENTED_DOWNLOAD_MIN, no_segments);
+	
+	segments = calloc(1, sizeof(struct download_segments));
+	require(segments != NULL, calloc_segments);
+	
+	/* If-Range needs a strong entity tag or a date */
+	segments->validator = CFHTTPMessageCopyHeaderFieldValue(response, CFSTR("ETag"));
+	if ( (segments->validator != NULL) && CFStringHasPrefix(segments->validator, CFSTR("W/")) )
 	{
-		/* no relative path -- use the base URL */
-		urlRef = nodecache_get_baseURL();
+		CFRelease(segments->validator);
+		segments->validator = NULL;
 	}
-
-	free(node_path);
-
-nodecache_get_path_from_node:
+	if ( segments->validator == NULL )
+	{
+		segments->validator = CFHTTPMessageCopyHeaderFieldValue(response, CFSTR("Last-Modified"));
+	}
+	require_quiet(segments->validator != NULL, validator);
+	
+	segments->urlRef = CFHTTPMessageCopyRequestURL(request);
+	require(segments->urlRef != NULL, CFHTTPMessageCopyRequestURL);
+	
+	require_noerr(pthread_mutex_init(&segments->lock, NULL), pthread_mutex_init);
+	require_noerr(pthread_cond_init(&segments->cond, NULL), pthread_cond_init);
+	
+	segments->refcount = 1;
+	segments->uid = uid;
+	segments->node = node;
+	if ( !CFStringHasPrefix(segments->validator, CFSTR("W/")) && (CFStringFind(segments->validator, CFSTR("\""), 0).location != kCFNotFound) )
+	{
+		/* it's an entity tag, so blocks read out of band with it can be used */
+		CFIndex len = CFStringGetMaximumSizeForEncoding(CFStringGetLength(segments->validator), kCFStringEncodingUTF8) + 1;
 		
-	return ( urlRef );
-}
-
-/******************************************************************************/
-
-static int translate_status_to_error(UInt32 statusCode)
-{
-	int result;
-	uint64_t code = statusCode;
+		segments->entity_tag = malloc(len);
+		if ( (segments->entity_tag != NULL) && !CFStringGetCString(segments->validator, segments->entity_tag, len, kCFStringEncodingUTF8) )
+		{
+			free(segments->entity_tag);
+			segments->entity_tag = NULL;
+		}
+	}
 	
-	/* switch by Nxx range */
-	switch ( statusCode / 100 )
+	/* equal segments, in multiples of BODY_BUFFER_SIZE */
+	segment_size = (length + gDownloadSegments - 1) / gDownloadSegments;
+	segment_size = (segment_size + BODY_BUFFER_SIZE - 1) & ~((off_t)BODY_BUFFER_SIZE - 1);
+	for ( index = 0; (index < gDownloadSegments) && ((index * segment_size) < length); ++index )
 	{
-		case 1:	/* Informational 1xx */
-			syslog(LOG_ERR,"unexpected statusCode %llu", code);
-			result = ENOENT;	/* CFNetwork eats 1xx responses so this should never happen */
-			break;
-		case 2:	/* Successful 2xx */
-			result = 0;
-			break;
-		case 3:	/* Redirection 3xx */
-			syslog(LOG_ERR,"unexpected statusCode %llu", code);
-			result = ENOENT;
-			break;
-		case 4:	/* Client Error 4xx */
-			switch ( statusCode )
-			{
-				case 401:	/* 401 Unauthorized */
-				case 402:	/* Payment required */
-				case 403:	/* Forbidden */
-				case 405:   /* 405 Method Not Allowed.  A few DAV servers return when folder isn't writable 
-							 * <rdar://problem/4294372> MSG: Error message (filename too long) displayed when that's not the issue
-							 */
-					/* 
-					 * We return EPERM here so that Finder exhibits the correct behavior.
-					 * Returning EAUTH can result in strange behavior such as files 
-					 * dissappearing, as seen in:
-					 * <rdar://problem/6140701> Invalid credentials leads to scary user experience
-					 * 
-					 */
-					syslog(LOG_DEBUG,"unexpected statusCode %llu", code);
-					result = EPERM;
-					break;
-				case 407:	/* 407 Proxy Authentication Required */
-					syslog(LOG_ERR,"unexpected statusCode %llu", code);
-					result = EAUTH;
-					break;
-				case 404:	/* Not Found */
-				case 409:	/* Conflict (path prefix does not exist) */
-				case 410:	/* Gone */
-					result = ENOENT;
-					break;
-				case 413:	/* Request Entity Too Large (this server doesn't allow large PUTs) */
-					result = EFBIG;
-					syslog(LOG_ERR,"unexpected statusCode %llu", code);
-					break;
-				case 414:	/* Request URI Too Long */
-					syslog(LOG_ERR,"unexpected statusCode %llu", code);
-					result = ENAMETOOLONG;
-					break;
-				case 416:	/* Requested Range Not Available */
-					syslog(LOG_DEBUG,"unexpected statusCode %llu", code);
-					result = EINVAL;
-					break;
-				case 423:	/* Locked (WebDAV) */
-				case 424:	/* Failed Dependency (WebDAV) (EBUSY when a directory cannot be MOVE'd) */
-					syslog(LOG_ERR,"unexpected statusCode %llu", code);
-					result = EBUSY;
-					break;
-				default:
-					syslog(LOG_ERR,"unexpected statusCode %llu", code);
-					result = EINVAL;	/* unexpected */
-					break;
-			}
-			break;
-		case 5:	/* Server Error 5xx */
-			if ( statusCode == 507 )	/* Insufficient Storage (WebDAV) */
-			{
-				syslog(LOG_ERR,"unexpected statusCode %llu", code);
-				result = ENOSPC;
-			}
-			else
-			{
-				syslog(LOG_ERR,"unexpected statusCode %llu", code);
-				result = ENOENT;	/* unexpected */
-			}
-			break;
-		default: /* only the 1xx through 5xx ranges are defined */
-			syslog(LOG_ERR,"unexpected statusCode %llu", code);
-			result = EIO;
-			break;
+		struct download_segment *segment = &segments->segment[index];
+		
+		segment->segments = segments;
+		segment->start = index * segment_size;
+		segment->end = MIN(segment->start + segment_size, length);
+		segment->spill_fd = -1;
+		if ( index != 0 )
+		{
+			require_noerr_quiet(get_cachefile(&segment->spill_fd), get_cachefile);
+			(void) ftruncate(segment->spill_fd, 0LL);
+		}
+		segments->count = index + 1;
 	}
 	
-	return ( result );
+	/* the first segment has to hold what was already read */
+	require_quiet(segments->segment[0].end >= lseek(node->file_fd, 0LL, SEEK_END), get_cachefile);
+	
+	return ( segments );
+	
+	/**********************/
+	
+get_cachefile:
+	/* download_segments_release closes the spill files */
+	download_segments_release(segments);
+	return ( NULL );
+	
+pthread_cond_init:
+	pthread_mutex_destroy(&segments->lock);
+pthread_mutex_init:
+	CFRelease(segments->urlRef);
+CFHTTPMessageCopyRequestURL:
+	CFRelease(segments->validator);
+validator:
+	free(segments);
+calloc_segments:
+no_segments:
+	
+	return ( NULL );
 }
 
 /******************************************************************************/
 
-/* returns TRUE if SSL properties were correctly applied (or were not needed) */
-static int ApplySSLProperties(CFReadStreamRef readStreamRef)
+/*
+ * download_segment_copy_blocks copies the blocks of a segment that were
+ * already read out of band into its spill file, so they don't have to be
+ * downloaded again. It dereferences segments->node, so it must only be called
+ * by the thread that owns the node -- never by a segment thread, which can
+ * outlive the download.
+ */
+static void download_segment_copy_blocks(struct download_segment *segment)
 {
-	int result = TRUE;
+	struct download_segments *segments = segment->segments;
+	off_t offset;
+	off_t copied;
 	
-	if ( gSSLPropertiesDict != NULL ) 
+	offset = segment->start + segment->received;
+	if ( (segments->entity_tag != NULL) && (offset < segment->end) )
 	{
-		result = (CFReadStreamSetProperty(readStreamRef, kCFStreamPropertySSLSettings, gSSLPropertiesDict) == TRUE);
+		copied = nodecache_copy_file_blocks(segments->node, segments->entity_tag, offset, segment->end,
+			segment->spill_fd, offset - segment->start);
+		if ( copied != 0 )
+		{
+			pthread_mutex_lock(&segments->lock);
+			segment->received += copied;
+			pthread_cond_broadcast(&segments->cond);
+			pthread_mutex_unlock(&segments->lock);
+		}
 	}
-	
-	return ( result );
 }
 
 /******************************************************************************/
 
 /*
- * get_ReadStreamRec
- *
- * Tries to return a ReadStreamRec that's not in use and open. If that's not
- * possible, returns the first ReadStreamRec that's not in use and closed.
+ * download_segment downloads the rest of one segment into its spill file with
+ * a Range request. It's run by the segment's thread and, if that fails, once
+ * more by the thread finishing the download. It doesn't touch segments->node.
  */
-static struct ReadStreamRec *get_ReadStreamRec(void)
+static int download_segment(
+	struct download_segment *segment,	/* -> the segment to download */
+	int wait)							/* -> if TRUE, wait for a connection if none is free */
 {
-	int index;
-	struct ReadStreamRec *result;
-	int mutexerror;
+	struct download_segments *segments = segment->segments;
+	CFHTTPMessageRef message;
+	CFHTTPMessageRef responseMessage;
+	CFTypeRef theResponsePropertyRef;
+	CFStringRef headerRef;
+	struct ReadStreamRec *readStreamRecPtr;
+	UInt8 *buffer;
+	CFIndex bytesRead;
+	off_t offset;
+	UInt32 auth_generation;
+	int retryTransaction;
+	int abort;
+	int error;
 	
-	result = NULL;
+	error = 0;
+	buffer = NULL;
+	readStreamRecPtr = NULL;
+	responseMessage = NULL;
 	
-	/* grab gNetworkGlobals_lock */
-	mutexerror = pthread_mutex_lock(&gNetworkGlobals_lock);
-	require_noerr_action(mutexerror, pthread_mutex_lock, webdav_kill(-1));
+	/* only one thread downloads a segment at a time, so received is stable */
+	offset = segment->start + segment->received;
+	if ( offset >= segment->end )
+	{
+		return ( 0 );
+	}
+	
+	message = CFHTTPMessageCreateRequest(kCFAllocatorDefault, CFSTR("GET"), segments->urlRef, kCFHTTPVersion1_1);
+	require_action(message != NULL, CFHTTPMessageCreateRequest, error = EIO);
+	
+	if (gServerIdent & WEBDAV_MICROSOFT_IIS_SERVER) {
+		/* translate flag and no-cache only for Microsoft IIS Server */
+		CFHTTPMessageSetHeaderFieldValue(message, CFSTR("translate"), CFSTR("f"));
+		CFHTTPMessageSetHeaderFieldValue(message, CFSTR("Pragma"), CFSTR("no-cache"));
+	}
+	CFHTTPMessageSetHeaderFieldValue(message, CFSTR("User-Agent"), userAgentHeaderValue);
+	if ( X_Source_Id_HeaderValue != NULL )
+	{
+		CFHTTPMessageSetHeaderFieldValue(message, CFSTR("X-Source-Id"), X_Source_Id_HeaderValue);
+	}
+	add_cookie_headers(message, segments->urlRef);
+	CFHTTPMessageSetHeaderFieldValue(message, CFSTR("Accept"), CFSTR("*/*"));
+	
+	/* ask for the rest of the segment, but only if the file hasn't changed */
+	headerRef = CFStringCreateWithFormat(kCFAllocatorDefault, NULL, CFSTR("bytes=%qd-%qd"), offset, segment->end - 1);
+	require_action(headerRef != NULL, CFStringCreateWithFormat, error = ENOMEM);
+	CFHTTPMessageSetHeaderFieldValue(message, CFSTR("Range"), headerRef);
+	CFRelease(headerRef);
+	CFHTTPMessageSetHeaderFieldValue(message, CFSTR("If-Range"), segments->validator);
+	
+	/* the credentials were just used for the original request */
+	auth_generation = 0;
+	error = authcache_apply(segments->uid, message, 0, NULL, &auth_generation);
+	require_noerr_quiet(error, authcache_apply);
 	
-	for ( index = 0; index < (WEBDAV_REQUEST_THREADS + 1); ++index )
+	retryTransaction = FALSE;
+	error = open_stream_for_transaction(message, NULL, TRUE, &retryTransaction, wait, &readStreamRecPtr);
+	require_noerr_quiet(error, open_stream_for_transaction);
+	
+	buffer = body_buffer_get();
+	require_action(buffer != NULL, malloc_buffer, error = ENOMEM);
+	
+	bytesRead = CFReadStreamRead(readStreamRecPtr->readStreamRef, buffer, MIN(BODY_BUFFER_SIZE, segment->end - offset));
+	require_action(bytesRead >= 0, CFReadStreamRead, error = EIO);
+	
+	/* it must be the range asked for */
+	theResponsePropertyRef = CFReadStreamCopyProperty(readStreamRecPtr->readStreamRef, kCFStreamPropertyHTTPResponseHeader);
+	require_action(theResponsePropertyRef != NULL, GetResponseHeader, error = EIO);
+	responseMessage = *((CFHTTPMessageRef*)((void*)&theResponsePropertyRef));
+	require_action_quiet(CFHTTPMessageGetResponseStatusCode(responseMessage) == 206, GetResponseHeader, error = EIO);
+	headerRef = CFHTTPMessageCopyHeaderFieldValue(responseMessage, CFSTR("Content-Range"));
+	require_action(headerRef != NULL, GetResponseHeader, error = EIO);
 	{
-		if ( !gReadStreams[index].inUse )
+		char contentRange[64];
+		char expected[32];
+		
+		snprintf(expected, sizeof(expected), "bytes %qd-", (long long)offset);
+		if ( !CFStringGetCString(headerRef, contentRange, sizeof(contentRange), kCFStringEncodingASCII) ||
+			 (strncasecmp(contentRange, expected, strlen(expected)) != 0) )
 		{
-			/* found one not in use */
-			
-			/* if it still looks open, grab it */
-			if ( gReadStreams[index].readStreamRef != NULL )
-			{
-				result = &gReadStreams[index]; /* get pointer to it */
-				result->inUse = TRUE;	/* mark it in use */
-				break;
-			}
-			else if ( result == NULL )
-			{
-				/* else... keep track of the first closed one in case we don't find an open one */
-				result = &gReadStreams[index];
-			}
+			error = EIO;
+		}
+		CFRelease(headerRef);
+	}
+	require_noerr_quiet(error, GetResponseHeader);
+	
+	/* write the segment into the spill file as it arrives */
+	while ( bytesRead > 0 )
+	{
+		require_action(pwrite(segment->spill_fd, buffer, (size_t)bytesRead, offset - segment->start) == (ssize_t)bytesRead, pwrite, error = EIO);
+		offset += bytesRead;
+		
+		pthread_mutex_lock(&segments->lock);
+		segment->received = offset - segment->start;
+		abort = segments->abort;
+		pthread_cond_broadcast(&segments->cond);
+		pthread_mutex_unlock(&segments->lock);
+		
+		require_action_quiet(!abort, aborted, error = ECANCELED);
+		
+		if ( offset >= segment->end )
+		{
+			break;
+		}
+		bytesRead = CFReadStreamRead(readStreamRecPtr->readStreamRef, buffer, MIN(BODY_BUFFER_SIZE, segment->end - offset));
+	}
+	if ( bytesRead < 0 )
+	{
+		CFStreamError streamError;
+		
+		streamError = CFReadStreamGetError(readStreamRecPtr->readStreamRef);
+		syslog(LOG_ERR,"download_segment: CFStreamError: domain %ld, error %lld", streamError.domain, (SInt64)streamError.error);
+	}
+	require_action(offset >= segment->end, CFReadStreamRead, error = EIO);
+	
+	/* the whole range was read, so the connection can be reused unless the server is closing it */
+	readStreamRecPtr->connectionClose = FALSE;
+	headerRef = CFHTTPMessageCopyHeaderFieldValue(responseMessage, CFSTR("Connection"));
+	if ( headerRef != NULL )
+	{
+		if ( CFStringCompare(headerRef, CFSTR("close"), kCFCompareCaseInsensitive) == kCFCompareEqualTo )
+		{
+			readStreamRecPtr->connectionClose = TRUE;
 		}
+		CFRelease(headerRef);
+	}
+	if ( readStreamRecPtr->connectionClose )
+	{
+		CFReadStreamClose(readStreamRecPtr->readStreamRef);
+		CFRelease(readStreamRecPtr->readStreamRef);
+		readStreamRecPtr->readStreamRef = NULL;
 	}
+	release_ReadStreamRec(readStreamRecPtr);
 	
-	if ( result != NULL )
+	CFRelease(responseMessage);
+	body_buffer_put(buffer, BODY_BUFFER_SIZE);
+	CFRelease(message);
+	
+	return ( 0 );
+	
+	/**********************/
+	
+aborted:
+pwrite:
+GetResponseHeader:
+CFReadStreamRead:
+	
+	if ( responseMessage != NULL )
 	{
-		/* should always happen */
-		result->inUse = TRUE;	/* mark it in use */
+		CFRelease(responseMessage);
 	}
-
-	/* release gNetworkGlobals_lock */
-	mutexerror = pthread_mutex_unlock(&gNetworkGlobals_lock);
-	require_noerr_action(mutexerror, pthread_mutex_unlock, webdav_kill(-1));
-
-pthread_mutex_unlock:
-pthread_mutex_lock:
-
-	return ( result );
+	body_buffer_put(buffer, BODY_BUFFER_SIZE);
+	
+malloc_buffer:
+	
+	/* close and release the read stream on errors */
+	CFReadStreamClose(readStreamRecPtr->readStreamRef);
+	CFRelease(readStreamRecPtr->readStreamRef);
+	readStreamRecPtr->readStreamRef = NULL;
+	release_ReadStreamRec(readStreamRecPtr);
+	
+open_stream_for_transaction:
+authcache_apply:
+CFStringCreateWithFormat:
+	
+	CFRelease(message);
+	
+CFHTTPMessageCreateRequest:
+	
+	return ( error );
 }
 
 /******************************************************************************/
 
-/*
- * release_ReadStreamRec
- *
- * Release a ReadStreamRec.
- */
-static void release_ReadStreamRec(struct ReadStreamRec *theReadStreamRec)
+static void *download_segment_thread(void *arg)
 {
-	int mutexerror;
+	struct download_segment *segment = (struct download_segment *)arg;
+	struct download_segments *segments = segment->segments;
+	int error;
 	
-	/* grab gNetworkGlobals_lock */
-	mutexerror = pthread_mutex_lock(&gNetworkGlobals_lock);
-	require_noerr_action(mutexerror, pthread_mutex_lock, webdav_kill(-1));
+	/* don't hold up requests for a connection -- if none is free, this thread's caller downloads the segment */
+	error = download_segment(segment, FALSE);
 	
-	/* release theReadStreamRec */
-	theReadStreamRec->inUse = FALSE;
+	pthread_mutex_lock(&segments->lock);
+	segment->error = error;
+	segment->done = TRUE;
+	pthread_cond_broadcast(&segments->cond);
+	pthread_mutex_unlock(&segments->lock);
 	
-	/* release gNetworkGlobals_lock */
-	mutexerror = pthread_mutex_unlock(&gNetworkGlobals_lock);
-	require_noerr_action(mutexerror, pthread_mutex_unlock, webdav_kill(-1));
-
-pthread_mutex_unlock:
-pthread_mutex_lock:
-
-	return;
+	download_segments_release(segments);
+	
+	pthread_mutex_lock(&gNetworkGlobals_lock);
+	--gSegmentThreads;
+	pthread_mutex_unlock(&gNetworkGlobals_lock);
+	
+	return ( NULL );
 }
 
 /******************************************************************************/
 
 /*
- * SecAddTrustedCerts
- *
- * Adds trusted SecCertificateRefs to our global SSL properties dictionary
+ * download_segments_start starts a thread for each segment after the first,
+ * after copying any blocks already read out of band into its spill file.
+ * A segment whose thread can't be started, because WEBDAV_MAX_SEGMENT_THREADS
+ * are already running or pthread_create fails, is marked done with an error,
+ * so download_segments_assemble downloads it itself.
  */
-static void SecAddTrustedCerts(CFArrayRef certs)
+static void download_segments_start(struct download_segments *segments)
 {
-	SecCertificateRef certRef;
-	const void *certPtr;
-	CFMutableArrayRef newCertArr, incomingCerts;
-	CFArrayRef existingCertArr;
-	CFIndex i, count;
-	
-	require(certs != NULL, out);
-	require(gSSLPropertiesDict != NULL, out);
-	
-	incomingCerts = NULL;
-	
-	// Make a mutable copy of incoming certs
-	incomingCerts = CFArrayCreateMutableCopy(kCFAllocatorDefault, 0, certs);
-	require(incomingCerts != NULL, out);
-	
-	// Any existing trusted certificates?
-	existingCertArr = CFDictionaryGetValue(gSSLPropertiesDict, _kCFStreamSSLTrustedLeafCertificates);
-	
+	pthread_attr_t attr;
+	pthread_t thread;
+	int index;
+	int error;
 	
-	if (existingCertArr == NULL) {
-		// Add our copy of incoming certs to the dictionary
-		CFDictionarySetValue(gSSLPropertiesDict, _kCFStreamSSLTrustedLeafCertificates, incomingCerts);
+	error = pthread_attr_init(&attr);
+	if ( error == 0 )
+	{
+		error = pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
 	}
-	else {
-		// Copy old certificates
-		newCertArr = CFArrayCreateMutableCopy(kCFAllocatorDefault, 0, existingCertArr);
-		require(newCertArr != NULL, MallocNewCerts);
+	
+	for ( index = 1; index < segments->count; ++index )
+	{
+		struct download_segment *segment = &segments->segment[index];
+		int started = FALSE;
 		
-		// Remove old certificates
-		CFDictionaryRemoveValue(gSSLPropertiesDict, _kCFStreamSSLTrustedLeafCertificates);
-
-		// Add any new certs
-		count = CFArrayGetCount(incomingCerts);
-
-		for (i = 0; i < count; ++i)
+		/* no thread is running yet, so this is done while the caller owns the node */
+		download_segment_copy_blocks(segment);
+		
+		/* each segment thread uses one of the ReadStreamRecs set aside for them */
+		pthread_mutex_lock(&gNetworkGlobals_lock);
+		if ( (error == 0) && (gSegmentThreads < WEBDAV_MAX_SEGMENT_THREADS) )
 		{
-			certPtr = CFArrayGetValueAtIndex(incomingCerts, i);
-			if (certPtr == NULL)
-				continue;
+			++gSegmentThreads;
+			started = TRUE;
+		}
+		pthread_mutex_unlock(&gNetworkGlobals_lock);
+		
+		if ( started )
+		{
+			pthread_mutex_lock(&segments->lock);
+			++segments->refcount;
+			pthread_mutex_unlock(&segments->lock);
 			
-			certRef = *((SecCertificateRef*)((void*)&certPtr)); /* ugly but it works */
-	
-			if (CFArrayContainsValue(newCertArr, CFRangeMake(0, CFArrayGetCount(newCertArr)), certRef) == false) {
+			if ( pthread_create(&thread, &attr, download_segment_thread, segment) != 0 )
+			{
+				pthread_mutex_lock(&segments->lock);
+				--segments->refcount;
+				pthread_mutex_unlock(&segments->lock);
 				
-				// Don't have this cert yet, so add it
-				CFArrayAppendValue(newCertArr, certRef);
+				pthread_mutex_lock(&gNetworkGlobals_lock);
+				--gSegmentThreads;
+				pthread_mutex_unlock(&gNetworkGlobals_lock);
+				
+				started = FALSE;
 			}
 		}
 		
-		// Now set the new array
-		CFDictionarySetValue(gSSLPropertiesDict, _kCFStreamSSLTrustedLeafCertificates, newCertArr);
-	}
-
-	if (incomingCerts != NULL) {
-		// Release our reference from the Copy
-		CFRelease(incomingCerts);
+		if ( !started )
+		{
+			pthread_mutex_lock(&segments->lock);
+			segment->error = EAGAIN;
+			segment->done = TRUE;
+			pthread_mutex_unlock(&segments->lock);
+		}
 	}
-out:
-MallocNewCerts:	
-	return;
-}
-
-/******************************************************************************/
-
-/*
- * SecCertificateCreateCFData
- *
- * Creates a CFDataRef from a SecCertificateRef.
- */
-static CFDataRef SecCertificateCreateCFData(SecCertificateRef cert)
-{
-	CFDataRef data;
-
-	data = SecCertificateCopyData(cert);
-
-	if (data == NULL)
-		syslog(LOG_ERR, "%s : SecCertificateCopyData returned NULL\n", __FUNCTION__);
- 
-	return (data);
+	
+	pthread_attr_destroy(&attr);
 }
 
 /******************************************************************************/
 
 /*
- * SecCertificateArrayCreateCFDataArray
- *
- * Convert a CFArray[SecCertificate] to CFArray[CFData].
+ * download_segments_assemble appends the segments after the first to the
+ * cache file in order, waiting for their bytes to arrive. It gives up if the
+ * download is terminated or a segment can't be downloaded even on this
+ * thread. It drops the caller's reference to segments.
  */
-static CFArrayRef SecCertificateArrayCreateCFDataArray(CFArrayRef certs)
+static int download_segments_assemble(
+	struct node_entry *node,
+	struct download_segments *segments)
 {
-	CFMutableArrayRef array;
-	CFIndex count;
-	int i;
-	const void *certRef;
-
-	count = CFArrayGetCount(certs);
-	array = CFArrayCreateMutable(NULL, count, &kCFTypeArrayCallBacks);
-	require(array != NULL, CFArrayCreateMutable);
+	UInt8 *buffer;
+	int index;
+	int error;
 	
-	for (i = 0; i < count; ++i)
+	error = 0;
+	buffer = body_buffer_get();
+	require_action(buffer != NULL, malloc_buffer, error = ENOMEM);
+	
+	for ( index = 1; (index < segments->count) && (error == 0); ++index )
 	{
-		SecCertificateRef cert;
-		CFDataRef data;
-
-		certRef = CFArrayGetValueAtIndex(certs, i);
-		cert = *((SecCertificateRef*)((void*)&certRef)); /* ugly but it works */
-		require(cert != NULL, CFArrayGetValueAtIndex);
+		struct download_segment *segment = &segments->segment[index];
+		off_t copied, received;
+		int done, retried;
 		
-		data = SecCertificateCreateCFData(cert);
-		require(data != NULL, SecCertificateCreateCFData);
+		copied = 0;
+		retried = FALSE;
+		while ( segment->start + copied < segment->end )
+		{
+			pthread_mutex_lock(&segments->lock);
+			while ( (segment->received == copied) && !segment->done &&
+				((node->file_status & WEBDAV_DOWNLOAD_TERMINATED) == 0) )
+			{
+				struct timeval now;
+				struct timespec timeout;
+				
+				/* the closer doesn't signal us, so check for termination now and then */
+				gettimeofday(&now, NULL);
+				timeout.tv_sec = now.tv_sec + 1;
+				timeout.tv_nsec = now.tv_usec * 1000;
+				(void) pthread_cond_timedwait(&segments->cond, &segments->lock, &timeout);
+			}
+			received = segment->received;
+			done = segment->done;
+			pthread_mutex_unlock(&segments->lock);
+			
+			/* were we asked to terminate the download? */
+			require_action_quiet((node->file_status & WEBDAV_DOWNLOAD_TERMINATED) == 0, terminated, error = EIO);
+			
+			/* append what has arrived to the cache file */
+			while ( copied < received )
+			{
+				size_t count = (size_t)MIN(BODY_BUFFER_SIZE, received - copied);
+				
+				require_action(pread(segment->spill_fd, buffer, count, copied) == (ssize_t)count, pread, error = EIO);
+				require_action(write(node->file_fd, buffer, count) == (ssize_t)count, write, error = EIO);
+				copied += count;
+			}
+			requestqueue_download_progress(node);
+			
+			if ( done && (segment->start + copied < segment->end) )
+			{
+				/* the segment's thread failed -- try the rest of it once on this thread */
+				require_action(!retried, download_segment, error = EIO);
+				retried = TRUE;
+				pthread_mutex_lock(&segments->lock);
+				segment->done = FALSE;
+				pthread_mutex_unlock(&segments->lock);
+				
+				download_segment_copy_blocks(segment);
+				error = download_segment(segment, TRUE);
+				
+				pthread_mutex_lock(&segments->lock);
+				segment->error = error;
+				segment->done = TRUE;
+				pthread_mutex_unlock(&segments->lock);
+				require_noerr_quiet(error, download_segment);
+			}
+		}
 		
-		CFArrayAppendValue(array, data);
-		CFRelease(data);
+		/* the segment is in the cache file, so its spill file can go */
+		pthread_mutex_lock(&segments->lock);
+		if ( segment->done )
+		{
+			close(segment->spill_fd);
+			segment->spill_fd = -1;
+		}
+		pthread_mutex_unlock(&segments->lock);
 	}
 	
-	return (array);
+download_segment:
+write:
+pread:
+terminated:
 	
-	/************/
-
-SecCertificateCreateCFData:
-CFArrayGetValueAtIndex:
-	CFRelease(array);
-CFArrayCreateMutable:
-
-	return (NULL);
+	body_buffer_put(buffer, BODY_BUFFER_SIZE);
+	
+malloc_buffer:
+	
+	download_segments_abort(segments);
+	
+	return ( error );
 }
 
 /******************************************************************************/
 
-/* returns TRUE if user asked to continue with this certificate problem; FALSE if not */
-static int ConfirmCertificate(CFReadStreamRef readStreamRef, SInt32 error)
+/*
+ * stream_get_transaction
+ *
+ * Creates an HTTP stream, sends the request and returns the response and response body.
+ */
+static int stream_get_transaction(
+	uid_t uid,					/* -> uid of the user making the request */
+	CFHTTPMessageRef request,	/* -> the request to send */
+	int *retryTransaction,		/* -> if TRUE, return EAGAIN on errors when streamError is kCFStreamErrorDomainPOSIX/EPIPE and set retryTransaction to FALSE */ 
+	struct node_entry *node,	/* -> node to get into */
+	CFHTTPMessageRef *response)
 {
+	struct ReadStreamRec *readStreamRecPtr;
+	UInt8 *buffer;
+	CFIndex totalRead;
+	CFIndex bytesRead;
+	CFTypeRef theResponsePropertyRef;
+	int background_load;
+	CFStringRef connectionHeaderRef;
+	CFStringRef setCookieHeaderRef;
+	CFHTTPMessageRef responseMessage;
 	int result;
-	CFMutableDictionaryRef dict;
-	CFArrayRef certs;
-	CFArrayRef certs_data;
-	CFNumberRef error_number;
-	CFStringRef host_name;
-	CFDataRef theData;
-	CFURLRef  baseURL;
-	int fd[2];
-	int pid, terminated_pid;
-	union wait status;
-	char CFUserTextEncodingEnvSetting[sizeof(CFENVFORMATSTRING) + 20]; 
-	char *env[] = {CFUserTextEncodingEnvSetting, "", (char *) 0 };
 	
-	/* 
-	 * Create a new environment with a definition of __CF_USER_TEXT_ENCODING to work 
-	 * around CF's interest in the user's home directory (which could be networked, 
-	 * causing recursive references through automount). Make sure we include the uid
-	 * since CF will check for this when deciding if to look in the home directory.
-	 */ 
-	snprintf(CFUserTextEncodingEnvSetting, sizeof(CFUserTextEncodingEnvSetting), CFENVFORMATSTRING, getuid());
+	result = 0;
+		
+	/*
+	 * If we're down and the mount is supposed to fail on disconnects
+	 * instead of retrying, just return an error.
+	 */
+	require_quiet(!gSuppressAllUI || (get_connectionstate() == WEBDAV_CONNECTION_UP), connection_down);
 	
-	certs = NULL;
-	result = FALSE;
-	fd[0] = fd[1] = -1;
+	result = open_stream_for_transaction(request, NULL, TRUE, retryTransaction, TRUE, &readStreamRecPtr);
+	require_noerr_quiet(result, open_stream_for_transaction);
 	
-	/* create a dictionary to stuff things all in */
-	dict = CFDictionaryCreateMutable(kCFAllocatorDefault, 0, &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks);
-	require(dict != NULL, CFDictionaryCreateMutable);
+	/* malloc a buffer big enough for first read */
+	buffer = malloc(first_read_len);
+	require(buffer != NULL, malloc_buffer);
+
+	/* Send the message and get up to first_read_len bytes of response */
+	totalRead = 0;
+	background_load = FALSE;
+	while ( 1 )
+	{
+		bytesRead = CFReadStreamRead(readStreamRecPtr->readStreamRef, buffer + totalRead, first_read_len - totalRead);
+		if ( bytesRead > 0 )
+		{
+			totalRead += bytesRead;
+			if ( totalRead >= first_read_len )
+			{
+				/* is there more data to read? */
+				if ( CFReadStreamGetStatus(readStreamRecPtr->readStreamRef) == kCFStreamStatusAtEnd )
+				{
+					/* there are no more bytes to read */
+					background_load = FALSE;
+				}
+				else
+				{
+					/* we'll need to hand off to get the rest of the file data */
+					background_load = TRUE;
+				}
+				break;
+			}
+		}
+		else if ( bytesRead == 0 )
+		{
+			/* there are no more bytes to read */
+			background_load = FALSE;
+			break;
+		}
+		else
+		{
+			CFStreamError streamError;
+			
+			streamError = CFReadStreamGetError(readStreamRecPtr->readStreamRef);
+			if ( *retryTransaction &&
+				((streamError.domain == kCFStreamErrorDomainPOSIX && streamError.error == EPIPE) ||
+				 (streamError.domain ==  kCFStreamErrorDomainHTTP && streamError.error ==  kCFStreamErrorHTTPConnectionLost)) )
+			{
+				/* if we get a POSIX EPIPE or HTTP Connection Lost error back from the stream, retry the transaction once */
+				syslog(LOG_INFO,"stream_get_transaction: CFStreamError: domain %ld, error %lld -- retrying", streamError.domain, (SInt64)streamError.error);
+				*retryTransaction = FALSE;
+				result = EAGAIN;
+			}
+			else
+			{
+				if ( get_connectionstate() == WEBDAV_CONNECTION_UP )
+				{
+					syslog(LOG_ERR,"stream_get_transaction: CFStreamError: domain %ld, error %lld", streamError.domain, (SInt64)streamError.error);
+				}
+				set_connectionstate(WEBDAV_CONNECTION_DOWN);
+				result = stream_error_to_errno(&streamError);
+			}
+			goto CFReadStreamRead;
+		}
+	};
 	
-	/* get the certificates from the stream and add it with the kSSLClientPropTLSServerCertificateChain key */
-	certs = (CFArrayRef)CFReadStreamCopyProperty(readStreamRef, kCFStreamPropertySSLPeerCertificates);
-	require(certs != NULL, CFReadStreamCopyProperty);
+	/* get the response header */
+	theResponsePropertyRef = CFReadStreamCopyProperty(readStreamRecPtr->readStreamRef, kCFStreamPropertyHTTPResponseHeader);
+	require(theResponsePropertyRef != NULL, GetResponseHeader);
 	
-	certs_data = SecCertificateArrayCreateCFDataArray(certs);
-	require(certs_data != NULL, CFReadStreamCopyProperty);
+	/* fun with casting a "const void *" CFTypeRef away */
+	responseMessage = *((CFHTTPMessageRef*)((void*)&theResponsePropertyRef));
 
-	CFDictionaryAddValue(dict, kSSLClientPropTLSServerCertificateChain, certs_data);
-	CFRelease(certs_data);
+	/*
+	 *	if WEBDAV_DOWNLOAD_NEVER
+	 *		download entire file
+	 *	else if WEBDAV_DOWNLOAD_FINISHED
+	 *		then use If-None-Match: node->file_entity_tag
+	 *		and  If-Modified-Since: node->file_last_modified date
+	 *			200 = getting whole file
+	 *			304 = not modified; current copy is OK
+	 *	else if has node->file_entity_tag and NOT weak
+	 *		download partial file with If-Range: node->file_entity_tag
+	 *			206 = getting remainder
+	 *			200 = getting whole file
+	 *	else if has node->file_last_modified
+	 *		download partial file with If-Range: node->file_last_modified date
+	 *			206 = getting remainder
+	 *			200 = getting whole file
+	 */
+	/* get the status code */
+	switch ( CFHTTPMessageGetResponseStatusCode(responseMessage) )
+	{
+		case 200:	/* OK - download whole file from beginning */
+			/* clear the flags */
+			require(fchflags(node->file_fd, 0) == 0, fchflags);
+			/* truncate the file */
+			require_action(ftruncate(node->file_fd, 0LL) != -1, ftruncate, syslog(LOG_ERR,"errno %d", errno));
+			/* reset the position to 0 */
+			require(lseek(node->file_fd, 0LL, SEEK_SET) >= 0, lseek);
+			/* write the bytes in buffer to the cache file*/
+			require(write(node->file_fd, buffer, (size_t)totalRead) == (ssize_t)totalRead, write);
+			
+			// If file is large, turn off data caching
+			if (node->attr_stat_info.attr_stat.st_size > (off_t)webdavCacheMaximumSize) {
+				fcntl(node->file_fd, F_NOCACHE, 1);
+			}
+			break;
+			
+		case 206:	/* Partial Content - download from EOF */
+			/* clear the flags */
+			require(fchflags(node->file_fd, 0) == 0, fchflags);
+			/* seek to EOF */
+			require(lseek(node->file_fd, 0LL, SEEK_END) >= 0, lseek);
+			/* write the bytes in buffer to the cache file*/
+			require(write(node->file_fd, buffer, (size_t)totalRead) >= 0, write);
+			break;
+			
+		case 304:	/* Not Modified - the cache file is still good */
+			background_load = FALSE;
+			break;
+			
+		default:
+			background_load = FALSE;
+			break;
+	}
 	
-	/* convert error to a CFNumberRef and add it with the kSSLClientPropTLSTrustClientStatus key */
-	error_number = CFNumberCreate(kCFAllocatorDefault, kCFNumberSInt32Type, &error);
-	require(error_number != NULL, CFNumberCreate);
-
-	CFDictionaryAddValue(dict, kSSLClientPropTLSTrustClientStatus, error_number);
-	CFRelease(error_number);
+	free(buffer);
+	buffer = NULL;
 	
-	/* get the host name from the base URL and add it with the kSSLClientPropTLSServerHostName key */
-	baseURL = nodecache_get_baseURL();
-	host_name = CFURLCopyHostName(baseURL);
-	CFRelease(baseURL);
-	require(host_name != NULL, CFURLCopyHostName);
+	set_connectionstate(WEBDAV_CONNECTION_UP);
 	
-	CFDictionaryAddValue(dict, kSSLClientPropTLSServerHostName, host_name);
-	CFRelease(host_name);
+	/* Get the Connection header (if any) */
+	readStreamRecPtr->connectionClose = FALSE;
+	connectionHeaderRef = CFHTTPMessageCopyHeaderFieldValue(responseMessage, CFSTR("Connection"));
+	if ( connectionHeaderRef != NULL )
+	{
+		/* is the connection-token is "close"? */
+		if ( CFStringCompare(connectionHeaderRef, CFSTR("close"), kCFCompareCaseInsensitive) == kCFCompareEqualTo )
+		{
+			/* yes -- then the server closed this connection, so close and release the read stream now */
+			readStreamRecPtr->connectionClose = TRUE;
+		}
+		CFRelease(connectionHeaderRef);
+	}
 	
-	/* flatten it */
-	theData = CFPropertyListCreateXMLData(kCFAllocatorDefault, dict);
-	require(theData != NULL, CFPropertyListCreateXMLData);
+	// Handle cookies
+	setCookieHeaderRef = CFHTTPMessageCopyHeaderFieldValue(responseMessage, CFSTR("Set-Cookie"));
+	if (setCookieHeaderRef != NULL) {
+		handle_cookies(setCookieHeaderRef, request);
+		CFRelease(setCookieHeaderRef);
+	}
 
-	CFRelease(dict);
-	dict = NULL;
-	
-	/* open a pipe */
-	require(pipe(fd) >= 0, pipe);
 	
-	pid = fork();
-	require (pid >= 0, fork);
-	if ( pid > 0 )
+	if ( background_load )
 	{
-		/* parent */
-		size_t length;
-		ssize_t bytes_written;
+		int error;
+		struct download_segments *segments;
 		
-		close(fd[0]); /* close read end */
-		fd[0] = -1;
-		length = CFDataGetLength(theData);
-		bytes_written = write(fd[1], CFDataGetBytePtr(theData), length);
-		require(bytes_written == (ssize_t)length, write);
+		/*
+		 * As a hack, set the NODUMP bit so that the kernel
+		 * knows that we are in the process of filling up the file
+		 */
+		require(fchflags(node->file_fd, UF_NODUMP) == 0, fchflags);
 		
-		close(fd[1]); /* close write end */
-		fd[1] = -1;
-
-		/* Parent waits for child's completion here */
-		while ( (terminated_pid = wait4(pid, (int *)&status, 0, NULL)) < 0 )
+		node->file_status = WEBDAV_DOWNLOAD_IN_PROGRESS;
+		
+		/* if the whole file is coming and it's large, get the rest of it in parallel segments */
+		segments = NULL;
+		if ( CFHTTPMessageGetResponseStatusCode(responseMessage) == 200 )
 		{
-			/* retry if EINTR, else break out with error */
-			if ( errno != EINTR )
+			segments = download_segments_create(uid, request, responseMessage, node);
+			if ( segments != NULL )
 			{
-				break;
+				download_segments_start(segments);
 			}
 		}
 		
-		/* we'll get here when the child completes */
-		if ( (terminated_pid == pid) && (WIFEXITED(status)) )
-		{
-			result = WEXITSTATUS(status) == 0;
-		}
-		else
+		/* pass the node and readStreamRef off to another thread to finish */
+		error = requestqueue_enqueue_download(node, readStreamRecPtr, segments);
+		if ( (error != 0) && (segments != NULL) )
 		{
-			result = FALSE;
-		}
-		
-		// Did the user confirm the certificate?
-		if (result == TRUE) {
-			// Yes, add them to the global SSL properties dictionary
-			SecAddTrustedCerts(certs);
+			download_segments_abort(segments);
 		}
+		require_noerr_quiet(error, webdav_requestqueue_enqueue_new_download);
 	}
 	else
 	{
-		/* child */
-		close(fd[1]); /* close write end */
-		fd[1] = -1;
+		node->file_status = WEBDAV_DOWNLOAD_FINISHED;
 		
-		if ( fd[0] != STDIN_FILENO )
+		if ( readStreamRecPtr->connectionClose )
 		{
-			require(dup2(fd[0], STDIN_FILENO) == STDIN_FILENO, dup2);
-			close(fd[0]); /* not needed after dup2 */
-			fd[0] = -1;
+			/* close and release the stream */
+			CFReadStreamClose(readStreamRecPtr->readStreamRef);
+			CFRelease(readStreamRecPtr->readStreamRef);
+			readStreamRecPtr->readStreamRef = NULL;
 		}
 		
-		require(execle(PRIVATE_CERT_UI_COMMAND, PRIVATE_CERT_UI_COMMAND, (char *) 0, env) >= 0, execl);
+		/* make this ReadStreamRec is available again */
+		release_ReadStreamRec(readStreamRecPtr);
+	}
+	
+	*response = responseMessage;
+	
+	return ( 0 );
+
+	/**********************/
+
+webdav_requestqueue_enqueue_new_download:
+fchflags:
+ftruncate:
+lseek:
+write:
+GetResponseHeader:
+CFReadStreamRead:
+
+	if ( buffer != NULL )
+	{
+		free(buffer);
 	}
 
-	return ( result );
+malloc_buffer:
+
+	/* close and release the read stream on errors */
+	CFReadStreamClose(readStreamRecPtr->readStreamRef);
+	CFRelease(readStreamRecPtr->readStreamRef);
+	readStreamRecPtr->readStreamRef = NULL;
+	
+	/* make this ReadStreamRec is available again */
+	release_ReadStreamRec(readStreamRecPtr);
+
+open_stream_for_transaction:
+connection_down:
 
-	/************/
+	*response = NULL;
 
-execl:
-dup2:
-write:
-fork:
-	if (fd[0] != -1)
-	{
-		close(fd[0]);
-	}
-	if (fd[1] != -1)
-	{
-		close(fd[1]);
-	}
-pipe:
-CFPropertyListCreateXMLData:
-CFURLCopyHostName:
-CFNumberCreate:
-	if ( certs != NULL )
-	{
-		CFRelease(certs);
-	}
-CFReadStreamCopyProperty:
-	if ( dict != NULL )
+	if ( result == 0 )
 	{
-		CFRelease(dict);
+		result = EIO;
 	}
-CFDictionaryCreateMutable:
 
-	return ( FALSE );
+	return ( result );
 }
 
 /******************************************************************************/
 
 /*
- * returns EAGAIN if entire transaction should be retried
- * returns ECANCELED if the user clicked cancel in the certificate UI
- * returns EIO if this was not an SSL error
+ * stream_transaction_from_file
+ *
+ * Creates an HTTP stream with the read stream coming from file_fd,
+ * sends the request and returns the response. The response body (if any) is
+ * read and disposed.
  */
-static int HandleSSLErrors(CFReadStreamRef readStreamRef)
+static int stream_transaction_from_file(
+	CFHTTPMessageRef request,
+	int file_fd,
+	int *retryTransaction,		/* -> if TRUE, return EAGAIN on errors when streamError is kCFStreamErrorDomainPOSIX/EPIPE and set retryTransaction to FALSE */ 
+	CFHTTPMessageRef *response)
 {
-	CFStreamError streamError;
-	SInt32 error;
+	CFReadStreamRef fdStream;
+	struct ReadStreamRec *readStreamRecPtr;
+	void *buffer;
+	CFIndex bytesRead;
+	CFTypeRef theResponsePropertyRef;
+	off_t contentLength;
+	CFStringRef contentLengthString;
+	CFStringRef connectionHeaderRef;
+	CFStringRef setCookieHeaderRef;
+	CFHTTPMessageRef responseMessage;
 	int result;
 	
-	result = EIO;
+	result = 0;
+		
+	/*
+	 * If we're down and the mount is supposed to fail on disconnects
+	 * instead of retrying, just return an error.
+	 */
+	require_quiet(!gSuppressAllUI || (get_connectionstate() == WEBDAV_CONNECTION_UP), connection_down);
+	
+	/* get the file length */
+	contentLength = lseek(file_fd, 0LL, SEEK_END);
+	require(contentLength != -1, lseek);
+	
+	/* create a string with the file length for the Content-Length header */
+	contentLengthString = CFStringCreateWithFormat(kCFAllocatorDefault, NULL, CFSTR("%qd"), contentLength);
+	/* CFReadStreamCreateForStreamedHTTPRequest will use chunked transfer-encoding if the Content-Length header cannot be provided */
+	if ( contentLengthString != NULL )
+	{
+		CFHTTPMessageSetHeaderFieldValue(request, CFSTR("Content-Length"), contentLengthString);
+		CFRelease(contentLengthString);
+	}
+	
+	/* set the file position to 0 */
+	verify(lseek(file_fd, 0LL, SEEK_SET) != -1);
+	
+	/* create a stream from the file */
+	CFStreamCreatePairWithSocket(kCFAllocatorDefault, file_fd, &fdStream, NULL);
+	require(fdStream != NULL, CFReadStreamCreateWithFile);
+	
+	result = open_stream_for_transaction(request, fdStream, FALSE, retryTransaction, TRUE, &readStreamRecPtr);
+	require_noerr_quiet(result, open_stream_for_transaction);
+		
+	/* get a buffer big enough for most responses */
+	buffer = body_buffer_get();
+	require(buffer != NULL, malloc_currentbuffer);
 
-	streamError = CFReadStreamGetError(readStreamRef);
-	if ( streamError.domain == kCFStreamErrorDomainSSL )
+	/* Send the message and eat the response */
+	while ( 1 )
 	{
-		error = streamError.error;
-				
-		if ( gSSLPropertiesDict == NULL )
+		bytesRead = CFReadStreamRead(readStreamRecPtr->readStreamRef, buffer, BODY_BUFFER_SIZE);
+		if ( bytesRead > 0 )
 		{
-			gSSLPropertiesDict = CFDictionaryCreateMutable(kCFAllocatorDefault, 0, &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks);
-			require(gSSLPropertiesDict != NULL, CFDictionaryCreateMutable);
+			continue;
 		}
-		
-		/* if we haven't tried falling back from TLS to SSL and the errror indicates that might work... */
-		if ( (CFDictionaryGetValue(gSSLPropertiesDict, kCFStreamSSLLevel) == NULL) &&
-				(((error <= errSSLProtocol) && (error > errSSLXCertChainInvalid)) ||
-				 ((error <= errSSLCrypto) && (error > errSSLUnknownRootCert)) ||
-				 ((error <= errSSLClosedNoNotify) && (error > errSSLPeerBadCert)) ||
-				 (error == errSSLIllegalParam) ||
-				 ((error <= errSSLPeerAccessDenied) && (error > errSSLLast))) )
+		else if ( bytesRead == 0 )
 		{
-			/* retry with fall back from TLS to SSL */
-			CFDictionarySetValue(gSSLPropertiesDict, kCFStreamSSLLevel, kCFStreamSocketSecurityLevelSSLv3);
-			result = EAGAIN;
+			/* there are no more bytes to read */
+			break;
 		}
 		else
 		{
-			switch ( error )
+			CFStreamError streamError;
+						
+			streamError = CFReadStreamGetError(readStreamRecPtr->readStreamRef);
+			if ( *retryTransaction && ((streamError.domain == kCFStreamErrorDomainPOSIX && streamError.error == EPIPE) ||
+									  (streamError.domain ==  kCFStreamErrorDomainHTTP && streamError.error ==  kCFStreamErrorHTTPConnectionLost)) )
 			{
-				case errSSLCertExpired:
-				case errSSLCertNotYetValid:
-					/* The certificate for this server has expired or is not yet valid */
-					if ( ConfirmCertificate(readStreamRef, error) )
-					{
-						result = EAGAIN;
-					}
-					else
-					{
-						result = ECANCELED;
-					}
-					break;
-					
-				case errSSLBadCert:
-				case errSSLXCertChainInvalid:
-				case errSSLHostNameMismatch:
-					/* The certificate for this server is invalid */
-					if ( ConfirmCertificate(readStreamRef, error) )
-					{
-						result = EAGAIN;
-					}
-					else
-					{
-						result = ECANCELED;
-					}
-					break;
-					
-				case errSSLUnknownRootCert:
-				case errSSLNoRootCert:
-					/* The certificate for this server was signed by an unknown certifying authority */
-					if ( ConfirmCertificate(readStreamRef, error) )
-					{
-						result = EAGAIN;
-					}
-					else
-					{
-						result = ECANCELED;
-					}
-					break;
-					
-				default:
-					result = EIO;
-					break;
+				/* if we get a POSIX errror back from the stream, retry the transaction once */
+				syslog(LOG_INFO,"stream_transaction_from_file: CFStreamError: domain %ld, error %lld -- retrying", streamError.domain, (SInt64)streamError.error);
+				*retryTransaction = FALSE;
+				result = EAGAIN;
 			}
+			else
+			{
+				if ( get_connectionstate() == WEBDAV_CONNECTION_UP )
+				{
+					syslog(LOG_ERR,"stream_transaction_from_file: CFStreamError: domain %ld, error %lld", streamError.domain, (SInt64)streamError.error);
+				}
+				set_connectionstate(WEBDAV_CONNECTION_DOWN);
+				result = stream_error_to_errno(&streamError);
+			}
+			goto CFReadStreamRead;
 		}
-	}
-
-CFDictionaryCreateMutable:
+	};
 	
-	return ( result );
-}
+	body_buffer_put(buffer, BODY_BUFFER_SIZE);
 
-/******************************************************************************/
-
-/*
- * returns ETIMEDOUT for server reachability type errors
- * returns EXIO otherwise
- * returns EIO if this was not an SSL error
- */
-
-static int stream_error_to_errno(CFStreamError *streamError)
-{
-	int result = ENXIO;
+	/* get the response header */
+	theResponsePropertyRef = CFReadStreamCopyProperty(readStreamRecPtr->readStreamRef, kCFStreamPropertyHTTPResponseHeader);
+	require(theResponsePropertyRef != NULL, GetResponseHeader);
 	
-	if (streamError->domain == kCFStreamErrorDomainPOSIX)
+	/* fun with casting a "const void *" CFTypeRef away */
+	responseMessage = *((CFHTTPMessageRef*)((void*)&theResponsePropertyRef));
+	
+	set_connectionstate(WEBDAV_CONNECTION_UP);
+	
+	/* Get the Connection header (if any) */
+	connectionHeaderRef = CFHTTPMessageCopyHeaderFieldValue(responseMessage, CFSTR("Connection"));
+	/* is the connection-token is "close"? */
+	if ( connectionHeaderRef != NULL )
 	{
-		switch (streamError->error) {
-			case EADDRNOTAVAIL:
-			case ENETDOWN:
-			case ETIMEDOUT:
-			case ECONNRESET:
-			case ENETUNREACH:
-			case ECONNREFUSED:
-				/* These errors affect mobility, so return ETIMEDOUT */
-				syslog(LOG_ERR, "stream_error: Posix error %d", (int)streamError->error);
-				result = ETIMEDOUT;
-				break;
-			default:
-				syslog(LOG_ERR, "stream_error: Posix error %d", (int)streamError->error);
-				result = ENXIO;
-				break;
+		if ( CFStringCompare(connectionHeaderRef, CFSTR("close"), kCFCompareCaseInsensitive) == kCFCompareEqualTo )
+		{
+			/* yes -- then the server closed this connection, so close and release the read stream now */
+			CFReadStreamClose(readStreamRecPtr->readStreamRef);
+			CFRelease(readStreamRecPtr->readStreamRef);
+			readStreamRecPtr->readStreamRef = NULL;
 		}
+		CFRelease(connectionHeaderRef);
+	}
+	
+	// Handle cookies
+	setCookieHeaderRef = CFHTTPMessageCopyHeaderFieldValue(responseMessage, CFSTR("Set-Cookie"));
+	if (setCookieHeaderRef != NULL) {
+		handle_cookies(setCookieHeaderRef, request);
+		CFRelease(setCookieHeaderRef);
 	}
-	else if (streamError->domain == kCFStreamErrorDomainNetDB)
-	{
-		switch (streamError->error) {
-			case EAI_NODATA:
-				/* no address associated with host name */
-				syslog(LOG_ERR, "stream_error: NetDB error EAI_NODATA"); 
-				result = ETIMEDOUT;
-				break;
-			default:
-				syslog(LOG_ERR, "stream_error: NetDB error %d", (int)streamError->error);
-				result = ENXIO;
-				break;
-		}			
-	}
-	else {
-		syslog(LOG_ERR, "stream_error: Domain %d Error %d", (int) streamError->domain, (int)streamError->error);
-		result = ENXIO;
-	}
-	return result;
-}
 
-/******************************************************************************/
+	CFRelease(fdStream);
 
-	/* create the HTTP read stream with CFReadStreamCreateForHTTPRequest */
-	/* turn on automatic redirection */
-	/* add proxies (if any) */
-	/* apply any SSL properties we've already negotiated with the server */
-	/* open the read stream */
+	/* make this ReadStreamRec is available again */
+	release_ReadStreamRec(readStreamRecPtr);
 	
+	/* fun with casting a "const void *" CFTypeRef away */
+	*response = responseMessage;
 	
-	/* set the file position to 0 */
-	/* create a stream from the file */
-	/* create the HTTP read stream with CFReadStreamCreateForStreamedHTTPRequest */
-	/* Note: PUTs cannot be automatically redirected -- see rfc2616 section 10.3.x */
-	/* add proxies (if any) */
-	/* apply any SSL properties we've already negotiated with the server */
-	/* open the read stream */
+	return ( 0 );
 
+	/**********************/
 
-	/* create the HTTP read stream with CFReadStreamCreateForHTTPRequest */
-	/* (conditional) turn on automatic redirection */
-	/* add proxies (if any) */
-	/* apply any SSL properties we've already negotiated with the server */
-	/* open the read stream and handle SSL errors */
-	
-static int open_stream_for_transaction(
-	CFHTTPMessageRef request,	/* -> the request to send */
-	CFReadStreamRef fdStream,	/* -> if not NULL, the file stream */
-	int auto_redirect,			/* -> if TRUE, set kCFStreamPropertyHTTPShouldAutoredirect on stream */
-	int *retryTransaction,		/* -> if TRUE, return EAGAIN on errors when streamError is kCFStreamErrorDomainPOSIX/EPIPE and set retryTransaction to FALSE */ 
-	struct ReadStreamRec **readStreamRecPtr)	/* <- pointer to the ReadStreamRec in use */
-{
-	int result, error;
-	struct ReadStreamRec *theReadStreamRec;
-	CFReadStreamRef newReadStreamRef;
-	CFSocketNativeHandle sock;
-	CFDataRef sockWrapper = NULL;
-	
-	result = error = 0;
-	*readStreamRecPtr = NULL;
-	
-	/* create the HTTP read stream */
-	if ( fdStream != NULL )
-	{
-		newReadStreamRef = CFReadStreamCreateForStreamedHTTPRequest(kCFAllocatorDefault, request, fdStream);
-		require(newReadStreamRef != NULL, CFReadStreamCreateForStreamedHTTPRequest);
-	}
-	else
-	{
-		newReadStreamRef = CFReadStreamCreateForHTTPRequest(kCFAllocatorDefault, request);
-		require(newReadStreamRef != NULL, CFReadStreamCreateForHTTPRequest);
-	}
+CFReadStreamRead:
+
+	body_buffer_put(buffer, BODY_BUFFER_SIZE);
+
+GetResponseHeader:
+malloc_currentbuffer:
+
+	CFReadStreamClose(readStreamRecPtr->readStreamRef);
+	CFRelease(readStreamRecPtr->readStreamRef);
+	readStreamRecPtr->readStreamRef = NULL;
 	
-	/* add persistent property */
-	CFReadStreamSetProperty(newReadStreamRef, kCFStreamPropertyHTTPAttemptPersistentConnection, kCFBooleanTrue);
+	/* make this ReadStreamRec is available again */
+	release_ReadStreamRec(readStreamRecPtr);
 
-	/* turn on automatic redirection */
-	if ( auto_redirect )
+	CFRelease(fdStream);
+
+CFReadStreamCreateWithFile:
+
+lseek:
+open_stream_for_transaction:
+connection_down:
+
+	*response = NULL;
+
+	if ( result == 0 )
 	{
-		require(CFReadStreamSetProperty(newReadStreamRef, kCFStreamPropertyHTTPShouldAutoredirect, kCFBooleanTrue) != FALSE, SetAutoredirectProperty);
+		result = EIO;
 	}
 
-	/* add proxies (if any) */
-	require_quiet(set_global_stream_properties(newReadStreamRef) == 0, set_global_stream_properties);
+	return ( result );
+}
 
-	/* apply any SSL properties we've already negotiated with the server */
-	ApplySSLProperties(newReadStreamRef);
+/******************************************************************************/
 
-	/* get a ReadStreamRec that was not in use */
-	theReadStreamRec = get_ReadStreamRec();
+/*
+ * stream_transaction
+ *
+ * Creates an HTTP stream, sends the request and returns the response and response body.
+ * If there's a consumer and the response is successful, the response body is passed
+ * to the consumer as it arrives and no buffer is returned.
+ */
+static int stream_transaction(
+	CFHTTPMessageRef request,	/* -> the request to send */
+	int auto_redirect,			/* -> if TRUE, set kCFStreamPropertyHTTPShouldAutoredirect on stream */
+	int *retryTransaction,		/* -> if TRUE, return EAGAIN on errors when streamError is kCFStreamErrorDomainPOSIX/EPIPE and set retryTransaction to FALSE */ 
+	struct BodyConsumer *consumer, /* -> if not NULL, the consumer for a successful response's body */
+	int decode,					/* -> if TRUE, a compressed body streamed to consumer is inflated first */
+	UInt8 **buffer,				/* <- response data buffer (caller responsible for freeing) */
+	CFIndex *count,				/* <- response data buffer length */
+	CFHTTPMessageRef *response)	/* <- the response message */
+{
+	struct ReadStreamRec *readStreamRecPtr;
+	CFIndex	totalRead;
+	UInt8 *currentbuffer;
+	UInt8 *newBuffer;
+	CFIndex bytesRead;
+	CFIndex bytesToRead;
+	CFIndex bufferSize;
+	CFTypeRef theResponsePropertyRef;
+	CFStringRef connectionHeaderRef;
+	CFStringRef setCookieHeaderRef;
+	CFHTTPMessageRef responseMessage;
+	int result;
+	int streaming;
+	int checkedStatus;
+	CFIndex totalConsumed;
+	struct ContentDecoder decoder;
+	int decoding;
 	
-	/* (after unlocking) make sure we got a ReadStreamRec */
-	require(theReadStreamRec != NULL, get_ReadStreamRec);
+	result = 0;
+	streaming = FALSE;
+	checkedStatus = (consumer == NULL);
+	totalConsumed = 0;
+	decoding = FALSE;
 	
-	/* add the unique property from the ReadStreamRec to newReadStreamRef */
-	require(CFReadStreamSetProperty(newReadStreamRef, CFSTR("WebdavConnectionNumber"), theReadStreamRec->uniqueValue) != FALSE, SetWebdavConnectionNumberProperty);
+	/*
+	 * If we're down and the mount is supposed to fail on disconnects
+	 * instead of retrying, just return an error.
+	 */
+	require_quiet(!gSuppressAllUI || (get_connectionstate() == WEBDAV_CONNECTION_UP), connection_down);
 	
-	/* open the read stream and handle SSL errors */
-	if ( CFReadStreamOpen(newReadStreamRef) == FALSE )
+	/* get an open ReadStreamRec */
+	result = open_stream_for_transaction(request, NULL, auto_redirect, retryTransaction, TRUE, &readStreamRecPtr);
+	require_noerr_quiet(result, open_stream_for_transaction);
+	
+	/* get a buffer big enough for most responses */
+	bufferSize = BODY_BUFFER_SIZE;
+	currentbuffer = body_buffer_get();
+	require(currentbuffer != NULL, malloc_currentbuffer);
+
+	/* Send the message and get the response */
+	totalRead = 0;
+	while ( 1 )
 	{
-		result = HandleSSLErrors(newReadStreamRef);
-		if ( result != EAGAIN )
+		bytesToRead = bufferSize - totalRead;
+		bytesRead = CFReadStreamRead(readStreamRecPtr->readStreamRef, currentbuffer + totalRead, bytesToRead);
+		if ( bytesRead > 0 )
 		{
-			CFStreamError streamError;
+			totalRead += bytesRead;
 			
-			streamError = CFReadStreamGetError(newReadStreamRef);
-			if ( *retryTransaction &&
-				((streamError.domain == kCFStreamErrorDomainPOSIX && streamError.error == EPIPE) ||
-				 (streamError.domain ==  kCFStreamErrorDomainHTTP && streamError.error ==  kCFStreamErrorHTTPConnectionLost)) )
+			if ( !checkedStatus )
 			{
-				/* if we get a POSIX EPIPE or HTTP Connection Lost error back from the stream, retry the transaction once */
-				syslog(LOG_INFO,"open_stream_for_transaction: CFStreamError: domain %ld, error %lld -- retrying", streamError.domain, (SInt64)streamError.error);
-				*retryTransaction = FALSE;
-				result = EAGAIN;
+				/* the response header is here, so find out if the body should go to the consumer */
+				theResponsePropertyRef = CFReadStreamCopyProperty(readStreamRecPtr->readStreamRef, kCFStreamPropertyHTTPResponseHeader);
+				if ( theResponsePropertyRef != NULL )
+				{
+					checkedStatus = TRUE;
+					streaming = ((CFHTTPMessageGetResponseStatusCode((CFHTTPMessageRef)theResponsePropertyRef) / 100) == 2);
+					if ( streaming )
+					{
+						/* the consumer can't be given the body twice, so don't retry after this */
+						*retryTransaction = FALSE;
+						
+						/* a compressed body we asked for is inflated on its way to the consumer */
+						decoding = decode && content_decoder_init(&decoder, (CFHTTPMessageRef)theResponsePropertyRef);
+					}
+					CFRelease(theResponsePropertyRef);
+				}
 			}
-			else
+			
+			if ( streaming )
 			{
-				if ( get_connectionstate() == WEBDAV_CONNECTION_UP )
+				/* pass what's been read to the consumer and reuse currentbuffer */
+				if ( decoding )
 				{
-					syslog(LOG_ERR,"open_stream_for_transaction: CFStreamError: domain %ld, error %lld", streamError.domain, (int64_t)streamError.error);
+					result = content_decoder_consume(&decoder, consumer, currentbuffer, totalRead);
 				}
-				set_connectionstate(WEBDAV_CONNECTION_DOWN);
-				result = stream_error_to_errno(&streamError);
+				else
+				{
+					result = consumer->consume(consumer->context, currentbuffer, totalRead);
+				}
+				require_noerr_quiet(result, CFReadStreamRead);
+				
+				totalConsumed += totalRead;
+				totalRead = 0;
+				continue;
+			}
+			
+			/* is currentbuffer getting close to full? */
+			if ( (bytesToRead - bytesRead) < (BODY_BUFFER_SIZE / 2) )
+			{
+				/*
+				 * yes, so get larger currentbuffer for next read. Doubling
+				 * keeps the copying done by realloc linear in the body size.
+				 */
+				newBuffer = realloc(currentbuffer, bufferSize * 2);
+				require(newBuffer != NULL, realloc);
+				
+				currentbuffer = newBuffer;
+				bufferSize *= 2;
 			}
 		}
-		goto CFReadStreamOpen;
+		else if ( bytesRead == 0 )
+		{
+			/* there are no more bytes to read */
+			break;
+		}
+		else
+		{
+			result = HandleSSLErrors(readStreamRecPtr->readStreamRef);
+			if ( result != EAGAIN )
+			{
+				if ( result != ECANCELED )
+				{
+					CFStreamError streamError;
+								
+					streamError = CFReadStreamGetError(readStreamRecPtr->readStreamRef);
+					if ( *retryTransaction &&
+						((streamError.domain == kCFStreamErrorDomainPOSIX && streamError.error == EPIPE) ||
+						 (streamError.domain ==  kCFStreamErrorDomainHTTP && streamError.error ==  kCFStreamErrorHTTPConnectionLost)) )
+					{
+						/* if we get a POSIX EPIPE or HTTP Connection Lost error back from the stream, retry the transaction once */
+						syslog(LOG_INFO,"stream_transaction: CFStreamError: domain %ld, error %lld -- retrying", streamError.domain, (SInt64)streamError.error);
+						*retryTransaction = FALSE;
+						result = EAGAIN;
+					}
+					else
+					{
+						if ( get_connectionstate() == WEBDAV_CONNECTION_UP )
+						{
+							syslog(LOG_ERR,"stream_transaction: CFStreamError: domain %ld, error %lld", streamError.domain, (SInt64)streamError.error);
+						}
+						set_connectionstate(WEBDAV_CONNECTION_DOWN);
+						result = stream_error_to_errno(&streamError);
+					}
+				}
+			}
+			goto CFReadStreamRead;
+		}
+	};
+	
+	if ( decoding )
+	{
+		/* the consumer was given the inflated body */
+		decoding = FALSE;
+		result = content_decoder_finish(&decoder);
+		require_noerr_quiet(result, content_decoder_finish);
+		totalConsumed = (CFIndex)decoder.uncompressed;
+	}
+	
+	/* get the response header */
+	theResponsePropertyRef = CFReadStreamCopyProperty(readStreamRecPtr->readStreamRef, kCFStreamPropertyHTTPResponseHeader);
+	require(theResponsePropertyRef != NULL, GetResponseHeader);
+	
+	/* fun with casting a "const void *" CFTypeRef away */
+	responseMessage = *((CFHTTPMessageRef*)((void*)&theResponsePropertyRef));
+	
+	set_connectionstate(WEBDAV_CONNECTION_UP);
+	
+	/* Get the Connection header (if any) */
+	connectionHeaderRef = CFHTTPMessageCopyHeaderFieldValue(responseMessage, CFSTR("Connection"));
+	/* is the connection-token is "close"? */
+	if ( connectionHeaderRef != NULL )
+	{
+		if ( CFStringCompare(connectionHeaderRef, CFSTR("close"), kCFCompareCaseInsensitive) == kCFCompareEqualTo )
+		{
+			/* yes -- then the server closed this connection, so close and release the read stream now */
+			CFReadStreamClose(readStreamRecPtr->readStreamRef);
+			CFRelease(readStreamRecPtr->readStreamRef);
+			readStreamRecPtr->readStreamRef = NULL;
+		}
+		CFRelease(connectionHeaderRef);
+	}
+	
+	// Handle cookies
+	setCookieHeaderRef = CFHTTPMessageCopyHeaderFieldValue(responseMessage, CFSTR("Set-Cookie"));
+	if (setCookieHeaderRef != NULL) {
+		handle_cookies(setCookieHeaderRef, request);
+		CFRelease(setCookieHeaderRef);
 	}
 	
-	/* close and release old read stream */
-	if ( theReadStreamRec->readStreamRef != NULL )
+	/* make this ReadStreamRec is available again */
+	release_ReadStreamRec(readStreamRecPtr);
+		
+	*response = responseMessage;
+	if ( streaming )
 	{
-		CFReadStreamClose(theReadStreamRec->readStreamRef);
-		CFRelease(theReadStreamRec->readStreamRef);
+		/* the consumer got the body */
+		body_buffer_put(currentbuffer, bufferSize);
+		*count = totalConsumed;
+		*buffer = NULL;
 	}
-	
-	/* Set SO_NOADDRERR on the socket so we will know about EADDRNOTAVAIL errors ASAP */
-	sockWrapper = (CFDataRef)CFReadStreamCopyProperty(newReadStreamRef, kCFStreamPropertySocketNativeHandle);
-	
-	if (sockWrapper)
+	else
 	{
-		CFRange r = {0, sizeof(CFSocketNativeHandle)};
-		CFDataGetBytes(sockWrapper, r, (UInt8 *)&sock);
-		CFRelease(sockWrapper);
-		int flag = 1;
-		setsockopt(sock, SOL_SOCKET, SO_NOADDRERR, &flag, (socklen_t)sizeof(flag));
+		/* the caller frees the body */
+		body_buffer_disown();
+		*count = totalRead;
+		*buffer = currentbuffer;
 	}
-
-	/* save new read stream */
-	theReadStreamRec->readStreamRef = newReadStreamRef;
-	
-	/* return the ReadStreamRec to the caller */
-	*readStreamRecPtr = theReadStreamRec;
 	
 	return ( 0 );
 
 	/**********************/
 
-CFReadStreamOpen:
-SetWebdavConnectionNumberProperty:
-	
-	release_ReadStreamRec(theReadStreamRec);
-	
-get_ReadStreamRec:
-set_global_stream_properties:
-SetAutoredirectProperty:
-	
-	CFRelease(newReadStreamRef);
-	
-CFReadStreamCreateForHTTPRequest:	
-CFReadStreamCreateForStreamedHTTPRequest:
+GetResponseHeader:
+content_decoder_finish:
+CFReadStreamRead:
+realloc:
+
+	if ( decoding )
+	{
+		(void) content_decoder_finish(&decoder);
+	}
+	body_buffer_put(currentbuffer, bufferSize);
+
+malloc_currentbuffer:
+
+	/* close and release the read stream on errors */
+	CFReadStreamClose(readStreamRecPtr->readStreamRef);
+	CFRelease(readStreamRecPtr->readStreamRef);
+	readStreamRecPtr->readStreamRef = NULL;
 	
-	*readStreamRecPtr = NULL;
+	/* make this ReadStreamRec is available again */
+	release_ReadStreamRec(readStreamRecPtr);
+
+open_stream_for_transaction:
+connection_down:
+
+	*response = NULL;
+	*count = 0;
+	*buffer = NULL;
 	if ( result == 0 )
 	{
 		result = EIO;
@@ -1778,631 +3938,936 @@ CFReadStreamCreateForStreamedHTTPRequest:
 /******************************************************************************/
 
 /*
- * stream_get_transaction
+ * Pipelining
  *
- * Creates an HTTP stream, sends the request and returns the response and response body.
+ * When WEBDAVFS_PIPELINE_DEPTH is set, small idempotent requests (PROPFIND
+ * Depth 0, HEAD and OPTIONS) that don't need a proxy are written back to back
+ * on one persistent connection of their own instead of each waiting for a
+ * ReadStreamRec and a full round trip. CFHTTPStream sends one request per
+ * stream, so the connection is a plain socket stream pair and the requests
+ * and responses are framed here. Responses come back in the order the
+ * requests were written, so whichever waiting thread holds gPipelineDriving
+ * writes the queued requests and reads the response at the head of
+ * gPipelineSent, handing it to its owner.
+ *
+ * A request that can't be pipelined -- the connection closed before its
+ * response came back, or the response is a redirect or an authentication
+ * challenge that CFNetwork has to handle -- gets ENOTSUP and is sent one at a
+ * time by stream_transaction. If the server misbehaves (a response that can't be framed, or the connection dropped with
+ * more than one request outstanding), pipelining is turned off for the mount.
+ * If the pipeline connection can't be opened, requests are sent one at a time
+ * for WEBDAV_PIPELINE_RETRY_DELAY seconds before it's tried again.
  */
-static int stream_get_transaction(
-	CFHTTPMessageRef request,	/* -> the request to send */
-	int *retryTransaction,		/* -> if TRUE, return EAGAIN on errors when streamError is kCFStreamErrorDomainPOSIX/EPIPE and set retryTransaction to FALSE */ 
-	struct node_entry *node,	/* -> node to get into */
-	CFHTTPMessageRef *response)
+
+struct pipeline_request
 {
-	struct ReadStreamRec *readStreamRecPtr;
-	UInt8 *buffer;
-	CFIndex totalRead;
-	CFIndex bytesRead;
-	CFTypeRef theResponsePropertyRef;
-	int background_load;
-	CFStringRef connectionHeaderRef;
-	CFStringRef setCookieHeaderRef;
-	CFHTTPMessageRef responseMessage;
-	int result;
+	TAILQ_ENTRY(pipeline_request) link;	/* gPipelinePending or gPipelineSent */
+	CFDataRef serialized;		/* the request as written to the connection */
+	int noBody;					/* TRUE if the response has no body (HEAD) */
+	CFHTTPMessageRef response;	/* the response */
+	UInt8 *body;				/* the response body (malloc'd) */
+	CFIndex bodyLength;			/* length of body */
+	int error;					/* ENOTSUP if the request must be sent one at a time */
+	int done;					/* TRUE when response or error is set */
+};
+
+TAILQ_HEAD(pipeline_request_head, pipeline_request);
+
+static pthread_cond_t gPipeline_cond = PTHREAD_COND_INITIALIZER;
+/* these variables are protected by gPipeline_lock */
+static struct pipeline_request_head gPipelinePending = TAILQ_HEAD_INITIALIZER(gPipelinePending);	/* requests not written yet */
+static struct pipeline_request_head gPipelineSent = TAILQ_HEAD_INITIALIZER(gPipelineSent);	/* requests waiting for responses, in order */
+static int gPipelineSentCount = 0;		/* requests in gPipelineSent */
+static int gPipelineDriving = FALSE;	/* TRUE while a thread is writing requests and reading responses */
+static time_t gPipelineRetryTime = 0;	/* requests go one at a time until then (see WEBDAV_PIPELINE_RETRY_DELAY) */
+/* these variables are only used by the thread driving the pipeline */
+static CFReadStreamRef gPipelineReadStream = NULL;
+static CFWriteStreamRef gPipelineWriteStream = NULL;
+static int gPipelineSocket = -1;
+static time_t gPipelineLastUsed = 0;	/* when the last response was read */
+static UInt8 *gPipelineInput = NULL;	/* bytes read but not yet framed */
+static CFIndex gPipelineInputLength = 0;
+static CFIndex gPipelineInputSize = 0;
+
+/*****************************************************************************/
+
+/*
+ * pipeline_serialize returns the bytes of a request as written to the
+ * connection, or NULL if it can't be pipelined (it isn't one of the idempotent
+ * methods or it's for another server).
+ */
+static CFDataRef pipeline_serialize(CFHTTPMessageRef request, int *noBody)
+{
+	CFStringRef method;
+	CFStringRef depth;
+	CFURLRef url;
+	CFStringRef host;
+	CFStringRef baseHost;
+	CFStringRef path;
+	CFStringRef query;
+	CFDictionaryRef headers;
+	CFDataRef body;
+	CFMutableStringRef header;
+	CFDataRef headerData;
+	CFMutableDataRef result;
+	CFIndex index;
+	CFIndex count;
+	const void **keys;
+	const void **values;
+	int eligible;
 	
-	result = 0;
-		
-	/*
-	 * If we're down and the mount is supposed to fail on disconnects
-	 * instead of retrying, just return an error.
-	 */
-	require_quiet(!gSuppressAllUI || (get_connectionstate() == WEBDAV_CONNECTION_UP), connection_down);
+	result = NULL;
+	depth = NULL;
+	url = NULL;
+	host = NULL;
+	baseHost = NULL;
 	
-	result = open_stream_for_transaction(request, NULL, TRUE, retryTransaction, &readStreamRecPtr);
-	require_noerr_quiet(result, open_stream_for_transaction);
+	method = CFHTTPMessageCopyRequestMethod(request);
+	require_quiet(method != NULL, CFHTTPMessageCopyRequestMethod);
 	
-	/* malloc a buffer big enough for first read */
-	buffer = malloc(first_read_len);
-	require(buffer != NULL, malloc_buffer);
-
-	/* Send the message and get up to first_read_len bytes of response */
-	totalRead = 0;
-	background_load = FALSE;
-	while ( 1 )
+	*noBody = (CFStringCompare(method, CFSTR("HEAD"), 0) == kCFCompareEqualTo);
+	if ( CFStringCompare(method, CFSTR("PROPFIND"), 0) == kCFCompareEqualTo )
 	{
-		bytesRead = CFReadStreamRead(readStreamRecPtr->readStreamRef, buffer + totalRead, first_read_len - totalRead);
-		if ( bytesRead > 0 )
+		depth = CFHTTPMessageCopyHeaderFieldValue(request, CFSTR("Depth"));
+		eligible = (depth != NULL) && (CFStringCompare(depth, CFSTR("0"), 0) == kCFCompareEqualTo);
+	}
+	else
+	{
+		eligible = *noBody || (CFStringCompare(method, CFSTR("OPTIONS"), 0) == kCFCompareEqualTo);
+	}
+	require_quiet(eligible, not_eligible);
+	
+	/* the pipeline connection only goes to the server in gBaseURL */
+	url = CFHTTPMessageCopyRequestURL(request);
+	require_quiet(url != NULL, not_eligible);
+	host = CFURLCopyHostName(url);
+	baseHost = CFURLCopyHostName(gBaseURL);
+	require_quiet((host != NULL) && (baseHost != NULL) &&
+		(CFStringCompare(host, baseHost, kCFCompareCaseInsensitive) == kCFCompareEqualTo) &&
+		(CFURLGetPortNumber(url) == CFURLGetPortNumber(gBaseURL)), not_eligible);
+	
+	/* the request line -- CFURLCopyPath leaves the percent escapes in */
+	header = CFStringCreateMutable(kCFAllocatorDefault, 0);
+	require_quiet(header != NULL, CFStringCreateMutable);
+	path = CFURLCopyPath(url);
+	query = CFURLCopyQueryString(url, NULL);
+	CFStringAppendFormat(header, NULL, CFSTR("%@ %@%s%@ HTTP/1.1\r\n"), method,
+		((path != NULL) && (CFStringGetLength(path) != 0)) ? path : CFSTR("/"),
+		(query != NULL) ? "?" : "", (query != NULL) ? query : CFSTR(""));
+	if ( path != NULL )
+	{
+		CFRelease(path);
+	}
+	if ( query != NULL )
+	{
+		CFRelease(query);
+	}
+	
+	/* the headers, plus the ones CFHTTPStream would have added */
+	headers = CFHTTPMessageCopyAllHeaderFields(request);
+	if ( headers != NULL )
+	{
+		count = CFDictionaryGetCount(headers);
+		keys = malloc(sizeof(void *) * count * 2);
+		if ( keys != NULL )
 		{
-			totalRead += bytesRead;
-			if ( totalRead >= first_read_len )
+			values = keys + count;
+			CFDictionaryGetKeysAndValues(headers, keys, values);
+			for ( index = 0; index < count; ++index )
 			{
-				/* is there more data to read? */
-				if ( CFReadStreamGetStatus(readStreamRecPtr->readStreamRef) == kCFStreamStatusAtEnd )
-				{
-					/* there are no more bytes to read */
-					background_load = FALSE;
-				}
-				else
+				if ( (CFStringCompare((CFStringRef)keys[index], CFSTR("Host"), kCFCompareCaseInsensitive) != kCFCompareEqualTo) &&
+					 (CFStringCompare((CFStringRef)keys[index], CFSTR("Content-Length"), kCFCompareCaseInsensitive) != kCFCompareEqualTo) )
 				{
-					/* we'll need to hand off to get the rest of the file data */
-					background_load = TRUE;
+					CFStringAppendFormat(header, NULL, CFSTR("%@: %@\r\n"), keys[index], values[index]);
 				}
-				break;
 			}
+			free(keys);
 		}
-		else if ( bytesRead == 0 )
-		{
-			/* there are no more bytes to read */
-			background_load = FALSE;
-			break;
-		}
-		else
+		CFRelease(headers);
+	}
+	if ( CFURLGetPortNumber(url) != -1 )
+	{
+		CFStringAppendFormat(header, NULL, CFSTR("Host: %@:%d\r\n"), host, (int)CFURLGetPortNumber(url));
+	}
+	else
+	{
+		CFStringAppendFormat(header, NULL, CFSTR("Host: %@\r\n"), host);
+	}
+	body = CFHTTPMessageCopyBody(request);
+	CFStringAppendFormat(header, NULL, CFSTR("Content-Length: %ld\r\n\r\n"), (body != NULL) ? (long)CFDataGetLength(body) : 0L);
+	
+	headerData = CFStringCreateExternalRepresentation(kCFAllocatorDefault, header, kCFStringEncodingUTF8, 0);
+	CFRelease(header);
+	if ( headerData != NULL )
+	{
+		result = CFDataCreateMutableCopy(kCFAllocatorDefault, 0, headerData);
+		if ( (result != NULL) && (body != NULL) )
 		{
-			CFStreamError streamError;
-			
-			streamError = CFReadStreamGetError(readStreamRecPtr->readStreamRef);
-			if ( *retryTransaction &&
-				((streamError.domain == kCFStreamErrorDomainPOSIX && streamError.error == EPIPE) ||
-				 (streamError.domain ==  kCFStreamErrorDomainHTTP && streamError.error ==  kCFStreamErrorHTTPConnectionLost)) )
-			{
-				/* if we get a POSIX EPIPE or HTTP Connection Lost error back from the stream, retry the transaction once */
-				syslog(LOG_INFO,"stream_get_transaction: CFStreamError: domain %ld, error %lld -- retrying", streamError.domain, (SInt64)streamError.error);
-				*retryTransaction = FALSE;
-				result = EAGAIN;
-			}
-			else
-			{
-				if ( get_connectionstate() == WEBDAV_CONNECTION_UP )
-				{
-					syslog(LOG_ERR,"stream_get_transaction: CFStreamError: domain %ld, error %lld", streamError.domain, (SInt64)streamError.error);
-				}
-				set_connectionstate(WEBDAV_CONNECTION_DOWN);
-				result = stream_error_to_errno(&streamError);
-			}
-			goto CFReadStreamRead;
+			CFDataAppendBytes(result, CFDataGetBytePtr(body), CFDataGetLength(body));
 		}
-	};
-	
-	/* get the response header */
-	theResponsePropertyRef = CFReadStreamCopyProperty(readStreamRecPtr->readStreamRef, kCFStreamPropertyHTTPResponseHeader);
-	require(theResponsePropertyRef != NULL, GetResponseHeader);
-	
-	/* fun with casting a "const void *" CFTypeRef away */
-	responseMessage = *((CFHTTPMessageRef*)((void*)&theResponsePropertyRef));
+		CFRelease(headerData);
+	}
+	if ( body != NULL )
+	{
+		CFRelease(body);
+	}
 
-	/*
-	 *	if WEBDAV_DOWNLOAD_NEVER
-	 *		download entire file
-	 *	else if WEBDAV_DOWNLOAD_FINISHED
-	 *		then use If-Modified-Since: node->file_last_modified date
-	 *		//and  If-None-Match node->file_entity_tag to the cache file
-	 *			200 = getting whole file
-	 *			304 = not modified; current copy is OK
-	 *	//else if has node->file_entity_tag and NOT weak
-	 *	//	download partial file with If-Range: node->file_entity_tag
-	 *	//		206 = getting remainder
-	 *	//		200 = getting whole file
-	 *	else //if has node->file_last_modified
-	 *		download partial file with If-Range: node->file_last_modified date
-	 *			206 = getting remainder
-	 *			200 = getting whole file
-	 */
-	/* get the status code */
-	switch ( CFHTTPMessageGetResponseStatusCode(responseMessage) )
+CFStringCreateMutable:
+not_eligible:
+
+	if ( baseHost != NULL )
 	{
-		case 200:	/* OK - download whole file from beginning */
-			/* clear the flags */
-			require(fchflags(node->file_fd, 0) == 0, fchflags);
-			/* truncate the file */
-			require_action(ftruncate(node->file_fd, 0LL) != -1, ftruncate, syslog(LOG_ERR,"errno %d", errno));
-			/* reset the position to 0 */
-			require(lseek(node->file_fd, 0LL, SEEK_SET) >= 0, lseek);
-			/* write the bytes in buffer to the cache file*/
-			require(write(node->file_fd, buffer, (size_t)totalRead) == (ssize_t)totalRead, write);
-			
-			// If file is large, turn off data caching
-			if (node->attr_stat_info.attr_stat.st_size > (off_t)webdavCacheMaximumSize) {
-				fcntl(node->file_fd, F_NOCACHE, 1);
-			}
-			break;
-			
-		case 206:	/* Partial Content - download from EOF */
-			/* clear the flags */
-			require(fchflags(node->file_fd, 0) == 0, fchflags);
-			/* seek to EOF */
-			require(lseek(node->file_fd, 0LL, SEEK_END) >= 0, lseek);
-			/* write the bytes in buffer to the cache file*/
-			require(write(node->file_fd, buffer, (size_t)totalRead) >= 0, write);
-			break;
-			
-		case 304:	/* Not Modified - the cache file is still good */
-			background_load = FALSE;
-			break;
-			
-		default:
-			background_load = FALSE;
-			break;
+		CFRelease(baseHost);
 	}
+	if ( host != NULL )
+	{
+		CFRelease(host);
+	}
+	if ( url != NULL )
+	{
+		CFRelease(url);
+	}
+	if ( depth != NULL )
+	{
+		CFRelease(depth);
+	}
+	CFRelease(method);
+
+CFHTTPMessageCopyRequestMethod:
+
+	return ( result );
+}
+
+/*****************************************************************************/
+
+/*
+ * pipeline_disconnect closes the pipeline connection and throws away any
+ * bytes read from it. Called by the thread driving the pipeline.
+ */
+static void pipeline_disconnect(void)
+{
+	if ( gPipelineReadStream != NULL )
+	{
+		CFReadStreamClose(gPipelineReadStream);
+		CFRelease(gPipelineReadStream);
+		gPipelineReadStream = NULL;
+	}
+	if ( gPipelineWriteStream != NULL )
+	{
+		CFWriteStreamClose(gPipelineWriteStream);
+		CFRelease(gPipelineWriteStream);
+		gPipelineWriteStream = NULL;
+	}
+	gPipelineSocket = -1;
+	gPipelineInputLength = 0;
+}
+
+/*****************************************************************************/
+
+/*
+ * pipeline_is_open returns FALSE if the server has closed the idle pipeline
+ * connection (it has nothing to read until a request is written, so if it's
+ * readable, it's at EOF or was reset).
+ */
+static int pipeline_is_open(void)
+{
+	struct pollfd pfd;
 	
-	free(buffer);
-	buffer = NULL;
-	
-	set_connectionstate(WEBDAV_CONNECTION_UP);
-	
-	/* Get the Connection header (if any) */
-	readStreamRecPtr->connectionClose = FALSE;
-	connectionHeaderRef = CFHTTPMessageCopyHeaderFieldValue(responseMessage, CFSTR("Connection"));
-	if ( connectionHeaderRef != NULL )
+	if ( gPipelineInputLength != 0 )
 	{
-		/* is the connection-token is "close"? */
-		if ( CFStringCompare(connectionHeaderRef, CFSTR("close"), kCFCompareCaseInsensitive) == kCFCompareEqualTo )
+		/* bytes nobody asked for */
+		return ( FALSE );
+	}
+	if ( CFReadStreamGetStatus(gPipelineReadStream) == kCFStreamStatusError )
+	{
+		return ( FALSE );
+	}
+	if ( gPipelineSocket >= 0 )
+	{
+		pfd.fd = gPipelineSocket;
+		pfd.events = POLLIN;
+		pfd.revents = 0;
+		if ( (poll(&pfd, 1, 0) != 0) || (pfd.revents != 0) )
 		{
-			/* yes -- then the server closed this connection, so close and release the read stream now */
-			readStreamRecPtr->connectionClose = TRUE;
+			return ( FALSE );
 		}
-		CFRelease(connectionHeaderRef);
 	}
 	
-	// Handle cookies
-	setCookieHeaderRef = CFHTTPMessageCopyHeaderFieldValue(responseMessage, CFSTR("Set-Cookie"));
-	if (setCookieHeaderRef != NULL) {
-		handle_cookies(setCookieHeaderRef, request);
-		CFRelease(setCookieHeaderRef);
-	}
+	return ( TRUE );
+}
+
+/*****************************************************************************/
 
+/*
+ * pipeline_connect opens the pipeline connection to the server in gBaseURL.
+ * Called by the thread driving the pipeline.
+ */
+static int pipeline_connect(void)
+{
+	CFStringRef host;
+	CFStringRef scheme;
+	SInt32 port;
+	int secure;
+	CFDataRef sockWrapper;
+	int error;
 	
-	if ( background_load )
+	error = 0;
+	
+	scheme = CFURLCopyScheme(gBaseURL);
+	secure = (scheme != NULL) && (CFStringCompare(scheme, CFSTR("https"), kCFCompareCaseInsensitive) == kCFCompareEqualTo);
+	if ( scheme != NULL )
 	{
-		int error;
-		/*
-		 * As a hack, set the NODUMP bit so that the kernel
-		 * knows that we are in the process of filling up the file
-		 */
-		require(fchflags(node->file_fd, UF_NODUMP) == 0, fchflags);
-		
-		node->file_status = WEBDAV_DOWNLOAD_IN_PROGRESS;
-		
-		/* pass the node and readStreamRef off to another thread to finish */
-		error = requestqueue_enqueue_download(node, readStreamRecPtr);
-		require_noerr_quiet(error, webdav_requestqueue_enqueue_new_download);
+		CFRelease(scheme);
 	}
-	else
+	port = CFURLGetPortNumber(gBaseURL);
+	if ( port == -1 )
 	{
-		node->file_status = WEBDAV_DOWNLOAD_FINISHED;
-		
-		if ( readStreamRecPtr->connectionClose )
-		{
-			/* close and release the stream */
-			CFReadStreamClose(readStreamRecPtr->readStreamRef);
-			CFRelease(readStreamRecPtr->readStreamRef);
-			readStreamRecPtr->readStreamRef = NULL;
-		}
-		
-		/* make this ReadStreamRec is available again */
-		release_ReadStreamRec(readStreamRecPtr);
+		port = secure ? 443 : 80;
 	}
 	
-	*response = responseMessage;
+	host = CFURLCopyHostName(gBaseURL);
+	require_action(host != NULL, CFURLCopyHostName, error = EIO);
 	
-	return ( 0 );
-
-	/**********************/
-
-webdav_requestqueue_enqueue_new_download:
-fchflags:
-ftruncate:
-lseek:
-write:
-GetResponseHeader:
-CFReadStreamRead:
-
-	if ( buffer != NULL )
+	CFStreamCreatePairWithSocketToHost(kCFAllocatorDefault, host, (UInt32)port, &gPipelineReadStream, &gPipelineWriteStream);
+	CFRelease(host);
+	require_action((gPipelineReadStream != NULL) && (gPipelineWriteStream != NULL), CFStreamCreatePairWithSocketToHost, error = EIO);
+	
+	if ( secure )
 	{
-		free(buffer);
+		CFReadStreamSetProperty(gPipelineReadStream, kCFStreamPropertySocketSecurityLevel, kCFStreamSocketSecurityLevelNegotiatedSSL);
+		/* apply any SSL properties we've already negotiated with the server */
+		ApplySSLProperties(gPipelineReadStream);
 	}
-
-malloc_buffer:
-
-	/* close and release the read stream on errors */
-	CFReadStreamClose(readStreamRecPtr->readStreamRef);
-	CFRelease(readStreamRecPtr->readStreamRef);
-	readStreamRecPtr->readStreamRef = NULL;
 	
-	/* make this ReadStreamRec is available again */
-	release_ReadStreamRec(readStreamRecPtr);
+	require_action_quiet(CFReadStreamOpen(gPipelineReadStream) && CFWriteStreamOpen(gPipelineWriteStream), CFStreamOpen, error = EIO);
+	
+	sockWrapper = (CFDataRef)CFReadStreamCopyProperty(gPipelineReadStream, kCFStreamPropertySocketNativeHandle);
+	if ( sockWrapper != NULL )
+	{
+		CFRange r = {0, sizeof(CFSocketNativeHandle)};
+		CFDataGetBytes(sockWrapper, r, (UInt8 *)&gPipelineSocket);
+		CFRelease(sockWrapper);
+	}
+	
+	++gPipelineStats.connections;
+	
+	return ( 0 );
 
-open_stream_for_transaction:
-connection_down:
+CFStreamOpen:
+CFStreamCreatePairWithSocketToHost:
 
-	*response = NULL;
+	pipeline_disconnect();
 
-	if ( result == 0 )
-	{
-		result = EIO;
-	}
+CFURLCopyHostName:
 
-	return ( result );
+	return ( error );
 }
 
-/******************************************************************************/
+/*****************************************************************************/
 
 /*
- * stream_transaction_from_file
- *
- * Creates an HTTP stream with the read stream coming from file_fd,
- * sends the request and returns the response. The response body (if any) is
- * read and disposed.
+ * pipeline_fill reads more of the pipeline connection into gPipelineInput,
+ * waiting up to WEBDAV_PIPELINE_TIMEOUT seconds for it. Returns EPIPE if the
+ * server closed the connection.
  */
-static int stream_transaction_from_file(
-	CFHTTPMessageRef request,
-	int file_fd,
-	int *retryTransaction,		/* -> if TRUE, return EAGAIN on errors when streamError is kCFStreamErrorDomainPOSIX/EPIPE and set retryTransaction to FALSE */ 
-	CFHTTPMessageRef *response)
+static int pipeline_fill(void)
 {
-	CFReadStreamRef fdStream;
-	struct ReadStreamRec *readStreamRecPtr;
-	void *buffer;
+	UInt8 *newInput;
 	CFIndex bytesRead;
-	CFTypeRef theResponsePropertyRef;
-	off_t contentLength;
-	CFStringRef contentLengthString;
-	CFStringRef connectionHeaderRef;
-	CFStringRef setCookieHeaderRef;
-	CFHTTPMessageRef responseMessage;
-	int result;
-	
-	result = 0;
-		
-	/*
-	 * If we're down and the mount is supposed to fail on disconnects
-	 * instead of retrying, just return an error.
-	 */
-	require_quiet(!gSuppressAllUI || (get_connectionstate() == WEBDAV_CONNECTION_UP), connection_down);
+	struct pollfd pfd;
 	
-	/* get the file length */
-	contentLength = lseek(file_fd, 0LL, SEEK_END);
-	require(contentLength != -1, lseek);
+	if ( gPipelineInputLength == gPipelineInputSize )
+	{
+		newInput = realloc(gPipelineInput, (gPipelineInputSize != 0) ? (gPipelineInputSize * 2) : BODY_BUFFER_SIZE);
+		require(newInput != NULL, realloc);
+		gPipelineInput = newInput;
+		gPipelineInputSize = (gPipelineInputSize != 0) ? (gPipelineInputSize * 2) : BODY_BUFFER_SIZE;
+	}
 	
-	/* create a string with the file length for the Content-Length header */
-	contentLengthString = CFStringCreateWithFormat(kCFAllocatorDefault, NULL, CFSTR("%qd"), contentLength);
-	/* CFReadStreamCreateForStreamedHTTPRequest will use chunked transfer-encoding if the Content-Length header cannot be provided */
-	if ( contentLengthString != NULL )
+	/* don't wait forever for a server that stopped answering */
+	if ( (gPipelineSocket >= 0) && !CFReadStreamHasBytesAvailable(gPipelineReadStream) )
 	{
-		CFHTTPMessageSetHeaderFieldValue(request, CFSTR("Content-Length"), contentLengthString);
-		CFRelease(contentLengthString);
+		pfd.fd = gPipelineSocket;
+		pfd.events = POLLIN;
+		pfd.revents = 0;
+		require_quiet(poll(&pfd, 1, WEBDAV_PIPELINE_TIMEOUT * 1000) > 0, poll);
 	}
 	
-	/* set the file position to 0 */
-	verify(lseek(file_fd, 0LL, SEEK_SET) != -1);
+	bytesRead = CFReadStreamRead(gPipelineReadStream, gPipelineInput + gPipelineInputLength, gPipelineInputSize - gPipelineInputLength);
+	require_quiet(bytesRead != 0, closed);
+	require_quiet(bytesRead > 0, CFReadStreamRead);
 	
-	/* create a stream from the file */
-	CFStreamCreatePairWithSocket(kCFAllocatorDefault, file_fd, &fdStream, NULL);
-	require(fdStream != NULL, CFReadStreamCreateWithFile);
+	gPipelineInputLength += bytesRead;
 	
-	result = open_stream_for_transaction(request, fdStream, FALSE, retryTransaction, &readStreamRecPtr);
-	require_noerr_quiet(result, open_stream_for_transaction);
-		
-	/* malloc a buffer big enough for most responses */
-	buffer = malloc(BODY_BUFFER_SIZE);
-	require(buffer != NULL, malloc_currentbuffer);
+	return ( 0 );
 
-	/* Send the message and eat the response */
-	while ( 1 )
+closed:
+
+	return ( EPIPE );
+
+CFReadStreamRead:
+poll:
+realloc:
+
+	return ( EIO );
+}
+
+/*****************************************************************************/
+
+/* pipeline_consume throws away the first length bytes of gPipelineInput */
+static void pipeline_consume(CFIndex length)
+{
+	memmove(gPipelineInput, gPipelineInput + length, gPipelineInputLength - length);
+	gPipelineInputLength -= length;
+}
+
+/*****************************************************************************/
+
+/*
+ * pipeline_line returns the length of the CRLF terminated line at offset in
+ * gPipelineInput (including the CRLF), reading more if needed.
+ */
+static int pipeline_line(CFIndex offset, CFIndex *length)
+{
+	CFIndex index;
+	int error;
+	
+	index = offset;
+	while ( TRUE )
 	{
-		bytesRead = CFReadStreamRead(readStreamRecPtr->readStreamRef, buffer, BODY_BUFFER_SIZE);
-		if ( bytesRead > 0 )
+		for ( ; index + 1 < gPipelineInputLength; ++index )
 		{
-			continue;
+			if ( (gPipelineInput[index] == '\r') && (gPipelineInput[index + 1] == '\n') )
+			{
+				*length = index + 2 - offset;
+				return ( 0 );
+			}
 		}
-		else if ( bytesRead == 0 )
+		error = pipeline_fill();
+		if ( error != 0 )
 		{
-			/* there are no more bytes to read */
-			break;
+			return ( error );
 		}
-		else
+	}
+}
+
+/*****************************************************************************/
+
+/*
+ * pipeline_read_body appends length bytes of the response body to the
+ * request's body, reading more if needed.
+ */
+static int pipeline_read_body(struct pipeline_request *preq, CFIndex length)
+{
+	UInt8 *newBody;
+	int error;
+	
+	while ( gPipelineInputLength < length )
+	{
+		error = pipeline_fill();
+		if ( error != 0 )
 		{
-			CFStreamError streamError;
-						
-			streamError = CFReadStreamGetError(readStreamRecPtr->readStreamRef);
-			if ( *retryTransaction && ((streamError.domain == kCFStreamErrorDomainPOSIX && streamError.error == EPIPE) ||
-									  (streamError.domain ==  kCFStreamErrorDomainHTTP && streamError.error ==  kCFStreamErrorHTTPConnectionLost)) )
-			{
-				/* if we get a POSIX errror back from the stream, retry the transaction once */
-				syslog(LOG_INFO,"stream_transaction_from_file: CFStreamError: domain %ld, error %lld -- retrying", streamError.domain, (SInt64)streamError.error);
-				*retryTransaction = FALSE;
-				result = EAGAIN;
-			}
-			else
-			{
-				if ( get_connectionstate() == WEBDAV_CONNECTION_UP )
-				{
-					syslog(LOG_ERR,"stream_transaction_from_file: CFStreamError: domain %ld, error %lld", streamError.domain, (SInt64)streamError.error);
-				}
-				set_connectionstate(WEBDAV_CONNECTION_DOWN);
-				result = stream_error_to_errno(&streamError);
-			}
-			goto CFReadStreamRead;
+			return ( error );
 		}
-	};
+	}
 	
-	free(buffer);
+	newBody = realloc(preq->body, preq->bodyLength + length + 1);
+	require(newBody != NULL, realloc);
+	preq->body = newBody;
+	memcpy(preq->body + preq->bodyLength, gPipelineInput, length);
+	preq->bodyLength += length;
+	pipeline_consume(length);
+	
+	return ( 0 );
 
-	/* get the response header */
-	theResponsePropertyRef = CFReadStreamCopyProperty(readStreamRecPtr->readStreamRef, kCFStreamPropertyHTTPResponseHeader);
-	require(theResponsePropertyRef != NULL, GetResponseHeader);
+realloc:
+
+	return ( ENOMEM );
+}
+
+/*****************************************************************************/
+
+/*
+ * pipeline_read_response reads the response to preq from the pipeline
+ * connection. Returns EPROTO if the response can't be framed.
+ */
+static int pipeline_read_response(struct pipeline_request *preq)
+{
+	CFIndex headerLength;
+	CFIndex lineLength;
+	CFIndex statusCode;
+	CFIndex chunkLength;
+	CFStringRef headerRef;
+	char value[32];
+	long long contentLength;
+	int error;
 	
-	/* fun with casting a "const void *" CFTypeRef away */
-	responseMessage = *((CFHTTPMessageRef*)((void*)&theResponsePropertyRef));
+	preq->body = malloc(1);
+	require_action(preq->body != NULL, malloc_body, error = ENOMEM);
+	preq->bodyLength = 0;
 	
-	set_connectionstate(WEBDAV_CONNECTION_UP);
+	do
+	{
+		/* find the end of the response header */
+		headerLength = 0;
+		do
+		{
+			error = pipeline_line(headerLength, &lineLength);
+			require_noerr_quiet(error, pipeline_line);
+			headerLength += lineLength;
+		} while ( lineLength != 2 );
+		
+		if ( preq->response != NULL )
+		{
+			CFRelease(preq->response);
+		}
+		preq->response = CFHTTPMessageCreateEmpty(kCFAllocatorDefault, FALSE);
+		require_action(preq->response != NULL, CFHTTPMessageCreateEmpty, error = ENOMEM);
+		require_action(CFHTTPMessageAppendBytes(preq->response, gPipelineInput, headerLength) &&
+			CFHTTPMessageIsHeaderComplete(preq->response), CFHTTPMessageAppendBytes, error = EPROTO);
+		pipeline_consume(headerLength);
+		
+		/* skip informational responses */
+		statusCode = CFHTTPMessageGetResponseStatusCode(preq->response);
+	} while ( (statusCode / 100) == 1 );
 	
-	/* Get the Connection header (if any) */
-	connectionHeaderRef = CFHTTPMessageCopyHeaderFieldValue(responseMessage, CFSTR("Connection"));
-	/* is the connection-token is "close"? */
-	if ( connectionHeaderRef != NULL )
+	if ( preq->noBody || (statusCode == 204) || (statusCode == 304) )
+	{
+		return ( 0 );
+	}
+	
+	headerRef = CFHTTPMessageCopyHeaderFieldValue(preq->response, CFSTR("Transfer-Encoding"));
+	if ( headerRef != NULL )
+	{
+		CFRange range = CFStringFind(headerRef, CFSTR("chunked"), kCFCompareCaseInsensitive);
+		CFRelease(headerRef);
+		require_action(range.location != kCFNotFound, Transfer_Encoding, error = EPROTO);
+		
+		/* read the chunks */
+		do
+		{
+			error = pipeline_line(0, &lineLength);
+			require_noerr_quiet(error, pipeline_line);
+			gPipelineInput[lineLength - 2] = '\0';
+			contentLength = strtoll((char *)gPipelineInput, NULL, 16);
+			pipeline_consume(lineLength);
+			require_action((contentLength >= 0) && (contentLength <= INT32_MAX - preq->bodyLength), Transfer_Encoding, error = EPROTO);
+			chunkLength = (CFIndex)contentLength;
+			
+			if ( chunkLength != 0 )
+			{
+				error = pipeline_read_body(preq, chunkLength);
+				require_noerr_quiet(error, pipeline_read_body);
+				
+				/* the CRLF after the chunk's data */
+				error = pipeline_line(0, &lineLength);
+				require_noerr_quiet(error, pipeline_line);
+				require_action(lineLength == 2, Transfer_Encoding, error = EPROTO);
+				pipeline_consume(lineLength);
+			}
+		} while ( chunkLength != 0 );
+		
+		/* skip the trailer */
+		do
+		{
+			error = pipeline_line(0, &lineLength);
+			require_noerr_quiet(error, pipeline_line);
+			pipeline_consume(lineLength);
+		} while ( lineLength != 2 );
+	}
+	else
 	{
-		if ( CFStringCompare(connectionHeaderRef, CFSTR("close"), kCFCompareCaseInsensitive) == kCFCompareEqualTo )
+		/* without a Content-Length, the body runs until the connection closes and can't be pipelined */
+		headerRef = CFHTTPMessageCopyHeaderFieldValue(preq->response, CFSTR("Content-Length"));
+		require_action(headerRef != NULL, Content_Length, error = EPROTO);
+		contentLength = -1;
+		if ( CFStringGetCString(headerRef, value, sizeof(value), kCFStringEncodingASCII) )
 		{
-			/* yes -- then the server closed this connection, so close and release the read stream now */
-			CFReadStreamClose(readStreamRecPtr->readStreamRef);
-			CFRelease(readStreamRecPtr->readStreamRef);
-			readStreamRecPtr->readStreamRef = NULL;
+			contentLength = strtoll(value, NULL, 10);
 		}
-		CFRelease(connectionHeaderRef);
-	}
-	
-	// Handle cookies
-	setCookieHeaderRef = CFHTTPMessageCopyHeaderFieldValue(responseMessage, CFSTR("Set-Cookie"));
-	if (setCookieHeaderRef != NULL) {
-		handle_cookies(setCookieHeaderRef, request);
-		CFRelease(setCookieHeaderRef);
+		CFRelease(headerRef);
+		require_action((contentLength >= 0) && (contentLength <= INT32_MAX), Content_Length, error = EPROTO);
+		
+		error = pipeline_read_body(preq, (CFIndex)contentLength);
+		require_noerr_quiet(error, pipeline_read_body);
 	}
-
-	CFRelease(fdStream);
-
-	/* make this ReadStreamRec is available again */
-	release_ReadStreamRec(readStreamRecPtr);
-	
-	/* fun with casting a "const void *" CFTypeRef away */
-	*response = responseMessage;
 	
 	return ( 0 );
 
-	/**********************/
+Content_Length:
+Transfer_Encoding:
+pipeline_read_body:
+CFHTTPMessageAppendBytes:
+CFHTTPMessageCreateEmpty:
+pipeline_line:
+
+	free(preq->body);
+	preq->body = NULL;
+	preq->bodyLength = 0;
+	if ( preq->response != NULL )
+	{
+		CFRelease(preq->response);
+		preq->response = NULL;
+	}
 
-CFReadStreamRead:
+malloc_body:
 
-	free(buffer);
+	return ( error );
+}
 
-GetResponseHeader:
-malloc_currentbuffer:
+/*****************************************************************************/
 
-	CFReadStreamClose(readStreamRecPtr->readStreamRef);
-	CFRelease(readStreamRecPtr->readStreamRef);
-	readStreamRecPtr->readStreamRef = NULL;
+/*
+ * pipeline_fail finishes every request written to the pipeline connection
+ * with ENOTSUP so they're sent one at a time, and closes the connection.
+ * If misbehaved is TRUE (the server got the framing or protocol wrong),
+ * pipelining is turned off. If flush_pending is TRUE, the requests not
+ * written yet are sent one at a time too. Called with gPipeline_lock locked
+ * by the thread driving the pipeline.
+ */
+static void pipeline_fail(int misbehaved, int flush_pending)
+{
+	struct pipeline_request *preq;
 	
-	/* make this ReadStreamRec is available again */
-	release_ReadStreamRec(readStreamRecPtr);
-
-	CFRelease(fdStream);
-
-CFReadStreamCreateWithFile:
-
-lseek:
-open_stream_for_transaction:
-connection_down:
-
-	*response = NULL;
-
-	if ( result == 0 )
+	while ( (preq = TAILQ_FIRST(&gPipelineSent)) != NULL )
 	{
-		result = EIO;
+		TAILQ_REMOVE(&gPipelineSent, preq, link);
+		preq->error = ENOTSUP;
+		preq->done = TRUE;
+		++gPipelineStats.fallbacks;
 	}
-
-	return ( result );
+	gPipelineSentCount = 0;
+	
+	if ( misbehaved && (gPipelineDepth != 0) )
+	{
+		syslog(LOG_INFO, "pipeline_fail: the server doesn't handle pipelined requests; sending them one at a time");
+		gPipelineDepth = 0;
+		
+		/* nothing else will be written, so send the rest one at a time too */
+		flush_pending = TRUE;
+	}
+	
+	if ( flush_pending )
+	{
+		while ( (preq = TAILQ_FIRST(&gPipelinePending)) != NULL )
+		{
+			TAILQ_REMOVE(&gPipelinePending, preq, link);
+			preq->error = ENOTSUP;
+			preq->done = TRUE;
+			++gPipelineStats.fallbacks;
+		}
+	}
+	
+	pipeline_disconnect();
+	pthread_cond_broadcast(&gPipeline_cond);
 }
 
-/******************************************************************************/
+/*****************************************************************************/
 
 /*
- * stream_transaction
- *
- * Creates an HTTP stream, sends the request and returns the response and response body.
+ * pipeline_connection_close returns TRUE if response's Connection header (a
+ * comma separated list of connection-tokens) has the "close" token.
  */
-static int stream_transaction(
-	CFHTTPMessageRef request,	/* -> the request to send */
-	int auto_redirect,			/* -> if TRUE, set kCFStreamPropertyHTTPShouldAutoredirect on stream */
-	int *retryTransaction,		/* -> if TRUE, return EAGAIN on errors when streamError is kCFStreamErrorDomainPOSIX/EPIPE and set retryTransaction to FALSE */ 
-	UInt8 **buffer,				/* <- response data buffer (caller responsible for freeing) */
-	CFIndex *count,				/* <- response data buffer length */
-	CFHTTPMessageRef *response)	/* <- the response message */
+static int pipeline_connection_close(CFHTTPMessageRef response)
 {
-	struct ReadStreamRec *readStreamRecPtr;
-	CFIndex	totalRead;
-	UInt8 *currentbuffer;
-	UInt8 *newBuffer;
-	CFIndex bytesRead;
-	CFIndex bytesToRead;
-	CFIndex bufferSize;
-	CFTypeRef theResponsePropertyRef;
 	CFStringRef connectionHeaderRef;
-	CFStringRef setCookieHeaderRef;
-	CFHTTPMessageRef responseMessage;
+	CFArrayRef tokens;
+	CFMutableStringRef token;
+	CFIndex index;
 	int result;
 	
-	result = 0;
-	
-	/*
-	 * If we're down and the mount is supposed to fail on disconnects
-	 * instead of retrying, just return an error.
-	 */
-	require_quiet(!gSuppressAllUI || (get_connectionstate() == WEBDAV_CONNECTION_UP), connection_down);
-	
-	/* get an open ReadStreamRec */
-	result = open_stream_for_transaction(request, NULL, auto_redirect, retryTransaction, &readStreamRecPtr);
-	require_noerr_quiet(result, open_stream_for_transaction);
-	
-	/* malloc a buffer big enough for most responses */
-	bufferSize = BODY_BUFFER_SIZE;
-	currentbuffer = malloc(bufferSize);
-	require(currentbuffer != NULL, malloc_currentbuffer);
-
-	/* Send the message and get the response */
-	totalRead = 0;
-	while ( 1 )
+	result = FALSE;
+	connectionHeaderRef = CFHTTPMessageCopyHeaderFieldValue(response, CFSTR("Connection"));
+	if ( connectionHeaderRef != NULL )
 	{
-		bytesToRead = bufferSize - totalRead;
-		bytesRead = CFReadStreamRead(readStreamRecPtr->readStreamRef, currentbuffer + totalRead, bytesToRead);
-		if ( bytesRead > 0 )
+		tokens = CFStringCreateArrayBySeparatingStrings(kCFAllocatorDefault, connectionHeaderRef, CFSTR(","));
+		if ( tokens != NULL )
 		{
-			totalRead += bytesRead;
-			
-			/* is currentbuffer getting close to full? */
-			if ( (bytesToRead - bytesRead) < (BODY_BUFFER_SIZE / 2) )
+			for ( index = 0; (index < CFArrayGetCount(tokens)) && !result; ++index )
 			{
-				/* yes, so get larger currentbuffer for next read */
-				bufferSize += BODY_BUFFER_SIZE;
-				newBuffer = realloc(currentbuffer, bufferSize);
-				require(newBuffer != NULL, realloc);
-				
-				currentbuffer = newBuffer;
+				token = CFStringCreateMutableCopy(kCFAllocatorDefault, 0, CFArrayGetValueAtIndex(tokens, index));
+				if ( token != NULL )
+				{
+					CFStringTrimWhitespace(token);
+					result = (CFStringCompare(token, CFSTR("close"), kCFCompareCaseInsensitive) == kCFCompareEqualTo);
+					CFRelease(token);
+				}
 			}
+			CFRelease(tokens);
 		}
-		else if ( bytesRead == 0 )
+		CFRelease(connectionHeaderRef);
+	}
+	
+	return ( result );
+}
+
+/*****************************************************************************/
+
+/*
+ * pipeline_drive writes the queued requests (keeping no more than
+ * gPipelineDepth waiting for responses) and reads responses in order until
+ * mine is done. Called with gPipeline_lock locked by the thread driving the
+ * pipeline; the lock is dropped around the I/O.
+ */
+static void pipeline_drive(struct pipeline_request *mine)
+{
+	struct pipeline_request *preq;
+	CFIndex written;
+	CFIndex length;
+	const UInt8 *bytes;
+	int error;
+	
+	while ( !mine->done )
+	{
+		/* a server closes an idle connection, so don't write a batch into one it has closed */
+		if ( (gPipelineReadStream != NULL) && (gPipelineSentCount == 0) &&
+			 (((time(NULL) - gPipelineLastUsed) > gConnectionIdleTimeout) || !pipeline_is_open()) )
 		{
-			/* there are no more bytes to read */
-			break;
+			pipeline_disconnect();
 		}
-		else
+		
+		if ( gPipelineReadStream == NULL )
 		{
-			result = HandleSSLErrors(readStreamRecPtr->readStreamRef);
-			if ( result != EAGAIN )
+			pthread_mutex_unlock(&gPipeline_lock);
+			error = pipeline_connect();
+			pthread_mutex_lock(&gPipeline_lock);
+			if ( error != 0 )
 			{
-				if ( result != ECANCELED )
+				/*
+				 * The server may just be unreachable for now, so send this
+				 * batch one at a time and try the pipeline connection again later.
+				 */
+				gPipelineRetryTime = time(NULL) + WEBDAV_PIPELINE_RETRY_DELAY;
+				pipeline_fail(FALSE, TRUE);
+				continue;
+			}
+		}
+		
+		/* write what's queued */
+		error = 0;
+		while ( ((preq = TAILQ_FIRST(&gPipelinePending)) != NULL) && (gPipelineSentCount < gPipelineDepth) )
+		{
+			TAILQ_REMOVE(&gPipelinePending, preq, link);
+			TAILQ_INSERT_TAIL(&gPipelineSent, preq, link);
+			if ( gPipelineSentCount++ != 0 )
+			{
+				++gPipelineStats.overlapped;
+			}
+			++gPipelineStats.sent;
+			
+			pthread_mutex_unlock(&gPipeline_lock);
+			bytes = CFDataGetBytePtr(preq->serialized);
+			length = CFDataGetLength(preq->serialized);
+			error = 0;
+			while ( length != 0 )
+			{
+				written = CFWriteStreamWrite(gPipelineWriteStream, bytes, length);
+				if ( written <= 0 )
 				{
-					CFStreamError streamError;
-								
-					streamError = CFReadStreamGetError(readStreamRecPtr->readStreamRef);
-					if ( *retryTransaction &&
-						((streamError.domain == kCFStreamErrorDomainPOSIX && streamError.error == EPIPE) ||
-						 (streamError.domain ==  kCFStreamErrorDomainHTTP && streamError.error ==  kCFStreamErrorHTTPConnectionLost)) )
-					{
-						/* if we get a POSIX EPIPE or HTTP Connection Lost error back from the stream, retry the transaction once */
-						syslog(LOG_INFO,"stream_transaction: CFStreamError: domain %ld, error %lld -- retrying", streamError.domain, (SInt64)streamError.error);
-						*retryTransaction = FALSE;
-						result = EAGAIN;
-					}
-					else
-					{
-						if ( get_connectionstate() == WEBDAV_CONNECTION_UP )
-						{
-							syslog(LOG_ERR,"stream_transaction: CFStreamError: domain %ld, error %lld", streamError.domain, (SInt64)streamError.error);
-						}
-						set_connectionstate(WEBDAV_CONNECTION_DOWN);
-						result = stream_error_to_errno(&streamError);
-					}
+					error = EIO;
+					break;
 				}
+				bytes += written;
+				length -= written;
+			}
+			pthread_mutex_lock(&gPipeline_lock);
+			if ( error != 0 )
+			{
+				break;
 			}
-			goto CFReadStreamRead;
 		}
-	};
-	
-	/* get the response header */
-	theResponsePropertyRef = CFReadStreamCopyProperty(readStreamRecPtr->readStreamRef, kCFStreamPropertyHTTPResponseHeader);
-	require(theResponsePropertyRef != NULL, GetResponseHeader);
+		if ( error != 0 )
+		{
+			pipeline_fail(FALSE, FALSE);
+			continue;
+		}
+		
+		/* read the response at the head of the line */
+		preq = TAILQ_FIRST(&gPipelineSent);
+		if ( preq == NULL )
+		{
+			/* mine was finished by pipeline_fail */
+			continue;
+		}
+		pthread_mutex_unlock(&gPipeline_lock);
+		error = pipeline_read_response(preq);
+		pthread_mutex_lock(&gPipeline_lock);
+		if ( error != 0 )
+		{
+			/*
+			 * A server that closes the connection with several requests
+			 * outstanding (and no Connection: close) doesn't pipeline.
+			 */
+			pipeline_fail((error == EPROTO) || ((error == EPIPE) && (gPipelineSentCount > 1)), FALSE);
+			continue;
+		}
+		
+		TAILQ_REMOVE(&gPipelineSent, preq, link);
+		--gPipelineSentCount;
+		preq->done = TRUE;
+		gPipelineLastUsed = time(NULL);
+		
+		if ( pipeline_connection_close(preq->response) )
+		{
+			/* the rest weren't answered, so they go one at a time */
+			pipeline_fail(FALSE, FALSE);
+		}
+		else
+		{
+			pthread_cond_broadcast(&gPipeline_cond);
+		}
+	}
+}
+
+/*****************************************************************************/
+
+/*
+ * pipeline_transaction is the "pipelined" Transport. It sends request on the
+ * pipeline connection and returns its response like stream_transaction does.
+ * Returns ENOTSUP if pipelining is off or the request can't be pipelined, in
+ * which case it should be sent with stream_transaction.
+ */
+static int pipeline_transaction(
+	CFHTTPMessageRef request,	/* -> the request to send */
+	int auto_redirect,			/* -> if TRUE, redirects are followed (by stream_transaction) */
+	int *retryTransaction,		/* <-> not used -- failed requests go to stream_transaction */
+	struct BodyConsumer *consumer, /* -> must be NULL; bodies aren't streamed to consumers */
+	int decode,					/* -> not used -- the caller decodes the returned buffer */
+	UInt8 **buffer,				/* <- response data buffer (caller responsible for freeing) */
+	CFIndex *count,				/* <- response data buffer length */
+	CFHTTPMessageRef *response)	/* <- the response message */
+{
+	#pragma unused(retryTransaction, decode)
+	struct pipeline_request preq;
+	CFStringRef setCookieHeaderRef;
+	CFIndex statusCode;
+	int proxied;
 	
-	/* fun with casting a "const void *" CFTypeRef away */
-	responseMessage = *((CFHTTPMessageRef*)((void*)&theResponsePropertyRef));
+	/* a proxy needs CFHTTPStream */
+	pthread_mutex_lock(&gNetworkGlobals_lock);
+	proxied = gHttpProxyEnabled || gHttpsProxyEnabled;
+	pthread_mutex_unlock(&gNetworkGlobals_lock);
+	if ( (gPipelineDepth == 0) || proxied || (consumer != NULL) )
+	{
+		return ( ENOTSUP );
+	}
 	
-	set_connectionstate(WEBDAV_CONNECTION_UP);
+	bzero(&preq, sizeof(preq));
+	preq.serialized = pipeline_serialize(request, &preq.noBody);
+	if ( preq.serialized == NULL )
+	{
+		return ( ENOTSUP );
+	}
 	
-	/* Get the Connection header (if any) */
-	connectionHeaderRef = CFHTTPMessageCopyHeaderFieldValue(responseMessage, CFSTR("Connection"));
-	/* is the connection-token is "close"? */
-	if ( connectionHeaderRef != NULL )
+	pthread_mutex_lock(&gPipeline_lock);
+	if ( (gPipelineDepth == 0) || (time(NULL) < gPipelineRetryTime) )
 	{
-		if ( CFStringCompare(connectionHeaderRef, CFSTR("close"), kCFCompareCaseInsensitive) == kCFCompareEqualTo )
+		preq.error = ENOTSUP;
+		preq.done = TRUE;
+	}
+	else
+	{
+		TAILQ_INSERT_TAIL(&gPipelinePending, &preq, link);
+	}
+	while ( !preq.done )
+	{
+		if ( !gPipelineDriving )
 		{
-			/* yes -- then the server closed this connection, so close and release the read stream now */
-			CFReadStreamClose(readStreamRecPtr->readStreamRef);
-			CFRelease(readStreamRecPtr->readStreamRef);
-			readStreamRecPtr->readStreamRef = NULL;
+			gPipelineDriving = TRUE;
+			pipeline_drive(&preq);
+			gPipelineDriving = FALSE;
+			
+			/* let a waiting thread take over */
+			pthread_cond_broadcast(&gPipeline_cond);
+		}
+		else
+		{
+			pthread_cond_wait(&gPipeline_cond, &gPipeline_lock);
 		}
-		CFRelease(connectionHeaderRef);
 	}
+	pthread_mutex_unlock(&gPipeline_lock);
 	
-	// Handle cookies
-	setCookieHeaderRef = CFHTTPMessageCopyHeaderFieldValue(responseMessage, CFSTR("Set-Cookie"));
-	if (setCookieHeaderRef != NULL) {
-		handle_cookies(setCookieHeaderRef, request);
-		CFRelease(setCookieHeaderRef);
-	}
+	CFRelease(preq.serialized);
 	
-	/* make this ReadStreamRec is available again */
-	release_ReadStreamRec(readStreamRecPtr);
-		
-	*response = responseMessage;
-	*count = totalRead;
-	*buffer = currentbuffer;
+	if ( preq.error == 0 )
+	{
+		statusCode = CFHTTPMessageGetResponseStatusCode(preq.response);
+		if ( (auto_redirect && ((statusCode / 100) == 3)) || (statusCode == 401) || (statusCode == 407) )
+		{
+			/*
+			 * let CFNetwork follow the redirect, or do the authentication
+			 * handshake (some schemes authenticate the connection)
+			 */
+			free(preq.body);
+			CFRelease(preq.response);
+			preq.error = ENOTSUP;
+		}
+		else
+		{
+			set_connectionstate(WEBDAV_CONNECTION_UP);
+			
+			// Handle cookies
+			setCookieHeaderRef = CFHTTPMessageCopyHeaderFieldValue(preq.response, CFSTR("Set-Cookie"));
+			if ( setCookieHeaderRef != NULL )
+			{
+				handle_cookies(setCookieHeaderRef, request);
+				CFRelease(setCookieHeaderRef);
+			}
+			
+			*buffer = preq.body;
+			*count = preq.bodyLength;
+			*response = preq.response;
+		}
+	}
 	
-	return ( 0 );
-
-	/**********************/
-
-GetResponseHeader:
-CFReadStreamRead:
-realloc:
+	return ( preq.error );
+}
 
-	free(currentbuffer);
+/******************************************************************************/
 
-malloc_currentbuffer:
+/*
+ * The transports WEBDAVFS_TRANSPORT can select. "cfnetwork" sends every request
+ * with stream_transaction (one request per connection at a time), and is the
+ * fallback for requests the others can't send.
+ */
+static const struct Transport gTransports[] =
+{
+	{ "cfnetwork", stream_transaction },
+	{ "pipelined", pipeline_transaction },
+};
 
-	/* close and release the read stream on errors */
-	CFReadStreamClose(readStreamRecPtr->readStreamRef);
-	CFRelease(readStreamRecPtr->readStreamRef);
-	readStreamRecPtr->readStreamRef = NULL;
+static const struct Transport *transport_named(const char *name)
+{
+	unsigned int index;
 	
-	/* make this ReadStreamRec is available again */
-	release_ReadStreamRec(readStreamRecPtr);
-
-open_stream_for_transaction:
-connection_down:
-
-	*response = NULL;
-	*count = 0;
-	*buffer = NULL;
-	if ( result == 0 )
+	for ( index = 0; index < sizeof(gTransports) / sizeof(gTransports[0]); ++index )
 	{
-		result = EIO;
+		if ( strcmp(gTransports[index].name, name) == 0 )
+		{
+			return ( &gTransports[index] );
+		}
 	}
 	
-	return ( result );
+	return ( NULL );
 }
 
 /******************************************************************************/
 
 /*
- * send_transaction
+ * send_transaction_to_consumer
  *
  * Creates a request, adds the message body, headers and authentication if needed,
  * and then calls stream_transaction() to send the request to the server and get
  * the server's response. If the caller requests the response body and/or the
  * response message, they are returned. Otherwise, they are freed/released.
+ * If there's a consumer, the body of a successful response is passed to it
+ * instead of being returned (and count is the number of bytes it was given).
  *
  * The 'node' parameter is needed for handling http redirects:
  * auto_redirect true  - node involved in the transaction, NULL if root node.
  * auto_redirect false - node is not used.
  */
-static int send_transaction(
+static int send_transaction_to_consumer(
 	uid_t uid,							/* -> uid of the user making the request */
 	CFURLRef url,						/* -> url to the resource */
 	struct node_entry *node,			/* <- the node involved in the transaction (needed to handle http redirects if auto_redirect if false) */
@@ -2411,6 +4876,7 @@ static int send_transaction(
 	CFIndex headerCount,				/* -> number of headers */
 	struct HeaderFieldValue *headers,	/* -> pointer to array of struct HeaderFieldValue, or NULL if none */
 	enum RedirectAction redirectAction,		/* -> specifies how to handle http 3xx redirection */
+	struct BodyConsumer *consumer,		/* -> if not NULL, the consumer for a successful response's body */
 	UInt8 **buffer,						/* <- if not NULL, response data buffer is returned here (caller responsible for freeing) */
 	CFIndex *count,						/* <- if not NULL, response data buffer length is returned here*/
 	CFHTTPMessageRef *response)			/* <- if not NULL, response is returned here */
@@ -2426,6 +4892,7 @@ static int send_transaction(
 	CFIndex responseBufferLength;
 	int retryTransaction;
 	int auto_redirect;
+	int decode;
 	
 	error = 0;
 	responseBuffer = NULL;
@@ -2478,6 +4945,13 @@ static int send_transaction(
 		/* add cookies (if any) */
 		add_cookie_headers(message, url);
 		
+		/* multistatus XML compresses well, so ask for PROPFIND responses compressed */
+		decode = gAcceptEncoding && (CFStringCompare(requestMethod, CFSTR("PROPFIND"), 0) == kCFCompareEqualTo);
+		if ( decode )
+		{
+			CFHTTPMessageSetHeaderFieldValue(message, CFSTR("Accept-Encoding"), CFSTR("gzip, deflate"));
+		}
+		
 		/* add other HTTP headers (if any) */
 		for ( i = 0, headerPtr = headers; i < headerCount; ++i, ++headerPtr )
 		{
@@ -2507,8 +4981,13 @@ static int send_transaction(
 			CFRelease(responseRef);
 			responseRef = NULL;
 		}
-		/* now that everything's ready to send, send it */
-		error = stream_transaction(message, auto_redirect, &retryTransaction, &responseBuffer, &responseBufferLength, &responseRef);
+		/* now that everything's ready to send, send it with the mount's transport */
+		error = gTransport->transaction(message, auto_redirect, &retryTransaction, consumer, decode, &responseBuffer, &responseBufferLength, &responseRef);
+		if ( (error == ENOTSUP) && (gTransport->transaction != stream_transaction) )
+		{
+			/* the transport couldn't send it, so send it one at a time */
+			error = stream_transaction(message, auto_redirect, &retryTransaction, consumer, decode, &responseBuffer, &responseBufferLength, &responseRef);
+		}
 		if ( error == EAGAIN )
 		{
 			statusCode = 0;
@@ -2521,6 +5000,16 @@ static int send_transaction(
 				break;
 			}
 			
+			/* inflate a compressed body we asked for that the transport returned in a buffer */
+			if ( decode )
+			{
+				error = content_decode_buffer(responseRef, &responseBuffer, &responseBufferLength);
+				if ( error != 0 )
+				{
+					break;
+				}
+			}
+			
 			/* get the status code */
 			statusCode = CFHTTPMessageGetResponseStatusCode(responseRef);
 			
@@ -2602,6 +5091,31 @@ CFHTTPMessageCreateRequest:
 
 /*****************************************************************************/
 
+/*
+ * send_transaction
+ *
+ * send_transaction_to_consumer without a consumer: the response body (if
+ * requested) is returned in a buffer.
+ */
+static int send_transaction(
+	uid_t uid,							/* -> uid of the user making the request */
+	CFURLRef url,						/* -> url to the resource */
+	struct node_entry *node,			/* <- the node involved in the transaction (needed to handle http redirects if auto_redirect if false) */
+	CFStringRef requestMethod,			/* -> the request method */
+	CFDataRef bodyData,					/* -> message body data, or NULL if no body */
+	CFIndex headerCount,				/* -> number of headers */
+	struct HeaderFieldValue *headers,	/* -> pointer to array of struct HeaderFieldValue, or NULL if none */
+	enum RedirectAction redirectAction,		/* -> specifies how to handle http 3xx redirection */
+	UInt8 **buffer,						/* <- if not NULL, response data buffer is returned here (caller responsible for freeing) */
+	CFIndex *count,						/* <- if not NULL, response data buffer length is returned here*/
+	CFHTTPMessageRef *response)			/* <- if not NULL, response is returned here */
+{
+	return ( send_transaction_to_consumer(uid, url, node, requestMethod, bodyData, headerCount, headers,
+		redirectAction, NULL, buffer, count, response) );
+}
+
+/*****************************************************************************/
+
 /*
  * ParseDAVLevel parses a DAV header's field-value (if any) to get the DAV level.
  *	Input:
@@ -3046,6 +5560,133 @@ create_cfurl_from_node:
 
 /******************************************************************************/
 
+/*
+ * Stat-ahead. Listing a large directory and then stat'ing its children (ls -l,
+ * the Finder) would cost a Depth 0 PROPFIND per child once their attributes
+ * go stale. stat_ahead_dirs watches the directories whose children were most
+ * recently found stale; when one gets WEBDAV_STAT_AHEAD_MISSES within
+ * WEBDAV_STAT_AHEAD_WINDOW seconds, all of its children's attributes are
+ * refreshed with one Depth 1 PROPFIND. Threads that find a refresh of the same
+ * directory in progress wait for it instead of sending their own requests.
+ */
+struct stat_ahead_dir
+{
+	struct node_entry *node;	/* the directory, or NULL if the slot is free */
+	uid_t uid;					/* the uid the attributes are being cached for */
+	time_t window_start;		/* local time - when misses started being counted */
+	u_int32_t misses;			/* stale children stat'd since window_start */
+	int in_progress;			/* TRUE while the directory is being refreshed */
+	u_int32_t generation;		/* incremented each time a refresh finishes */
+};
+
+static pthread_mutex_t stat_ahead_lock = PTHREAD_MUTEX_INITIALIZER;	/* protects stat_ahead_dirs */
+static pthread_cond_t stat_ahead_cond = PTHREAD_COND_INITIALIZER;	/* broadcast when a refresh finishes */
+static struct stat_ahead_dir stat_ahead_dirs[WEBDAV_STAT_AHEAD_DIRS];
+
+/*
+ * network_stat_ahead is called before node's stale attributes are fetched on
+ * their own. It returns TRUE if node's parent directory was just refreshed (by
+ * this thread or another), in which case the caller should check node's
+ * attributes again before asking the server for them.
+ */
+int network_stat_ahead(
+	uid_t uid,					/* -> uid of the user making the request */
+	struct node_entry *node)	/* -> node whose attributes are stale */
+{
+	struct node_entry *parent_node;
+	struct stat_ahead_dir *dir;
+	struct stat_ahead_dir *victim;
+	u_int32_t generation;
+	int index;
+	time_t now;
+	int refreshed;
+	int error;
+	
+	refreshed = FALSE;
+	
+	parent_node = node->parent;
+	require_quiet((parent_node != NULL) && !NODE_IS_DELETED(parent_node), no_parent);
+	
+	now = time(NULL);
+	
+	require_noerr(pthread_mutex_lock(&stat_ahead_lock), pthread_mutex_lock);
+	
+	/* find the parent's slot, or take the one least recently counted in that isn't busy */
+	dir = victim = NULL;
+	for ( index = 0; index < WEBDAV_STAT_AHEAD_DIRS; ++index )
+	{
+		struct stat_ahead_dir *slot = &stat_ahead_dirs[index];
+		
+		if ( (slot->node == parent_node) && (slot->uid == uid) )
+		{
+			dir = slot;
+			break;
+		}
+		if ( !slot->in_progress && ((victim == NULL) || (slot->window_start < victim->window_start)) )
+		{
+			victim = slot;
+		}
+	}
+	if ( dir == NULL )
+	{
+		require_quiet(victim != NULL, no_slot);
+		dir = victim;
+		dir->node = parent_node;
+		dir->uid = uid;
+		dir->window_start = now;
+		dir->misses = 0;
+	}
+	
+	if ( dir->in_progress )
+	{
+		/* coalesce with the refresh that's already going */
+		generation = dir->generation;
+		while ( dir->in_progress && (dir->generation == generation) )
+		{
+			require_noerr(pthread_cond_wait(&stat_ahead_cond, &stat_ahead_lock), pthread_cond_wait);
+		}
+		refreshed = TRUE;
+	}
+	else
+	{
+		if ( now >= dir->window_start + WEBDAV_STAT_AHEAD_WINDOW )
+		{
+			dir->window_start = now;
+			dir->misses = 0;
+		}
+		if ( ++dir->misses >= WEBDAV_STAT_AHEAD_MISSES )
+		{
+			dir->in_progress = TRUE;
+			dir->misses = 0;
+			
+			pthread_mutex_unlock(&stat_ahead_lock);
+			
+			error = network_propfind_directory(uid, FALSE, parent_node, -1);
+			LogMessage(kTrace, "network_stat_ahead: refreshed %s, error %d\n", parent_node->name, error);
+			
+			pthread_mutex_lock(&stat_ahead_lock);
+			
+			dir->in_progress = FALSE;
+			dir->window_start = time(NULL);
+			++dir->generation;
+			pthread_cond_broadcast(&stat_ahead_cond);
+			refreshed = (error == 0);
+		}
+	}
+
+pthread_cond_wait:
+no_slot:
+
+	pthread_mutex_unlock(&stat_ahead_lock);
+
+pthread_mutex_lock:
+no_parent:
+
+	return ( refreshed );
+}
+
+/******************************************************************************/
+
 /* NOTE: this will do both the OPTIONS and the PROPFIND. */
 /* NOTE: if webdavfs is changed to support advlocks, then 
  * server_mount_flags parameter is not needed.
@@ -3159,17 +5800,39 @@ int network_mount(
 
 int network_finish_download(
 	struct node_entry *node,
-	struct ReadStreamRec *readStreamRecPtr)
+	struct ReadStreamRec *readStreamRecPtr,
+	struct download_segments *segments)
 {
 	UInt8 *buffer;
 	CFIndex bytesRead;
+	CFIndex readLength;
+	off_t remaining;
+	
+	/* with segments, this stream only provides the first segment */
+	remaining = 0;
+	if ( segments != NULL )
+	{
+		remaining = segments->segment[0].end - lseek(node->file_fd, 0LL, SEEK_END);
+	}
 	
-	/* malloc a buffer */
-	buffer = malloc(BODY_BUFFER_SIZE);
+	/* get a buffer */
+	buffer = body_buffer_get();
 	require(buffer != NULL, malloc_buffer);
 
 	while ( 1 )
 	{
+		readLength = BODY_BUFFER_SIZE;
+		if ( segments != NULL )
+		{
+			if ( remaining == 0 )
+			{
+				/* the rest of the response isn't wanted, so the connection can't be reused */
+				readStreamRecPtr->connectionClose = TRUE;
+				break;
+			}
+			readLength = (CFIndex)MIN(remaining, BODY_BUFFER_SIZE);
+		}
+		
 		/* were we asked to terminate the download? */
 		if ( (node->file_status & WEBDAV_DOWNLOAD_TERMINATED) != 0 )
 		{
@@ -3198,14 +5861,17 @@ int network_finish_download(
 			}
 		}
 		
-		bytesRead = CFReadStreamRead(readStreamRecPtr->readStreamRef, buffer, BODY_BUFFER_SIZE);
+		bytesRead = CFReadStreamRead(readStreamRecPtr->readStreamRef, buffer, readLength);
 		if ( bytesRead > 0 )
 		{
 			require(write(node->file_fd, buffer, (size_t)bytesRead) == (ssize_t)bytesRead, write);
+			remaining -= bytesRead;
+			requestqueue_download_progress(node);
 		}
 		else if ( bytesRead == 0 )
 		{
 			/* there are no more bytes to read */
+			require(segments == NULL, CFReadStreamRead);
 			break;
 		}
 		else
@@ -3219,7 +5885,7 @@ int network_finish_download(
 		}
 	};
 
-	free(buffer);
+	body_buffer_put(buffer, BODY_BUFFER_SIZE);
 
 	if ( readStreamRecPtr->connectionClose )
 	{
@@ -3232,13 +5898,22 @@ int network_finish_download(
 	/* make this ReadStreamRec is available again */
 	release_ReadStreamRec(readStreamRecPtr);
 	
+	if ( segments != NULL )
+	{
+		/* now append the other segments as they arrive */
+		if ( download_segments_assemble(node, segments) != 0 )
+		{
+			return ( EIO );
+		}
+	}
+	
 	return ( 0 );
 
 terminated:
 write:
 CFReadStreamRead:
 
-	free(buffer);
+	body_buffer_put(buffer, BODY_BUFFER_SIZE);
 
 malloc_buffer:
 
@@ -3249,6 +5924,11 @@ malloc_buffer:
 	
 	/* make this ReadStreamRec is available again */
 	release_ReadStreamRec(readStreamRecPtr);
+	
+	if ( segments != NULL )
+	{
+		download_segments_abort(segments);
+	}
 
 	return ( EIO );
 }
@@ -3740,35 +6420,70 @@ int network_open(
 			if ( (node->file_status & WEBDAV_DOWNLOAD_STATUS_MASK) != WEBDAV_DOWNLOAD_NEVER )
 			{
 				CFStringRef httpDateString;
+				CFStringRef entityTagString;
 				
-				httpDateString = CFStringCreateRFC2616DateStringWithTimeT(node->file_last_modified);
-				if ( httpDateString != NULL )
+				httpDateString = (node->file_last_modified != -1) ?
+					CFStringCreateRFC2616DateStringWithTimeT(node->file_last_modified) : NULL;
+				entityTagString = (node->file_entity_tag != NULL) ?
+					CFStringCreateWithCString(kCFAllocatorDefault, node->file_entity_tag, kCFStringEncodingUTF8) : NULL;
+				
+				if ( (node->file_status & WEBDAV_DOWNLOAD_STATUS_MASK) == WEBDAV_DOWNLOAD_FINISHED )
 				{
-					if ( (node->file_status & WEBDAV_DOWNLOAD_STATUS_MASK) == WEBDAV_DOWNLOAD_FINISHED )
+					/*
+					 * If-None-Match catches changes made within the same second as the
+					 * Last-Modified date, so it's sent when there's an entity tag (weak
+					 * ones too -- If-None-Match uses the weak comparison). Servers that
+					 * understand it ignore If-Modified-Since, which is sent for the ones
+					 * that don't.
+					 */
+					if ( entityTagString != NULL )
+					{
+						CFHTTPMessageSetHeaderFieldValue(message, CFSTR("If-None-Match"), entityTagString);
+					}
+					if ( httpDateString != NULL )
 					{
 						CFHTTPMessageSetHeaderFieldValue(message, CFSTR("If-Modified-Since"), httpDateString);
 					}
+				}
+				else
+				{
+					CFStringRef validator;
+					off_t currentLength;
+					CFStringRef currentLengthString;
+					
+					/* If-Range needs a strong entity tag or a date */
+					if ( (entityTagString != NULL) && !CFStringHasPrefix(entityTagString, CFSTR("W/")) )
+					{
+						validator = entityTagString;
+					}
 					else
 					{
-						off_t currentLength;
-						CFStringRef currentLengthString;
-						
-						currentLength = lseek(node->file_fd, 0LL, SEEK_END);
-						if ( currentLength != -1 )
+						validator = httpDateString;
+					}
+					
+					currentLength = lseek(node->file_fd, 0LL, SEEK_END);
+					if ( (validator != NULL) && (currentLength != -1) )
+					{
+						/* create a string with the file length for the Range header */
+						currentLengthString = CFStringCreateWithFormat(kCFAllocatorDefault, NULL, CFSTR("bytes=%qd-"), currentLength);
+						/* CFReadStreamCreateForStreamedHTTPRequest will use chunked transfer-encoding if the Content-Length header cannot be provided */
+						if ( currentLengthString != NULL )
 						{
-							/* create a string with the file length for the Range header */
-							currentLengthString = CFStringCreateWithFormat(kCFAllocatorDefault, NULL, CFSTR("bytes=%qd-"), currentLength);
-							/* CFReadStreamCreateForStreamedHTTPRequest will use chunked transfer-encoding if the Content-Length header cannot be provided */
-							if ( currentLengthString != NULL )
-							{
-								CFHTTPMessageSetHeaderFieldValue(message, CFSTR("If-Range"), httpDateString);
-								CFHTTPMessageSetHeaderFieldValue(message, CFSTR("Range"), currentLengthString);
-								CFRelease(currentLengthString);
-							}
+							CFHTTPMessageSetHeaderFieldValue(message, CFSTR("If-Range"), validator);
+							CFHTTPMessageSetHeaderFieldValue(message, CFSTR("Range"), currentLengthString);
+							CFRelease(currentLengthString);
 						}
 					}
+				}
+				
+				if ( httpDateString != NULL )
+				{
 					CFRelease(httpDateString);
 				}
+				if ( entityTagString != NULL )
+				{
+					CFRelease(entityTagString);
+				}
 			}
 			
 			/* apply credentials (if any) */
@@ -3789,7 +6504,7 @@ int network_open(
 				responseRef = NULL;
 			}
 			/* now that everything's ready to send, send it */
-			error = stream_get_transaction(message, &retryTransaction, node, &responseRef);
+			error = stream_get_transaction(uid, message, &retryTransaction, node, &responseRef);
 			if ( error == EAGAIN )
 			{
 				statusCode = 0;
@@ -4989,7 +7704,7 @@ create_cfurl_from_node:
 static int network_handle_multistatus_reply(CFURLRef urlRef, UInt8 *responseBuffer, CFIndex responseBufferLen, CFIndex *statusCode)
 {
 	webdav_parse_multistatus_list_t *statusList;
-	webdav_parse_multistatus_element_t *elementPtr, *nextElementPtr;
+	webdav_parse_multistatus_element_t *elementPtr;
 	CFStringRef urlStrRef;
 	char *urlStr, *urlPtr, *st;
 	size_t urlLen, matchLen;
@@ -5037,8 +7752,7 @@ static int network_handle_multistatus_reply(CFURLRef urlRef, UInt8 *responseBuff
 	
 	urlLen = strlen(urlPtr);
 	
-	elementPtr = statusList->head;
-	while (elementPtr != NULL) {
+	for (elementPtr = statusList->head; elementPtr != NULL; elementPtr = elementPtr->next) {
 		if (elementPtr->name == NULL) {
 			continue; // skipit
 		}
@@ -5046,7 +7760,7 @@ static int network_handle_multistatus_reply(CFURLRef urlRef, UInt8 *responseBuff
 		if (elementPtr->seen_href == FALSE)
 			continue;  // skipit
 		
-		matchLen = strlen((char *)elementPtr->name);
+		matchLen = elementPtr->name_len;
 		
 		if (matchLen <= 0) {
 			continue; // skipit
@@ -5063,8 +7777,6 @@ static int network_handle_multistatus_reply(CFURLRef urlRef, UInt8 *responseBuff
 			*statusCode = elementPtr->statusCode;
 			break;
 		}
-		
-		elementPtr = elementPtr->next;
 	}
 	
 parsed_nothing:
@@ -5073,15 +7785,7 @@ parsed_nothing:
 		free(urlStr);
 	if (urlStrRef)
 		CFRelease(urlStrRef);
-	if (statusList) {
-		elementPtr = statusList->head;
-		while (elementPtr != NULL) {
-			nextElementPtr = elementPtr->next;
-			free(elementPtr);
-			elementPtr = nextElementPtr;
-		}
-		free(statusList);
-	}	
+	parse_multi_status_free(statusList);
 	
 	return (error);
 }
@@ -5734,16 +8438,23 @@ create_cfurl_from_node:
 
 /******************************************************************************/
 
-int network_readdir(
+/*
+ * network_propfind_directory gets the directory's listing with a Depth 1
+ * PROPFIND and caches its children's attributes. If dirents_fd isn't -1, the
+ * listing is also written to it as dirents.
+ */
+static int network_propfind_directory(
 	uid_t uid,					/* -> uid of the user making the request */
 	int cache,					/* -> if TRUE, perform additional caching */
-	struct node_entry *node)	/* -> directory node to read */
+	struct node_entry *node,	/* -> directory node to read */
+	int dirents_fd)				/* -> the file to write the dirents to, or -1 */
 {
 	int error, redir_cnt;
 	CFURLRef urlRef;
-	UInt8 *responseBuffer;
 	CFIndex count;
 	CFDataRef bodyData;
+	webdav_parse_opendir_stream_t *opendir_stream;
+	struct BodyConsumer consumer;
 	const UInt8 xmlString[] =
 		"<?xml version=\"1.0\" encoding=\"utf-8\"?>\n"
 		"<D:propfind xmlns:D=\"DAV:\">\n"
@@ -5795,18 +8506,27 @@ int network_readdir(
 			break;
 		}
 		
-		error = send_transaction(uid, urlRef, node, CFSTR("PROPFIND"), bodyData,
-								 headerCount, headers, REDIRECT_MANUAL, &responseBuffer, &count, NULL);
+		/* the directory file is written as the response is parsed */
+		opendir_stream = parse_opendir_stream_create(urlRef, uid, node, dirents_fd);
+		if (opendir_stream == NULL) {
+			CFRelease(urlRef);
+			error = EIO;
+			break;
+		}
+		consumer.consume = parse_opendir_stream_data;
+		consumer.context = opendir_stream;
+		
+		error = send_transaction_to_consumer(uid, urlRef, node, CFSTR("PROPFIND"), bodyData,
+								 headerCount, headers, REDIRECT_MANUAL, &consumer, NULL, &count, NULL);
 		if ( !error )
 		{
-			/* parse responseBuffer to create the directory file */
-			error = parse_opendir(responseBuffer, count, urlRef, uid, node);
-			/* free the response buffer */
-			free(responseBuffer);
+			/* finish parsing to complete the directory file */
+			error = parse_opendir_stream_finish(opendir_stream, FALSE);
 			CFRelease(urlRef);
 			break;
 		}
 		
+		(void) parse_opendir_stream_finish(opendir_stream, TRUE);
 		CFRelease(urlRef);
 
 		if (error != EDESTADDRREQ)
@@ -5825,6 +8545,27 @@ CFDataCreateWithBytesNoCopy:
 
 /******************************************************************************/
 
+int network_readdir(
+	uid_t uid,					/* -> uid of the user making the request */
+	int cache,					/* -> if TRUE, perform additional caching */
+	struct node_entry *node)	/* -> directory node to read */
+{
+	return ( network_propfind_directory(uid, cache, node, node->file_fd) );
+}
+
+/******************************************************************************/
+
+int network_prefetch_directory(
+	uid_t uid,					/* -> uid of the user making the request */
+	int cache,					/* -> if TRUE, perform additional caching */
+	struct node_entry *node,	/* -> directory node to read */
+	int fd)						/* -> the file to write the dirents to */
+{
+	return ( network_propfind_directory(uid, cache, node, fd) );
+}
+
+/******************************************************************************/
+
 int network_mkdir(
 	uid_t uid,					/* -> uid of the user making the request */
 	struct node_entry *node,	/* -> parent node */
@@ -5886,12 +8627,15 @@ int network_read(
 	off_t offset,				/* -> position within the file at which the read is to begin */
 	size_t count,				/* -> number of bytes of data to be read */
 	char **buffer,				/* <- buffer data was read into (allocated by network_read) */
-	size_t *actual_count)		/* <- number of bytes actually read */
+	size_t *actual_count,		/* <- number of bytes actually read */
+	char **entity_tag)			/* <- if not NULL, the response's ETag or NULL if none (caller must free) */
 {
 	int error;
 	CFURLRef urlRef;
 	UInt8 *responseBuffer;
 	CFIndex responseCount;
+	CFHTTPMessageRef response;
+	CFStringRef headerRef;
 	CFStringRef byteRangesSpecifierRef;
 	/* the 2 headers -- the range value will be computed below */
 	CFIndex headerCount = 2;
@@ -5909,6 +8653,10 @@ int network_read(
 
 	*buffer = NULL;
 	*actual_count = 0;
+	if ( entity_tag != NULL )
+	{
+		*entity_tag = NULL;
+	}
 	
 	/* create a CFURL to the node */
 	urlRef = create_cfurl_from_node(node, NULL, 0);
@@ -5920,17 +8668,69 @@ int network_read(
 	headers[1].value = byteRangesSpecifierRef;
 	
 	/* send request to the server and get the response */
+	response = NULL;
 	error = send_transaction(uid, urlRef, NULL, CFSTR("GET"), NULL,
-		headerCount, headers, REDIRECT_AUTO, &responseBuffer, &responseCount, NULL);
+		headerCount, headers, REDIRECT_AUTO, &responseBuffer, &responseCount, &response);
 	if ( !error )
 	{
-		if ( (size_t)responseCount > count )
+		/*
+		 * The bytes must start at offset: the server either sent the range
+		 * asked for, or ignored the Range header and sent the whole file.
+		 */
+		if ( CFHTTPMessageGetResponseStatusCode(response) == 206 )
+		{
+			headerRef = CFHTTPMessageCopyHeaderFieldValue(response, CFSTR("Content-Range"));
+			if ( headerRef != NULL )
+			{
+				char contentRange[64];
+				char expected[32];
+				
+				snprintf(expected, sizeof(expected), "bytes %qd-", (long long)offset);
+				if ( !CFStringGetCString(headerRef, contentRange, sizeof(contentRange), kCFStringEncodingASCII) ||
+					 (strncasecmp(contentRange, expected, strlen(expected)) != 0) )
+				{
+					error = EIO;
+				}
+				CFRelease(headerRef);
+			}
+		}
+		else if ( offset != 0 )
+		{
+			error = EIO;
+		}
+		
+		if ( error )
+		{
+			free(responseBuffer);
+		}
+		else
 		{
-			/* don't return more than we asked for */
-			responseCount = count;
+			if ( (size_t)responseCount > count )
+			{
+				/* don't return more than we asked for */
+				responseCount = count;
+			}
+			*buffer = (char *)responseBuffer;
+			*actual_count = responseCount;
+			
+			if ( entity_tag != NULL )
+			{
+				headerRef = CFHTTPMessageCopyHeaderFieldValue(response, CFSTR("ETag"));
+				if ( headerRef != NULL )
+				{
+					CFIndex len = CFStringGetMaximumSizeForEncoding(CFStringGetLength(headerRef), kCFStringEncodingUTF8) + 1;
+					
+					*entity_tag = malloc(len);
+					if ( (*entity_tag != NULL) && !CFStringGetCString(headerRef, *entity_tag, len, kCFStringEncodingUTF8) )
+					{
+						free(*entity_tag);
+						*entity_tag = NULL;
+					}
+					CFRelease(headerRef);
+				}
+			}
 		}
-		*buffer = (char *)responseBuffer;
-		*actual_count = responseCount;
+		CFRelease(response);
 	}
 	
 	CFRelease(byteRangesSpecifierRef);
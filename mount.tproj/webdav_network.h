@@ -42,6 +42,13 @@ struct ReadStreamRec
 	CFReadStreamRef readStreamRef;	/* the read stream, or NULL */
 	CFStringRef uniqueValue;		/* CFString used to make stream unique */
 	int connectionClose;			/* if TRUE, readStreamRef should be closed when transaction is complete */
+	int sock;						/* the read stream's socket, or -1 if unknown */
+	time_t lastUsed;				/* when the ReadStreamRec was last released */
+	struct timeval acquired;		/* when the ReadStreamRec was last taken */
+	u_int64_t uses;					/* times the ReadStreamRec was taken */
+	u_int64_t reuses;				/* times it was taken with its connection still open */
+	u_int64_t busyUsec;				/* total time in use (microseconds) */
+	u_int64_t maxBusyUsec;			/* longest time in use (microseconds) */
 };
 
 int network_init(
@@ -72,6 +79,10 @@ int network_getattr(
 	struct node_entry *node,	/* -> parent node */
 	struct webdav_stat_attr *statbuf);	/* <- stat information is returned in this buffer */
 
+int network_stat_ahead(
+	uid_t uid,					/* -> uid of the user making the request */
+	struct node_entry *node);	/* -> node whose attributes are stale */
+
 int network_mount(
 	uid_t uid,					/* -> uid of the user making the request */
 	int *server_mount_flags);	/* <- flags to OR in with mount flags (i.e., MNT_RDONLY) */
@@ -79,9 +90,12 @@ int network_mount(
 								 * server_mount_flags parameter is not needed.
 								 */
 
+struct download_segments;
+
 int network_finish_download(
 	struct node_entry *node,	/* -> node to download to */
-	struct ReadStreamRec *readStreamRecPtr); /* -> the ReadStreamRec */
+	struct ReadStreamRec *readStreamRecPtr, /* -> the ReadStreamRec */
+	struct download_segments *segments); /* -> the rest of a segmented download, or NULL */
 
 /*
  * Sends an "OPTIONS" request to the server after 'delay' seconds
@@ -191,6 +205,16 @@ int network_readdir(
 	int cache,					/* -> if TRUE, perform additional caching */
 	struct node_entry *node);	/* -> directory node to read */
 
+/*
+ * network_prefetch_directory is network_readdir, but writes the directory's
+ * dirents to fd instead of the directory's cache file (see filesystem_prefetch).
+ */
+int network_prefetch_directory(
+	uid_t uid,					/* -> uid of the user making the request */
+	int cache,					/* -> if TRUE, perform additional caching */
+	struct node_entry *node,	/* -> directory node to read */
+	int fd);					/* -> the file to write the dirents to */
+
 int network_mkdir(
 	uid_t uid,					/* -> uid of the user making the request */
 	struct node_entry *node,	/* -> parent node */
@@ -204,12 +228,19 @@ int network_read(
 	off_t offset,				/* -> position within the file at which the read is to begin */
 	size_t count,				/* -> number of bytes of data to be read */
 	char **buffer,				/* <- buffer data was read into (allocated by network_read) */
-	size_t *actual_count);		/* <- number of bytes actually read */
+	size_t *actual_count,		/* <- number of bytes actually read */
+	char **entity_tag);			/* <- if not NULL, the response's ETag or NULL if none (caller must free) */
 
 /* Read the response CFReadStream of a sequential write */	
 int network_read_seqwrite_rsp(
 	struct stream_put_ctx *ctx);	/* -> sequential write context */
 
+/* log the body buffer pool and connection counters */
+void network_log_stats(void);
+
+/* close connections that have been idle too long or were closed by the server */
+void network_reap_connections(void);
+
 time_t DateBytesToTime(			/* <- time_t value; -1 if error */
 	const UInt8 *bytes,			/* -> pointer to bytes to parse */
 	CFIndex length);			/* -> number of bytes to parse */
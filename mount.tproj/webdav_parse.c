@@ -91,6 +91,7 @@ static void parser_lock_add(void *ctx, const xmlChar *localname, int length);
 static void parser_stat_add(void *ctx, const xmlChar *localname, int length);
 static void parser_statfs_add(void *ctx, const xmlChar *localname, int length);
 void parser_opendir_add(void *ctx, const xmlChar *localname, int length);
+static void parser_opendir_text(webdav_parse_opendir_struct_t *parent_ptr);
 void parse_stat_end(void *ctx,
 					const xmlChar *localname,
 					const xmlChar *prefix,
@@ -331,7 +332,14 @@ void parser_opendir_end(void *ctx,
 {
 	#pragma unused(localname,prefix,URI)
 	webdav_parse_opendir_struct_t * struct_ptr = (webdav_parse_opendir_struct_t *)ctx;
+	if ( (struct_ptr->start == true) && (struct_ptr->text != NULL) )
+	{
+		parser_opendir_text(struct_ptr);
+	}
 	struct_ptr->start = false;
+	struct_ptr->text = NULL;
+	struct_ptr->text_length = 0;
+	struct_ptr->text_size = 0;
 }
 /*****************************************************************************/
 
@@ -356,21 +364,159 @@ void parser_multistatus_end(void *ctx,
 	struct_ptr->start = false;
 }
 /*****************************************************************************/
-static webdav_parse_opendir_element_t *create_opendir_element(void)
+
+/* arena chunks are at least this large; larger requests get a chunk of their own */
+#define WEBDAV_PARSE_ARENA_CHUNK_SIZE 8192
+
+struct webdav_parse_arena_chunk
+{
+	struct webdav_parse_arena_chunk *next;
+	size_t size;					/* bytes in data */
+	size_t used;					/* bytes of data handed out */
+	u_int64_t data[];				/* u_int64_t so allocations are 8-byte aligned */
+};
+
+/*
+ * parse_arena_alloc returns size bytes of zeroed memory from the arena, or
+ * NULL if a new chunk could not be allocated.
+ */
+static void *parse_arena_alloc(webdav_parse_arena_t *arena, size_t size)
+{
+	struct webdav_parse_arena_chunk *chunk;
+	void *result;
+	
+	/* keep allocations 8-byte aligned */
+	size = (size + 7) & ~((size_t)7);
+	
+	chunk = arena->chunks;
+	if ( (chunk == NULL) || ((chunk->size - chunk->used) < size) )
+	{
+		size_t chunk_size = (size > WEBDAV_PARSE_ARENA_CHUNK_SIZE) ? size : WEBDAV_PARSE_ARENA_CHUNK_SIZE;
+		
+		chunk = malloc(sizeof(struct webdav_parse_arena_chunk) + chunk_size);
+		if ( chunk == NULL )
+		{
+			return ( NULL );
+		}
+		chunk->size = chunk_size;
+		chunk->used = 0;
+		chunk->next = arena->chunks;
+		arena->chunks = chunk;
+	}
+	
+	result = (char *)chunk->data + chunk->used;
+	chunk->used += size;
+	bzero(result, size);
+	
+	return ( result );
+}
+
+/*****************************************************************************/
+
+/*
+ * parse_arena_reset makes everything allocated from the arena available
+ * again. The current chunk is kept for reuse; the others are freed.
+ */
+static void parse_arena_reset(webdav_parse_arena_t *arena)
+{
+	struct webdav_parse_arena_chunk *chunk, *next_chunk;
+	
+	if ( arena->chunks != NULL )
+	{
+		chunk = arena->chunks->next;
+		while ( chunk != NULL )
+		{
+			next_chunk = chunk->next;
+			free(chunk);
+			chunk = next_chunk;
+		}
+		arena->chunks->next = NULL;
+		arena->chunks->used = 0;
+	}
+}
+
+/*****************************************************************************/
+
+static void parse_arena_free(webdav_parse_arena_t *arena)
+{
+	struct webdav_parse_arena_chunk *chunk, *next_chunk;
+	
+	chunk = arena->chunks;
+	while ( chunk != NULL )
+	{
+		next_chunk = chunk->next;
+		free(chunk);
+		chunk = next_chunk;
+	}
+	arena->chunks = NULL;
+}
+
+/*****************************************************************************/
+
+/*
+ * parse_arena_append_name appends text to a cstring allocated from the arena,
+ * moving it to a larger allocation (twice the needed size, up to
+ * WEBDAV_MAX_URI_LEN) when it doesn't fit. Returns ENAMETOOLONG if the result
+ * would not fit in WEBDAV_MAX_URI_LEN bytes.
+ */
+static int parse_arena_append_name(
+	webdav_parse_arena_t *arena,
+	char **name,					/* <-> the cstring, or NULL */
+	u_int32_t *name_length,			/* <-> length of the cstring */
+	u_int32_t *name_size,			/* <-> bytes allocated for the cstring */
+	const UInt8 *text,				/* -> the text to append */
+	size_t text_length)				/* -> length of text */
+{
+	size_t needed;
+	
+	needed = *name_length + text_length + 1;
+	if ( needed > WEBDAV_MAX_URI_LEN )
+	{
+		return ( ENAMETOOLONG );
+	}
+	
+	if ( needed > *name_size )
+	{
+		size_t new_size;
+		char *new_name;
+		
+		new_size = (needed < 64) ? 64 : needed * 2;
+		if ( new_size > WEBDAV_MAX_URI_LEN )
+		{
+			new_size = WEBDAV_MAX_URI_LEN;
+		}
+		new_name = parse_arena_alloc(arena, new_size);
+		if ( new_name == NULL )
+		{
+			return ( ENOMEM );
+		}
+		if ( *name != NULL )
+		{
+			memcpy(new_name, *name, *name_length);
+		}
+		*name = new_name;
+		*name_size = (u_int32_t)new_size;
+	}
+	
+	memcpy(*name + *name_length, text, text_length);
+	*name_length += (u_int32_t)text_length;
+	(*name)[*name_length] = '\0';
+	
+	return ( 0 );
+}
+
+/*****************************************************************************/
+static webdav_parse_opendir_element_t *create_opendir_element(webdav_parse_arena_t *arena)
 {
 	webdav_parse_opendir_element_t *element_ptr;
 	
-	element_ptr = malloc(sizeof(webdav_parse_opendir_element_t));
+	element_ptr = parse_arena_alloc(arena, sizeof(webdav_parse_opendir_element_t));
 	if (!element_ptr)
 		return (NULL);
 	
-	bzero(element_ptr, sizeof(webdav_parse_opendir_element_t));
-	element_ptr->dir_data.d_type = DT_REG;
+	element_ptr->d_type = DT_REG;
 	element_ptr->seen_href = FALSE;
 	element_ptr->seen_response_end = FALSE;
-	element_ptr->dir_data.d_namlen = 0;
-	element_ptr->dir_data.d_name_URI_length = 0;
-	element_ptr->dir_data.d_reclen = sizeof(struct webdav_dirent);
 	element_ptr->next = NULL;
 	return (element_ptr);
 }
@@ -391,6 +537,9 @@ void parser_opendir_create (void *ctx,
 	webdav_parse_opendir_struct_t * struct_ptr = (webdav_parse_opendir_struct_t *)ctx;
 	CFStringRef nodeString;
 	struct_ptr->start=true;
+	struct_ptr->text = NULL;
+	struct_ptr->text_length = 0;
+	struct_ptr->text_size = 0;
 	nodeString =  CFStringCreateWithCString (kCFAllocatorDefault,
 											 (const char *)localname,
 											 kCFStringEncodingUTF8
@@ -412,7 +561,7 @@ void parser_opendir_create (void *ctx,
 		else
 		{
 			// Create the new href element
-			element_ptr = create_opendir_element();
+			element_ptr = create_opendir_element(&struct_ptr->arena);
 			require_action(element_ptr != NULL, malloc_element_ptr, struct_ptr->error = ENOMEM);
 			
 			element_ptr->seen_href = TRUE;
@@ -450,7 +599,7 @@ void parser_opendir_create (void *ctx,
 			//
 			// The <D:href> element might appear after the <D:propstat>. To handle this
 			// case we simply create a placeholder opendir element.
-			element_ptr = create_opendir_element();
+			element_ptr = create_opendir_element(&struct_ptr->arena);
 			require_action(element_ptr != NULL, malloc_element_ptr, struct_ptr->error = ENOMEM);
 			
 			if (struct_ptr->head == NULL)
@@ -465,7 +614,7 @@ void parser_opendir_create (void *ctx,
 			struct_ptr->tail = element_ptr;
 		}
 		
-		element_ptr->dir_data.d_type = DT_DIR;
+		element_ptr->d_type = DT_DIR;
 		
 		/* Not interested in child of collection element. We can
 		 * and should free the return_ptr in this case.
@@ -490,7 +639,7 @@ void parser_opendir_create (void *ctx,
 			//
 			// The <D:href> element might appear after the <D:propstat>. To handle this
 			// case we simply create a placeholder opendir element.
-			element_ptr = create_opendir_element();
+			element_ptr = create_opendir_element(&struct_ptr->arena);
 			require_action(element_ptr != NULL, malloc_element_ptr, struct_ptr->error = ENOMEM);
 			
 			if (struct_ptr->head == NULL)
@@ -525,7 +674,7 @@ void parser_opendir_create (void *ctx,
 			//
 			// The <D:href> element might appear after the <D:propstat>. To handle this
 			// case we simply create a placeholder opendir element.
-			element_ptr = create_opendir_element();
+			element_ptr = create_opendir_element(&struct_ptr->arena);
 			require_action(element_ptr != NULL, malloc_element_ptr, struct_ptr->error = ENOMEM);
 			
 			if (struct_ptr->head == NULL)
@@ -560,7 +709,7 @@ void parser_opendir_create (void *ctx,
 			//
 			// The <D:href> element might appear after the <D:propstat>. To handle this
 			// case we simply create a placeholder opendir element.
-			element_ptr = create_opendir_element();
+			element_ptr = create_opendir_element(&struct_ptr->arena);
 			require_action(element_ptr != NULL, malloc_element_ptr, struct_ptr->error = ENOMEM);
 			
 			if (struct_ptr->head == NULL)
@@ -596,7 +745,7 @@ void parser_opendir_create (void *ctx,
 			//
 			// The <D:href> element might appear after the <D:propstat>. To handle this
 			// case we simply create a placeholder opendir element.
-			element_ptr = create_opendir_element();
+			element_ptr = create_opendir_element(&struct_ptr->arena);
 			require_action(element_ptr != NULL, malloc_element_ptr, struct_ptr->error = ENOMEM);
 			
 			if (struct_ptr->head == NULL)
@@ -631,18 +780,15 @@ malloc_element_ptr:
 }
 /*****************************************************************************/
 static webdav_parse_multistatus_element_t *
-create_multistatus_element(void)
+create_multistatus_element(webdav_parse_arena_t *arena)
 {
 	webdav_parse_multistatus_element_t *element_ptr;
 	
-	element_ptr = malloc(sizeof(webdav_parse_multistatus_element_t));
+	element_ptr = parse_arena_alloc(arena, sizeof(webdav_parse_multistatus_element_t));
 	if (!element_ptr)
 		return (NULL);
 	
-	bzero(element_ptr, sizeof(webdav_parse_multistatus_element_t));
 	element_ptr->statusCode = WEBDAV_MULTISTATUS_INVALID_STATUS;
-	element_ptr->name_len = 0;
-	element_ptr->name[0] = 0;
 	element_ptr->seen_href = FALSE;
 	element_ptr->seen_response_end = FALSE;
 	element_ptr->next = NULL;
@@ -884,7 +1030,7 @@ static void parser_multistatus_create(void *ctx,
 		else
 		{
 			// Create the new href element
-			element_ptr = create_multistatus_element();
+			element_ptr = create_multistatus_element(&struct_ptr->arena);
 			require_action(element_ptr != NULL, malloc_element_ptr, struct_ptr->error = ENOMEM);
 			
 			element_ptr->seen_href = TRUE;
@@ -921,7 +1067,7 @@ static void parser_multistatus_create(void *ctx,
 			//
 			// The <D:href> element might appear after the <D:propstat>. To handle this
 			// case we simply create a placeholder opendir element.
-			element_ptr = create_multistatus_element();
+			element_ptr = create_multistatus_element(&struct_ptr->arena);
 			require_action(element_ptr != NULL, malloc_element_ptr, struct_ptr->error = ENOMEM);
 			
 			if (struct_ptr->head == NULL)
@@ -957,118 +1103,128 @@ malloc_element_ptr:
 		CFRelease(nodeString);
 }
 /*****************************************************************************/
+/*
+ * parser_opendir_add collects the text of one of our elements. The push parser
+ * is fed the response as it arrives, so libxml2 can split the text of an
+ * element across several characters callbacks; it's appended to
+ * parent_ptr->text and handled by parser_opendir_text at the end tag.
+ */
 void parser_opendir_add(void *ctx, const xmlChar *localname, int length)
 {
+	webdav_parse_opendir_struct_t * parent_ptr = (webdav_parse_opendir_struct_t *)ctx;
+	int error;
+	
+	/* text that isn't in one of our elements (dead properties, whitespace) is skipped */
+	if ( parent_ptr->start != true )
+	{
+		return;
+	}
+	switch (parent_ptr->id)
+	{
+		case WEBDAV_OPENDIR_ELEMENT:
+		case WEBDAV_OPENDIR_ELEMENT_LENGTH:
+		case WEBDAV_OPENDIR_ELEMENT_MODDATE:
+		case WEBDAV_OPENDIR_ELEMENT_CREATEDATE:
+		case WEBDAV_OPENDIR_APPLEDOUBLEHEADER:
+			break;
+			
+		default:
+			parent_ptr->start = false;
+			return;
+	}
 	
+	error = parse_arena_append_name(&parent_ptr->arena, &parent_ptr->text,
+		&parent_ptr->text_length, &parent_ptr->text_size, localname, (size_t)length);
+	if ( error != 0 )
+	{
+		debug_string((error == ENAMETOOLONG) ? "text too long" : "malloc failed");
+		parent_ptr->error = error;
+		parent_ptr->start = false;
+	}
+}
+
+/*****************************************************************************/
+
+/*
+ * parser_opendir_text handles the whole text of one of our elements once its
+ * end tag is seen.
+ */
+static void parser_opendir_text(webdav_parse_opendir_struct_t *parent_ptr)
+{
 	webdav_parse_opendir_element_t * element_ptr;
-	webdav_parse_opendir_text_t * text_ptr = NULL;
-	webdav_parse_opendir_struct_t * parent_ptr = (webdav_parse_opendir_struct_t *)ctx;
-	char * ampPointer = NULL;
-	char* str_ptr = NULL;
+	const char *text = parent_ptr->text;
 	char *ep;
+	int error;
 	
-	text_ptr = malloc(sizeof(webdav_parse_opendir_text_t));
-	bzero(text_ptr,sizeof(webdav_parse_opendir_text_t));
-	text_ptr->size = (CFIndex)length;
-	memcpy(text_ptr->name,localname,length);
-	/* If the parent is one of our returned directory elements, and if this is a
-	 * text element, than copy the text into the name buffer provided we have room */
-	if(parent_ptr->start == true)
+	switch (parent_ptr->id)
 	{
-		switch (parent_ptr->id)
+		case WEBDAV_OPENDIR_ELEMENT:
+			element_ptr = (webdav_parse_opendir_element_t *)parent_ptr->data_ptr;
+			/* append the text to the URI, provided the complete name will fit */
+			error = parse_arena_append_name(&parent_ptr->arena, &element_ptr->name,
+				&element_ptr->name_length, &element_ptr->name_size, (const UInt8 *)text, parent_ptr->text_length);
+			if ( error != 0 )
+			{
+				debug_string((error == ENAMETOOLONG) ? "URI too long" : "malloc failed");
+				parent_ptr->error = error;
+			}
+			break;
+			
+		case WEBDAV_OPENDIR_ELEMENT_LENGTH:
+			element_ptr = (webdav_parse_opendir_element_t *)parent_ptr->data_ptr;
+			element_ptr->statsize = strtoq(text, &ep, 10);
+			break;
+			
+		case WEBDAV_OPENDIR_ELEMENT_MODDATE:
+			element_ptr = (webdav_parse_opendir_element_t *)parent_ptr->data_ptr;
+			element_ptr->stattime.tv_sec = DateBytesToTime((const UInt8 *)text, parent_ptr->text_length);
+			if (element_ptr->stattime.tv_sec == -1)
+			{
+				element_ptr->stattime.tv_sec = 0;
+			}
+			element_ptr->stattime.tv_nsec = 0;
+			break;
+			
+		case WEBDAV_OPENDIR_ELEMENT_CREATEDATE:
+			// First try ISO8601
+			element_ptr = (webdav_parse_opendir_element_t *)parent_ptr->data_ptr;
+			element_ptr->createtime.tv_sec = ISO8601ToTime((const UInt8 *)text, parent_ptr->text_length);
+			
+			if (element_ptr->createtime.tv_sec == -1) {
+				// Try RFC 850, RFC 1123
+				element_ptr->createtime.tv_sec = DateBytesToTime((const UInt8 *)text, parent_ptr->text_length);
+			}
+			
+			if (element_ptr->createtime.tv_sec == -1)
+			{
+				element_ptr->createtime.tv_sec = 0;
+			}
+			element_ptr->createtime.tv_nsec = 0;
+			break;
+			
+		case WEBDAV_OPENDIR_APPLEDOUBLEHEADER:
 		{
-			case WEBDAV_OPENDIR_ELEMENT:
-				element_ptr = (webdav_parse_opendir_element_t *)parent_ptr->data_ptr;
-				/* TO Handle a special case for ampersand */
-				ampPointer = strstr((const char*) localname,"amp;");
-				if(ampPointer) {
-					char * literalPtr = strchr((const char*) localname,'<');
-					int totalLength = (int)(literalPtr - (char*)localname);
-					if(totalLength >= (length+5)) {
-						str_ptr = (char*)malloc(totalLength+1);
-						memset(str_ptr,0,totalLength+1);
-						memcpy(str_ptr,localname,totalLength);
-						ampPointer = strstr((const char*) str_ptr,"amp;");
-						/* To handle multiple ampersands*/
-						while(ampPointer) {
-							ampPointer+=4;
-							memcpy(&text_ptr->name[length],"&",1);
-							memcpy(&text_ptr->name[length+1],ampPointer,totalLength-length-4-1);
-							text_ptr->size = totalLength-4;
-							ampPointer = strstr((const char*)text_ptr->name,"amp;");
-							length++;
-						}
-						free(str_ptr);
-					}
-				}
-				/* make sure the complete name will fit in the structure */
-				if ((element_ptr->dir_data.d_name_URI_length + text_ptr->size) <=
-					((unsigned int)sizeof(element_ptr->dir_data.d_name) - 1))
-				{
-					bcopy(text_ptr->name,
-						  &element_ptr->dir_data.d_name[element_ptr->dir_data.d_name_URI_length],
-						  text_ptr->size);
-					element_ptr->dir_data.d_name_URI_length += (uint32_t)text_ptr->size;
-				}
-				else
-				{
-					debug_string("URI too long");
-					parent_ptr->error = ENAMETOOLONG;
-				}
-				break;
-				
-			case WEBDAV_OPENDIR_ELEMENT_LENGTH:
-				element_ptr = (webdav_parse_opendir_element_t *)parent_ptr->data_ptr;
-				element_ptr->statsize = strtoq((const char *)text_ptr->name, &ep, 10);
-				break;
-				
-			case WEBDAV_OPENDIR_ELEMENT_MODDATE:
-				element_ptr = (webdav_parse_opendir_element_t *)parent_ptr->data_ptr;
-				element_ptr->stattime.tv_sec = DateBytesToTime(text_ptr->name, strlen((const char *)text_ptr->name));
-				if (element_ptr->stattime.tv_sec == -1)
-				{
-					element_ptr->stattime.tv_sec = 0;
-				}
-				element_ptr->stattime.tv_nsec = 0;
-				break;
-				
-			case WEBDAV_OPENDIR_ELEMENT_CREATEDATE:
-				// First try ISO8601
-				element_ptr = (webdav_parse_opendir_element_t *)parent_ptr->data_ptr;
-				element_ptr->createtime.tv_sec = ISO8601ToTime(text_ptr->name, strlen((const char *)text_ptr->name));
-				
-				if (element_ptr->createtime.tv_sec == -1) {
-					// Try RFC 850, RFC 1123
-					element_ptr->createtime.tv_sec = DateBytesToTime(text_ptr->name, strlen((const char *)text_ptr->name));
-					
-				}
-				
-				if (element_ptr->createtime.tv_sec == -1)
-				{
-					element_ptr->createtime.tv_sec = 0;
-				}
-				element_ptr->createtime.tv_nsec = 0;
-				break;
-				
-			case WEBDAV_OPENDIR_APPLEDOUBLEHEADER:
+			size_t	len = APPLEDOUBLEHEADER_LENGTH;
+			
+			element_ptr = (webdav_parse_opendir_element_t *)parent_ptr->data_ptr;
+			if (element_ptr->appledoubleheader == NULL)
 			{
-				size_t	len = APPLEDOUBLEHEADER_LENGTH;
-				
-				element_ptr = (webdav_parse_opendir_element_t *)parent_ptr->data_ptr;
-				from_base64((const char *)text_ptr->name, (unsigned char *)element_ptr->appledoubleheader, &len);
+				element_ptr->appledoubleheader = parse_arena_alloc(&parent_ptr->arena, APPLEDOUBLEHEADER_LENGTH);
+			}
+			if (element_ptr->appledoubleheader != NULL)
+			{
+				from_base64(text, (unsigned char *)element_ptr->appledoubleheader, &len);
 				if (len == APPLEDOUBLEHEADER_LENGTH)
 				{
 					element_ptr->appledoubleheadervalid = TRUE;
 				}
 			}
-				break;
-				
-			default:
-				break;
-		}	/* end of switch statement */
-		parent_ptr->start = false;
-	}/* end of if it is our text element */
-	free(text_ptr);
+		}
+			break;
+			
+		default:
+			break;
+	}	/* end of switch statement */
 }
 
 /*****************************************************************************/
@@ -1318,13 +1474,32 @@ static void parser_multistatus_add(void *ctx, const xmlChar *localname, int leng
 {
 	webdav_parse_multistatus_element_t * element_ptr;
 	webdav_parse_multistatus_list_t * parent_ptr = (webdav_parse_multistatus_list_t *)ctx;
-	webdav_parse_multistatus_text_t * text_ptr = NULL;
+	webdav_parse_multistatus_text_t text;
+	webdav_parse_multistatus_text_t * text_ptr = &text;
 	webdav_parse_multistatus_list_t * struct_ptr = (webdav_parse_multistatus_list_t *)ctx;
 	char *ep, *ch, *endPtr;
 	int errnum;
+	int error;
+	/* text that isn't in one of our elements (dead properties, whitespace) is skipped */
+	if ( parent_ptr->start != true )
+	{
+		return;
+	}
+	if ( (parent_ptr->id != WEBDAV_MULTISTATUS_ELEMENT) && (parent_ptr->id != WEBDAV_MULTISTATUS_STATUS) )
+	{
+		parent_ptr->start = false;
+		return;
+	}
+	
 	/* If the parent is one of our returned directory elements, and if this is a
 	 * text element, than copy the text into the name buffer provided we have room */
-	text_ptr = malloc(sizeof(webdav_parse_multistatus_text_t));
+	if ( (size_t)length >= sizeof(text_ptr->name) )
+	{
+		debug_string("text too long");
+		struct_ptr->error = ENAMETOOLONG;
+		parent_ptr->start = false;
+		return;
+	}
 	bzero(text_ptr,sizeof(webdav_parse_multistatus_text_t));
 	text_ptr->size = (CFIndex)length;
 	memcpy(text_ptr->name,localname,length);
@@ -1336,17 +1511,13 @@ static void parser_multistatus_add(void *ctx, const xmlChar *localname, int leng
 			case WEBDAV_MULTISTATUS_ELEMENT:
 				element_ptr = (webdav_parse_multistatus_element_t *)parent_ptr->data_ptr;
 				
-				/* make sure the complete name will fit in the structure */
-				if ( (text_ptr->size) < (CFIndex)(sizeof(element_ptr->name)))
-				{
-					bcopy(text_ptr->name, &element_ptr->name, text_ptr->size);
-					element_ptr->name_len += (uint32_t)text_ptr->size;
-					element_ptr->name[element_ptr->name_len] = 0;
-				}
-				else
+				/* append the text to the URI, provided the complete name will fit */
+				error = parse_arena_append_name(&struct_ptr->arena, &element_ptr->name,
+					&element_ptr->name_len, &element_ptr->name_size, text_ptr->name, (size_t)text_ptr->size);
+				if ( error != 0 )
 				{
-					debug_string("URI too long");
-					struct_ptr->error = ENAMETOOLONG;
+					debug_string((error == ENAMETOOLONG) ? "URI too long" : "malloc failed");
+					struct_ptr->error = error;
 				}
 				break;
 				
@@ -1404,7 +1575,6 @@ static void parser_multistatus_add(void *ctx, const xmlChar *localname, int leng
 		}	/* end of switch statement */
 		parent_ptr->start = false;
 	}/* end of if it is our text element */
-	free(text_ptr);
 }
 
 /*****************************************************************************/
@@ -1537,266 +1707,846 @@ CFStringCreateWithCString:
 
 /*****************************************************************************/
 
-int parse_opendir(UInt8 *xmlp,					/* -> xml data returned by PROPFIND with depth of 1 */
-				  CFIndex xmlp_len,				/* -> length of xml data */
-				  CFURLRef urlRef,				/* -> the CFURL to the parent directory */
-				  uid_t uid,						/* -> uid of the user making the request */
-				  struct node_entry *parent_node)	/* -> pointer to the parent directory's node_entry */
+/*
+ * The state of a directory listing being parsed as it arrives. opendir_struct
+ * must be first: the SAX callbacks are passed the stream as their context.
+ */
+struct webdav_parse_opendir_stream
 {
-	int error = 0;
-	ssize_t size = 0;
-	struct webdav_dirent dir_data[2];
-	CFIndex parentPathLength;
 	webdav_parse_opendir_struct_t opendir_struct;
-	webdav_parse_opendir_element_t *element_ptr, *prev_element_ptr;
-	opendir_struct.head = opendir_struct.tail = NULL;
-	opendir_struct.error = 0;
+	xmlParserCtxtPtr parser;			/* the libxml push parser */
+	CFURLRef urlRef;					/* the CFURL to the parent directory */
+	CFIndex parentPathLength;			/* the normalized length of urlRef's path */
+	Boolean parentParsed;				/* TRUE if the parent* fields below are valid */
+	Boolean parentIsDirectory;			/* TRUE if urlRef's absolute path ends with a slash */
+	size_t parentAuthorityLength;		/* length of parentAuthority */
+	size_t parentPathBytes;				/* length of parentPath */
+	char parentAuthority[MAXPATHLEN];	/* "scheme://host[:port]" of urlRef's absolute URL */
+	char parentPath[MAXPATHLEN];		/* urlRef's percent decoded absolute path without a trailing slash */
+	uid_t uid;							/* uid of the user making the request */
+	struct node_entry *parent_node;		/* the parent directory's node_entry */
+	int dirents_fd;						/* the file the dirents are written to, or -1 */
+	int started;						/* TRUE once the directory file has been started (see parse_opendir_start) */
+	int error;							/* set if writing the directory file failed */
+};
+
+/*****************************************************************************/
+
+/*
+ * ParseParentURL breaks the parent directory's URL down once per listing so
+ * GetComponentNameFromHref can match the children's hrefs against it without
+ * creating any CoreFoundation objects. If anything goes wrong, parentParsed
+ * is left FALSE and every href takes the GetComponentName path.
+ */
+static void ParseParentURL(webdav_parse_opendir_stream_t *stream)
+{
+	CFURLRef absoluteURL;
+	CFStringRef escapedPath;
+	CFStringRef unescapedPath;
+	char *authorityEnd;
 	
-	xmlSAXHandler sh;
-    memset(&sh,0,sizeof(sh));
-    sh.startElementNs = parser_opendir_create;
-    sh.characters = parser_opendir_add;
-	sh.endElementNs = parser_opendir_end;
-    sh.initialized = XML_SAX2_MAGIC;
+	absoluteURL = CFURLCopyAbsoluteURL(stream->urlRef);
+	require(absoluteURL != NULL, CFURLCopyAbsoluteURL);
 	
-	/* truncate the file, and reset the file pointer to 0 */
-	require(ftruncate(parent_node->file_fd, 0) == 0, ftruncate);
-	require(lseek(parent_node->file_fd, 0, SEEK_SET) == 0, lseek);
+	/* the authority is everything before the first slash after "scheme://" */
+	require(CFStringGetCString(CFURLGetString(absoluteURL), stream->parentAuthority, sizeof(stream->parentAuthority), kCFStringEncodingUTF8), CFStringGetCString);
+	authorityEnd = strstr(stream->parentAuthority, "://");
+	require(authorityEnd != NULL, CFStringGetCString);
+	authorityEnd = strchr(authorityEnd + 3, '/');
+	if ( authorityEnd != NULL )
+	{
+		stream->parentIsDirectory = (stream->parentAuthority[strlen(stream->parentAuthority) - 1] == '/');
+		*authorityEnd = '\0';
+	}
+	stream->parentAuthorityLength = strlen(stream->parentAuthority);
 	
-	int result = xmlSAXUserParseMemory( &sh,&opendir_struct,(char*)xmlp,(int)xmlp_len);
-	require(result == 0, ParserCreate);
-	/* parse the XML -- exit now if error during parse */
+	escapedPath = CFURLCopyPath(absoluteURL);
+	require(escapedPath != NULL, CFStringGetCString);
 	
-	/* if the directory is not deleted, write "." and ".."  */
-	if ( !NODE_IS_DELETED(parent_node) )
+	unescapedPath = CFURLCreateStringByReplacingPercentEscapes(kCFAllocatorDefault, escapedPath, CFSTR(""));
+	require(unescapedPath != NULL, CFURLCreateStringByReplacingPercentEscapes);
+	
+	if ( CFStringGetCString(unescapedPath, stream->parentPath, sizeof(stream->parentPath), kCFStringEncodingUTF8) )
 	{
-		bzero(dir_data, sizeof(dir_data));
-		
-		dir_data[0].d_ino = parent_node->fileid;
-		dir_data[0].d_reclen = sizeof(struct webdav_dirent);
-		dir_data[0].d_type = DT_DIR;
-		dir_data[0].d_namlen = 1;
-		dir_data[0].d_name[0] = '.';
-		
-		dir_data[1].d_ino =
-		(dir_data[0].d_ino == WEBDAV_ROOTFILEID) ? WEBDAV_ROOTPARENTFILEID : parent_node->parent->fileid;
-		dir_data[1].d_reclen = sizeof(struct webdav_dirent);
-		dir_data[1].d_type = DT_DIR;
-		dir_data[1].d_namlen = 2;
-		dir_data[1].d_name[0] = '.';
-		dir_data[1].d_name[1] = '.';
-		
-		size = write(parent_node->file_fd, dir_data, sizeof(struct webdav_dirent) * 2);
-		require(size == (sizeof(struct webdav_dirent) * 2), write_dot_dotdot);
+		stream->parentPathBytes = strlen(stream->parentPath);
+		/* drop the trailing slash so the root's path is "" */
+		if ( (stream->parentPathBytes != 0) && (stream->parentPath[stream->parentPathBytes - 1] == '/') )
+		{
+			stream->parentPath[--stream->parentPathBytes] = '\0';
+		}
+		stream->parentParsed = TRUE;
 	}
 	
-	/*
-	 * Important: the xml we get back from the server includes the info
-	 * on the parent directory as well as all of its children.
-	 *
-	 * The elements returned by PROPFIND contain http URI. So, give a parent URL of
-	 * http://host/parent/, the responses could be:
-	 *		absolute URL:	http://host/parent/child
-	 *		absolute path:	/parent/child
-	 *		relative path:	child
-	 * So, if all URLs are normalized to an absolute path with percent escapes
-	 * removed, then the children will always be longer than the parent.
-	 */
+	CFRelease(unescapedPath);
 	
-	/* get the parent directory's path length */
-	parentPathLength = GetNormalizedPathLength(urlRef);
+CFURLCreateStringByReplacingPercentEscapes:
 	
-	/* invalidate any children nodes -- they'll be marked valid by nodecache_get_node */
-	(void) nodecache_invalidate_directory_node_time(parent_node);
+	CFRelease(escapedPath);
+	
+CFStringGetCString:
+	
+	CFRelease(absoluteURL);
+	
+CFURLCopyAbsoluteURL:
+	
+	return;
+}
+
+/*****************************************************************************/
+
+/*
+ * IsPlainHrefByte returns TRUE for the bytes that can appear unescaped in the
+ * path of an href and need no special handling: the RFC 3986 unreserved and
+ * sub-delims characters, ':', '@' and '/'.
+ */
+static Boolean IsPlainHrefByte(UInt8 c)
+{
+	if ( ((c >= 'a') && (c <= 'z')) || ((c >= 'A') && (c <= 'Z')) || ((c >= '0') && (c <= '9')) )
+	{
+		return ( TRUE );
+	}
+	switch ( c )
+	{
+		case '-': case '.': case '_': case '~':
+		case '!': case '$': case '&': case '\'': case '(': case ')':
+		case '*': case '+': case ',': case ';': case '=':
+		case ':': case '@': case '/':
+			return ( TRUE );
+		default:
+			return ( FALSE );
+	}
+}
+
+/*****************************************************************************/
+
+static int HexDigitValue(UInt8 c)
+{
+	if ( (c >= '0') && (c <= '9') )
+		return ( c - '0' );
+	if ( (c >= 'a') && (c <= 'f') )
+		return ( c - 'a' + 10 );
+	if ( (c >= 'A') && (c <= 'F') )
+		return ( c - 'A' + 10 );
+	return ( -1 );
+}
+
+/*****************************************************************************/
+
+/*
+ * DecodeHrefPath percent decodes the path portion of an href into buffer.
+ * Runs of plain bytes are copied with memcpy. It returns FALSE if the path
+ * holds anything it doesn't handle the way CFURL would: a query or fragment,
+ * a "." or ".." segment, a byte that should have been escaped, a bad escape,
+ * or an escaped '/' or NUL.
+ */
+static Boolean DecodeHrefPath(
+	const UInt8 *path,				/* -> the escaped path */
+	size_t pathLength,				/* -> length of path */
+	char *buffer,					/* <- the decoded path */
+	size_t *bufferLength)			/* <- length of the decoded path (never more than pathLength) */
+{
+	const UInt8 *end = path + pathLength;
+	const UInt8 *segment = path;
+	const UInt8 *run;
+	size_t length = 0;
 	
-	/* look at the list of elements */
-	for (element_ptr = opendir_struct.head; element_ptr != NULL; element_ptr = element_ptr->next)
+	while ( path < end )
 	{
-		char namebuffer[MAXNAMLEN + 1];
-		struct webdav_stat_attr statbuf;
-		
-		// Skip any placeholder that never saw a matching <D:href> element
-		if (element_ptr->seen_href == FALSE)
-			continue;
+		/* copy the run of plain bytes up to the next escape */
+		run = path;
+		while ( (path < end) && IsPlainHrefByte(*path) )
+		{
+			if ( *path == '/' )
+			{
+				/* the segment just ended -- reject "." and ".." */
+				if ( ((path - segment) == 1 && segment[0] == '.') ||
+					 ((path - segment) == 2 && segment[0] == '.' && segment[1] == '.') )
+				{
+					return ( FALSE );
+				}
+				segment = path + 1;
+			}
+			++path;
+		}
+		memcpy(buffer + length, run, (size_t)(path - run));
+		length += (size_t)(path - run);
 		
-		/* make element_ptr->dir_data.d_name a cstring */
-		element_ptr->dir_data.d_name[element_ptr->dir_data.d_name_URI_length] = '\0';
-		//syslog(LOG_ERR,"element_ptr->dir_data.d_name is %s\n",element_ptr->dir_data.d_name);
-		/* get the component name if this element is not the parent */
-		if ( GetComponentName(urlRef, parentPathLength, element_ptr->dir_data.d_name, namebuffer) )
+		if ( path < end )
 		{
-			/* this is a child */
-			struct node_entry *element_node;
-			size_t name_len;
+			int high, low;
 			
-			name_len = strlen(namebuffer);
-			//syslog(LOG_ERR,"namebuffer is %s\n",namebuffer);
-			/* get (or create) a cache node for this element */
-			error = nodecache_get_node(parent_node, name_len, namebuffer, TRUE, FALSE,
-									   element_ptr->dir_data.d_type == DT_DIR ? WEBDAV_DIR_TYPE : WEBDAV_FILE_TYPE, &element_node);
-			if (error)
+			/* the only other byte handled is a valid escape of anything but '/' or NUL */
+			if ( (*path != '%') || ((end - path) < 3) )
 			{
-				debug_string("nodecache_get_node failed");
-				continue;
+				return ( FALSE );
 			}
-			/* move just the element name over element_ptr->dir_data.d_name */
-			bcopy(element_node->name, element_ptr->dir_data.d_name, element_node->name_length);
-			
-			element_ptr->dir_data.d_name[element_node->name_length] = '\0';
-			element_ptr->dir_data.d_namlen = element_node->name_length;
-			
-			/* set the file number */
-			element_ptr->dir_data.d_ino = element_node->fileid;
-			//syslog(LOG_ERR,"element_node->fileid : %d\n",element_node->fileid);
-			/*
-			 * Prepare to cache this element's attributes, since it's
-			 * highly likely a stat will follow reading the directory.
-			 */
-			
-			bzero(&statbuf, sizeof(struct webdav_stat_attr));
-			
-			/* the first thing to do is fill in the fields we cannot get from the server. */
-			statbuf.attr_stat.st_dev = 0;
-			/* Why 1 for st_nlink?
-			 * Getting the real link count for directories is expensive.
-			 * Setting it to 1 lets FTS(3) (and other utilities that assume
-			 * 1 means a file system doesn't support link counts) work.
-			 */
-			statbuf.attr_stat.st_nlink = 1;
-			statbuf.attr_stat.st_uid = UNKNOWNUID;
-			statbuf.attr_stat.st_gid = UNKNOWNUID;
-			statbuf.attr_stat.st_rdev = 0;
-			statbuf.attr_stat.st_blksize = WEBDAV_IOSIZE;
-			statbuf.attr_stat.st_flags = 0;
-			statbuf.attr_stat.st_gen = 0;
-			
-			/* set all times to the last modified time since we cannot get the other times */
-			statbuf.attr_stat.st_atimespec = statbuf.attr_stat.st_mtimespec = statbuf.attr_stat.st_ctimespec = element_ptr->stattime;
-			
-			/* set create time if we have it */
-			if (element_ptr->createtime.tv_sec)
-				statbuf.attr_create_time = element_ptr->createtime;
-			//syslog(LOG_ERR,"element_ptr->dir_data.d_type : %d\n",element_ptr->dir_data.d_type);
-			if (element_ptr->dir_data.d_type == DT_DIR)
+			high = HexDigitValue(path[1]);
+			low = HexDigitValue(path[2]);
+			if ( (high < 0) || (low < 0) || (((high << 4) | low) == '/') || (((high << 4) | low) == 0) )
 			{
-				statbuf.attr_stat.st_mode = S_IFDIR | S_IRWXU;
-				statbuf.attr_stat.st_size = WEBDAV_DIR_SIZE;
-				/* appledoubleheadervalid is never valid for directories */
-				element_ptr->appledoubleheadervalid = FALSE;
+				return ( FALSE );
 			}
-			else
-			{
-				statbuf.attr_stat.st_mode = S_IFREG | S_IRWXU;
-				statbuf.attr_stat.st_size = element_ptr->statsize;
-				/* appledoubleheadervalid is valid for files only if the server
-				 * returned the appledoubleheader property and file size is
-				 * the size of the appledoubleheader (APPLEDOUBLEHEADER_LENGTH bytes).
-				 */
-				element_ptr->appledoubleheadervalid =
-				(element_ptr->appledoubleheadervalid && (element_ptr->statsize == APPLEDOUBLEHEADER_LENGTH));
-				//syslog(LOG_ERR, "element_ptr->appledoubleheadervalid %d",element_ptr->appledoubleheadervalid);
-			}
-			
-			/* calculate number of S_BLKSIZE blocks */
-			statbuf.attr_stat.st_blocks = ((statbuf.attr_stat.st_size + S_BLKSIZE - 1) / S_BLKSIZE);
-			
-			/* set the fileid in statbuf*/
-			statbuf.attr_stat.st_ino = element_node->fileid;
-			
-			/* Now cache the stat structure (ignoring errors) */
-			(void) nodecache_add_attributes(element_node, uid, &statbuf,
-											element_ptr->appledoubleheadervalid ? element_ptr->appledoubleheader : NULL);
-			
-			/* Complete the task of getting the regular name into the dirent */
-			
-			size = write(parent_node->file_fd, (void *)&element_ptr->dir_data, element_ptr->dir_data.d_reclen);
-			require(size == element_ptr->dir_data.d_reclen, write_element);
+			buffer[length++] = (char)((high << 4) | low);
+			path += 3;
+		}
+	}
+	
+	/* check the last segment */
+	if ( ((path - segment) == 1 && segment[0] == '.') ||
+		 ((path - segment) == 2 && segment[0] == '.' && segment[1] == '.') )
+	{
+		return ( FALSE );
+	}
+	
+	*bufferLength = length;
+	return ( TRUE );
+}
+
+/*****************************************************************************/
+
+/*
+ * IsValidUTF8 returns TRUE if bytes is well formed UTF-8 (no overlong forms,
+ * surrogates or code points above U+10FFFF).
+ */
+static Boolean IsValidUTF8(const UInt8 *bytes, size_t length)
+{
+	const UInt8 *end = bytes + length;
+	
+	while ( bytes < end )
+	{
+		UInt8 c = *bytes++;
+		int trailing;
+		UInt8 min, max;
+		
+		if ( c < 0x80 )
+			continue;
+		
+		min = 0x80;
+		max = 0xbf;
+		if ( (c >= 0xc2) && (c <= 0xdf) )
+		{
+			trailing = 1;
+		}
+		else if ( (c >= 0xe0) && (c <= 0xef) )
+		{
+			trailing = 2;
+			if ( c == 0xe0 )
+				min = 0xa0;
+			else if ( c == 0xed )
+				max = 0x9f;
+		}
+		else if ( (c >= 0xf0) && (c <= 0xf4) )
+		{
+			trailing = 3;
+			if ( c == 0xf0 )
+				min = 0x90;
+			else if ( c == 0xf4 )
+				max = 0x8f;
 		}
 		else
 		{
-			struct node_entry *temp_node;
-			/* it was the parent */
-			
-			/* we are reading this directory, so mark it "recent" */
-			(void) nodecache_get_node(parent_node, 0, NULL, TRUE, TRUE, WEBDAV_DIR_TYPE, &temp_node);
-			
-			/*
-			 * Prepare to cache this element's attributes, since it's
-			 * highly likely a stat will follow reading the directory.
-			 */
-			
-			bzero(&statbuf, sizeof(struct webdav_stat_attr));
-			
-			/* the first thing to do is fill in the fields we cannot get from the server. */
-			statbuf.attr_stat.st_dev = 0;
-			/* Why 1 for st_nlink?
-			 * Getting the real link count for directories is expensive.
-			 * Setting it to 1 lets FTS(3) (and other utilities that assume
-			 * 1 means a file system doesn't support link counts) work.
-			 */
-			statbuf.attr_stat.st_nlink = 1;
-			statbuf.attr_stat.st_uid = UNKNOWNUID;
-			statbuf.attr_stat.st_gid = UNKNOWNUID;
-			statbuf.attr_stat.st_rdev = 0;
-			statbuf.attr_stat.st_blksize = WEBDAV_IOSIZE;
-			statbuf.attr_stat.st_flags = 0;
-			statbuf.attr_stat.st_gen = 0;
-			
-			/* set all times to the last modified time since we cannot get the other times */
-			statbuf.attr_stat.st_atimespec = statbuf.attr_stat.st_mtimespec = statbuf.attr_stat.st_ctimespec = element_ptr->stattime;
-			
-			/* set create time if we have it */
-			if (element_ptr->createtime.tv_sec)
-				statbuf.attr_create_time = element_ptr->createtime;
-			
+			return ( FALSE );
+		}
+		
+		if ( (end - bytes) < trailing )
+			return ( FALSE );
+		
+		/* only the first trailing byte has a restricted range */
+		if ( (*bytes < min) || (*bytes > max) )
+			return ( FALSE );
+		++bytes;
+		while ( --trailing > 0 )
+		{
+			if ( (*bytes & 0xc0) != 0x80 )
+				return ( FALSE );
+			++bytes;
+		}
+	}
+	return ( TRUE );
+}
+
+/*****************************************************************************/
+
+/*
+ * GetComponentNameFromHref is the fast path for GetComponentName. It works on
+ * the raw UTF-8 href, so no CoreFoundation objects are created per entry:
+ *
+ *	absolute URL:	http://host/parent/child	the authority must match the parent's
+ *	absolute path:	/parent/child
+ *	relative path:	child						resolved against the parent directory
+ *
+ * The path is percent decoded and must be the parent's decoded path, which is
+ * the parent itself, or the parent's path plus one more segment, which is the
+ * child's component name.
+ *
+ * GetComponentNameFromHref returns FALSE if it can't decide -- an href it
+ * doesn't handle, or a path that doesn't match the parent's bytes -- and the
+ * caller must use GetComponentName. Otherwise it returns TRUE with *isChild
+ * set just as GetComponentName's result would be.
+ */
+static Boolean GetComponentNameFromHref(
+	webdav_parse_opendir_stream_t *stream,
+	const char *uri,				/* -> the http URI from the WebDAV server */
+	size_t uriLength,				/* -> length of uri */
+	char *componentName,			/* <-> buffer of MAXNAMLEN + 1 bytes where URI's LastPathComponent is returned if *isChild is TRUE */
+	Boolean *isChild)				/* <- TRUE if http URI was not parent and component name was returned */
+{
+	char decoded[WEBDAV_MAX_URI_LEN];
+	const char *path;
+	const char *rest;
+	size_t decodedLength;
+	size_t restLength;
+	const char *scheme_end;
+	
+	if ( !stream->parentParsed || (uriLength == 0) || (uriLength >= sizeof(decoded)) )
+	{
+		return ( FALSE );
+	}
+	
+	/* classify the href */
+	scheme_end = strstr(uri, "://");
+	if ( uri[0] == '/' )
+	{
+		/* absolute path */
+		path = uri;
+	}
+	else if ( scheme_end != NULL && (memchr(uri, '/', (size_t)(scheme_end - uri)) == NULL) )
+	{
+		/* absolute URL -- it must be on the parent's server */
+		path = strchr(scheme_end + 3, '/');
+		if ( (path == NULL) ||
+			 ((size_t)(path - uri) != stream->parentAuthorityLength) ||
+			 (strncasecmp(uri, stream->parentAuthority, stream->parentAuthorityLength) != 0) )
+		{
+			return ( FALSE );
+		}
+	}
+	else
+	{
+		/* relative path -- only simple names relative to a directory are handled */
+		const char *colon = strchr(uri, ':');
+		const char *slash = strchr(uri, '/');
+		
+		/* a colon in the first segment would make it a scheme */
+		if ( !stream->parentIsDirectory || ((colon != NULL) && ((slash == NULL) || (colon < slash))) )
+		{
+			return ( FALSE );
+		}
+		path = NULL;
+	}
+	
+	if ( path != NULL )
+	{
+		if ( !DecodeHrefPath((const UInt8 *)path, uriLength - (size_t)(path - uri), decoded, &decodedLength) )
+		{
+			return ( FALSE );
+		}
+		
+		/* the decoded path must start with the parent's path */
+		if ( (decodedLength < stream->parentPathBytes) ||
+			 (memcmp(decoded, stream->parentPath, stream->parentPathBytes) != 0) )
+		{
+			return ( FALSE );
+		}
+		rest = decoded + stream->parentPathBytes;
+		restLength = decodedLength - stream->parentPathBytes;
+		
+		/* the parent itself? */
+		if ( (restLength == 0) || ((restLength == 1) && (rest[0] == '/')) )
+		{
+			*isChild = FALSE;
+			return ( TRUE );
+		}
+		
+		/* otherwise a slash must follow the parent's path */
+		if ( rest[0] != '/' )
+		{
+			return ( FALSE );
+		}
+		++rest;
+		--restLength;
+	}
+	else
+	{
+		if ( !DecodeHrefPath((const UInt8 *)uri, uriLength, decoded, &decodedLength) )
+		{
+			return ( FALSE );
+		}
+		rest = decoded;
+		restLength = decodedLength;
+	}
+	
+	/* what's left must be exactly one segment, with an optional trailing slash */
+	if ( (restLength != 0) && (rest[restLength - 1] == '/') )
+	{
+		--restLength;
+	}
+	if ( (restLength == 0) || (memchr(rest, '/', restLength) != NULL) ||
+		 !IsValidUTF8((const UInt8 *)rest, restLength) )
+	{
+		return ( FALSE );
+	}
+	
+	if ( restLength > MAXNAMLEN )
+	{
+		debug_string("could not get child name (too long?)");
+		*isChild = FALSE;
+		return ( TRUE );
+	}
+	
+	memcpy(componentName, rest, restLength);
+	componentName[restLength] = '\0';
+	*isChild = TRUE;
+	return ( TRUE );
+}
+
+/*****************************************************************************/
+
+/*
+ * parse_opendir_element caches the attributes of one parsed response element
+ * and, if it is a child of the parent directory, writes its webdav_dirent to
+ * the directory file.
+ */
+static int parse_opendir_element(
+	webdav_parse_opendir_stream_t *stream,
+	webdav_parse_opendir_element_t *element_ptr)
+{
+	int error = 0;
+	ssize_t size;
+	CFURLRef urlRef = stream->urlRef;
+	CFIndex parentPathLength = stream->parentPathLength;
+	uid_t uid = stream->uid;
+	struct node_entry *parent_node = stream->parent_node;
+	char namebuffer[MAXNAMLEN + 1];
+	struct webdav_stat_attr statbuf;
+	struct webdav_dirent dir_data;
+	Boolean isChild;
+	
+	// Skip any placeholder that never saw a matching <D:href> element, or an empty <D:href>
+	if ( (element_ptr->seen_href == FALSE) || (element_ptr->name == NULL) )
+		return ( 0 );
+	
+	//syslog(LOG_ERR,"element_ptr->name is %s\n",element_ptr->name);
+	/* get the component name if this element is not the parent */
+	if ( !GetComponentNameFromHref(stream, element_ptr->name, element_ptr->name_length, namebuffer, &isChild) )
+	{
+		/* an href the fast path doesn't handle -- let CFURL work it out */
+		isChild = GetComponentName(urlRef, parentPathLength, element_ptr->name, namebuffer);
+	}
+	if ( isChild )
+	{
+		/* this is a child */
+		struct node_entry *element_node;
+		size_t name_len;
+		
+		name_len = strlen(namebuffer);
+		//syslog(LOG_ERR,"namebuffer is %s\n",namebuffer);
+		/* get (or create) a cache node for this element */
+		error = nodecache_get_node(parent_node, name_len, namebuffer, TRUE, FALSE,
+								   element_ptr->d_type == DT_DIR ? WEBDAV_DIR_TYPE : WEBDAV_FILE_TYPE, &element_node);
+		if (error)
+		{
+			debug_string("nodecache_get_node failed");
+			return ( 0 );
+		}
+		bzero(&dir_data, sizeof(struct webdav_dirent));
+		dir_data.d_reclen = sizeof(struct webdav_dirent);
+		dir_data.d_type = element_ptr->d_type;
+		
+		/* move just the element name into dir_data.d_name */
+		bcopy(element_node->name, dir_data.d_name, element_node->name_length);
+		
+		dir_data.d_name[element_node->name_length] = '\0';
+		dir_data.d_namlen = element_node->name_length;
+		
+		/* set the file number */
+		dir_data.d_ino = element_node->fileid;
+		//syslog(LOG_ERR,"element_node->fileid : %d\n",element_node->fileid);
+		/*
+		 * Prepare to cache this element's attributes, since it's
+		 * highly likely a stat will follow reading the directory.
+		 */
+		
+		bzero(&statbuf, sizeof(struct webdav_stat_attr));
+		
+		/* the first thing to do is fill in the fields we cannot get from the server. */
+		statbuf.attr_stat.st_dev = 0;
+		/* Why 1 for st_nlink?
+		 * Getting the real link count for directories is expensive.
+		 * Setting it to 1 lets FTS(3) (and other utilities that assume
+		 * 1 means a file system doesn't support link counts) work.
+		 */
+		statbuf.attr_stat.st_nlink = 1;
+		statbuf.attr_stat.st_uid = UNKNOWNUID;
+		statbuf.attr_stat.st_gid = UNKNOWNUID;
+		statbuf.attr_stat.st_rdev = 0;
+		statbuf.attr_stat.st_blksize = WEBDAV_IOSIZE;
+		statbuf.attr_stat.st_flags = 0;
+		statbuf.attr_stat.st_gen = 0;
+		
+		/* set all times to the last modified time since we cannot get the other times */
+		statbuf.attr_stat.st_atimespec = statbuf.attr_stat.st_mtimespec = statbuf.attr_stat.st_ctimespec = element_ptr->stattime;
+		
+		/* set create time if we have it */
+		if (element_ptr->createtime.tv_sec)
+			statbuf.attr_create_time = element_ptr->createtime;
+		//syslog(LOG_ERR,"element_ptr->d_type : %d\n",element_ptr->d_type);
+		if (element_ptr->d_type == DT_DIR)
+		{
 			statbuf.attr_stat.st_mode = S_IFDIR | S_IRWXU;
 			statbuf.attr_stat.st_size = WEBDAV_DIR_SIZE;
-			
-			/* calculate number of S_BLKSIZE blocks */
-			statbuf.attr_stat.st_blocks = ((statbuf.attr_stat.st_size + S_BLKSIZE - 1) / S_BLKSIZE);
-			
-			/* set the fileid in statbuf*/
-			statbuf.attr_stat.st_ino = parent_node->fileid;
-			
-			/* Now cache the stat structure (ignoring errors) */
-			(void) nodecache_add_attributes(parent_node, uid, &statbuf, NULL);
+			/* appledoubleheadervalid is never valid for directories */
+			element_ptr->appledoubleheadervalid = FALSE;
+		}
+		else
+		{
+			statbuf.attr_stat.st_mode = S_IFREG | S_IRWXU;
+			statbuf.attr_stat.st_size = element_ptr->statsize;
+			/* appledoubleheadervalid is valid for files only if the server
+			 * returned the appledoubleheader property and file size is
+			 * the size of the appledoubleheader (APPLEDOUBLEHEADER_LENGTH bytes).
+			 */
+			element_ptr->appledoubleheadervalid =
+			(element_ptr->appledoubleheadervalid && (element_ptr->statsize == APPLEDOUBLEHEADER_LENGTH));
+			//syslog(LOG_ERR, "element_ptr->appledoubleheadervalid %d",element_ptr->appledoubleheadervalid);
+		}
+		
+		/* calculate number of S_BLKSIZE blocks */
+		statbuf.attr_stat.st_blocks = ((statbuf.attr_stat.st_size + S_BLKSIZE - 1) / S_BLKSIZE);
+		
+		/* set the fileid in statbuf*/
+		statbuf.attr_stat.st_ino = element_node->fileid;
+		
+		/* Now cache the stat structure (ignoring errors) */
+		(void) nodecache_add_attributes(element_node, uid, &statbuf,
+										element_ptr->appledoubleheadervalid ? element_ptr->appledoubleheader : NULL);
+		
+		/* Complete the task of getting the regular name into the dirent */
+		
+		if ( stream->dirents_fd != -1 )
+		{
+			size = write(stream->dirents_fd, (void *)&dir_data, dir_data.d_reclen);
+			require_action(size == dir_data.d_reclen, write_element, error = EIO);
+		}
+	}
+	else
+	{
+		struct node_entry *temp_node;
+		/* it was the parent */
+		
+		if ( stream->dirents_fd != -1 )
+		{
+			/* we are reading this directory, so mark it "recent" */
+			(void) nodecache_get_node(parent_node, 0, NULL, TRUE, TRUE, WEBDAV_DIR_TYPE, &temp_node);
+		}
+		
+		/*
+		 * Prepare to cache this element's attributes, since it's
+		 * highly likely a stat will follow reading the directory.
+		 */
+		
+		bzero(&statbuf, sizeof(struct webdav_stat_attr));
+		
+		/* the first thing to do is fill in the fields we cannot get from the server. */
+		statbuf.attr_stat.st_dev = 0;
+		/* Why 1 for st_nlink?
+		 * Getting the real link count for directories is expensive.
+		 * Setting it to 1 lets FTS(3) (and other utilities that assume
+		 * 1 means a file system doesn't support link counts) work.
+		 */
+		statbuf.attr_stat.st_nlink = 1;
+		statbuf.attr_stat.st_uid = UNKNOWNUID;
+		statbuf.attr_stat.st_gid = UNKNOWNUID;
+		statbuf.attr_stat.st_rdev = 0;
+		statbuf.attr_stat.st_blksize = WEBDAV_IOSIZE;
+		statbuf.attr_stat.st_flags = 0;
+		statbuf.attr_stat.st_gen = 0;
+		
+		/* set all times to the last modified time since we cannot get the other times */
+		statbuf.attr_stat.st_atimespec = statbuf.attr_stat.st_mtimespec = statbuf.attr_stat.st_ctimespec = element_ptr->stattime;
+		
+		/* set create time if we have it */
+		if (element_ptr->createtime.tv_sec)
+			statbuf.attr_create_time = element_ptr->createtime;
+		
+		statbuf.attr_stat.st_mode = S_IFDIR | S_IRWXU;
+		statbuf.attr_stat.st_size = WEBDAV_DIR_SIZE;
+		
+		/* calculate number of S_BLKSIZE blocks */
+		statbuf.attr_stat.st_blocks = ((statbuf.attr_stat.st_size + S_BLKSIZE - 1) / S_BLKSIZE);
+		
+		/* set the fileid in statbuf*/
+		statbuf.attr_stat.st_ino = parent_node->fileid;
+		
+		/* Now cache the stat structure (ignoring errors) */
+		(void) nodecache_add_attributes(parent_node, uid, &statbuf, NULL);
+	}
+
+write_element:
+
+	return ( error );
+}
+
+/*****************************************************************************/
+
+/*
+ * parse_opendir_flush handles and frees the elements parsed so far. It is
+ * called each time a </response> closes, so only one response's elements are
+ * ever held in memory and the arena's first chunk is reused for the next.
+ */
+static void parse_opendir_flush(webdav_parse_opendir_stream_t *stream)
+{
+	webdav_parse_opendir_element_t *element_ptr;
+	
+	for ( element_ptr = stream->opendir_struct.head; element_ptr != NULL; element_ptr = element_ptr->next )
+	{
+		if ( stream->error == 0 )
+		{
+			stream->error = parse_opendir_element(stream, element_ptr);
 		}
-	}	/* for element_ptr */
+	}
+	parse_arena_reset(&stream->opendir_struct.arena);
+	
+	stream->opendir_struct.text = NULL;
+	stream->opendir_struct.text_length = 0;
+	stream->opendir_struct.text_size = 0;
+	stream->opendir_struct.head = stream->opendir_struct.tail = NULL;
+	stream->opendir_struct.id = WEBDAV_OPENDIR_IGNORE;
+	stream->opendir_struct.data_ptr = NULL;
+}
+
+/*****************************************************************************/
+
+static void parser_opendir_stream_end(void *ctx,
+									  const xmlChar *localname,
+									  const xmlChar *prefix,
+									  const xmlChar *URI)
+{
+	webdav_parse_opendir_stream_t *stream = (webdav_parse_opendir_stream_t *)ctx;
 	
-	/* delete any children nodes that are still invalid */
-	(void) nodecache_delete_invalid_directory_nodes(parent_node);
+	parser_opendir_end(ctx, localname, prefix, URI);
 	
-	/* free any elements allocated */
-	element_ptr = opendir_struct.head;
-	while (element_ptr)
+	if ( strcasecmp((const char *)localname, "response") == 0 )
 	{
-		prev_element_ptr = element_ptr;
-		element_ptr = element_ptr->next;
-		free(prev_element_ptr);
+		parse_opendir_flush(stream);
 	}
+}
+
+/*****************************************************************************/
+
+/*
+ * parse_opendir_start is called when the first part of a successful response
+ * arrives (or a successful response has no body). It empties the directory
+ * file, writes "." and "..", and invalidates the children's node times. Until
+ * then, a failed, redirected or unsuccessful request leaves the cached listing
+ * alone.
+ */
+static int parse_opendir_start(webdav_parse_opendir_stream_t *stream)
+{
+	struct node_entry *parent_node;
+	ssize_t size;
+	struct webdav_dirent dir_data[2];
 	
-	return ( 0 );
+	stream->started = TRUE;
 	
-	/**********************/
+	if ( stream->dirents_fd == -1 )
+	{
+		return ( 0 );
+	}
 	
-write_element:
-	/* free any elements allocated */
-	element_ptr = opendir_struct.head;
-	while (element_ptr)
+	parent_node = stream->parent_node;
+	
+	/* truncate the file, and reset the file pointer to 0 */
+	require(ftruncate(stream->dirents_fd, 0) == 0, ftruncate);
+	require(lseek(stream->dirents_fd, 0, SEEK_SET) == 0, lseek);
+	
+	/* if the directory is not deleted, write "." and ".."  */
+	if ( !NODE_IS_DELETED(parent_node) )
 	{
-		prev_element_ptr = element_ptr;
-		element_ptr = element_ptr->next;
-		free(prev_element_ptr);
+		bzero(dir_data, sizeof(dir_data));
+		
+		dir_data[0].d_ino = parent_node->fileid;
+		dir_data[0].d_reclen = sizeof(struct webdav_dirent);
+		dir_data[0].d_type = DT_DIR;
+		dir_data[0].d_namlen = 1;
+		dir_data[0].d_name[0] = '.';
+		
+		dir_data[1].d_ino =
+		(dir_data[0].d_ino == WEBDAV_ROOTFILEID) ? WEBDAV_ROOTPARENTFILEID : parent_node->parent->fileid;
+		dir_data[1].d_reclen = sizeof(struct webdav_dirent);
+		dir_data[1].d_type = DT_DIR;
+		dir_data[1].d_namlen = 2;
+		dir_data[1].d_name[0] = '.';
+		dir_data[1].d_name[1] = '.';
+		
+		size = write(stream->dirents_fd, dir_data, sizeof(struct webdav_dirent) * 2);
+		require(size == (sizeof(struct webdav_dirent) * 2), write_dot_dotdot);
 	}
+	
+	/*
+	 * invalidate any children nodes -- they'll be marked valid by nodecache_get_node
+	 * as their responses are parsed and the rest are deleted by parse_opendir_stream_finish
+	 */
+	(void) nodecache_invalidate_directory_node_time(parent_node);
+	
+	return ( 0 );
+	
+	/**********************/
+	
 write_dot_dotdot:
 	/* directory is in unknown condition - erase whatever is there */
-	(void) ftruncate(parent_node->file_fd, 0);
-ParserCreate:
+	(void) ftruncate(stream->dirents_fd, 0);
 lseek:
 ftruncate:
+
 	return ( EIO );
 }
 
+/*****************************************************************************/
+
+webdav_parse_opendir_stream_t *parse_opendir_stream_create(
+	CFURLRef urlRef,				/* -> the CFURL to the parent directory */
+	uid_t uid,						/* -> uid of the user making the request */
+	struct node_entry *parent_node,	/* -> pointer to the parent directory's node_entry */
+	int dirents_fd)					/* -> the file to write the dirents to, or -1 */
+{
+	webdav_parse_opendir_stream_t *stream;
+	xmlSAXHandler sh;
+	
+	stream = calloc(1, sizeof(webdav_parse_opendir_stream_t));
+	require(stream != NULL, calloc_stream);
+	
+	stream->urlRef = urlRef;
+	CFRetain(urlRef);
+	stream->uid = uid;
+	stream->parent_node = parent_node;
+	stream->dirents_fd = dirents_fd;
+	stream->opendir_struct.id = WEBDAV_OPENDIR_IGNORE;
+	
+	memset(&sh,0,sizeof(sh));
+	sh.startElementNs = parser_opendir_create;
+	sh.characters = parser_opendir_add;
+	sh.endElementNs = parser_opendir_stream_end;
+	sh.initialized = XML_SAX2_MAGIC;
+	
+	/* the parser is fed with parse_opendir_stream_data() as the response arrives */
+	stream->parser = xmlCreatePushParserCtxt(&sh, stream, NULL, 0, NULL);
+	require(stream->parser != NULL, ParserCreate);
+	
+	/*
+	 * Important: the xml we get back from the server includes the info
+	 * on the parent directory as well as all of its children.
+	 *
+	 * The elements returned by PROPFIND contain http URI. So, give a parent URL of
+	 * http://host/parent/, the responses could be:
+	 *		absolute URL:	http://host/parent/child
+	 *		absolute path:	/parent/child
+	 *		relative path:	child
+	 * So, if all URLs are normalized to an absolute path with percent escapes
+	 * removed, then the children will always be longer than the parent.
+	 */
+	
+	/* get the parent directory's path length */
+	stream->parentPathLength = GetNormalizedPathLength(urlRef);
+	ParseParentURL(stream);
+	
+	/* the directory file isn't touched until the response turns out to be successful */
+	return ( stream );
+	
+	/**********************/
+	
+ParserCreate:
+	CFRelease(stream->urlRef);
+	free(stream);
+calloc_stream:
+	return ( NULL );
+}
+
+/*****************************************************************************/
+
+int parse_opendir_stream_data(
+	void *context,					/* -> the webdav_parse_opendir_stream_t */
+	const UInt8 *data,				/* -> the next part of the xml data returned by PROPFIND with depth of 1 */
+	CFIndex length)					/* -> length of data */
+{
+	webdav_parse_opendir_stream_t *stream = (webdav_parse_opendir_stream_t *)context;
+	
+	if ( (stream->error == 0) && !stream->started )
+	{
+		/* only the body of a successful response is passed here */
+		stream->error = parse_opendir_start(stream);
+	}
+	
+	if ( stream->error == 0 )
+	{
+		if ( xmlParseChunk(stream->parser, (const char *)data, (int)length, 0) != 0 )
+		{
+			stream->error = EIO;
+		}
+	}
+	
+	return ( stream->error );
+}
+
+/*****************************************************************************/
+
+int parse_opendir_stream_finish(
+	webdav_parse_opendir_stream_t *stream,
+	int abort)						/* -> TRUE if the transaction failed and the directory file should be erased */
+{
+	int error;
+	
+	if ( (stream->error == 0) && !abort && !stream->started )
+	{
+		/* a successful response with no body */
+		stream->error = parse_opendir_start(stream);
+	}
+	
+	if ( (stream->error == 0) && !abort )
+	{
+		/* parse whatever is left -- exit now if error during parse */
+		if ( xmlParseChunk(stream->parser, NULL, 0, 1) != 0 )
+		{
+			stream->error = EIO;
+		}
+		else
+		{
+			/* handle anything after the last </response> */
+			parse_opendir_flush(stream);
+		}
+	}
+	
+	if ( (stream->error == 0) && !abort )
+	{
+		if ( stream->dirents_fd != -1 )
+		{
+			/* delete any children nodes that are still invalid */
+			(void) nodecache_delete_invalid_directory_nodes(stream->parent_node);
+		}
+		error = 0;
+	}
+	else
+	{
+		if ( (stream->dirents_fd != -1) && stream->started )
+		{
+			/* the directory file was partly written, so erase whatever is there */
+			(void) ftruncate(stream->dirents_fd, 0);
+		}
+		error = EIO;
+	}
+	
+	/* free any elements allocated */
+	stream->error = EIO;	/* so parse_opendir_flush just frees them */
+	parse_opendir_flush(stream);
+	parse_arena_free(&stream->opendir_struct.arena);
+	
+	xmlFreeParserCtxt(stream->parser);
+	CFRelease(stream->urlRef);
+	free(stream);
+	
+	return ( error );
+}
+
 /*****************************************************************************/
 webdav_parse_multistatus_list_t *
 parse_multi_status(
@@ -1805,7 +2555,7 @@ parse_multi_status(
 {
 	webdav_parse_multistatus_list_t *multistatus_list;
 	
-	multistatus_list = malloc(sizeof(webdav_parse_multistatus_list_t));
+	multistatus_list = calloc(1, sizeof(webdav_parse_multistatus_list_t));
 	require(multistatus_list != NULL, malloc_list);
 	
 	multistatus_list->error = 0;
@@ -1829,6 +2579,21 @@ malloc_list:
 	return ( 0 );
 }
 
+/*****************************************************************************/
+
+/*
+ * parse_multi_status_free frees a list returned by parse_multi_status along
+ * with all of its elements.
+ */
+void parse_multi_status_free(webdav_parse_multistatus_list_t *multistatus_list)
+{
+	if ( multistatus_list != NULL )
+	{
+		parse_arena_free(&multistatus_list->arena);
+		free(multistatus_list);
+	}
+}
+
 
 /*****************************************************************************/
 
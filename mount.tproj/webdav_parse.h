@@ -61,21 +61,6 @@ struct webdav_quotas
  */
 #define WEBDAV_MAX_URI_LEN ((MAXPATHLEN * 3) + 1)
 
-/* This structure must be exactly like "struct dirent", defined in sys/dirent.h,
-   except that d_name is long enough to hold the entire URI and the URI length
-   is stored in d_name_URI_length. */
-struct large_dirent
-{
-	webdav_ino_t d_ino;							/* file number of entry */
-	u_int16_t d_reclen;							/* sizeof(struct dirent) */
-	u_int8_t d_type;							/* file type, see below */
-	u_int8_t d_namlen;							/* length of string in d_name */
-	char d_name[WEBDAV_MAX_URI_LEN];			/* name must be no longer than this */
-	u_int32_t d_name_URI_length;				/* the length of the URI stored in
-												 * d_name until it is shortened
-												 * to a file name */
-};
-
 // XXX Dependency on __DARWIN_64_BIT_INO_T
 // struct dirent is in flux right now because __DARWIN_64_BIT_INO_T is set to 1 for user space,
 // but set to zero for kernel space.
@@ -115,16 +100,30 @@ struct webdav_dirent {
 		char d_name[__DARWIN_MAXNAMLEN + 1];	/* name must be no longer than this */
 };
 
+/*
+ * The parse elements and the strings they point to are allocated from a
+ * webdav_parse_arena_t and are all freed at once when the arena is reset or
+ * freed, so an element is only as large as the href the server returned.
+ */
+struct webdav_parse_arena_chunk;
+typedef struct
+{
+	struct webdav_parse_arena_chunk *chunks;	/* the chunk being allocated from is first */
+} webdav_parse_arena_t;
+
 typedef struct webdav_parse_opendir_element_tag
 {
-	struct large_dirent dir_data;
+	char *name;					/* the http URI as a cstring, or NULL if no text was seen */
+	u_int32_t name_length;		/* length of the URI in name */
+	u_int32_t name_size;		/* bytes allocated for name */
+	u_int8_t d_type;			/* DT_REG or DT_DIR */
 	struct timespec stattime;
 	struct timespec createtime;
 	u_quad_t statsize;
 	int appledoubleheadervalid;	/* TRUE if appledoubleheader field is valid */
 	int seen_href;	/* TRUE if we've seen the <D:href> entity for this element (otherwise this is a place holder) */
 	int seen_response_end; /* TRUE if we've seen <d:/response> for this element */
-	char appledoubleheader[APPLEDOUBLEHEADER_LENGTH];
+	char *appledoubleheader;	/* APPLEDOUBLEHEADER_LENGTH bytes, or NULL if the property wasn't returned */
 	struct webdav_parse_opendir_element_tag *next;
 } webdav_parse_opendir_element_t;
 
@@ -134,16 +133,14 @@ typedef struct
 	int id;
 	void *data_ptr;
 	Boolean start; /*For characters callback to work only after start tag and no end tag*/
+	char *text;					/* the current element's text so far (from arena), or NULL -- handled at its end tag */
+	u_int32_t text_length;		/* length of text */
+	u_int32_t text_size;		/* bytes allocated for text */
 	webdav_parse_opendir_element_t *head;
 	webdav_parse_opendir_element_t *tail;
+	webdav_parse_arena_t arena;	/* the elements and their strings */
 } webdav_parse_opendir_struct_t;
 
-typedef struct
-{
-	CFIndex size;
-	UInt8 name[WEBDAV_MAX_URI_LEN];
-} webdav_parse_opendir_text_t;
-
 typedef struct
 {
 	int id;
@@ -169,8 +166,9 @@ typedef struct
 typedef struct webdav_parse_multistatus_element_tag
 {
 	UInt32 statusCode;
-	UInt8  name_len;		/* length of string in name */
-	UInt8 name[WEBDAV_MAX_URI_LEN];
+	char *name;				/* the http URI as a cstring, or NULL if no text was seen */
+	u_int32_t name_len;		/* length of string in name */
+	u_int32_t name_size;	/* bytes allocated for name */
 	
 	/* some bookkeeping fields, only used during parsing */
 	int seen_href;	/* TRUE if we've seen the <D:href> entity for this element (otherwise this is a place holder) */
@@ -187,21 +185,40 @@ typedef struct
 	webdav_parse_multistatus_element_t *head;
 	webdav_parse_multistatus_element_t *tail;
 	Boolean start;
+	webdav_parse_arena_t arena;	/* the elements and their strings */
 } webdav_parse_multistatus_list_t;
 
 /* Functions */
 extern int parse_stat(const UInt8 *xmlp, CFIndex xmlp_len, struct webdav_stat_attr *statbuf);
 extern int parse_statfs(const UInt8 *xmlp, CFIndex xmlp_len, struct statfs *statfsbuf);
 extern int parse_lock(const UInt8 *xmlp, CFIndex xmlp_len, char **locktoken);
-extern int parse_opendir(
-	UInt8 *xmlp,					/* -> xml data returned by PROPFIND with depth of 1 */
-	CFIndex xmlp_len,				/* -> length of xml data */
+/*
+ * A directory listing is parsed as the PROPFIND response arrives: create the
+ * stream, pass each part of the response body to parse_opendir_stream_data
+ * (which writes dirents and caches attributes as each response element is
+ * parsed), then call parse_opendir_stream_finish. The dirents are written to
+ * dirents_fd (normally the directory's cache file), which isn't touched until
+ * the first part of a successful response arrives. If dirents_fd is -1, only
+ * the attributes are cached: no directory file is written and the parent's
+ * child nodes are left alone.
+ */
+typedef struct webdav_parse_opendir_stream webdav_parse_opendir_stream_t;
+extern webdav_parse_opendir_stream_t *parse_opendir_stream_create(
 	CFURLRef urlRef,				/* -> the CFURL to the parent directory (may be a relative CFURL) */
 	uid_t uid,						/* -> uid of the user making the request */ 
-	struct node_entry *parent_node);/* -> pointer to the parent directory's node_entry */
+	struct node_entry *parent_node,	/* -> pointer to the parent directory's node_entry */
+	int dirents_fd);				/* -> the file to write the dirents to, or -1 */
+extern int parse_opendir_stream_data(
+	void *context,					/* -> the webdav_parse_opendir_stream_t */
+	const UInt8 *data,				/* -> the next part of the xml data returned by PROPFIND with depth of 1 */
+	CFIndex length);				/* -> length of data */
+extern int parse_opendir_stream_finish(
+	webdav_parse_opendir_stream_t *stream,
+	int abort);						/* -> TRUE if the transaction failed */
 extern int parse_file_count(const UInt8 *xmlp, CFIndex xmlp_len, int *file_count);
 extern int parse_cachevalidators(const UInt8 *xmlp, CFIndex xmlp_len, time_t *last_modified, char **entity_tag);
 extern webdav_parse_multistatus_list_t *parse_multi_status(	UInt8 *xmlp, CFIndex xmlp_len);
+extern void parse_multi_status_free(webdav_parse_multistatus_list_t *multistatus_list);
 /* Definitions */
 
 #define WEBDAV_OPENDIR_ELEMENT 1	/* Make it not 0 (for null) but small enough to not be a ptr */
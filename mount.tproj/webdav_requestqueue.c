@@ -33,9 +33,12 @@
 #include <sys/socket.h>
 #include <sys/uio.h>
 #include <sys/sysctl.h>
+#include <sys/time.h>
+#include <sys/stat.h>
 #include "webdav_requestqueue.h"
 #include "webdav_network.h"
 #include "webdav_cookie.h"
+#include "OpaqueIDs.h"
 
 /*****************************************************************************/
 
@@ -49,6 +52,8 @@ typedef struct webdav_requestqueue_element_tag
 {
 	struct webdav_requestqueue_element_tag *next;
 	int type;
+	int request_class;						/* the WEBDAV_CLASS_* queue the element is on */
+	u_int64_t enqueue_time;					/* when the element was queued (in microseconds) */
 	union
 	{
 		struct request
@@ -60,6 +65,7 @@ typedef struct webdav_requestqueue_element_tag
 		{
 			struct node_entry *node;			/* the node */
 			struct ReadStreamRec *readStreamRecPtr; /* the ReadStreamRec */
+			struct download_segments *segments;	/* the rest of a segmented download, or NULL */
 		} download;								/* Struct used for download requests */
 		
 		struct serverping
@@ -71,6 +77,19 @@ typedef struct webdav_requestqueue_element_tag
 		{
 			struct stream_put_ctx *ctx;
 		} seqwrite_read_rsp;
+		
+		struct prefetch
+		{
+			opaque_id nodeid;					/* the directory to read ahead of demand */
+		} prefetch;								/* Struct used for directory prefetches */
+		
+		struct channel_request
+		{
+			struct webdav_kext_channel *channel; /* the channel the request came in on */
+			uint32_t tag;						/* the request's tag */
+			size_t length;						/* length of frame */
+			char *frame;						/* the operation and request (NUL terminated) */
+		} channel_request;						/* Struct used for requests from the kernel on a channel */
 				
 	} element;
 } webdav_requestqueue_element_t;
@@ -82,6 +101,43 @@ typedef struct
 	int request_count;
 } webdav_requestqueue_header_t;
 
+/* a request class: its queue, and counters for it */
+typedef struct
+{
+	webdav_requestqueue_header_t waiting;	/* the queued elements */
+	int running;							/* number of elements being handled */
+	int max_depth;							/* the most elements ever queued at once */
+	u_int64_t enqueued;						/* number of elements queued */
+	u_int64_t dispatched;					/* number of elements handed to a thread */
+	u_int64_t total_wait;					/* time dispatched elements spent queued (in microseconds) */
+	u_int64_t max_wait;						/* the longest time an element spent queued (in microseconds) */
+} webdav_requestclass_t;
+
+/* a long-lived connection from the kext (see struct webdav_channel_header) */
+typedef struct webdav_kext_channel
+{
+	int socket;							/* the connection */
+	pthread_mutex_t send_lock;			/* serializes reply frames and protects refcount */
+	int refcount;						/* the channel reader plus requests read and not yet replied to */
+} webdav_kext_channel_t;
+
+/* where a reply is sent */
+typedef struct
+{
+	int socket;							/* the socket the request came in on */
+	webdav_kext_channel_t *channel;		/* the channel the request came in on, or NULL */
+	uint32_t tag;						/* the tag of the channel request */
+} webdav_reply_dest_t;
+
+/* a WEBDAV_WAIT_DOWNLOAD request from a channel waiting for a download to make progress */
+typedef struct download_waiter
+{
+	struct download_waiter *next;
+	webdav_reply_dest_t dest;			/* where the reply goes (holds a reference to the channel) */
+	struct node_entry *node;			/* the node being downloaded (only compared, never dereferenced) */
+	uint64_t offset;					/* reply when the cache file has this many bytes (see WEBDAV_WAIT_DOWNLOAD_END) */
+} download_waiter_t;
+
 /*****************************************************************************/
 
 /* Definitions */
@@ -89,6 +145,33 @@ typedef struct
 #define WEBDAV_DOWNLOAD_TYPE 2
 #define WEBDAV_SERVER_PING_TYPE 3
 #define WEBDAV_SEQWRITE_MANAGER_TYPE 4
+#define WEBDAV_CHANNEL_REQUEST_TYPE 5
+#define WEBDAV_PREFETCH_TYPE 6
+
+/*
+ * Request classes, in the order they are dispatched. Downloads and sequential
+ * write managers hold a stream and are waited on by requests from the kernel,
+ * so they go first; server pings are short and detect reconnection. Metadata
+ * requests from the kernel go before data requests from the kernel, but a
+ * data request that has waited WEBDAV_DATA_MAX_WAIT goes before anything.
+ * Directory prefetches are only guesses, so they go when nothing else is
+ * waiting, and no more than WEBDAV_PREFETCH_PARALLEL of them run at once.
+ *
+ * All but the interactive class share gRequestThreads threads. One more thread
+ * is allowed for interactive requests, so a lookup or getattr never waits
+ * behind long downloads and data requests.
+ */
+#define WEBDAV_CLASS_BACKGROUND 0		/* downloads and sequential write managers */
+#define WEBDAV_CLASS_HOUSEKEEPING 1		/* server pings */
+#define WEBDAV_CLASS_INTERACTIVE 2		/* metadata requests from the kernel */
+#define WEBDAV_CLASS_DATA 3				/* data requests from the kernel */
+#define WEBDAV_CLASS_PREFETCH 4			/* directory prefetches */
+#define WEBDAV_CLASS_COUNT 5
+
+#define WEBDAV_DATA_MAX_WAIT 1000000	/* in microseconds */
+
+/* the largest frame the kext sends on a channel: the operation, the request, and a name */
+#define WEBDAV_CHANNEL_FRAME_MAX (sizeof(int) + (NAME_MAX + 1) + sizeof(union webdav_request))
 
 #define WEBDAV_MAX_IDLE_TIME 10		/* in seconds */
 
@@ -100,16 +183,25 @@ static int connectionstate;
 
 static pthread_mutex_t requests_lock;
 static pthread_cond_t requests_condvar;
-static webdav_requestqueue_header_t waiting_requests;
+static webdav_requestclass_t request_classes[WEBDAV_CLASS_COUNT];	/* protected by requests_lock */
 
 static pthread_mutex_t pulse_lock;
 static pthread_cond_t pulse_condvar;
+
+static pthread_mutex_t download_waiters_lock;
+static download_waiter_t *download_waiters;	/* protected by download_waiters_lock */
 static int purge_cache_files;	/* TRUE if closed cache files should be immediately removed from file cache */
 
 static int handle_request_thread(void *arg);
+static void requestqueue_log_stats(void);
+static int requestqueue_enqueue_channel_request(webdav_kext_channel_t *channel, uint32_t tag, char *frame, size_t length);
+static int open_channel(int so, struct webdav_request_open_channel *request_open_channel);
+static void download_wait(webdav_reply_dest_t *dest, struct webdav_request_wait_download *request_wait_download);
+static void download_waiters_wake(struct node_entry *node, int stopped);
 
 static int gCurrThreadCount = 0;
 static int gIdleThreadCount = 0;
+static int gRequestThreads = WEBDAV_REQUEST_THREADS;	/* threads shared by all request classes (see WEBDAV_CLASS_BACKGROUND) */
 static pthread_attr_t gRequest_thread_attr;
 
 
@@ -272,11 +364,55 @@ static int get_request(int so, int *operation, void *key, size_t klen)
 
 /*****************************************************************************/
 
-static void send_reply(int so, void *data, size_t size, int error)
+/* send an entire message, picking up where a short sendmsg left off */
+static ssize_t send_all(int so, struct iovec *iov, int iovcnt)
+{
+	struct msghdr msg;
+	ssize_t n, total;
+	
+	total = 0;
+	while ( iovcnt > 0 )
+	{
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = iov;
+		msg.msg_iovlen = iovcnt;
+		
+		n = sendmsg(so, &msg, 0);
+		if ( n < 0 )
+		{
+			if ( errno == EINTR )
+			{
+				continue;
+			}
+			return ( n );
+		}
+		total += n;
+		
+		/* skip what was sent */
+		while ( (iovcnt > 0) && ((size_t)n >= iov->iov_len) )
+		{
+			n -= iov->iov_len;
+			++iov;
+			--iovcnt;
+		}
+		if ( iovcnt > 0 )
+		{
+			iov->iov_base = (char *)iov->iov_base + n;
+			iov->iov_len -= n;
+		}
+	}
+	
+	return ( total );
+}
+
+/*****************************************************************************/
+
+static void send_reply(webdav_reply_dest_t *dest, void *data, size_t size, int error)
 {
 	ssize_t n;
-	struct iovec iov[2];
+	struct iovec iov[3];
 	struct msghdr msg;
+	struct webdav_channel_header header;
 	int send_error = error;
 	
 	/* if the connection is down, let the kernel know */
@@ -285,6 +421,28 @@ static void send_reply(int so, void *data, size_t size, int error)
 		send_error |= WEBDAV_CONNECTION_DOWN_MASK;
 	}
 	
+	if ( dest->channel != NULL )
+	{
+		/* frame the reply with the request's tag */
+		header.wch_length = (uint32_t)(sizeof(send_error) + size);
+		header.wch_tag = dest->tag;
+		iov[0].iov_base = (caddr_t)&header;
+		iov[0].iov_len = sizeof(header);
+		iov[1].iov_base = (caddr_t)&send_error;
+		iov[1].iov_len = sizeof(send_error);
+		iov[2].iov_base = (caddr_t)data;
+		iov[2].iov_len = size;
+		
+		pthread_mutex_lock(&dest->channel->send_lock);
+		n = send_all(dest->channel->socket, iov, (size != 0) ? 3 : 2);
+		pthread_mutex_unlock(&dest->channel->send_lock);
+		if (n < 0)
+		{
+			LogMessage(kError, "send_reply sendmsg failed on channel, errno %d\n", errno);
+		}
+		return;
+	}
+	
 	iov[0].iov_base = (caddr_t)&send_error;
 	iov[0].iov_len = sizeof(send_error);
 	if ( size != 0 )
@@ -305,7 +463,7 @@ static void send_reply(int so, void *data, size_t size, int error)
 		msg.msg_iovlen = 1;
 	}
 	
-	n = sendmsg(so, &msg, 0);
+	n = sendmsg(dest->socket, &msg, 0);
 	if (n < 0)
 	{
 		LogMessage(kError, "send_reply sendmsg failed\n");
@@ -314,20 +472,177 @@ static void send_reply(int so, void *data, size_t size, int error)
 
 /*****************************************************************************/
 
-static void handle_filesystem_request(int so)
+static void dispatch_filesystem_request(webdav_reply_dest_t *dest, int operation, char *key)
 {
 	int error;
-	int operation;
-	char key[(NAME_MAX + 1) + sizeof(union webdav_request)];
 	size_t num_bytes;
 	char *bytes;
 	union webdav_reply reply;
 	
-	/* get the request from the socket */
-	error = get_request(so, &operation, key, sizeof(key));
-	if ( !error ) {
+	error = 0;
 #if DEBUG	
-		LogMessage(kTrace, "handle_filesystem_request: %s(%d)\n",
+	LogMessage(kTrace, "handle_filesystem_request: %s(%d)\n",
+			(operation==WEBDAV_LOOKUP) ? "LOOKUP" :
+			(operation==WEBDAV_CREATE) ? "CREATE" :
+			(operation==WEBDAV_OPEN) ? "OPEN" :
+			(operation==WEBDAV_CLOSE) ? "CLOSE" :
+			(operation==WEBDAV_GETATTR) ? "GETATTR" :
+			(operation==WEBDAV_SETATTR) ? "SETATTR" :
+			(operation==WEBDAV_READ) ? "READ" :
+			(operation==WEBDAV_WRITE) ? "WRITE" :
+			(operation==WEBDAV_FSYNC) ? "FSYNC" :
+			(operation==WEBDAV_REMOVE) ? "REMOVE" :
+			(operation==WEBDAV_RENAME) ? "RENAME" :
+			(operation==WEBDAV_MKDIR) ? "MKDIR" :
+			(operation==WEBDAV_RMDIR) ? "RMDIR" :
+			(operation==WEBDAV_READDIR) ? "READDIR" :
+			(operation==WEBDAV_STATFS) ? "STATFS" :
+			(operation==WEBDAV_UNMOUNT) ? "UNMOUNT" :
+			(operation==WEBDAV_INVALCACHES) ? "INVALCACHES" :
+			"???",
+			operation
+			);
+#endif
+	bzero((void *)&reply, sizeof(union webdav_reply));
+	
+	/* If the connection is down just return EBUSY, but always let UNMOUNT and INVALCACHES requests */
+	/* go through regardless of the state of the connection. */
+	if ( (get_connectionstate() == WEBDAV_CONNECTION_DOWN) && (operation != WEBDAV_UNMOUNT) &&
+		(operation != WEBDAV_INVALCACHES) )
+	{
+		error = ETIMEDOUT;
+		send_reply(dest, (void *)&reply, sizeof(union webdav_reply), error);
+	}
+	else
+	{
+		/* call the function to handle the request */
+		switch ( operation )
+		{
+			case WEBDAV_LOOKUP:
+				error = filesystem_lookup((struct webdav_request_lookup *)key,
+						(struct webdav_reply_lookup *)&reply);
+				send_reply(dest, (void *)&reply, sizeof(struct webdav_reply_lookup), error);
+				break;
+
+			case WEBDAV_CREATE:
+				error = filesystem_create((struct webdav_request_create *)key,
+						(struct webdav_reply_create *)&reply);
+				send_reply(dest, (void *)&reply, sizeof(struct webdav_reply_create), error);
+				break;
+
+			case WEBDAV_OPEN:
+				error = filesystem_open((struct webdav_request_open *)key,
+						(struct webdav_reply_open *)&reply);
+				send_reply(dest, (void *)&reply, sizeof(struct webdav_reply_open), error);
+				break;
+
+			case WEBDAV_CLOSE:
+				error = filesystem_close((struct webdav_request_close *)key);				
+				send_reply(dest, (void *)0, 0, error);
+				break;
+
+			case WEBDAV_GETATTR:
+				error = filesystem_getattr((struct webdav_request_getattr *)key,
+						(struct webdav_reply_getattr *)&reply);
+				send_reply(dest, (void *)&reply, sizeof(struct webdav_reply_getattr), error);
+				break;
+
+			case WEBDAV_READ:
+				if ( ((struct webdav_request_read *)key)->ring_slot >= 0 )
+				{
+					/* the data goes in the read ring; only its count goes in the reply */
+					error = filesystem_read_ring((struct webdav_request_read *)key,
+							(struct webdav_reply_read *)&reply);
+					send_reply(dest, (void *)&reply, sizeof(struct webdav_reply_read), error);
+					break;
+				}
+				bytes = NULL;
+				num_bytes = 0;
+				error = filesystem_read((struct webdav_request_read *)key,
+						&bytes, &num_bytes);				
+				send_reply(dest, (void *)bytes, (int)num_bytes, error);
+				if (bytes)
+				{
+					free(bytes);
+				}
+				break;
+
+			case WEBDAV_FSYNC:
+				error = filesystem_fsync((struct webdav_request_fsync *)key);			
+				send_reply(dest, (void *)0, 0, error);
+				break;
+
+			case WEBDAV_REMOVE:
+				error = filesystem_remove((struct webdav_request_remove *)key);				
+				send_reply(dest, (void *)0, 0, error);
+				break;
+
+			case WEBDAV_RENAME:
+				error = filesystem_rename((struct webdav_request_rename *)key);
+				send_reply(dest, (void *)0, 0, error);
+				break;
+
+			case WEBDAV_MKDIR:
+				error = filesystem_mkdir((struct webdav_request_mkdir *)key,
+						(struct webdav_reply_mkdir *)&reply);
+				send_reply(dest, (void *)&reply, sizeof(struct webdav_reply_mkdir), error);
+				break;
+
+			case WEBDAV_RMDIR:
+				error = filesystem_rmdir((struct webdav_request_rmdir *)key);
+				send_reply(dest, (void *)0, 0, error);
+				break;
+
+			case WEBDAV_READDIR:
+				error = filesystem_readdir((struct webdav_request_readdir *)key);
+				send_reply(dest, (void *)0, 0, error);
+				break;
+
+			case WEBDAV_STATFS:
+				error = filesystem_statfs((struct webdav_request_statfs *)key,
+						(struct webdav_reply_statfs *)&reply);
+				send_reply(dest, (void *)&reply, sizeof(struct webdav_reply_statfs), error);
+				break;
+		
+			case WEBDAV_UNMOUNT:
+				webdav_kill(-2);	/* tell the main select loop to exit */
+				send_reply(dest, (void *)0, 0, error);
+				break;
+
+			case WEBDAV_INVALCACHES:
+				error = filesystem_invalidate_caches((struct webdav_request_invalcaches *)key);
+				send_reply(dest, (void *)0, 0, error);
+				break;
+
+			case WEBDAV_WRITESEQ:
+				error = filesystem_write_seq((struct webdav_request_writeseq *)key);
+				send_reply(dest, (void *)0, 0, error);
+				break;
+				
+			case WEBDAV_DUMP_COOKIES:
+				dump_cookies((struct webdav_request_cookies *)key);
+				send_reply(dest, (void *)0, 0, error);
+				break;
+			
+			case WEBDAV_WAIT_DOWNLOAD:
+				/* only waits when it comes in on a channel (see channel_reader_thread) */
+				download_wait(dest, (struct webdav_request_wait_download *)key);
+				break;
+				
+			case WEBDAV_CLEAR_COOKIES:
+				reset_cookies((struct webdav_request_cookies *)key);
+				send_reply(dest, (void *)0, 0, error);
+				break;
+			
+			default:
+				error = ENOTSUP;
+				send_reply(dest, (void *)0, 0, error);
+				break;
+		}
+	}
+
+#if DEBUG
+	LogMessage(kError, "handle_filesystem_request: error %d, %s(%d)\n", error,
 				(operation==WEBDAV_LOOKUP) ? "LOOKUP" :
 				(operation==WEBDAV_CREATE) ? "CREATE" :
 				(operation==WEBDAV_OPEN) ? "OPEN" :
@@ -349,160 +664,401 @@ static void handle_filesystem_request(int so)
 				operation
 				);
 #endif
-		bzero((void *)&reply, sizeof(union webdav_reply));
-		
-		/* If the connection is down just return EBUSY, but always let UNMOUNT and INVALCACHES requests */
-		/* go through regardless of the state of the connection. */
-		if ( (get_connectionstate() == WEBDAV_CONNECTION_DOWN) && (operation != WEBDAV_UNMOUNT) &&
-			(operation != WEBDAV_INVALCACHES) )
+}
+
+/*****************************************************************************/
+
+static void handle_filesystem_request(int so)
+{
+	int error;
+	int operation;
+	char key[(NAME_MAX + 1) + sizeof(union webdav_request)];
+	webdav_reply_dest_t dest;
+	
+	dest.socket = so;
+	dest.channel = NULL;
+	dest.tag = 0;
+	
+	/* get the request from the socket */
+	error = get_request(so, &operation, key, sizeof(key));
+	if ( !error ) {
+		if ( operation == WEBDAV_OPEN_CHANNEL )
 		{
-			error = ETIMEDOUT;
-			send_reply(so, (void *)&reply, sizeof(union webdav_reply), error);
+			/* on success, the socket belongs to the channel now */
+			if ( open_channel(so, (struct webdav_request_open_channel *)key) == 0 )
+			{
+				return;
+			}
 		}
 		else
 		{
-			/* call the function to handle the request */
-			switch ( operation )
+			dispatch_filesystem_request(&dest, operation, key);
+		}
+	}
+	else {
+		LogMessage(kError, "handle_filesystem_request: get_request failed %d\n", error);
+		send_reply(&dest, NULL, 0, error);
+	}
+
+	close(so);
+}
+
+/*****************************************************************************/
+
+/* drop a reference to a channel; the last one closes it */
+static void release_channel(webdav_kext_channel_t *channel)
+{
+	int refcount;
+	
+	pthread_mutex_lock(&channel->send_lock);
+	refcount = --channel->refcount;
+	pthread_mutex_unlock(&channel->send_lock);
+	
+	if ( refcount == 0 )
+	{
+		close(channel->socket);
+		pthread_mutex_destroy(&channel->send_lock);
+		free(channel);
+	}
+}
+
+/*****************************************************************************/
+
+/* receive exactly len bytes */
+static int recv_all(int so, void *buf, size_t len)
+{
+	ssize_t n;
+	
+	while ( len != 0 )
+	{
+		n = recv(so, buf, len, 0);
+		if ( n < 0 )
+		{
+			if ( errno == EINTR )
 			{
-				case WEBDAV_LOOKUP:
-					error = filesystem_lookup((struct webdav_request_lookup *)key,
-							(struct webdav_reply_lookup *)&reply);
-					send_reply(so, (void *)&reply, sizeof(struct webdav_reply_lookup), error);
-					break;
+				continue;
+			}
+			return ( errno );
+		}
+		else if ( n == 0 )
+		{
+			/* the kext closed the channel */
+			return ( ECONNRESET );
+		}
+		buf = (char *)buf + n;
+		len -= n;
+	}
+	
+	return ( 0 );
+}
 
-				case WEBDAV_CREATE:
-					error = filesystem_create((struct webdav_request_create *)key,
-							(struct webdav_reply_create *)&reply);
-					send_reply(so, (void *)&reply, sizeof(struct webdav_reply_create), error);
-					break;
+/*****************************************************************************/
 
-				case WEBDAV_OPEN:
-					error = filesystem_open((struct webdav_request_open *)key,
-							(struct webdav_reply_open *)&reply);
-					send_reply(so, (void *)&reply, sizeof(struct webdav_reply_open), error);
-					break;
+/*
+ * channel_reader_thread reads request frames from a channel and queues them
+ * for the request threads, which reply on the channel in whatever order they
+ * finish. WEBDAV_WAIT_DOWNLOAD requests don't need a request thread, so they
+ * are handled here.
+ */
+static void *channel_reader_thread(void *arg)
+{
+	webdav_kext_channel_t *channel = arg;
+	struct webdav_channel_header header;
+	char *frame;
+	int error;
+	
+	while ( TRUE )
+	{
+		error = recv_all(channel->socket, &header, sizeof(header));
+		if ( error )
+		{
+			break;
+		}
+		
+		if ( header.wch_length > WEBDAV_CHANNEL_FRAME_MAX )
+		{
+			LogMessage(kError, "channel_reader_thread: frame too long %u\n", header.wch_length);
+			break;
+		}
+		
+		frame = malloc(WEBDAV_CHANNEL_FRAME_MAX + 1);
+		require_action(frame != NULL, malloc_frame, error = ENOMEM);
+		
+		error = recv_all(channel->socket, frame, header.wch_length);
+		if ( error )
+		{
+			free(frame);
+			break;
+		}
+		/* terminate the string (if any) at the end of the request */
+		frame[header.wch_length] = '\0';
+		
+		pthread_mutex_lock(&channel->send_lock);
+		++channel->refcount;
+		pthread_mutex_unlock(&channel->send_lock);
+		
+		if ( (header.wch_length >= (sizeof(int) + sizeof(struct webdav_request_wait_download))) &&
+			 (*(int *)frame == WEBDAV_WAIT_DOWNLOAD) )
+		{
+			webdav_reply_dest_t dest;
+			
+			dest.socket = channel->socket;
+			dest.channel = channel;
+			dest.tag = header.wch_tag;
+			download_wait(&dest, (struct webdav_request_wait_download *)(frame + sizeof(int)));
+			free(frame);
+			release_channel(channel);
+			continue;
+		}
+		
+		error = requestqueue_enqueue_channel_request(channel, header.wch_tag, frame, header.wch_length);
+		if ( error )
+		{
+			free(frame);
+			release_channel(channel);
+			break;
+		}
+	}
 
-				case WEBDAV_CLOSE:
-					error = filesystem_close((struct webdav_request_close *)key);				
-					send_reply(so, (void *)0, 0, error);
-					break;
+malloc_frame:
 
-				case WEBDAV_GETATTR:
-					error = filesystem_getattr((struct webdav_request_getattr *)key,
-							(struct webdav_reply_getattr *)&reply);
-					send_reply(so, (void *)&reply, sizeof(struct webdav_reply_getattr), error);
-					break;
+	/* replies still in progress can be sent, but nothing more will be read */
+	(void) shutdown(channel->socket, SHUT_RD);
+	release_channel(channel);
+	
+	return ( NULL );
+}
 
-				case WEBDAV_READ:
-					bytes = NULL;
-					num_bytes = 0;
-					error = filesystem_read((struct webdav_request_read *)key,
-							&bytes, &num_bytes);				
-					send_reply(so, (void *)bytes, (int)num_bytes, error);
-					if (bytes)
-					{
-						free(bytes);
-					}
-					break;
+/*****************************************************************************/
 
-				case WEBDAV_FSYNC:
-					error = filesystem_fsync((struct webdav_request_fsync *)key);			
-					send_reply(so, (void *)0, 0, error);
-					break;
+/*
+ * open_channel turns a connection from the kext into a channel. The reply
+ * grants the kext its credits: the number of requests it may have outstanding.
+ */
+static int open_channel(int so, struct webdav_request_open_channel *request_open_channel)
+{
+	int error;
+	webdav_kext_channel_t *channel;
+	pthread_t reader_thread;
+	webdav_reply_dest_t dest;
+	struct webdav_reply_open_channel reply_open_channel;
+	
+	dest.socket = so;
+	dest.channel = NULL;
+	dest.tag = 0;
+	bzero(&reply_open_channel, sizeof(reply_open_channel));
+	channel = NULL;
+	
+	require_action(request_open_channel->version == WEBDAV_CHANNEL_VERSION, bad_version, error = ENOTSUP);
+	
+	channel = calloc(1, sizeof(webdav_kext_channel_t));
+	require_action(channel != NULL, calloc_channel, error = ENOMEM);
+	
+	error = pthread_mutex_init(&channel->send_lock, NULL);
+	require_noerr(error, pthread_mutex_init);
+	
+	channel->socket = so;
+	channel->refcount = 1;	/* for the channel reader */
+	
+	/* a failure to associate the read ring isn't fatal; READ data just comes back in the reply */
+	(void) filesystem_associate_read_ring(request_open_channel->ring_ref, &reply_open_channel);
+	
+	/* grant the credits before the reader starts, since frames follow right behind the reply */
+	reply_open_channel.credits = MIN((gRequestThreads + 1) * WEBDAV_CHANNEL_CREDITS_PER_THREAD +
+		(WEBDAV_MAX_KEXT_CONNECTIONS / 4), WEBDAV_MAX_KEXT_CONNECTIONS);
+	send_reply(&dest, (void *)&reply_open_channel, sizeof(reply_open_channel), 0);
+	
+	error = pthread_create(&reader_thread, &gRequest_thread_attr, channel_reader_thread, (void *)channel);
+	require_noerr(error, pthread_create);
+	
+	return ( 0 );
 
-				case WEBDAV_REMOVE:
-					error = filesystem_remove((struct webdav_request_remove *)key);				
-					send_reply(so, (void *)0, 0, error);
-					break;
+pthread_create:
+	/* the caller closes the socket, and the kext will see the channel fail */
+	pthread_mutex_destroy(&channel->send_lock);
+	free(channel);
+	return ( error );
 
-				case WEBDAV_RENAME:
-					error = filesystem_rename((struct webdav_request_rename *)key);
-					send_reply(so, (void *)0, 0, error);
-					break;
+pthread_mutex_init:
+	free(channel);
+calloc_channel:
+bad_version:
 
-				case WEBDAV_MKDIR:
-					error = filesystem_mkdir((struct webdav_request_mkdir *)key,
-							(struct webdav_reply_mkdir *)&reply);
-					send_reply(so, (void *)&reply, sizeof(struct webdav_reply_mkdir), error);
-					break;
+	send_reply(&dest, (void *)&reply_open_channel, sizeof(reply_open_channel), error);
+	return ( error );
+}
 
-				case WEBDAV_RMDIR:
-					error = filesystem_rmdir((struct webdav_request_rmdir *)key);
-					send_reply(so, (void *)0, 0, error);
-					break;
+/*****************************************************************************/
 
-				case WEBDAV_READDIR:
-					error = filesystem_readdir((struct webdav_request_readdir *)key);
-					send_reply(so, (void *)0, 0, error);
-					break;
+static void handle_channel_request(webdav_kext_channel_t *channel, uint32_t tag, char *frame, size_t length)
+{
+	int operation;
+	webdav_reply_dest_t dest;
+	
+	dest.socket = channel->socket;
+	dest.channel = channel;
+	dest.tag = tag;
+	
+	if ( length >= (sizeof(int) + sizeof(struct webdav_cred)) )
+	{
+		/* the request is large enough to contain operation and webdav_cred */
+		memcpy(&operation, frame, sizeof(int));
+		dispatch_filesystem_request(&dest, operation, frame + sizeof(int));
+	}
+	else
+	{
+		LogMessage(kError, "handle_channel_request: got short message\n");
+		send_reply(&dest, NULL, 0, EINVAL);
+	}
+	
+	free(frame);
+	release_channel(channel);
+}
 
-				case WEBDAV_STATFS:
-					error = filesystem_statfs((struct webdav_request_statfs *)key,
-							(struct webdav_reply_statfs *)&reply);
-					send_reply(so, (void *)&reply, sizeof(struct webdav_reply_statfs), error);
-					break;
+/*****************************************************************************/
+
+/*
+ * download_wait handles a WEBDAV_WAIT_DOWNLOAD request. If the node's cache
+ * file is still being downloaded and doesn't have offset bytes yet, a request
+ * from a channel is kept until download_waiters_wake replies to it. Otherwise
+ * (including every request not on a channel) the reply is sent now, and says
+ * whether the server waited: if it didn't, the kext polls.
+ */
+static void download_wait(webdav_reply_dest_t *dest, struct webdav_request_wait_download *request_wait_download)
+{
+	int error;
+	struct node_entry *node;
+	struct stat statbuf;
+	download_waiter_t *waiter;
+	struct webdav_reply_wait_download reply_wait_download;
+	
+	bzero(&reply_wait_download, sizeof(reply_wait_download));
+	
+	error = RetrieveDataFromOpaqueID(request_wait_download->obj_id, (void **)&node);
+	require_noerr_quiet(error, RetrieveDataFromOpaqueID);
+	
+	/* a download that stops after this is locked out until the waiter is on the list */
+	error = pthread_mutex_lock(&download_waiters_lock);
+	require_noerr(error, pthread_mutex_lock);
+	
+	if ( (node->file_status & WEBDAV_DOWNLOAD_STATUS_MASK) != WEBDAV_DOWNLOAD_IN_PROGRESS )
+	{
+		/* the download stopped (or hasn't started) -- the cache file's flags tell the rest */
+		reply_wait_download.waited = TRUE;
+	}
+	else if ( (fstat(node->file_fd, &statbuf) != 0) || ((uint64_t)statbuf.st_size >= request_wait_download->offset) )
+	{
+		/* the bytes are already there */
+		reply_wait_download.waited = TRUE;
+	}
+	else if ( dest->channel != NULL )
+	{
+		waiter = malloc(sizeof(download_waiter_t));
+		if ( waiter != NULL )
+		{
+			waiter->dest = *dest;
+			waiter->node = node;
+			waiter->offset = request_wait_download->offset;
 			
-				case WEBDAV_UNMOUNT:
-					webdav_kill(-2);	/* tell the main select loop to exit */
-					send_reply(so, (void *)0, 0, error);
-					break;
+			/* the waiter keeps the channel open until it is replied to */
+			pthread_mutex_lock(&dest->channel->send_lock);
+			++dest->channel->refcount;
+			pthread_mutex_unlock(&dest->channel->send_lock);
+			
+			waiter->next = download_waiters;
+			download_waiters = waiter;
+			
+			(void) pthread_mutex_unlock(&download_waiters_lock);
+			return;
+		}
+	}
+	
+	(void) pthread_mutex_unlock(&download_waiters_lock);
+	
+pthread_mutex_lock:
+RetrieveDataFromOpaqueID:
 
-				case WEBDAV_INVALCACHES:
-					error = filesystem_invalidate_caches((struct webdav_request_invalcaches *)key);
-					send_reply(so, (void *)0, 0, error);
-					break;
+	send_reply(dest, (void *)&reply_wait_download, sizeof(struct webdav_reply_wait_download), error);
+}
 
-				case WEBDAV_WRITESEQ:
-					error = filesystem_write_seq((struct webdav_request_writeseq *)key);
-					send_reply(so, (void *)0, 0, error);
-					break;
-					
-				case WEBDAV_DUMP_COOKIES:
-					dump_cookies((struct webdav_request_cookies *)key);
-					send_reply(so, (void *)0, 0, error);
-					break;
-					
-				case WEBDAV_CLEAR_COOKIES:
-					reset_cookies((struct webdav_request_cookies *)key);
-					send_reply(so, (void *)0, 0, error);
-					break;
-				
-				default:
-					error = ENOTSUP;
-					break;
+/*****************************************************************************/
+
+/*
+ * download_waiters_wake replies to the WEBDAV_WAIT_DOWNLOAD requests waiting
+ * on node's download: all of them if the download stopped, otherwise the
+ * ones whose bytes are in the cache file now.
+ */
+static void download_waiters_wake(struct node_entry *node, int stopped)
+{
+	download_waiter_t **waiterPtr;
+	download_waiter_t *waiter;
+	download_waiter_t *ready;
+	struct stat statbuf;
+	int have_size;
+	struct webdav_reply_wait_download reply_wait_download;
+	
+	if ( pthread_mutex_lock(&download_waiters_lock) != 0 )
+	{
+		return;
+	}
+	
+	ready = NULL;
+	have_size = FALSE;
+	waiterPtr = &download_waiters;
+	while ( (waiter = *waiterPtr) != NULL )
+	{
+		if ( waiter->node == node )
+		{
+			if ( !stopped && !have_size )
+			{
+				/* only look at the cache file if someone is waiting on it */
+				if ( fstat(node->file_fd, &statbuf) != 0 )
+				{
+					/* let the kernel sort it out */
+					stopped = TRUE;
+				}
+				have_size = TRUE;
+			}
+			/* WEBDAV_WAIT_DOWNLOAD_END is larger than any size, so only the end of the download satisfies it */
+			if ( stopped || ((uint64_t)statbuf.st_size >= waiter->offset) )
+			{
+				*waiterPtr = waiter->next;
+				waiter->next = ready;
+				ready = waiter;
+				continue;
 			}
 		}
-
-#if DEBUG
-		LogMessage(kError, "handle_filesystem_request: error %d, %s(%d)\n", error,
-					(operation==WEBDAV_LOOKUP) ? "LOOKUP" :
-					(operation==WEBDAV_CREATE) ? "CREATE" :
-					(operation==WEBDAV_OPEN) ? "OPEN" :
-					(operation==WEBDAV_CLOSE) ? "CLOSE" :
-					(operation==WEBDAV_GETATTR) ? "GETATTR" :
-					(operation==WEBDAV_SETATTR) ? "SETATTR" :
-					(operation==WEBDAV_READ) ? "READ" :
-					(operation==WEBDAV_WRITE) ? "WRITE" :
-					(operation==WEBDAV_FSYNC) ? "FSYNC" :
-					(operation==WEBDAV_REMOVE) ? "REMOVE" :
-					(operation==WEBDAV_RENAME) ? "RENAME" :
-					(operation==WEBDAV_MKDIR) ? "MKDIR" :
-					(operation==WEBDAV_RMDIR) ? "RMDIR" :
-					(operation==WEBDAV_READDIR) ? "READDIR" :
-					(operation==WEBDAV_STATFS) ? "STATFS" :
-					(operation==WEBDAV_UNMOUNT) ? "UNMOUNT" :
-					(operation==WEBDAV_INVALCACHES) ? "INVALCACHES" :
-					"???",
-					operation
-					);
-#endif
+		waiterPtr = &waiter->next;
 	}
-	else {
-		LogMessage(kError, "handle_filesystem_request: get_request failed %d\n", error);
-		send_reply(so, NULL, 0, error);
+	
+	(void) pthread_mutex_unlock(&download_waiters_lock);
+	
+	/* reply outside the lock so a slow channel doesn't hold up the download */
+	bzero(&reply_wait_download, sizeof(reply_wait_download));
+	reply_wait_download.waited = TRUE;
+	while ( ready != NULL )
+	{
+		waiter = ready;
+		ready = waiter->next;
+		send_reply(&waiter->dest, (void *)&reply_wait_download, sizeof(struct webdav_reply_wait_download), 0);
+		release_channel(waiter->dest.channel);
+		free(waiter);
+	}
+}
+
+/*****************************************************************************/
+
+/*
+ * requestqueue_download_progress is called after bytes are added to node's
+ * cache file by a background download.
+ */
+void requestqueue_download_progress(struct node_entry *node)
+{
+	/* the list is almost always empty, so don't take the lock to find that out */
+	if ( download_waiters != NULL )
+	{
+		download_waiters_wake(node, FALSE);
 	}
-
-	close(so);
 }
 
 /*****************************************************************************/
@@ -522,6 +1078,11 @@ static void pulse_thread(void *arg)
 		require_noerr(error, pthread_mutex_lock);
 		
 		LogMessage(kTrace, "pulse_thread running\n");
+		requestqueue_log_stats();
+		nodecache_log_stats();
+		filesystem_log_stats();
+		network_log_stats();
+		network_reap_connections();
 		
 		node = nodecache_get_next_file_cache_node(TRUE);
 		while ( node != NULL )
@@ -537,10 +1098,9 @@ static void pulse_thread(void *arg)
 			}
 			else
 			{
-				/* remove any closed nodes that are deleted, or that need to be aged out of the list */
-				if ( NODE_IS_DELETED(node) || NODE_FILE_CACHE_INVALID(node) || purge_cache_files )
+				/* remove any closed nodes that are deleted (the rest are evicted by size -- see nodecache_trim_file_cache) */
+				if ( NODE_IS_DELETED(node) || purge_cache_files )
 				{
-					/* it's been closed for WEBDAV_CACHE_TIMEOUT seconds -- remove the node from the file cache */
 					nodecache_remove_file_cache(node);
 				}
 			}
@@ -550,6 +1110,9 @@ static void pulse_thread(void *arg)
 		/* now, remove any nodes in the deleted list that aren't cached */
 		nodecache_free_nodes();
 		
+		/* keep the persistent cache (if any) under its size cap, or empty it if purging */
+		filesystem_trim_persistent_cache(purge_cache_files);
+		
 		purge_cache_files = FALSE; /* reset gPurgeCacheFiles (if it was set) */
 		
 		/* sleep for a while */
@@ -576,6 +1139,144 @@ pthread_mutex_unlock:
 
 /*****************************************************************************/
 
+/* returns the current time in microseconds */
+static u_int64_t requestqueue_now(void)
+{
+	struct timeval tv;
+	
+	(void) gettimeofday(&tv, NULL);
+	return ( ((u_int64_t)tv.tv_sec * 1000000) + (u_int64_t)tv.tv_usec );
+}
+
+/*****************************************************************************/
+
+/* returns the request class for an operation from the kernel */
+static int request_class_for_operation(int operation)
+{
+	switch ( operation )
+	{
+		case WEBDAV_OPEN:
+		case WEBDAV_CLOSE:
+		case WEBDAV_READ:
+		case WEBDAV_FSYNC:
+		case WEBDAV_WRITESEQ:
+			return ( WEBDAV_CLASS_DATA );
+		
+		default:
+			return ( WEBDAV_CLASS_INTERACTIVE );
+	}
+}
+
+/*****************************************************************************/
+
+/* logs the request class counters. requests_lock must not be held. */
+static void requestqueue_log_stats(void)
+{
+	static const char *class_names[WEBDAV_CLASS_COUNT] = { "background", "housekeeping", "interactive", "data", "prefetch" };
+	webdav_requestclass_t classes[WEBDAV_CLASS_COUNT];
+	int i;
+	
+	if ( pthread_mutex_lock(&requests_lock) != 0 )
+	{
+		return;
+	}
+	memcpy(classes, request_classes, sizeof(classes));
+	(void) pthread_mutex_unlock(&requests_lock);
+	
+	for ( i = 0; i < WEBDAV_CLASS_COUNT; ++i )
+	{
+		LogMessage(kTrace, "requestqueue %s: depth %d (max %d), running %d, enqueued %llu, dispatched %llu, wait avg %llu max %llu usec\n",
+			class_names[i], classes[i].waiting.request_count, classes[i].max_depth, classes[i].running,
+			classes[i].enqueued, classes[i].dispatched,
+			(classes[i].dispatched != 0) ? (classes[i].total_wait / classes[i].dispatched) : 0ULL,
+			classes[i].max_wait);
+	}
+}
+
+/*****************************************************************************/
+
+/*
+ * dequeue_request returns the next element to handle (see WEBDAV_CLASS_BACKGROUND
+ * for the order), or NULL if no element can be handled now. requests_lock must be held.
+ */
+static webdav_requestqueue_element_t *dequeue_request(void)
+{
+	webdav_requestclass_t *theClass;
+	webdav_requestqueue_element_t *element;
+	u_int64_t now, wait;
+	int shared_ok;
+	int request_class;
+	
+	now = requestqueue_now();
+	
+	/* can another shared thread be used? */
+	shared_ok = (request_classes[WEBDAV_CLASS_BACKGROUND].running +
+		request_classes[WEBDAV_CLASS_HOUSEKEEPING].running +
+		request_classes[WEBDAV_CLASS_DATA].running +
+		request_classes[WEBDAV_CLASS_PREFETCH].running) < gRequestThreads;
+	
+	request_class = -1;
+	if ( shared_ok )
+	{
+		element = request_classes[WEBDAV_CLASS_DATA].waiting.item_head;
+		if ( (element != NULL) && ((now - element->enqueue_time) >= WEBDAV_DATA_MAX_WAIT) )
+		{
+			/* don't let metadata requests starve data requests */
+			request_class = WEBDAV_CLASS_DATA;
+		}
+		else if ( request_classes[WEBDAV_CLASS_BACKGROUND].waiting.request_count > 0 )
+		{
+			request_class = WEBDAV_CLASS_BACKGROUND;
+		}
+		else if ( request_classes[WEBDAV_CLASS_HOUSEKEEPING].waiting.request_count > 0 )
+		{
+			request_class = WEBDAV_CLASS_HOUSEKEEPING;
+		}
+	}
+	if ( (request_class < 0) && (request_classes[WEBDAV_CLASS_INTERACTIVE].waiting.request_count > 0) )
+	{
+		request_class = WEBDAV_CLASS_INTERACTIVE;
+	}
+	if ( (request_class < 0) && shared_ok && (request_classes[WEBDAV_CLASS_DATA].waiting.request_count > 0) )
+	{
+		request_class = WEBDAV_CLASS_DATA;
+	}
+	if ( (request_class < 0) && shared_ok && (request_classes[WEBDAV_CLASS_PREFETCH].waiting.request_count > 0) &&
+		 (request_classes[WEBDAV_CLASS_PREFETCH].running < WEBDAV_PREFETCH_PARALLEL) )
+	{
+		request_class = WEBDAV_CLASS_PREFETCH;
+	}
+	if ( request_class < 0 )
+	{
+		return ( NULL );
+	}
+	
+	theClass = &request_classes[request_class];
+	element = theClass->waiting.item_head;
+	--(theClass->waiting.request_count);
+	if ( theClass->waiting.request_count > 0 )
+	{
+		theClass->waiting.item_head = element->next;
+	}
+	else
+	{
+		theClass->waiting.item_head = theClass->waiting.item_tail = NULL;
+	}
+	
+	++(theClass->running);
+	++(theClass->dispatched);
+	wait = now - element->enqueue_time;
+	theClass->total_wait += wait;
+	if ( wait > theClass->max_wait )
+	{
+		theClass->max_wait = wait;
+	}
+	
+	return ( element );
+}
+
+/*****************************************************************************/
+
 static int handle_request_thread(void *arg)
 {
 	#pragma unused(arg)
@@ -583,26 +1284,25 @@ static int handle_request_thread(void *arg)
 	webdav_requestqueue_element_t * myrequest;
 	struct timespec timeout;
 	int idleRecheck = 0;
+	int lastClass = -1;
 
 	while (TRUE) {
 		error = pthread_mutex_lock(&requests_lock);
 		require_noerr(error, pthread_mutex_lock);
 
+		if (lastClass >= 0) {
+			/* the last request we handled is done */
+			--(request_classes[lastClass].running);
+			lastClass = -1;
+		}
+
 		/* Check to see if there is a request to process */
+		myrequest = dequeue_request();
 
-		if (waiting_requests.request_count > 0) {
+		if (myrequest != NULL) {
 			/* There is a request so dequeue it */
 			idleRecheck = 0;	/* reset this flag to indicate that we did find work to do */
-			myrequest = waiting_requests.item_head;
-			--(waiting_requests.request_count);
-			if (waiting_requests.request_count > 0) {
-				/* There was more than one item on */
-				/* the queue so bump the pointers */
-				waiting_requests.item_head = myrequest->next;
-			}
-			else {
-				waiting_requests.item_head = waiting_requests.item_tail = 0;
-			}
+			lastClass = myrequest->request_class;
 			
 			/* Ok, now unlock the queue and go about handling the request */
 			error = pthread_mutex_unlock(&requests_lock);
@@ -614,9 +1314,17 @@ static int handle_request_thread(void *arg)
 					handle_filesystem_request(myrequest->element.request.socket);
 					break;
 
+				case WEBDAV_CHANNEL_REQUEST_TYPE:
+					handle_channel_request(myrequest->element.channel_request.channel,
+						myrequest->element.channel_request.tag,
+						myrequest->element.channel_request.frame,
+						myrequest->element.channel_request.length);
+					break;
+
 				case WEBDAV_DOWNLOAD_TYPE:
 					/* finish the download */
-					error = network_finish_download(myrequest->element.download.node, myrequest->element.download.readStreamRecPtr);
+					error = network_finish_download(myrequest->element.download.node, myrequest->element.download.readStreamRecPtr,
+						myrequest->element.download.segments);
 					if (error) {
 						/* Set append to indicate that our download failed. It's a hack, but
 						 * it should work.	Be sure to still mark the download as finished so
@@ -633,6 +1341,8 @@ static int handle_request_thread(void *arg)
 						verify_noerr(fchflags(myrequest->element.download.node->file_fd, 0));
 						myrequest->element.download.node->file_status = WEBDAV_DOWNLOAD_FINISHED;
 					}
+					/* the cache file's flags are set, so let the kernel look at them */
+					download_waiters_wake(myrequest->element.download.node, TRUE);
 					error = 0;
 					break;
 
@@ -646,6 +1356,11 @@ static int handle_request_thread(void *arg)
 					network_seqwrite_manager(myrequest->element.seqwrite_read_rsp.ctx);
 				break;
 				
+				case WEBDAV_PREFETCH_TYPE:
+					/* read the directory ahead of demand */
+					filesystem_prefetch(myrequest->element.prefetch.nodeid);
+				break;
+				
 				default:
 					/* nothing we can do, just get the next request */
 					break;
@@ -727,7 +1442,21 @@ int requestqueue_init()
 	require_noerr(error, pthread_mutex_init);
 	
 	/* initialize requestqueue */
-	bzero(&waiting_requests, sizeof(waiting_requests));
+	bzero(request_classes, sizeof(request_classes));
+	
+	/* WEBDAVFS_REQUEST_THREADS overrides the number of shared request threads */
+	if ( getenv("WEBDAVFS_REQUEST_THREADS") != NULL )
+	{
+		gRequestThreads = atoi(getenv("WEBDAVFS_REQUEST_THREADS"));
+		if ( gRequestThreads < 1 )
+		{
+			gRequestThreads = 1;
+		}
+		else if ( gRequestThreads > WEBDAV_MAX_REQUEST_THREADS )
+		{
+			gRequestThreads = WEBDAV_MAX_REQUEST_THREADS;
+		}
+	}
 
 	error = pthread_cond_init(&requests_condvar, NULL);
 	require_noerr(error, pthread_cond_init);
@@ -739,6 +1468,11 @@ int requestqueue_init()
 	error = pthread_mutex_init(&requests_lock, &mutexattr);
 	require_noerr(error, pthread_mutex_init);
 
+	/* set up the lock on the download waiters */
+	download_waiters = NULL;
+	error = pthread_mutex_init(&download_waiters_lock, &mutexattr);
+	require_noerr(error, pthread_mutex_init);
+
 	error = pthread_attr_init(&gRequest_thread_attr);
 	require_noerr(error, pthread_attr_init);
 
@@ -780,6 +1514,74 @@ pthread_mutexattr_init:
 
 /*****************************************************************************/
 
+/* requestqueue_enqueue_element
+ * makes sure a thread will handle an element and then queues it on its request
+ * class's queue (at the head if at_head is TRUE). If an error is returned, the
+ * element was not queued. requests_lock must be held.
+ */
+static int requestqueue_enqueue_element(webdav_requestqueue_element_t *request_element_ptr, int request_class, int at_head)
+{
+	int error;
+	webdav_requestclass_t *theClass;
+	pthread_t request_thread;
+	
+	if (gIdleThreadCount > 0) {
+		/* Already have one or more threads just waiting for work to do.  Just kick the requests_condvar to wake 
+		up the threads (they can't look at the queues until we unlock requests_lock) */
+		error = pthread_cond_signal(&requests_condvar);
+		require_noerr(error, pthread_cond_signal);
+	}
+	else {
+		/* No idle threads, so try to create one if we have not reached out maximum number of threads
+		(the shared threads plus the one kept for interactive requests) */
+		if (gCurrThreadCount < (gRequestThreads + 1)) {
+			error = pthread_create(&request_thread, &gRequest_thread_attr, (void *) handle_request_thread, (void *) NULL);
+			require_noerr(error, pthread_create_signal);
+
+			gCurrThreadCount += 1;
+		}
+	}
+	
+	theClass = &request_classes[request_class];
+	
+	request_element_ptr->request_class = request_class;
+	request_element_ptr->enqueue_time = requestqueue_now();
+	
+	if (at_head) {
+		request_element_ptr->next = theClass->waiting.item_head;
+		if (theClass->waiting.item_head == NULL) {
+			/* request queue was empty */
+			theClass->waiting.item_tail = request_element_ptr;
+		}
+		theClass->waiting.item_head = request_element_ptr;
+	}
+	else {
+		request_element_ptr->next = NULL;
+		if (theClass->waiting.item_tail == NULL) {
+			theClass->waiting.item_head = request_element_ptr;
+		}
+		else {
+			theClass->waiting.item_tail->next = request_element_ptr;
+		}
+		theClass->waiting.item_tail = request_element_ptr;
+	}
+	
+	++(theClass->waiting.request_count);
+	++(theClass->enqueued);
+	if (theClass->waiting.request_count > theClass->max_depth) {
+		theClass->max_depth = theClass->waiting.request_count;
+	}
+	
+	error = 0;
+
+pthread_create_signal:
+pthread_cond_signal:
+
+	return (error);
+}
+
+/*****************************************************************************/
+
 /* requestqueue_enqueue_request
  * caller exits on errors.
  */
@@ -787,7 +1589,6 @@ int requestqueue_enqueue_request(int socket)
 {
 	int error, unlock_error;
 	webdav_requestqueue_element_t * request_element_ptr;
-	pthread_t request_thread;
 
 	error = pthread_mutex_lock(&requests_lock);
 	require_noerr(error, pthread_mutex_lock);
@@ -797,35 +1598,61 @@ int requestqueue_enqueue_request(int socket)
 
 	request_element_ptr->type = WEBDAV_REQUEST_TYPE;
 	request_element_ptr->element.request.socket = socket;
-	request_element_ptr->next = 0;
-	++(waiting_requests.request_count);
-
-	if (!(waiting_requests.item_tail)) {
-		waiting_requests.item_head = waiting_requests.item_tail = request_element_ptr;
-	}
-	else {
-		waiting_requests.item_tail->next = request_element_ptr;
-		waiting_requests.item_tail = request_element_ptr;
+	
+	/* the operation isn't known until the request is read, so it's treated as interactive */
+	error = requestqueue_enqueue_element(request_element_ptr, WEBDAV_CLASS_INTERACTIVE, FALSE);
+	if ( error )
+	{
+		free(request_element_ptr);
 	}
 
-	if (gIdleThreadCount > 0) {
-		/* Already have one or more threads just waiting for work to do.  Just kick the requests_condvar to wake 
-		up the threads */
-		error = pthread_cond_signal(&requests_condvar);
-		require_noerr(error, pthread_cond_signal);
-	}
-	else {
-		/* No idle threads, so try to create one if we have not reached out maximum number of threads */
-		if (gCurrThreadCount < WEBDAV_REQUEST_THREADS) {
-			error = pthread_create(&request_thread, &gRequest_thread_attr, (void *) handle_request_thread, (void *) NULL);
-			require_noerr(error, pthread_create_signal);
+malloc_request_element_ptr:
 
-			gCurrThreadCount += 1;
-		}
+	unlock_error = pthread_mutex_unlock(&requests_lock);
+	require_noerr_action(unlock_error, pthread_mutex_unlock, error = (error == 0) ? unlock_error : error);
+
+pthread_mutex_unlock:
+pthread_mutex_lock:
+
+	return (error);
+}
+
+/*****************************************************************************/
+
+/* requestqueue_enqueue_channel_request
+ * queues a request read from a channel. On success, the request owns frame.
+ */
+static int requestqueue_enqueue_channel_request(webdav_kext_channel_t *channel, uint32_t tag, char *frame, size_t length)
+{
+	int error, unlock_error;
+	webdav_requestqueue_element_t * request_element_ptr;
+	int operation;
+
+	error = pthread_mutex_lock(&requests_lock);
+	require_noerr(error, pthread_mutex_lock);
+
+	request_element_ptr = malloc(sizeof(webdav_requestqueue_element_t));
+	require_action(request_element_ptr != NULL, malloc_request_element_ptr, error = ENOMEM);
+
+	request_element_ptr->type = WEBDAV_CHANNEL_REQUEST_TYPE;
+	request_element_ptr->element.channel_request.channel = channel;
+	request_element_ptr->element.channel_request.tag = tag;
+	request_element_ptr->element.channel_request.frame = frame;
+	request_element_ptr->element.channel_request.length = length;
+	
+	/* the frame starts with the operation (handle_channel_request rejects short frames) */
+	operation = 0;
+	if ( length >= sizeof(int) )
+	{
+		memcpy(&operation, frame, sizeof(int));
+	}
+	error = requestqueue_enqueue_element(request_element_ptr, request_class_for_operation(operation), FALSE);
+	if ( error )
+	{
+		/* the caller still owns frame */
+		free(request_element_ptr);
 	}
 
-pthread_create_signal:
-pthread_cond_signal:
 malloc_request_element_ptr:
 
 	unlock_error = pthread_mutex_unlock(&requests_lock);
@@ -839,11 +1666,10 @@ pthread_mutex_lock:
 
 /*****************************************************************************/
 
-int requestqueue_enqueue_download(struct node_entry *node, struct ReadStreamRec *readStreamRecPtr)
+int requestqueue_enqueue_download(struct node_entry *node, struct ReadStreamRec *readStreamRecPtr, struct download_segments *segments)
 {
 	int error, error2;
 	webdav_requestqueue_element_t * request_element_ptr;
-	pthread_t request_thread;
 
 	error = pthread_mutex_lock(&requests_lock);
 	require_noerr_action(error, pthread_mutex_lock, webdav_kill(-1));
@@ -854,38 +1680,15 @@ int requestqueue_enqueue_download(struct node_entry *node, struct ReadStreamRec
 	request_element_ptr->type = WEBDAV_DOWNLOAD_TYPE;
 	request_element_ptr->element.download.node = node;
 	request_element_ptr->element.download.readStreamRecPtr = readStreamRecPtr;
+	request_element_ptr->element.download.segments = segments;
 	
 	/* Insert downloads at head of request queue. They must be executed immediately since the download is holding a stream reference. */
-	request_element_ptr->next = waiting_requests.item_head;
-	++(waiting_requests.request_count);
-
-	if ( waiting_requests.item_head == NULL ) {
-		/* request queue was empty */
-		waiting_requests.item_head = waiting_requests.item_tail = request_element_ptr;
-	}
-	else {
-		/* this request is the new head */
-		waiting_requests.item_head = request_element_ptr;
-	}
-
-	if (gIdleThreadCount > 0) {
-		/* Already have one or more threads just waiting for work to do.  Just kick the requests_condvar to wake 
-		up the threads */
-		error = pthread_cond_signal(&requests_condvar);
-		require_noerr(error, pthread_cond_signal);
-	}
-	else {
-		/* No idle threads, so try to create one if we have not reached out maximum number of threads */
-		if (gCurrThreadCount < WEBDAV_REQUEST_THREADS) {
-			error = pthread_create(&request_thread, &gRequest_thread_attr, (void *) handle_request_thread, (void *) NULL);
-			require_noerr(error, pthread_create_signal);
-
-			gCurrThreadCount += 1;
-		}
+	error = requestqueue_enqueue_element(request_element_ptr, WEBDAV_CLASS_BACKGROUND, TRUE);
+	if ( error )
+	{
+		free(request_element_ptr);
 	}
 
-pthread_create_signal:
-pthread_cond_signal:
 malloc_request_element_ptr:
 
 	error2 = pthread_mutex_unlock(&requests_lock);
@@ -903,7 +1706,6 @@ int requestqueue_enqueue_server_ping(u_int32_t delay)
 {
 	int error, error2;
 	webdav_requestqueue_element_t * request_element_ptr;
-	pthread_t request_thread;
 
 	error = pthread_mutex_lock(&requests_lock);
 	require_noerr_action(error, pthread_mutex_lock, webdav_kill(-1));
@@ -916,36 +1718,12 @@ int requestqueue_enqueue_server_ping(u_int32_t delay)
 	
 	/* Insert server pings at head of request queue. They must be executed immediately since they are */
 	/* used to detect when connectivity to the host has been restored. */
-	request_element_ptr->next = waiting_requests.item_head;
-	++(waiting_requests.request_count);
-
-	if ( waiting_requests.item_head == NULL ) {
-		/* request queue was empty */
-		waiting_requests.item_head = waiting_requests.item_tail = request_element_ptr;
-	}
-	else {
-		/* this request is the new head */
-		waiting_requests.item_head = request_element_ptr;
-	}
-
-	if (gIdleThreadCount > 0) {
-		/* Already have one or more threads just waiting for work to do.  Just kick the requests_condvar to wake 
-		up the threads */
-		error = pthread_cond_signal(&requests_condvar);
-		require_noerr(error, pthread_cond_signal);
-	}
-	else {
-		/* No idle threads, so try to create one if we have not reached out maximum number of threads */
-		if (gCurrThreadCount < WEBDAV_REQUEST_THREADS) {
-			error = pthread_create(&request_thread, &gRequest_thread_attr, (void *) handle_request_thread, (void *) NULL);
-			require_noerr(error, pthread_create_signal);
-
-			gCurrThreadCount += 1;
-		}
+	error = requestqueue_enqueue_element(request_element_ptr, WEBDAV_CLASS_HOUSEKEEPING, TRUE);
+	if ( error )
+	{
+		free(request_element_ptr);
 	}
 
-pthread_create_signal:
-pthread_cond_signal:
 malloc_request_element_ptr:
 
 	error2 = pthread_mutex_unlock(&requests_lock);
@@ -963,7 +1741,6 @@ int requestqueue_enqueue_seqwrite_manager(struct stream_put_ctx *ctx)
 {
 	int error, error2;
 	webdav_requestqueue_element_t * request_element_ptr;
-	pthread_t request_thread;
 
 	error = pthread_mutex_lock(&requests_lock);
 	require_noerr_action(error, pthread_mutex_lock, webdav_kill(-1));
@@ -974,36 +1751,46 @@ int requestqueue_enqueue_seqwrite_manager(struct stream_put_ctx *ctx)
 	request_element_ptr->type = WEBDAV_SEQWRITE_MANAGER_TYPE;
 	request_element_ptr->element.seqwrite_read_rsp.ctx = ctx;
 	
-	request_element_ptr->next = waiting_requests.item_head;
-	++(waiting_requests.request_count);
-
-	if ( waiting_requests.item_head == NULL ) {
-		/* request queue was empty */
-		waiting_requests.item_head = waiting_requests.item_tail = request_element_ptr;
-	}
-	else {
-		/* this request is the new head */
-		waiting_requests.item_head = request_element_ptr;
+	error = requestqueue_enqueue_element(request_element_ptr, WEBDAV_CLASS_BACKGROUND, TRUE);
+	if ( error )
+	{
+		free(request_element_ptr);
 	}
 
-	if (gIdleThreadCount > 0) {
-		/* Already have one or more threads just waiting for work to do.  Just kick the requests_condvar to wake 
-		up the threads */
-		error = pthread_cond_signal(&requests_condvar);
-		require_noerr(error, pthread_cond_signal);
-	}
-	else {
-		/* No idle threads, so try to create one if we have not reached out maximum number of threads */
-		if (gCurrThreadCount < WEBDAV_REQUEST_THREADS) {
-			error = pthread_create(&request_thread, &gRequest_thread_attr, (void *) handle_request_thread, (void *) NULL);
-			require_noerr(error, pthread_create_signal);
+malloc_request_element_ptr:
 
-			gCurrThreadCount += 1;
-		}
+	error2 = pthread_mutex_unlock(&requests_lock);
+	require_noerr_action(error2, pthread_mutex_unlock, error = (error == 0) ? error2 : error; webdav_kill(-1));
+
+pthread_mutex_unlock:
+pthread_mutex_lock:
+
+	return (error);
+}
+
+/*****************************************************************************/
+
+int requestqueue_enqueue_prefetch(opaque_id nodeid)
+{
+	int error, error2;
+	webdav_requestqueue_element_t * request_element_ptr;
+
+	error = pthread_mutex_lock(&requests_lock);
+	require_noerr_action(error, pthread_mutex_lock, webdav_kill(-1));
+
+	request_element_ptr = malloc(sizeof(webdav_requestqueue_element_t));
+	require_action(request_element_ptr != NULL, malloc_request_element_ptr, error = EIO);
+
+	request_element_ptr->type = WEBDAV_PREFETCH_TYPE;
+	request_element_ptr->element.prefetch.nodeid = nodeid;
+	
+	/* prefetches are queued in the order the walk found the directories */
+	error = requestqueue_enqueue_element(request_element_ptr, WEBDAV_CLASS_PREFETCH, FALSE);
+	if ( error )
+	{
+		free(request_element_ptr);
 	}
 
-pthread_create_signal:
-pthread_cond_signal:
 malloc_request_element_ptr:
 
 	error2 = pthread_mutex_unlock(&requests_lock);
@@ -42,9 +42,12 @@ extern int requestqueue_init(void);
 extern int requestqueue_enqueue_request(int socket);
 extern int requestqueue_enqueue_download(
 			struct node_entry *node,			/* the node */
-			struct ReadStreamRec *readStreamRecPtr); /* the ReadStreamRec */
+			struct ReadStreamRec *readStreamRecPtr, /* the ReadStreamRec */
+			struct download_segments *segments); /* the rest of a segmented download, or NULL */
 extern int requestqueue_enqueue_server_ping(u_int32_t delay);
 extern int requestqueue_purge_cache_files(void);
 extern int requestqueue_enqueue_seqwrite_manager(struct stream_put_ctx *);
+extern int requestqueue_enqueue_prefetch(opaque_id nodeid);
+extern void requestqueue_download_progress(struct node_entry *node);
 
 #endif
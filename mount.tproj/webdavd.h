@@ -67,8 +67,49 @@
 #define WEBDAV_DEFAULT_CACHE_MAX_SIZE 0x02000000  /* 32M */
 #define WEBDAV_ONE_GIGABYTE			  0x40000000  /* 1G */
 
-/* the number of threads available to handle requests from the kernel file system and downloads */
+/* the number of threads available to handle requests from the kernel file system and downloads
+ * (WEBDAVFS_REQUEST_THREADS in the environment overrides it, up to WEBDAV_MAX_REQUEST_THREADS)
+ */
 #define WEBDAV_REQUEST_THREADS 5
+#define WEBDAV_MAX_REQUEST_THREADS 16
+
+/*
+ * The credits granted to the kext when it opens a channel: enough requests to
+ * keep WEBDAV_CHANNEL_CREDITS_PER_THREAD queued for each request thread, plus
+ * room for the kext's WEBDAV_WAIT_DOWNLOAD waiters (WEBDAV_MAX_KEXT_CONNECTIONS / 4),
+ * which are held until a download makes progress.
+ */
+#define WEBDAV_CHANNEL_CREDITS_PER_THREAD 4
+
+/* the most threads downloading segments of segmented downloads at once (see WEBDAV_DOWNLOAD_SEGMENTS) */
+#define WEBDAV_MAX_SEGMENT_THREADS 8
+
+/* one ReadStreamRec for every request thread (including the one kept for interactive requests),
+ * one for the pulse thread, and one for every segment thread */
+#define WEBDAV_READ_STREAMS (WEBDAV_MAX_REQUEST_THREADS + 2 + WEBDAV_MAX_SEGMENT_THREADS)
+
+/* the number of server connections (ReadStreamRecs in use) allowed at once; a request
+ * that can't get one waits up to WEBDAV_CONNECTION_WAIT seconds and then goes over
+ * the limit so a download holding a connection can never deadlock the request threads
+ * (WEBDAVFS_MAX_CONNECTIONS in the environment lowers it, down to 1)
+ */
+#define WEBDAV_MAX_CONNECTIONS WEBDAV_READ_STREAMS
+#define WEBDAV_CONNECTION_WAIT 5
+
+/* idle connections older than this (in seconds) are closed instead of reused
+ * (WEBDAVFS_CONNECTION_IDLE in the environment overrides it)
+ */
+#define WEBDAV_CONNECTION_IDLE_TIMEOUT 60
+
+/* the most small metadata requests written on the pipeline connection before their
+ * responses come back (pipelining is off unless WEBDAVFS_PIPELINE_DEPTH is set),
+ * how long (in seconds) to wait for a pipelined response, and how long (in
+ * seconds) to send requests one at a time after the pipeline connection can't be opened
+ */
+#define WEBDAV_PIPELINE_DEPTH 4		/* used when WEBDAVFS_TRANSPORT selects "pipelined" without a depth */
+#define WEBDAV_MAX_PIPELINE_DEPTH 16
+#define WEBDAV_PIPELINE_TIMEOUT 60
+#define WEBDAV_PIPELINE_RETRY_DELAY 30
 
 #define PRIVATE_CERT_UI_COMMAND "/System/Library/Filesystems/webdav.fs/Support/webdav_cert_ui.app/Contents/MacOS/webdav_cert_ui"
 #define PRIVATE_LOAD_COMMAND "/System/Library/Extensions/webdav_fs.kext/Contents/Resources/load_webdav"
@@ -88,6 +129,64 @@
  */
 #define BODY_BUFFER_SIZE 0x10000	/* 64K */
 
+/*
+ * WEBDAV_BODY_BUFFER_POOL is the number of free BODY_BUFFER_SIZE buffers kept
+ * for reuse by response reads (see body_buffer_get).
+ */
+#define WEBDAV_BODY_BUFFER_POOL 16
+
+/*
+ * Downloads of files at least WEBDAV_SEGMENTED_DOWNLOAD_MIN bytes long are split
+ * into WEBDAV_DOWNLOAD_SEGMENTS Range requests on separate connections
+ * (WEBDAVFS_DOWNLOAD_SEGMENTS in the environment overrides it, up to
+ * WEBDAV_MAX_DOWNLOAD_SEGMENTS; 1 turns segmented downloads off).
+ */
+#define WEBDAV_DOWNLOAD_SEGMENTS 4
+#define WEBDAV_MAX_DOWNLOAD_SEGMENTS 8
+#define WEBDAV_SEGMENTED_DOWNLOAD_MIN 0x01000000	/* 16M */
+
+/*
+ * Bytes read out of band while a file is being downloaded are kept in blocks of
+ * WEBDAV_FILE_BLOCK_SIZE bytes, up to WEBDAV_MAX_FILE_BLOCKS blocks per file
+ * (see nodecache_add_file_blocks).
+ */
+#define WEBDAV_FILE_BLOCK_SIZE 0x10000	/* 64K */
+#define WEBDAV_MAX_FILE_BLOCKS 4096		/* 256M */
+
+/*
+ * When WEBDAV_STAT_AHEAD_MISSES children of a directory are stat'd with stale
+ * attributes within WEBDAV_STAT_AHEAD_WINDOW seconds, the attributes of all of
+ * the directory's children are refreshed with one Depth 1 PROPFIND (see
+ * network_stat_ahead). Up to WEBDAV_STAT_AHEAD_DIRS directories are watched.
+ */
+#define WEBDAV_STAT_AHEAD_MISSES 4
+#define WEBDAV_STAT_AHEAD_WINDOW 2		/* seconds */
+#define WEBDAV_STAT_AHEAD_DIRS 8
+
+/*
+ * Directory prefetch (see filesystem_prefetch). It is off unless
+ * WEBDAVFS_PREFETCH is in the environment. When WEBDAV_PREFETCH_WALK
+ * directories in a row are read within WEBDAV_PREFETCH_WINDOW seconds of their
+ * parents, the directory being read is taken to be part of a recursive walk
+ * and up to WEBDAV_PREFETCH_FANOUT of its child directories are read ahead of
+ * demand, WEBDAV_PREFETCH_PARALLEL at a time. WEBDAV_PREFETCH_DIRS prefetched
+ * listings are kept, each for WEBDAV_PREFETCH_TTL seconds.
+ */
+#define WEBDAV_PREFETCH_WALK 2
+#define WEBDAV_PREFETCH_WINDOW 5		/* seconds */
+#define WEBDAV_PREFETCH_FANOUT 16
+#define WEBDAV_PREFETCH_PARALLEL 4
+#define WEBDAV_PREFETCH_DIRS 64
+#define WEBDAV_PREFETCH_TTL 10			/* seconds */
+
+/*
+ * The contents of closed files can be kept in a persistent cache directory that
+ * outlives the mount (see save_persistent_cachefile). It is off unless
+ * WEBDAVFS_PERSISTENT_CACHE in the environment gives its size cap in megabytes;
+ * WEBDAV_MAX_PERSISTENT_CACHE_SIZE is the most that can be asked for.
+ */
+#define WEBDAV_MAX_PERSISTENT_CACHE_SIZE 0x40000	/* 256G, in megabytes */
+
 /* special file ID values */
 #define WEBDAV_ROOTPARENTFILEID 2
 #define WEBDAV_ROOTFILEID 3
@@ -231,6 +330,12 @@ extern int filesystem_getattr(struct webdav_request_getattr *request_getattr,
 extern int filesystem_read(struct webdav_request_read *request_read,
 		char **a_byte_addr, size_t *a_size);
 
+extern int filesystem_read_ring(struct webdav_request_read *request_read,
+		struct webdav_reply_read *reply_read);
+
+extern int filesystem_associate_read_ring(int ring_ref,
+		struct webdav_reply_open_channel *reply_open_channel);
+
 extern int filesystem_fsync(struct webdav_request_fsync *request_fsync);
 
 extern int filesystem_remove(struct webdav_request_remove *request_remove);
@@ -257,4 +362,19 @@ extern int filesystem_lock(struct node_entry *node);
 
 extern int filesystem_init(int typenum);
 
+extern void filesystem_log_stats(void);
+
+/* reads a directory queued by the prefetch engine */
+extern void filesystem_prefetch(opaque_id nodeid);
+
+/* returns an unlinked temp file in the cache directory */
+extern int get_cachefile(int *fd);
+
+/* keeps or discards a node's persistent cache entry when its cache file is removed */
+extern void save_persistent_cachefile(const char *key, int fd, int keep, time_t last_modified, const char *entity_tag);
+
+extern void filesystem_trim_persistent_cache(int purge);
+
+extern void filesystem_flush_persistent_cache(void);
+
 #endif /*ifndef _WEBDAVD_H_INCLUDE */
@@ -45,6 +45,8 @@
 
 #ifdef KERNEL
 #include <libkern/locks.h>
+#include <sys/queue.h>
+#include <sys/kpi_socket.h>
 	#define DEBUG 0
 #else
 	#define DEBUG 0
@@ -81,6 +83,8 @@
 #define WEBDAV_WRITESEQ			28
 #define WEBDAV_DUMP_COOKIES		29
 #define WEBDAV_CLEAR_COOKIES	30
+#define WEBDAV_OPEN_CHANNEL		31
+#define WEBDAV_WAIT_DOWNLOAD	32
 
 /* Webdav file type constants */
 #define WEBDAV_FILE_TYPE		1
@@ -354,10 +358,16 @@ struct webdav_request_read
 	opaque_id		obj_id;				/* opaque_id of file object */
 	off_t			offset;				/* position within the file object at which the read is to begin */
 	uint64_t		count;				/* number of bytes of data to be read (limited to WEBDAV_MAX_IO_BUFFER_SIZE (8000-bytes)) */
+	int32_t			ring_slot;			/* read ring slot to place the data in, or -1 to return the data in the reply */
 };
 
+/*
+ * When request_read.ring_slot is -1, the reply is the data read. Otherwise the
+ * data is placed in the read ring slot and the reply is a struct webdav_reply_read.
+ */
 struct webdav_reply_read
 {
+	uint64_t		count;				/* number of bytes placed in the read ring slot */
 };
 
 /* WEBDAV_WRITE XXX not needed at this time */
@@ -510,6 +520,66 @@ struct webdav_reply_writeseq
 	uint64_t		count;				/* number of bytes of data written to the file */
 };
 
+/* WEBDAV_OPEN_CHANNEL */
+struct webdav_request_open_channel
+{
+	struct webdav_cred pcr;				/* user and groups */
+	uint32_t		version;			/* WEBDAV_CHANNEL_VERSION */
+	int				ring_ref;			/* ref for associating the read ring file, or -1 if the ring isn't wanted */
+};
+
+struct webdav_reply_open_channel
+{
+	uint32_t		credits;			/* number of requests the server will accept outstanding across all channels */
+	pid_t			pid;				/* process ID of file system daemon (for matching to ring_ref's pid) */
+	uint32_t		ring_slots;			/* number of read ring slots, or 0 if the read ring wasn't associated */
+};
+
+/* WEBDAV_WAIT_DOWNLOAD */
+struct webdav_request_wait_download
+{
+	struct webdav_cred pcr;				/* user and groups */
+	opaque_id		obj_id;				/* opaque_id of file object */
+	uint64_t		offset;				/* wait until the cache file has this many bytes, or WEBDAV_WAIT_DOWNLOAD_END */
+};
+
+struct webdav_reply_wait_download
+{
+	uint32_t		waited;				/* non-zero if the server waited for offset or for the download to stop */
+};
+
+/*
+ * The read ring is a file shared by the kernel and the user-land server. It is
+ * associated with the mount with WEBDAV_ASSOCIATECACHEFILE_SYSCTL (using ring_ref)
+ * while the first channel is opened. It holds WEBDAV_READ_RING_SLOTS slots of
+ * WEBDAV_READ_RING_SLOT_SIZE bytes. The kernel owns the slots: it picks a free
+ * one for a WEBDAV_READ, the server writes the data into it, and the kernel reads
+ * the data from the ring file straight into the caller's buffer, so the data
+ * doesn't have to be copied through the socket. A slot is only reused after the
+ * server's reply to the request that used it has arrived; a slot whose request
+ * got no reply is retired (see webdav_read_ring_put_slot).
+ */
+#define WEBDAV_READ_RING_SLOTS		16
+#define WEBDAV_READ_RING_SLOT_SIZE	(128 * 1024)
+
+/*
+ * A channel is a long-lived connection to the user-land server. It is opened
+ * with a WEBDAV_OPEN_CHANNEL request sent the usual way (one message, one reply).
+ * After the reply, both sides send frames on the connection. Each frame is a
+ * struct webdav_channel_header followed by wch_length bytes:
+ *
+ *		request:	int vnop, the request struct, and the request's variable length data (if any)
+ *		reply:		int result, and the reply (if any)
+ *
+ * A reply carries the wch_tag of the request it answers, so replies can come
+ * back in any order and many requests can be outstanding on one channel.
+ */
+struct webdav_channel_header
+{
+	uint32_t		wch_length;			/* number of bytes following the header */
+	uint32_t		wch_tag;			/* identifies the request; the reply has the same tag */
+};
+
 union webdav_request
 {
 	struct webdav_request_lookup	lookup;
@@ -528,6 +598,8 @@ union webdav_request
 	struct webdav_request_statfs	statfs;
 	struct webdav_request_invalcaches invalcaches;
 	struct webdav_request_writeseq  writeseq;
+	struct webdav_request_open_channel open_channel;
+	struct webdav_request_wait_download wait_download;
 };
 
 union webdav_reply
@@ -548,6 +620,8 @@ union webdav_reply
 	struct webdav_reply_statfs		statfs;
 	struct webdav_reply_invalcaches	invalcaches;
 	struct webdav_reply_writeseq	writeseq;
+	struct webdav_reply_open_channel open_channel;
+	struct webdav_reply_wait_download wait_download;
 };
 
 #define UNKNOWNUID ((uid_t)99)
@@ -616,7 +690,7 @@ struct WebdavWriteSequential {
 /*
  * If name[0] is WEBDAV_ASSOCIATECACHEFILE_SYSCTL, then 
  *		name[1] = a pointer to a struct open_associatecachefile
- *		name[2] = fd of cache file
+ *		name[2] = fd of cache file (or of the read ring file)
  */
 #define WEBDAV_ASSOCIATECACHEFILE_SYSCTL   1
 /*
@@ -626,10 +700,47 @@ struct WebdavWriteSequential {
  */
 #define WEBDAV_NOTIFY_RECONNECTED_SYSCTL   2
 
-#define WEBDAV_MAX_KEXT_CONNECTIONS 128			/* maximum number of open connections to user-land server */
+#define WEBDAV_MAX_KEXT_CONNECTIONS 128			/* maximum number of requests outstanding to user-land server (credits) */
+#define WEBDAV_MAX_KEXT_CHANNELS 4				/* number of long-lived channels to user-land server */
+#define WEBDAV_CHANNEL_VERSION 1					/* version of the channel framing */
 
 #ifdef KERNEL
 
+/* a request waiting for its reply on a webdav_channel */
+struct webdav_channel_req
+{
+	TAILQ_ENTRY(webdav_channel_req) wcr_link;	/* the other requests waiting on the channel */
+	uint32_t wcr_tag;							/* the tag sent with the request */
+	u_int32_t wcr_flags;						/* WEBDAV_CHANNEL_REQ_DONE, etc */
+	int wcr_error;								/* error receiving the reply */
+	int *wcr_result;							/* where the result goes */
+	void *wcr_reply;							/* where the reply goes */
+	size_t wcr_replysize;						/* size of wcr_reply */
+};
+
+struct webdav_channel
+{
+	socket_t wc_so;								/* the connection to user-land server, or NULL */
+	u_int32_t wc_status;						/* WEBDAV_CHANNEL_OPEN, etc */
+	TAILQ_HEAD(, webdav_channel_req) wc_pending; /* requests sent and waiting for a reply */
+};
+
+/* Defines for webdav_channel_req wcr_flags field */
+
+#define WEBDAV_CHANNEL_REQ_DONE		0x00000001	/* the reply was received (or wcr_error was set) */
+#define WEBDAV_CHANNEL_REQ_BUSY		0x00000002	/* the receiver is copying the reply into wcr_result/wcr_reply */
+#define WEBDAV_CHANNEL_REQ_FAILED	0x00000004	/* the channel failed before the reply was received */
+#define WEBDAV_CHANNEL_REQ_SENT		0x00000008	/* the whole request frame was sent */
+
+/* Defines for webdav_channel wc_status field */
+
+#define WEBDAV_CHANNEL_OPEN			0x00000001	/* the channel can be used */
+#define WEBDAV_CHANNEL_OPENING		0x00000002	/* the channel is being opened */
+#define WEBDAV_CHANNEL_DEAD			0x00000004	/* the channel failed; it is reopened once idle */
+#define WEBDAV_CHANNEL_SNDLOCK		0x00000008	/* a thread is sending a frame */
+#define WEBDAV_CHANNEL_SNDWANT		0x00000010	/* a thread is waiting to send a frame */
+#define WEBDAV_CHANNEL_RCVLOCK		0x00000020	/* a thread is receiving a frame for the waiters */
+
 struct webdavmount
 {
 	vnode_t pm_root;							/* Root node */
@@ -637,7 +748,13 @@ struct webdavmount
 	struct mount *pm_mountp;					/* vfs structure for this filesystem */
 	char *pm_vol_name;							/* volume name */
 	struct sockaddr *pm_socket_name;			/* Socket to server name */
-	u_int32_t pm_open_connections;				/* number of connections opened to user-land server */
+	int32_t pm_credits;							/* number of requests that can still be sent to user-land server */
+	struct webdav_channel pm_channels[WEBDAV_MAX_KEXT_CHANNELS]; /* long-lived channels to user-land server */
+	u_int32_t pm_channel_next;					/* round-robin index into pm_channels */
+	uint32_t pm_channel_tag;					/* last tag assigned to a channel request */
+	vnode_t pm_read_ring_vp;					/* the read ring file, or NULLVP */
+	uint32_t pm_read_ring_free;					/* bitmap of free read ring slots */
+	uint32_t pm_download_waiters;				/* number of WEBDAV_WAIT_DOWNLOAD requests outstanding */
 	u_int32_t pm_server_ident;					/* identifies some (not all) types of servers we are connected to */
 	off_t pm_dir_size;							/* size of directories */
 	/* pathconf values: >=0 to return value; -1 if not supported */
@@ -650,7 +767,7 @@ struct webdavmount
 	size_t pm_iosize;							/* saved iosize to use */
 	uid_t		pm_uid;						/* effective uid of the mounting user */
 	gid_t		pm_gid;						/* effective gid of the mounting user */	
-	lck_mtx_t pm_mutex;							/* Protects pm_status adn pm_open_connections fields */
+	lck_mtx_t pm_mutex;							/* Protects pm_status, pm_credits, pm_channels, pm_read_ring and pm_download_waiters fields */
 	lck_mtx_t pm_renamelock;                    			/* Mount rename lock */
 };
 
@@ -716,8 +833,12 @@ struct open_associatecachefile
 #define WEBDAV_MOUNT_TIMEO 0x00000008			/* connection to webdav server was lost */
 #define WEBDAV_MOUNT_DEAD 0x00000010			/* file system is dead. */
 #define WEBDAV_MOUNT_SUPPRESS_ALL_UI 0x00000020	/* suppress UI when connection is lost */
-#define WEBDAV_MOUNT_CONNECTION_WANTED 0x000000040 /* wakeup is wanted to start another connection with user-land server */
+#define WEBDAV_MOUNT_CONNECTION_WANTED 0x000000040 /* wakeup is wanted when a credit is returned */
 #define WEBDAV_MOUNT_SECURECONNECTION 0x000000080 /* the connection to the server is secure */
+#define WEBDAV_MOUNT_NO_CHANNELS 0x000000100		/* user-land server refused channels; use one connection per request */
+#define WEBDAV_MOUNT_CHANNELS_CLOSED 0x000000200	/* channels are closed for unmount */
+#define WEBDAV_MOUNT_CREDITS_GRANTED 0x000000400	/* pm_credits was set from the user-land server's grant */
+#define WEBDAV_MOUNT_NO_WAIT_DOWNLOAD 0x000000800	/* user-land server doesn't handle WEBDAV_WAIT_DOWNLOAD; poll the cache file */
 
 /* Webdav sizes for statfs */
 
@@ -759,6 +880,19 @@ struct open_associatecachefile
  */
 #define WEBDAV_WAIT_FOR_PAGE_TIME (10 * 1000 * 1000)
 
+/*
+ * When channels are open, those loops don't poll. They send a WEBDAV_WAIT_DOWNLOAD
+ * request on a channel instead, and the user-land server replies as soon as the
+ * cache file has the bytes they need or the download stops, which is also when
+ * the cache file's UF_NODUMP and UF_APPEND flags are up to date.
+ *
+ * WEBDAV_WAIT_DOWNLOAD_END is the offset to wait for when the whole file is needed.
+ * Each waiter holds a credit, so no more than WEBDAV_MAX_DOWNLOAD_WAITERS wait on
+ * the user-land server at once; the rest poll.
+ */
+#define WEBDAV_WAIT_DOWNLOAD_END ((uint64_t)-1)
+#define WEBDAV_MAX_DOWNLOAD_WAITERS (WEBDAV_MAX_KEXT_CONNECTIONS / 4)
+
 /* the number of seconds soreceive() should block
  * before rechecking the server process state
  */
@@ -809,6 +943,7 @@ extern int webdav_sendmsg(int vnop, struct webdavmount *fmp,
 	void *request, size_t requestsize,
 	void *vardata, size_t vardatasize,
 	int *result, void *reply, size_t replysize);
+extern void webdav_close_channels(struct webdavmount *fmp);
 extern int webdav_get(
 	struct mount *mp,			/* mount point */
 	vnode_t dvp,				/* parent vnode */
@@ -218,6 +218,7 @@ static int webdav_mount(struct mount *mp, vnode_t devvp, user_addr_t data, vfs_c
 	struct timespec ts;
 	struct vfsstatfs *vfsp;
 	struct webdav_timespec64 wts;
+	int i;
 
 	START_MARKER("webdav_mount");
 	
@@ -339,7 +340,11 @@ static int webdav_mount(struct mount *mp, vnode_t devvp, user_addr_t data, vfs_c
 		goto bad;
 	}
 	
-	fmp->pm_open_connections = 0;
+	fmp->pm_credits = WEBDAV_MAX_KEXT_CONNECTIONS;
+	for ( i = 0; i < WEBDAV_MAX_KEXT_CHANNELS; ++i )
+	{
+		TAILQ_INIT(&fmp->pm_channels[i].wc_pending);
+	}
 
 	fmp->pm_dir_size = args.pa_dir_size;
 
@@ -469,6 +474,15 @@ static int webdav_unmount(struct mount *mp, int mntflags, vfs_context_t context)
 		return (EBUSY);
 	}
 
+	/* the channels are idle now, and the user-land server is going away */
+	webdav_close_channels(fmp);
+	
+	if ( fmp->pm_read_ring_vp != NULLVP )
+	{
+		vnode_rele(fmp->pm_read_ring_vp);   /* reference taken in webdav_sysctl() */
+		fmp->pm_read_ring_vp = NULLVP;
+	}
+
 	webdav_copy_creds(context, &request_unmount.pcr);
 
 	/* send the unmount message message to user-land and ignore errors */
@@ -187,52 +187,205 @@ void webdav_up(struct webdavmount *fmp)
 /*****************************************************************************/
 
 /*
- * webdav_sendmsg is used to communicate with the userland half of the file
- * system.
- *
- * Inputs:
- *      vnop        the operation to be peformed -- defined operations
- *					are in webdav.h
- *      fmp         pointer to struct webdavmount for the file system
- *      request     pointer to the webdav_request struct
- *      requestsize size of request
- *      vardata     pointer to optional variable length data (the last field of
- *					request), or NULL if none
- *      vardatasize size of vardata, or 0 if no vardata
- *
- * Outputs:
- *      result      the result of the operation
- *      reply       pointer to the webdav_reply struct
- *      replysize   size of reply
+ * webdav_get_credit waits for a credit to send a request to the user-land
+ * server. One credit is held for every outstanding request whether it is sent on
+ * a channel or on its own connection, so the user-land server never has more than
+ * WEBDAV_MAX_KEXT_CONNECTIONS requests to handle.
  */
-__private_extern__
-int webdav_sendmsg(int vnop, struct webdavmount *fmp,
+static
+int webdav_get_credit(struct webdavmount *fmp)
+{
+	int error;
+	
+	error = 0;
+	lck_mtx_lock(&fmp->pm_mutex);
+	while ( fmp->pm_credits <= 0 )
+	{
+		fmp->pm_status |= WEBDAV_MOUNT_CONNECTION_WANTED;
+		error = msleep((caddr_t)&fmp->pm_credits, &fmp->pm_mutex, PCATCH, "webdav_get_credit", NULL);
+		if ( error )
+		{
+			break;
+		}
+	}
+	if ( error == 0 )
+	{
+		--fmp->pm_credits;
+	}
+	lck_mtx_unlock(&fmp->pm_mutex);
+	
+	return ( error );
+}
+
+/*****************************************************************************/
+
+/*
+ * webdav_put_credit returns a credit taken by webdav_get_credit and wakes
+ * up anyone waiting for one.
+ */
+static
+void webdav_put_credit(struct webdavmount *fmp)
+{
+	lck_mtx_lock(&fmp->pm_mutex);
+	++fmp->pm_credits;
+	if ( fmp->pm_status & WEBDAV_MOUNT_CONNECTION_WANTED )
+	{
+		fmp->pm_status &= ~WEBDAV_MOUNT_CONNECTION_WANTED;
+		wakeup((caddr_t)&fmp->pm_credits);
+	}
+	lck_mtx_unlock(&fmp->pm_mutex);
+}
+
+/*****************************************************************************/
+
+/*
+ * webdav_connect creates a socket and connects it to the user-land server.
+ */
+static
+int webdav_connect(int vnop, struct webdavmount *fmp, socket_t *sop)
+{
+	int error;
+	socket_t so;
+	struct timeval tv;
+	
+	*sop = NULL;
+	
+	/* create a new socket */
+	error = sock_socket(PF_LOCAL, SOCK_STREAM, 0, NULL, NULL, &so);
+	if ( error != 0 )
+	{
+		printf("webdav_sendmsg: sock_socket() = %d\n", error);
+		return ( error );
+	}
+
+	/* set the socket receive timeout */
+	tv.tv_sec = WEBDAV_SO_RCVTIMEO_SECONDS;
+	tv.tv_usec = 0;
+	error = sock_setsockopt(so, SOL_SOCKET, SO_RCVTIMEO, &tv, (uint32_t)sizeof(struct timeval));
+	if (error)
+	{
+		printf("webdav_sendmsg: sock_setsockopt() = %d\n", error);
+		goto bad;
+	}
+
+	/*
+	 * When sock_connect() is called on local domain sockets, the attach
+	 * code calls soreserve() with hard coded values (currently PIPSIZ -- 8192).
+	 */
+	
+	/* make we're not force unmounting */
+	if ( (vnop != WEBDAV_UNMOUNT) && vfs_isforce(fmp->pm_mountp) )
+	{
+		error = ENXIO;
+		goto bad;
+	}
+
+	/* kick off connection */
+	error = sock_connect(so, fmp->pm_socket_name, 0);
+	if (error && error != EINPROGRESS)
+	{
+		/* is the other side gone? If so, we're dead. */
+		if ( error == ECONNREFUSED )
+		{
+			webdav_dead(fmp);
+		}
+		/* ENOENT is expected after a normal unmount */
+		if ( error != ENOENT )
+		{
+			printf("webdav_sendmsg: sock_connect() = %d\n", error);
+		}
+		goto bad;
+	}
+	
+	/* disable interrupts on socket buffers */
+	error = sock_nointerrupt(so, TRUE);
+	if (error)
+	{
+		printf("webdav_sendmsg: sock_nointerrupt() = %d\n", error);
+		goto bad;
+	}
+	
+	*sop = so;
+	return ( 0 );
+
+bad:
+
+	(void) sock_shutdown(so, SHUT_RDWR); /* ignore failures - nothing can be done */
+	sock_close(so);
+	return ( error );
+}
+
+/*****************************************************************************/
+
+/*
+ * webdav_sendmsg_socket sends one request to the user-land server on its own
+ * connection and waits for the reply. This is how every request was sent
+ * before channels, and it is still used to open channels, for WEBDAV_UNMOUNT,
+ * and whenever no channel is available.
+ */
+static
+int webdav_sendmsg_socket(int vnop, struct webdavmount *fmp,
 	void *request, size_t requestsize,
 	void *vardata, size_t vardatasize,
 	int *result, void *reply, size_t replysize)
 {
 	int error;
 	socket_t so;
-	int so_open;
 	struct msghdr msg;
 	struct iovec aiov[3];
-	struct timeval tv;
-	struct timeval lasttrytime;
-	struct timeval currenttime;
 	size_t iolen;
 	uint32_t num_rcv_timeouts;
+	
+	error = webdav_connect(vnop, fmp, &so);
+	if ( error )
+	{
+		return ( error );
+	}
+	
+	memset(&msg, 0, sizeof(msg));
+	
+	aiov[0].iov_base = (caddr_t) & vnop;
+	aiov[0].iov_len = sizeof(vnop);
+	aiov[1].iov_base = (caddr_t)request;
+	aiov[1].iov_len = requestsize;
+	if ( vardatasize == 0 )
+	{
+		msg.msg_iovlen = 2;
+	}
+	else
+	{
+		aiov[2].iov_base = vardata;
+		aiov[2].iov_len = vardatasize;
+		msg.msg_iovlen = 3;
+	}
+	msg.msg_iov = aiov;
 
-	if ( fmp == NULL )
-		panic("webdav_sendmsg: fmp is NULL!");
+	/* make we're not force unmounting */
+	if ( (vnop != WEBDAV_UNMOUNT) && vfs_isforce(fmp->pm_mountp) )
+	{
+		error = ENXIO;
+		goto done;
+	}
+
+	error = sock_send(so, &msg, 0, &iolen);
+	if (error)
+	{
+		printf("webdav_sendmsg: sock_send() = %d\n", error);
+		goto done;
+	}
 	
-	/* get current time */
-	microtime(&currenttime);
-	so_open = FALSE;
+	memset(&msg, 0, sizeof(msg));
+	
+	aiov[0].iov_base = (caddr_t)result;
+	aiov[0].iov_len = sizeof(*result);
+	aiov[1].iov_base = (caddr_t)reply;
+	aiov[1].iov_len = replysize;
+	msg.msg_iov = aiov;
+	msg.msg_iovlen = (replysize == 0 ? 1 : 2);
 	
+	num_rcv_timeouts = 0;
 	while ( TRUE )
 	{
-		lasttrytime.tv_sec = currenttime.tv_sec;
-		
 		/* make we're not force unmounting */
 		if ( (vnop != WEBDAV_UNMOUNT) && vfs_isforce(fmp->pm_mountp) )
 		{
@@ -240,164 +393,821 @@ int webdav_sendmsg(int vnop, struct webdavmount *fmp,
 			break;
 		}
 		
-		/* don't open more connections than the user-land server can handle */
-		lck_mtx_lock(&fmp->pm_mutex);
-again:
-		if (fmp->pm_open_connections >= WEBDAV_MAX_KEXT_CONNECTIONS)
+		error = sock_receive(so, &msg, MSG_WAITALL, &iolen);
+		
+		/* did sock_receive timeout? */
+		if (error != EWOULDBLOCK)
 		{
-			fmp->pm_status |= WEBDAV_MOUNT_CONNECTION_WANTED;
-			error = msleep((caddr_t)&fmp->pm_open_connections, &fmp->pm_mutex, PCATCH, "webdav_sendmsg - pm_open_connections", NULL);
-			if ( error )
+			/* sock_receive did not time out */
+			if ( error != 0 )
 			{
-				lck_mtx_unlock(&fmp->pm_mutex);
-				break;
+				printf("webdav_sendmsg: sock_receive() = %d\n", error);
+			}
+			break;
+		}
+		else {
+			/* sock_receive DID time out */
+			if ( (++num_rcv_timeouts == WEBDAV_MAX_SOCK_RCV_TIMEOUTS ) &&
+			     (vnop != WEBDAV_WRITE) && (vnop != WEBDAV_READ) &&
+				 (vnop != WEBDAV_FSYNC) && (vnop != WEBDAV_WRITESEQ) ) {
+					// This vnop has timed out.
+					printf("webdav_sendmsg: sock_receive() timeout. vnop: %d idisk: %s\n", vnop,
+						   (fmp->pm_server_ident & WEBDAV_IDISK_SERVER) ? "yes" : "no");
+					error = ETIMEDOUT;
+					break;
 			}
-			goto again;
 		}
+	}
 
-		++fmp->pm_open_connections;
-		lck_mtx_unlock(&fmp->pm_mutex);
+done:
+
+	(void) sock_shutdown(so, SHUT_RDWR); /* ignore failures - nothing can be done */
+	sock_close(so);
+	
+	return ( error );
+}
+
+/*****************************************************************************/
+
+/*
+ * webdav_channel_recv receives exactly len bytes from a channel.
+ *
+ * If started is FALSE and nothing at all has been received when the socket
+ * receive timeout expires, EWOULDBLOCK is returned so the caller can count the
+ * timeout. Once part of a frame has been received (or started is TRUE because
+ * the caller is in the middle of a frame) the rest is on its way, so timeouts
+ * are ignored.
+ */
+static
+int webdav_channel_recv(struct webdavmount *fmp, socket_t so, void *buf, size_t len, int started)
+{
+	int error;
+	struct msghdr msg;
+	struct iovec aiov;
+	size_t iolen;
+	
+	while ( len != 0 )
+	{
+		if ( vfs_isforce(fmp->pm_mountp) )
+		{
+			return ( ENXIO );
+		}
 		
-		/* create a new socket */
-		error = sock_socket(PF_LOCAL, SOCK_STREAM, 0, NULL, NULL, &so);
-		if ( error != 0 )
+		memset(&msg, 0, sizeof(msg));
+		aiov.iov_base = (caddr_t)buf;
+		aiov.iov_len = len;
+		msg.msg_iov = &aiov;
+		msg.msg_iovlen = 1;
+		
+		iolen = 0;
+		error = sock_receive(so, &msg, MSG_WAITALL, &iolen);
+		if ( (error == EWOULDBLOCK) && (iolen == 0) )
 		{
-			printf("webdav_sendmsg: sock_socket() = %d\n", error);
-			so_open = FALSE;
-			
-			lck_mtx_lock(&fmp->pm_mutex);
-			--fmp->pm_open_connections;
-			lck_mtx_unlock(&fmp->pm_mutex);
-			break;
+			if ( !started )
+			{
+				return ( EWOULDBLOCK );
+			}
+			continue;
 		}
-		else
+		else if ( (error != 0) && (error != EWOULDBLOCK) )
 		{
-			so_open = TRUE;
+			return ( error );
 		}
+		else if ( iolen == 0 )
+		{
+			/* the user-land server closed the channel */
+			return ( ECONNRESET );
+		}
+		
+		buf = (caddr_t)buf + iolen;
+		len -= iolen;
+		started = TRUE;
+	}
+	
+	return ( 0 );
+}
 
-		/* set the socket receive timeout */
-		tv.tv_sec = WEBDAV_SO_RCVTIMEO_SECONDS;
-		tv.tv_usec = 0;
-		error = sock_setsockopt(so, SOL_SOCKET, SO_RCVTIMEO, &tv, (uint32_t)sizeof(struct timeval));
-		if (error)
+/*****************************************************************************/
+
+/*
+ * webdav_channel_fail marks a channel dead and completes every request
+ * waiting on it with error (webdav_sendmsg sends them again on their own
+ * connections). The socket is closed by webdav_channel_get or
+ * webdav_close_channels once no thread is sending or receiving on it.
+ *
+ * Called with pm_mutex held.
+ */
+static
+void webdav_channel_fail(struct webdav_channel *wc, int error)
+{
+	struct webdav_channel_req *wcr;
+	
+	wc->wc_status = (wc->wc_status & ~WEBDAV_CHANNEL_OPEN) | WEBDAV_CHANNEL_DEAD;
+	
+	while ( (wcr = TAILQ_FIRST(&wc->wc_pending)) != NULL )
+	{
+		TAILQ_REMOVE(&wc->wc_pending, wcr, wcr_link);
+		wcr->wcr_error = error;
+		wcr->wcr_flags |= WEBDAV_CHANNEL_REQ_DONE | WEBDAV_CHANNEL_REQ_FAILED;
+	}
+	wakeup((caddr_t)&wc->wc_pending);
+}
+
+/*****************************************************************************/
+
+/*
+ * webdav_channel_idle is called when a thread stops using a channel (or
+ * finishes opening one) so webdav_close_channels can stop waiting.
+ *
+ * Called with pm_mutex held.
+ */
+static
+void webdav_channel_idle(struct webdavmount *fmp)
+{
+	if ( fmp->pm_status & WEBDAV_MOUNT_CHANNELS_CLOSED )
+	{
+		wakeup((caddr_t)&fmp->pm_channels);
+	}
+}
+
+/*****************************************************************************/
+
+/*
+ * webdav_channel_receive receives one reply frame from a channel and
+ * completes the request it belongs to. The caller holds WEBDAV_CHANNEL_RCVLOCK
+ * but not pm_mutex.
+ *
+ * Only EWOULDBLOCK before any of the frame header arrived is a plain timeout.
+ * Any error once the header is in leaves the channel in the middle of a frame,
+ * so it's never EWOULDBLOCK and the caller must fail the channel.
+ */
+static
+int webdav_channel_receive(struct webdavmount *fmp, struct webdav_channel *wc)
+{
+	int error;
+	struct webdav_channel_header header;
+	struct webdav_channel_req *wcr;
+	size_t length;
+	size_t replylen;
+	
+	error = webdav_channel_recv(fmp, wc->wc_so, &header, sizeof(header), FALSE);
+	if ( error )
+	{
+		return ( error );
+	}
+	
+	length = header.wch_length;
+	if ( length < sizeof(int) )
+	{
+		printf("webdav_channel_receive: short frame %u\n", header.wch_tag);
+		return ( EIO );
+	}
+	
+	/* find the request and keep it from going away while its reply is copied */
+	lck_mtx_lock(&fmp->pm_mutex);
+	TAILQ_FOREACH(wcr, &wc->wc_pending, wcr_link)
+	{
+		if ( wcr->wcr_tag == header.wch_tag )
 		{
-			printf("webdav_sendmsg: sock_setsockopt() = %d\n", error);
+			TAILQ_REMOVE(&wc->wc_pending, wcr, wcr_link);
+			wcr->wcr_flags |= WEBDAV_CHANNEL_REQ_BUSY;
 			break;
 		}
+	}
+	lck_mtx_unlock(&fmp->pm_mutex);
 	
-		/*
-		 * When sock_connect() is called on local domain sockets, the attach
-		 * code calls soreserve() with hard coded values (currently PIPSIZ -- 8192).
-		 */
+	if ( wcr != NULL )
+	{
+		error = webdav_channel_recv(fmp, wc->wc_so, wcr->wcr_result, sizeof(int), TRUE);
+		length -= sizeof(int);
+		if ( error == 0 )
+		{
+			replylen = MIN(length, wcr->wcr_replysize);
+			if ( replylen != 0 )
+			{
+				error = webdav_channel_recv(fmp, wc->wc_so, wcr->wcr_reply, replylen, TRUE);
+				length -= replylen;
+			}
+			if ( replylen < wcr->wcr_replysize )
+			{
+				/* a short reply: don't hand stale data to the caller */
+				bzero((caddr_t)wcr->wcr_reply + replylen, wcr->wcr_replysize - replylen);
+			}
+		}
 		
-		/* make we're not force unmounting */
-		if ( (vnop != WEBDAV_UNMOUNT) && vfs_isforce(fmp->pm_mountp) )
+		lck_mtx_lock(&fmp->pm_mutex);
+		wcr->wcr_error = error;
+		wcr->wcr_flags = (wcr->wcr_flags & ~WEBDAV_CHANNEL_REQ_BUSY) | WEBDAV_CHANNEL_REQ_DONE;
+		if ( error != 0 )
+		{
+			/* the channel is failed by our caller; this reply was lost with it */
+			wcr->wcr_flags |= WEBDAV_CHANNEL_REQ_FAILED;
+		}
+		wakeup((caddr_t)&wc->wc_pending);
+		lck_mtx_unlock(&fmp->pm_mutex);
+	}
+	
+	/* throw away anything nobody is waiting for (the request timed out or the reply was too long) */
+	while ( (error == 0) && (length != 0) )
+	{
+		mbuf_t m;
+		size_t recvlen;
+		
+		m = NULL;
+		recvlen = length;
+		error = sock_receivembuf(wc->wc_so, NULL, &m, MSG_WAITALL, &recvlen);
+		if ( m != NULL )
+		{
+			mbuf_freem(m);
+		}
+		if ( error == EWOULDBLOCK )
+		{
+			error = vfs_isforce(fmp->pm_mountp) ? ENXIO : 0;
+		}
+		else if ( (error == 0) && (recvlen == 0) )
+		{
+			error = ECONNRESET;
+		}
+		length -= MIN(recvlen, length);
+	}
+	
+	return ( error );
+}
+
+/*****************************************************************************/
+
+/*
+ * webdav_channel_open connects a channel to the user-land server and
+ * exchanges WEBDAV_OPEN_CHANNEL. The credits the server grants replace
+ * the WEBDAV_MAX_KEXT_CONNECTIONS default. Until the read ring has been
+ * associated, each WEBDAV_OPEN_CHANNEL also asks the server for it.
+ */
+static
+int webdav_channel_open(struct webdavmount *fmp, socket_t *sop)
+{
+	int error;
+	int server_error;
+	socket_t so;
+	struct msghdr msg;
+	struct iovec aiov[2];
+	size_t iolen;
+	int vnop;
+	int ring_wanted;
+	struct webdav_request_open_channel request_open_channel;
+	struct webdav_reply_open_channel reply_open_channel;
+	struct open_associatecachefile associatering;
+	
+	error = webdav_connect(WEBDAV_OPEN_CHANNEL, fmp, &so);
+	if ( error )
+	{
+		return ( error );
+	}
+	
+	bzero(&request_open_channel, sizeof(request_open_channel));
+	request_open_channel.pcr.pcr_uid = fmp->pm_uid;
+	request_open_channel.version = WEBDAV_CHANNEL_VERSION;
+	request_open_channel.ring_ref = -1;
+	vnop = WEBDAV_OPEN_CHANNEL;
+	
+	associatering.pid = 0;
+	associatering.cachevp = NULLVP;
+	lck_mtx_lock(&fmp->pm_mutex);
+	ring_wanted = (fmp->pm_read_ring_vp == NULLVP);
+	lck_mtx_unlock(&fmp->pm_mutex);
+	if ( ring_wanted )
+	{
+		/* if there's no ref, the channel is opened without the read ring */
+		if ( webdav_assign_ref(&associatering, &request_open_channel.ring_ref) != 0 )
+		{
+			request_open_channel.ring_ref = -1;
+		}
+	}
+	
+	memset(&msg, 0, sizeof(msg));
+	aiov[0].iov_base = (caddr_t)&vnop;
+	aiov[0].iov_len = sizeof(vnop);
+	aiov[1].iov_base = (caddr_t)&request_open_channel;
+	aiov[1].iov_len = sizeof(request_open_channel);
+	msg.msg_iov = aiov;
+	msg.msg_iovlen = 2;
+	
+	error = sock_send(so, &msg, 0, &iolen);
+	if ( error )
+	{
+		goto bad;
+	}
+	
+	server_error = 0;
+	bzero(&reply_open_channel, sizeof(reply_open_channel));
+	memset(&msg, 0, sizeof(msg));
+	aiov[0].iov_base = (caddr_t)&server_error;
+	aiov[0].iov_len = sizeof(server_error);
+	aiov[1].iov_base = (caddr_t)&reply_open_channel;
+	aiov[1].iov_len = sizeof(reply_open_channel);
+	msg.msg_iov = aiov;
+	msg.msg_iovlen = 2;
+	
+	error = sock_receive(so, &msg, MSG_WAITALL, &iolen);
+	if ( error )
+	{
+		goto bad;
+	}
+	
+	server_error &= ~WEBDAV_CONNECTION_DOWN_MASK;
+	if ( (server_error != 0) || (iolen != sizeof(server_error) + sizeof(reply_open_channel)) ||
+		 (reply_open_channel.credits == 0) )
+	{
+		/* the user-land server doesn't want channels */
+		error = ENOTSUP;
+		goto bad;
+	}
+	
+	lck_mtx_lock(&fmp->pm_mutex);
+	if ( !(fmp->pm_status & WEBDAV_MOUNT_CREDITS_GRANTED) )
+	{
+		/* the first channel opened sets the number of credits */
+		fmp->pm_status |= WEBDAV_MOUNT_CREDITS_GRANTED;
+		if ( reply_open_channel.credits < WEBDAV_MAX_KEXT_CONNECTIONS )
+		{
+			fmp->pm_credits -= (int32_t)(WEBDAV_MAX_KEXT_CONNECTIONS - reply_open_channel.credits);
+		}
+	}
+	if ( (associatering.cachevp != NULLVP) && (fmp->pm_read_ring_vp == NULLVP) &&
+		 (reply_open_channel.ring_slots == WEBDAV_READ_RING_SLOTS) &&
+		 (reply_open_channel.pid == associatering.pid) )
+	{
+		/* the read ring's vnode reference is released by webdav_unmount() */
+		fmp->pm_read_ring_vp = associatering.cachevp;
+		fmp->pm_read_ring_free = (1 << WEBDAV_READ_RING_SLOTS) - 1;
+		associatering.cachevp = NULLVP;
+	}
+	lck_mtx_unlock(&fmp->pm_mutex);
+	
+	error = 0;
+	*sop = so;
+	goto done;
+
+bad:
+
+	(void) sock_shutdown(so, SHUT_RDWR); /* ignore failures - nothing can be done */
+	sock_close(so);
+
+done:
+
+	if ( associatering.cachevp != NULLVP )
+	{
+		/* the read ring wasn't used (another channel may have associated it first) */
+		vnode_rele(associatering.cachevp);   /* reference taken in webdav_sysctl() */
+	}
+	webdav_release_ref(request_open_channel.ring_ref);
+	
+	return ( error );
+}
+
+/*****************************************************************************/
+
+/*
+ * webdav_channel_get returns an open channel to send a request on, opening
+ * (or reopening) one if needed. NULL is returned if the request should be
+ * sent on its own connection instead.
+ */
+static
+struct webdav_channel *webdav_channel_get(int vnop, struct webdavmount *fmp)
+{
+	struct webdav_channel *wc;
+	socket_t so, old_so;
+	int error;
+	
+	/* unmount always uses its own connection since the server is going away */
+	if ( vnop == WEBDAV_UNMOUNT )
+	{
+		return ( NULL );
+	}
+	
+	lck_mtx_lock(&fmp->pm_mutex);
+	
+	if ( fmp->pm_status & (WEBDAV_MOUNT_NO_CHANNELS | WEBDAV_MOUNT_CHANNELS_CLOSED) )
+	{
+		lck_mtx_unlock(&fmp->pm_mutex);
+		return ( NULL );
+	}
+	
+	wc = &fmp->pm_channels[fmp->pm_channel_next++ % WEBDAV_MAX_KEXT_CHANNELS];
+	
+	if ( wc->wc_status & WEBDAV_CHANNEL_OPEN )
+	{
+		lck_mtx_unlock(&fmp->pm_mutex);
+		return ( wc );
+	}
+	
+	/* someone else is opening it, or the dead socket is still being used */
+	if ( (wc->wc_status & (WEBDAV_CHANNEL_OPENING | WEBDAV_CHANNEL_SNDLOCK | WEBDAV_CHANNEL_RCVLOCK)) ||
+		 !TAILQ_EMPTY(&wc->wc_pending) )
+	{
+		lck_mtx_unlock(&fmp->pm_mutex);
+		return ( NULL );
+	}
+	
+	old_so = wc->wc_so;
+	wc->wc_so = NULL;
+	wc->wc_status = WEBDAV_CHANNEL_OPENING;
+	lck_mtx_unlock(&fmp->pm_mutex);
+	
+	if ( old_so != NULL )
+	{
+		(void) sock_shutdown(old_so, SHUT_RDWR);
+		sock_close(old_so);
+	}
+	
+	error = webdav_channel_open(fmp, &so);
+	
+	lck_mtx_lock(&fmp->pm_mutex);
+	if ( error == 0 )
+	{
+		wc->wc_so = so;
+		wc->wc_status = WEBDAV_CHANNEL_OPEN;
+	}
+	else
+	{
+		wc->wc_status = 0;
+		wc = NULL;
+		if ( error == ENOTSUP )
+		{
+			fmp->pm_status |= WEBDAV_MOUNT_NO_CHANNELS;
+		}
+	}
+	webdav_channel_idle(fmp);
+	lck_mtx_unlock(&fmp->pm_mutex);
+	
+	return ( wc );
+}
+
+/*****************************************************************************/
+
+/*
+ * webdav_vnop_idempotent returns TRUE if running vnop twice in user-land does
+ * no harm, so it can be sent again after a channel failed with it in flight.
+ */
+static
+int webdav_vnop_idempotent(int vnop)
+{
+	switch ( vnop )
+	{
+		case WEBDAV_LOOKUP:
+		case WEBDAV_GETATTR:
+		case WEBDAV_STATFS:
+		case WEBDAV_READDIR:
+		case WEBDAV_WAIT_DOWNLOAD:
+			return ( TRUE );
+		default:
+			return ( FALSE );
+	}
+}
+
+/*****************************************************************************/
+
+/*
+ * webdav_sendmsg_channel sends one request on a channel and waits for its reply.
+ *
+ * The threads waiting on a channel take turns receiving: whichever waiter finds
+ * nobody receiving reads the next reply frame, hands it to the request with the
+ * matching tag (which may be its own or someone else's), and then lets the next
+ * waiter have a turn.
+ *
+ * ENOTCONN is returned if the channel failed before the reply was received and
+ * the request can be sent again on its own connection: either the whole frame
+ * never left the kernel (so user-land can't have run it), or the vnop is
+ * idempotent. Otherwise, a failed channel returns EIO.
+ */
+static
+int webdav_sendmsg_channel(int vnop, struct webdavmount *fmp, struct webdav_channel *wc,
+	void *request, size_t requestsize,
+	void *vardata, size_t vardatasize,
+	int *result, void *reply, size_t replysize)
+{
+	int error;
+	struct webdav_channel_req wcr;
+	struct webdav_channel_header header;
+	struct msghdr msg;
+	struct iovec aiov[4];
+	size_t iolen;
+	struct timespec ts;
+	uint32_t num_rcv_timeouts;
+	int timed_out;
+	
+	bzero(&wcr, sizeof(wcr));
+	wcr.wcr_result = result;
+	wcr.wcr_reply = reply;
+	wcr.wcr_replysize = replysize;
+	
+	lck_mtx_lock(&fmp->pm_mutex);
+	
+	/* tag 0 is never used */
+	if ( ++fmp->pm_channel_tag == 0 )
+	{
+		++fmp->pm_channel_tag;
+	}
+	wcr.wcr_tag = fmp->pm_channel_tag;
+	
+	/* wait for our turn to send */
+	while ( wc->wc_status & WEBDAV_CHANNEL_SNDLOCK )
+	{
+		wc->wc_status |= WEBDAV_CHANNEL_SNDWANT;
+		(void) msleep((caddr_t)&wc->wc_so, &fmp->pm_mutex, PZERO, "webdav_sendmsg_channel", NULL);
+	}
+	if ( !(wc->wc_status & WEBDAV_CHANNEL_OPEN) )
+	{
+		/* the channel failed while we waited */
+		lck_mtx_unlock(&fmp->pm_mutex);
+		return ( ENOTCONN );
+	}
+	wc->wc_status |= WEBDAV_CHANNEL_SNDLOCK;
+	
+	/* the reply could come back before sock_send returns */
+	TAILQ_INSERT_TAIL(&wc->wc_pending, &wcr, wcr_link);
+	lck_mtx_unlock(&fmp->pm_mutex);
+	
+	header.wch_length = (uint32_t)(sizeof(vnop) + requestsize + vardatasize);
+	header.wch_tag = wcr.wcr_tag;
+	
+	memset(&msg, 0, sizeof(msg));
+	aiov[0].iov_base = (caddr_t)&header;
+	aiov[0].iov_len = sizeof(header);
+	aiov[1].iov_base = (caddr_t)&vnop;
+	aiov[1].iov_len = sizeof(vnop);
+	aiov[2].iov_base = (caddr_t)request;
+	aiov[2].iov_len = requestsize;
+	if ( vardatasize == 0 )
+	{
+		msg.msg_iovlen = 3;
+	}
+	else
+	{
+		aiov[3].iov_base = vardata;
+		aiov[3].iov_len = vardatasize;
+		msg.msg_iovlen = 4;
+	}
+	msg.msg_iov = aiov;
+	
+	iolen = 0;
+	error = sock_send(wc->wc_so, &msg, 0, &iolen);
+	
+	lck_mtx_lock(&fmp->pm_mutex);
+	if ( iolen == sizeof(header) + header.wch_length )
+	{
+		/* user-land may run the request now, even if the channel fails later */
+		wcr.wcr_flags |= WEBDAV_CHANNEL_REQ_SENT;
+	}
+	wc->wc_status &= ~WEBDAV_CHANNEL_SNDLOCK;
+	if ( wc->wc_status & WEBDAV_CHANNEL_SNDWANT )
+	{
+		wc->wc_status &= ~WEBDAV_CHANNEL_SNDWANT;
+		wakeup((caddr_t)&wc->wc_so);
+	}
+	if ( error )
+	{
+		printf("webdav_sendmsg_channel: sock_send() = %d\n", error);
+		/* the frame may be half sent, so nothing else can be sent on this channel */
+		webdav_channel_fail(wc, error);
+	}
+	
+	num_rcv_timeouts = 0;
+	while ( !(wcr.wcr_flags & WEBDAV_CHANNEL_REQ_DONE) )
+	{
+		timed_out = FALSE;
+		
+		if ( vfs_isforce(fmp->pm_mountp) )
 		{
 			error = ENXIO;
 			break;
 		}
-
-		/* kick off connection */
-		error = sock_connect(so, fmp->pm_socket_name, 0);
-		if (error && error != EINPROGRESS)
+		
+		if ( !(wc->wc_status & WEBDAV_CHANNEL_RCVLOCK) )
 		{
-			/* is the other side gone? If so, we're dead. */
-			if ( error == ECONNREFUSED )
+			/* nobody is receiving, so it's our turn */
+			wc->wc_status |= WEBDAV_CHANNEL_RCVLOCK;
+			lck_mtx_unlock(&fmp->pm_mutex);
+			
+			error = webdav_channel_receive(fmp, wc);
+			
+			lck_mtx_lock(&fmp->pm_mutex);
+			wc->wc_status &= ~WEBDAV_CHANNEL_RCVLOCK;
+			if ( error == EWOULDBLOCK )
 			{
-				webdav_dead(fmp);
+				timed_out = TRUE;
+				error = 0;
 			}
-			/* ENOENT is expected after a normal unmount */
-			if ( error != ENOENT )
+			else if ( error != 0 )
 			{
-				printf("webdav_sendmsg: sock_connect() = %d\n", error);
+				printf("webdav_sendmsg_channel: receive = %d\n", error);
+				webdav_channel_fail(wc, error);
 			}
-			break;
+			/* let the next waiter receive, or see its reply */
+			wakeup((caddr_t)&wc->wc_pending);
+		}
+		else
+		{
+			ts.tv_sec = WEBDAV_SO_RCVTIMEO_SECONDS;
+			ts.tv_nsec = 0;
+			error = msleep((caddr_t)&wc->wc_pending, &fmp->pm_mutex, PZERO, "webdav_sendmsg_channel", &ts);
+			if ( error == EWOULDBLOCK )
+			{
+				timed_out = TRUE;
+			}
+			error = 0;
 		}
 		
-		/* disable interrupts on socket buffers */
-		error = sock_nointerrupt(so, TRUE);
-		if (error)
+		if ( timed_out && !(wcr.wcr_flags & WEBDAV_CHANNEL_REQ_DONE) &&
+			 (++num_rcv_timeouts == WEBDAV_MAX_SOCK_RCV_TIMEOUTS) &&
+			 (vnop != WEBDAV_WRITE) && (vnop != WEBDAV_READ) &&
+			 (vnop != WEBDAV_FSYNC) && (vnop != WEBDAV_WRITESEQ) &&
+			 (vnop != WEBDAV_WAIT_DOWNLOAD) )
 		{
-			printf("webdav_sendmsg: sock_nointerrupt() = %d\n", error);
+			// This vnop has timed out.
+			printf("webdav_sendmsg_channel: timeout. vnop: %d idisk: %s\n", vnop,
+				   (fmp->pm_server_ident & WEBDAV_IDISK_SERVER) ? "yes" : "no");
+			error = ETIMEDOUT;
 			break;
 		}
-		
-		memset(&msg, 0, sizeof(msg));
-		
-		aiov[0].iov_base = (caddr_t) & vnop;
-		aiov[0].iov_len = sizeof(vnop);
-		aiov[1].iov_base = (caddr_t)request;
-		aiov[1].iov_len = requestsize;
-		if ( vardatasize == 0 )
+	}
+	
+	if ( wcr.wcr_flags & WEBDAV_CHANNEL_REQ_FAILED )
+	{
+		if ( !(wcr.wcr_flags & WEBDAV_CHANNEL_REQ_SENT) || webdav_vnop_idempotent(vnop) )
 		{
-			msg.msg_iovlen = 2;
+			error = ENOTCONN;
 		}
 		else
 		{
-			aiov[2].iov_base = vardata;
-			aiov[2].iov_len = vardatasize;
-			msg.msg_iovlen = 3;
+			printf("webdav_sendmsg_channel: channel failed after vnop %d was sent\n", vnop);
+			error = EIO;
+		}
+	}
+	else if ( wcr.wcr_flags & WEBDAV_CHANNEL_REQ_DONE )
+	{
+		error = wcr.wcr_error;
+	}
+	else
+	{
+		/* giving up: wait for a receiver that is copying our reply, then take our request off the channel */
+		while ( wcr.wcr_flags & WEBDAV_CHANNEL_REQ_BUSY )
+		{
+			(void) msleep((caddr_t)&wc->wc_pending, &fmp->pm_mutex, PZERO, "webdav_sendmsg_channel", NULL);
+		}
+		if ( !(wcr.wcr_flags & WEBDAV_CHANNEL_REQ_DONE) )
+		{
+			TAILQ_REMOVE(&wc->wc_pending, &wcr, wcr_link);
+		}
+	}
+	webdav_channel_idle(fmp);
+	lck_mtx_unlock(&fmp->pm_mutex);
+	
+	return ( error );
+}
+
+/*****************************************************************************/
+
+/*
+ * webdav_close_channels shuts down the channels to the user-land server and
+ * waits for the threads using them to leave. Called from webdav_unmount.
+ */
+__private_extern__
+void webdav_close_channels(struct webdavmount *fmp)
+{
+	int i;
+	int busy;
+	struct webdav_channel *wc;
+	
+	lck_mtx_lock(&fmp->pm_mutex);
+	fmp->pm_status |= WEBDAV_MOUNT_CHANNELS_CLOSED;
+	
+	/* shutting down the sockets wakes up anyone sending or receiving */
+	for ( i = 0; i < WEBDAV_MAX_KEXT_CHANNELS; ++i )
+	{
+		wc = &fmp->pm_channels[i];
+		if ( wc->wc_so != NULL )
+		{
+			(void) sock_shutdown(wc->wc_so, SHUT_RDWR);
+		}
+	}
+	
+	do
+	{
+		busy = FALSE;
+		for ( i = 0; i < WEBDAV_MAX_KEXT_CHANNELS; ++i )
+		{
+			wc = &fmp->pm_channels[i];
+			if ( (wc->wc_status & (WEBDAV_CHANNEL_OPENING | WEBDAV_CHANNEL_SNDLOCK | WEBDAV_CHANNEL_RCVLOCK)) ||
+				 !TAILQ_EMPTY(&wc->wc_pending) )
+			{
+				busy = TRUE;
+			}
+		}
+		if ( busy )
+		{
+			/* woken by webdav_channel_idle */
+			(void) msleep((caddr_t)&fmp->pm_channels, &fmp->pm_mutex, PZERO, "webdav_close_channels", NULL);
+		}
+	} while ( busy );
+	
+	for ( i = 0; i < WEBDAV_MAX_KEXT_CHANNELS; ++i )
+	{
+		wc = &fmp->pm_channels[i];
+		if ( wc->wc_so != NULL )
+		{
+			sock_close(wc->wc_so);
+			wc->wc_so = NULL;
 		}
-		msg.msg_iov = aiov;
+		wc->wc_status = 0;
+	}
+	lck_mtx_unlock(&fmp->pm_mutex);
+}
+
+/*****************************************************************************/
+
+/*
+ * webdav_sendmsg is used to communicate with the userland half of the file
+ * system.
+ *
+ * Requests are sent on one of the mount's long-lived channels when one is
+ * available, and on a connection of their own otherwise. Either way, each
+ * outstanding request holds one credit.
+ *
+ * Inputs:
+ *      vnop        the operation to be peformed -- defined operations
+ *					are in webdav.h
+ *      fmp         pointer to struct webdavmount for the file system
+ *      request     pointer to the webdav_request struct
+ *      requestsize size of request
+ *      vardata     pointer to optional variable length data (the last field of
+ *					request), or NULL if none
+ *      vardatasize size of vardata, or 0 if no vardata
+ *
+ * Outputs:
+ *      result      the result of the operation
+ *      reply       pointer to the webdav_reply struct
+ *      replysize   size of reply
+ */
+__private_extern__
+int webdav_sendmsg(int vnop, struct webdavmount *fmp,
+	void *request, size_t requestsize,
+	void *vardata, size_t vardatasize,
+	int *result, void *reply, size_t replysize)
+{
+	int error;
+	struct webdav_channel *wc;
+	struct timeval lasttrytime;
+	struct timeval currenttime;
 
+	if ( fmp == NULL )
+		panic("webdav_sendmsg: fmp is NULL!");
+	
+	/* get current time */
+	microtime(&currenttime);
+	
+	while ( TRUE )
+	{
+		lasttrytime.tv_sec = currenttime.tv_sec;
+		
 		/* make we're not force unmounting */
 		if ( (vnop != WEBDAV_UNMOUNT) && vfs_isforce(fmp->pm_mountp) )
 		{
 			error = ENXIO;
 			break;
 		}
-
-		error = sock_send(so, &msg, 0, &iolen);
-		if (error)
+		
+		/* don't send more requests than the user-land server can handle */
+		error = webdav_get_credit(fmp);
+		if ( error )
 		{
-			printf("webdav_sendmsg: sock_send() = %d\n", error);
 			break;
 		}
 		
-		memset(&msg, 0, sizeof(msg));
-		
-		aiov[0].iov_base = (caddr_t)result;
-		aiov[0].iov_len = sizeof(*result);
-		aiov[1].iov_base = (caddr_t)reply;
-		aiov[1].iov_len = replysize;
-		msg.msg_iov = aiov;
-		msg.msg_iovlen = (replysize == 0 ? 1 : 2);
-		
-		num_rcv_timeouts = 0;
-		while ( TRUE )
+		wc = webdav_channel_get(vnop, fmp);
+		if ( wc != NULL )
 		{
-			/* make we're not force unmounting */
-			if ( (vnop != WEBDAV_UNMOUNT) && vfs_isforce(fmp->pm_mountp) )
-			{
-				error = ENXIO;
-				break;
-			}
-			
-			error = sock_receive(so, &msg, MSG_WAITALL, &iolen);
-			
-			/* did sock_receive timeout? */
-			if (error != EWOULDBLOCK)
+			error = webdav_sendmsg_channel(vnop, fmp, wc, request, requestsize, vardata, vardatasize,
+				result, reply, replysize);
+			if ( error == ENOTCONN )
 			{
-				/* sock_receive did not time out */
-				if ( error != 0 )
-				{
-					printf("webdav_sendmsg: sock_receive() = %d\n", error);
-				}
-				break;
-			}
-			else {
-				/* sock_receive DID time out */
-				if ( (++num_rcv_timeouts == WEBDAV_MAX_SOCK_RCV_TIMEOUTS ) &&
-				     (vnop != WEBDAV_WRITE) && (vnop != WEBDAV_READ) &&
-					 (vnop != WEBDAV_FSYNC) && (vnop != WEBDAV_WRITESEQ) ) {
-						// This vnop has timed out.
-						printf("webdav_sendmsg: sock_receive() timeout. vnop: %d idisk: %s\n", vnop,
-							   (fmp->pm_server_ident & WEBDAV_IDISK_SERVER) ? "yes" : "no");
-						error = ETIMEDOUT;
-						break;
-				}
+				/*
+				 * The channel failed before the reply came back, and either
+				 * user-land never got the request or running it twice is
+				 * harmless (see webdav_sendmsg_channel). Send it again on its
+				 * own connection.
+				 */
+				error = webdav_sendmsg_socket(vnop, fmp, request, requestsize, vardata, vardatasize,
+					result, reply, replysize);
 			}
 		}
+		else
+		{
+			error = webdav_sendmsg_socket(vnop, fmp, request, requestsize, vardata, vardatasize,
+				result, reply, replysize);
+		}
+		
+		webdav_put_credit(fmp);
+		
 		if ( error != 0 )
 		{
 			break;
@@ -449,52 +1259,105 @@ again:
 			break;
 		}
 		
-		(void) sock_shutdown(so, SHUT_RDWR); /* ignore failures - nothing can be done */
-		sock_close(so);
-		so_open = FALSE;
-		
-		lck_mtx_lock(&fmp->pm_mutex);
-		--fmp->pm_open_connections;
-		
-		/* if anyone else is waiting for a connection, wake them up */
-		if ( fmp->pm_status & WEBDAV_MOUNT_CONNECTION_WANTED )
-		{
-			fmp->pm_status &= ~WEBDAV_MOUNT_CONNECTION_WANTED;
-			wakeup((caddr_t)&fmp->pm_open_connections);
-		}
-		
-		lck_mtx_unlock(&fmp->pm_mutex);
-		
 		/* ... and retry */
 	}
 	
-	if ( so_open )
+	/* translate all unexpected errors to EIO. Leave ENXIO (unmounting) alone. */
+	if ( (error != 0) && (error != ENXIO) && (error != ETIMEDOUT) && (error != EACCES))
 	{
-		(void) sock_shutdown(so, SHUT_RDWR); /* ignore failures - nothing can be done */
-		sock_close(so);
-		so_open = FALSE;
-		
-		lck_mtx_lock(&fmp->pm_mutex);
-		--fmp->pm_open_connections;
-		lck_mtx_unlock(&fmp->pm_mutex);
+		error = EIO;
 	}
+
+	return (error);
+}
+
+/*****************************************************************************/
+
+/*
+ * webdav_wait_for_download waits for a background download of vp's cache file
+ * to make progress: until the cache file has offset bytes (WEBDAV_WAIT_DOWNLOAD_END
+ * for the whole file), or the download stops. The caller rechecks the cache file's
+ * size and flags when it returns 0.
+ *
+ * The user-land server is asked to reply when that happens. If it can't be
+ * asked (no channels, too many waiters, or it doesn't know WEBDAV_WAIT_DOWNLOAD),
+ * this sleeps for WEBDAV_WAIT_FOR_PAGE_TIME instead.
+ */
+static
+int webdav_wait_for_download(vnode_t vp, uint64_t offset, const char *wmesg, vfs_context_t context)
+{
+	struct webdavmount *fmp;
+	struct webdav_request_wait_download request_wait_download;
+	struct webdav_reply_wait_download reply_wait_download;
+	struct timespec ts;
+	int error, server_error;
+	int waited;
+	
+	fmp = VFSTOWEBDAV(vnode_mount(vp));
+	waited = FALSE;
 	
-	/* if anyone else is waiting for a connection, wake them up */
 	lck_mtx_lock(&fmp->pm_mutex);
-	if ( fmp->pm_status & WEBDAV_MOUNT_CONNECTION_WANTED )
+	if ( !(fmp->pm_status & (WEBDAV_MOUNT_NO_CHANNELS | WEBDAV_MOUNT_CHANNELS_CLOSED | WEBDAV_MOUNT_NO_WAIT_DOWNLOAD)) &&
+		 (fmp->pm_download_waiters < WEBDAV_MAX_DOWNLOAD_WAITERS) )
 	{
-		fmp->pm_status &= ~WEBDAV_MOUNT_CONNECTION_WANTED;
-		wakeup((caddr_t)&fmp->pm_open_connections);
+		++fmp->pm_download_waiters;
+		lck_mtx_unlock(&fmp->pm_mutex);
+		
+		webdav_copy_creds(context, &request_wait_download.pcr);
+		request_wait_download.obj_id = VTOWEBDAV(vp)->pt_obj_id;
+		request_wait_download.offset = offset;
+		bzero(&reply_wait_download, sizeof(reply_wait_download));
+		
+		server_error = 0;
+		error = webdav_sendmsg(WEBDAV_WAIT_DOWNLOAD, fmp,
+			&request_wait_download, sizeof(struct webdav_request_wait_download),
+			NULL, 0,
+			&server_error, &reply_wait_download, sizeof(struct webdav_reply_wait_download));
+		
+		lck_mtx_lock(&fmp->pm_mutex);
+		--fmp->pm_download_waiters;
+		if ( error == 0 )
+		{
+			if ( server_error == ENOTSUP )
+			{
+				/* an older user-land server -- don't ask again */
+				fmp->pm_status |= WEBDAV_MOUNT_NO_WAIT_DOWNLOAD;
+			}
+			else if ( (server_error == 0) && reply_wait_download.waited )
+			{
+				waited = TRUE;
+			}
+		}
 	}
 	lck_mtx_unlock(&fmp->pm_mutex);
 	
-	/* translate all unexpected errors to EIO. Leave ENXIO (unmounting) alone. */
-	if ( (error != 0) && (error != ENXIO) && (error != ETIMEDOUT) && (error != EACCES))
+	if ( waited )
 	{
-		error = EIO;
+		return ( 0 );
 	}
-
-	return (error);
+	
+	/* sleep for a bit */
+	ts.tv_sec = 0;
+	ts.tv_nsec = WEBDAV_WAIT_FOR_PAGE_TIME;
+	error = msleep((caddr_t)&ts, NULL, PCATCH, wmesg, &ts);
+	if ( error )
+	{
+		if ( error == EWOULDBLOCK )
+		{
+			error = 0;
+		}
+		else
+		{
+			printf("%s: msleep(): %d\n", wmesg, error);
+			/* convert pseudo-errors to EIO */
+			if ( error < 0 )
+			{
+				error = EIO;
+			}
+		}
+	}
+	
+	return ( error );
 }
 
 /*****************************************************************************/
@@ -1471,33 +2334,16 @@ static int webdav_fsync(struct vnop_fsync_args *ap)
 
 		if (attrbuf.va_flags & UF_NODUMP)
 		{
-			struct timespec ts;
-			
 			/* We are downloading the file and we haven't finished
 			 * since the user process is going push the entire file
 			 * back to the server, we'll have to wait until we have
 			 * gotten all of it. Otherwise we will have inadvertantly
 			 * pushed back an incomplete file and wiped out the original
 			 */
-			ts.tv_sec = 0;
-			ts.tv_nsec = WEBDAV_WAIT_FOR_PAGE_TIME;
-			error = msleep((caddr_t)&ts, NULL, PCATCH, "webdav_fsync", &ts);
-			if ( error)
+			error = webdav_wait_for_download(vp, WEBDAV_WAIT_DOWNLOAD_END, "webdav_fsync", ap->a_context);
+			if ( error )
 			{
-				if ( error == EWOULDBLOCK )
-				{
-					error = 0;
-				}
-				else
-				{
-					printf("webdav_fsync: msleep(): %d\n", error);
-					/* convert pseudo-errors to EIO */
-					if ( error < 0 )
-					{
-						error = EIO;
-					}
-					goto done;
-				}
+				goto done;
 			}
 		}
 		else
@@ -1884,6 +2730,130 @@ static int webdav_vnop_mnomap(struct vnop_mnomap_args *ap)
 
 /*****************************************************************************/
 
+/*
+ * webdav_read_ring_get_slot returns a free read ring slot, or -1 if the
+ * read ring isn't associated or all of its slots are in use.
+ */
+static
+int webdav_read_ring_get_slot(struct webdavmount *fmp)
+{
+	int slot;
+	
+	slot = -1;
+	lck_mtx_lock(&fmp->pm_mutex);
+	if ( (fmp->pm_read_ring_vp != NULLVP) && (fmp->pm_read_ring_free != 0) )
+	{
+		slot = ffs((int)fmp->pm_read_ring_free) - 1;
+		fmp->pm_read_ring_free &= ~(1 << slot);
+	}
+	lck_mtx_unlock(&fmp->pm_mutex);
+	
+	return ( slot );
+}
+
+/*****************************************************************************/
+
+/*
+ * webdav_read_ring_put_slot frees a slot once the user-land server's reply to
+ * the WEBDAV_READ that used it has arrived. If there was no reply (the channel
+ * failed or the request timed out), the server may still be writing the slot,
+ * so it is retired instead: it is never handed out again for this mount.
+ */
+static
+void webdav_read_ring_put_slot(struct webdavmount *fmp, int slot, int replied)
+{
+	if ( replied )
+	{
+		lck_mtx_lock(&fmp->pm_mutex);
+		fmp->pm_read_ring_free |= (1 << slot);
+		lck_mtx_unlock(&fmp->pm_mutex);
+	}
+	else
+	{
+		printf("webdav_read_ring_put_slot: no reply, retiring slot %d\n", slot);
+	}
+}
+
+/*****************************************************************************/
+
+/*
+ * webdav_read_ring_bytes is webdav_read_bytes for reads that fit in a read
+ * ring slot. The user-land server places the data in the slot, and the data
+ * is read from the read ring file directly into a_uio.
+ *
+ * *replied is set to TRUE if the user-land server replied (and so is done with
+ * the slot).
+ *
+ * results:
+ * 0	no error - bytes were read
+ * !0	the bytes were not read and the caller must wait for the download
+ */
+static int webdav_read_ring_bytes(vnode_t vp, uio_t a_uio, int slot, int *replied, vfs_context_t context)
+{
+	int error;
+	int server_error;
+	struct webdavmount *fmp;
+	struct webdav_request_read request_read;
+	struct webdav_reply_read reply_read;
+	off_t offset;
+	
+	error = server_error = 0;
+	fmp = VFSTOWEBDAV(vnode_mount(vp));
+	
+	webdav_copy_creds(context, &request_read.pcr);
+	request_read.obj_id = VTOWEBDAV(vp)->pt_obj_id;
+	request_read.offset = offset = uio_offset(a_uio);
+	request_read.count = uio_resid(a_uio);
+	request_read.ring_slot = slot;
+	
+	bzero(&reply_read, sizeof(struct webdav_reply_read));
+	
+	error = webdav_sendmsg(WEBDAV_READ, fmp,
+		&request_read, sizeof(struct webdav_request_read), 
+		NULL, 0, 
+		&server_error, &reply_read, sizeof(struct webdav_reply_read));
+	*replied = (error == 0);
+	if ( (error == 0) && (server_error != 0) )
+	{
+		if ( server_error == ESTALE )
+		{
+			/*
+			 * The object id(s) passed to userland are invalid.
+			 * Purge the vnode(s) and restart the request.
+			 */
+			webdav_purge_stale_vnode(vp);
+			error = ERESTART;
+		}
+		else
+		{
+			error = server_error;
+		}
+	}
+	if ( error )
+	{
+		/* return an error so the caller will wait */
+		goto done;
+	}
+	
+	if ( reply_read.count != request_read.count )
+	{
+		/* a short read -- let the caller wait for the download instead */
+		error = EIO;
+		goto done;
+	}
+	
+	/* read the slot's bytes from the read ring into a_uio, then put a_uio's offset back in the file */
+	uio_setoffset(a_uio, (off_t)slot * WEBDAV_READ_RING_SLOT_SIZE);
+	error = VNOP_READ(fmp->pm_read_ring_vp, a_uio, 0, context);
+	uio_setoffset(a_uio, offset + (off_t)(request_read.count - uio_resid(a_uio)));
+
+done:
+
+	return ( error );
+}
+
+/*****************************************************************************/
+
 /*
  * webdav_read_bytes
  *
@@ -1921,6 +2891,22 @@ static int webdav_read_bytes(vnode_t vp, uio_t a_uio, vfs_context_t context)
 		error = EINVAL;
 		goto done;
 	}
+	
+	/* use the read ring if there's room, so the data doesn't have to come through the socket */
+	if ( uio_resid(a_uio) <= WEBDAV_READ_RING_SLOT_SIZE )
+	{
+		int slot;
+		int replied;
+		
+		slot = webdav_read_ring_get_slot(fmp);
+		if ( slot >= 0 )
+		{
+			replied = FALSE;
+			error = webdav_read_ring_bytes(vp, a_uio, slot, &replied, context);
+			webdav_read_ring_put_slot(fmp, slot, replied);
+			goto done;
+		}
+	}
 
 	/* Now allocate the buffer that we are going to use to hold the data that
 	 * comes back
@@ -1940,6 +2926,7 @@ static int webdav_read_bytes(vnode_t vp, uio_t a_uio, vfs_context_t context)
 	webdav_copy_creds(context, &request_read.pcr);
 	request_read.obj_id = pt->pt_obj_id;
 	request_read.offset = uio_offset(a_uio);
+	request_read.ring_slot = -1;
 
 	error = webdav_sendmsg(WEBDAV_READ, fmp,
 		&request_read, sizeof(struct webdav_request_read), 
@@ -2082,8 +3069,6 @@ static int webdav_rdwr(struct vnop_read_args *ap)
 		if ( (attrbuf.va_flags & UF_NODUMP) &&
 			 ( (!(reading) && (ioflag & IO_APPEND)) || (rounded_iolength > (off_t)attrbuf.va_data_size) ) ) 
 		{
-			struct timespec ts;
-			
 			/* We are downloading the file and we haven't gotten to
 			 * to the bytes we need so sleep, and then check again.
 			 */
@@ -2112,28 +3097,13 @@ static int webdav_rdwr(struct vnop_read_args *ap)
 				}
 			}
 			
-			/* sleep for a bit */
-			ts.tv_sec = 0;
-			ts.tv_nsec = WEBDAV_WAIT_FOR_PAGE_TIME;
-			error = msleep((caddr_t)&ts, NULL, PCATCH, "webdav_rdwr", &ts);
-			if ( error)
+			/* wait for the bytes (or, for an append, the whole file) */
+			error = webdav_wait_for_download(vp,
+				(!(reading) && (ioflag & IO_APPEND)) ? WEBDAV_WAIT_DOWNLOAD_END : (uint64_t)rounded_iolength,
+				"webdav_rdwr", ap->a_context);
+			if ( error )
 			{
-				if ( error == EWOULDBLOCK )
-				{
-					error = 0;
-				}
-				else
-				{
-#if DEBUG				
-					printf("webdav_rdwr: msleep(): %d\n", error);
-#endif
-					/* convert pseudo-errors to EIO */
-					if ( error < 0 )
-					{
-						error = EIO;
-					}
-					goto exit;
-				}
+				goto exit;
 			}
 		}
 		else
@@ -3411,31 +4381,14 @@ static int webdav_vnop_setattr(struct vnop_setattr_args *ap)
 
 				if (attrbuf.va_flags & UF_NODUMP)
 				{
-					struct timespec ts;
-					
 					/* We are downloading the file and we haven't finished
 					* since the user process is going to extend the file with
-					* writes until it is done, so sleep, and then check again.
+					* writes until it is done, so wait, and then check again.
 					*/
-					ts.tv_sec = 0;
-					ts.tv_nsec = WEBDAV_WAIT_FOR_PAGE_TIME;
-					error = msleep((caddr_t)&ts, NULL, PCATCH, "webdav_vnop_setattr", &ts);
-					if ( error)
+					error = webdav_wait_for_download(vp, WEBDAV_WAIT_DOWNLOAD_END, "webdav_vnop_setattr", ap->a_context);
+					if ( error )
 					{
-						if ( error == EWOULDBLOCK )
-						{
-							error = 0;
-						}
-						else
-						{
-							printf("webdav_vnop_setattr: msleep(): %d\n", error);
-							/* convert pseudo-errors to EIO */
-							if ( error < 0 )
-							{
-								error = EIO;
-							}
-							goto exit;
-						}
+						goto exit;
 					}
 				}
 				else
@@ -3911,10 +4864,8 @@ static int webdav_vnop_pagein(struct vnop_pagein_args *ap)
 
 		if ((attrbuf.va_flags & UF_NODUMP) && (uio_offset(auio) + uio_resid(auio)) > (off_t)attrbuf.va_data_size)
 		{
-			struct timespec ts;
-			
 			/* We are downloading the file and we haven't gotten to
-			 * to the bytes we need so sleep, and then try the whole
+			 * to the bytes we need so wait, and then try the whole
 			 * thing again.	We will take one shot at trying to get the
 			 * bytes out of the file directly if that part hasn't yet
 			 * been downloaded.	This is a little iffy since the VM system
@@ -3962,25 +4913,11 @@ static int webdav_vnop_pagein(struct vnop_pagein_args *ap)
 				tried_bytes = TRUE;
 			}
 
-			ts.tv_sec = 0;
-			ts.tv_nsec = WEBDAV_WAIT_FOR_PAGE_TIME;
-			error = msleep((caddr_t)&ts, NULL, PCATCH, "webdav_vnop_pagein", &ts);
-			if ( error)
+			error = webdav_wait_for_download(vp, (uint64_t)(uio_offset(auio) + uio_resid(auio)),
+				"webdav_vnop_pagein", ap->a_context);
+			if ( error )
 			{
-				if ( error == EWOULDBLOCK )
-				{
-					error = 0;
-				}
-				else
-				{
-					printf("webdav_vnop_pagein: msleep(): %d\n", error);
-					/* convert pseudo-errors to EIO */
-					if ( error < 0 )
-					{
-						error = EIO;
-					}
-					goto exit;
-				}
+				goto exit;
 			}
 		}
 		else
@@ -4177,31 +5114,15 @@ static int webdav_vnop_pageout(struct vnop_pageout_args *ap)
 
 		if ((attrbuf.va_flags & UF_NODUMP) && (uio_offset(auio) + uio_resid(auio)) > (off_t)attrbuf.va_data_size)
 		{
-			struct timespec ts;
-			
 			/* We are downloading the file and we haven't gotten to
-			 * to the bytes we need so sleep, and then try the whole
+			 * to the bytes we need so wait, and then try the whole
 			 * thing again.
 			 */
-			ts.tv_sec = 0;
-			ts.tv_nsec = WEBDAV_WAIT_FOR_PAGE_TIME;
-			error = msleep((caddr_t)&ts, NULL, PCATCH, "webdav_vnop_pageout", &ts);
-			if ( error)
+			error = webdav_wait_for_download(vp, (uint64_t)(uio_offset(auio) + uio_resid(auio)),
+				"webdav_vnop_pageout", ap->a_context);
+			if ( error )
 			{
-				if ( error == EWOULDBLOCK )
-				{
-					error = 0;
-				}
-				else
-				{
-					printf("webdav_vnop_pageout: msleep(): %d\n", error);
-					/* convert pseudo-errors to EIO */
-					if ( error < 0 )
-					{
-						error = EIO;
-					}
-					goto exit;
-				}
+				goto exit;
 			}
 		}
 		else